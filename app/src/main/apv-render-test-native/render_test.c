@@ -0,0 +1,1408 @@
+/*
+ * Render checks for the native libraries. They run on the host: "make
+ * check" builds and runs them. The test documents are made in memory.
+ */
+
+#include "fitz-internal.h"
+#include "mupdf-internal.h"
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "jpeglib.h"
+
+static int failures = 0;
+static pthread_mutex_t fail_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+fail(const char *fmt, ...)
+{
+	va_list args;
+
+	pthread_mutex_lock(&fail_mutex);
+	va_start(args, fmt);
+	printf("FAIL: ");
+	vprintf(fmt, args);
+	printf("\n");
+	va_end(args);
+	failures++;
+	pthread_mutex_unlock(&fail_mutex);
+}
+
+/*
+ * Test documents. Objects are numbered in the order they are added:
+ * 1 is the catalog, 2 the page tree, and the pages follow.
+ */
+
+typedef struct test_doc_s test_doc;
+
+struct test_doc_s
+{
+	fz_context *ctx;
+	fz_buffer *buf;
+	int ofs[256];
+	int count;
+};
+
+static void
+new_test_doc(fz_context *ctx, test_doc *doc)
+{
+	doc->ctx = ctx;
+	doc->buf = fz_new_buffer(ctx, 1024);
+	doc->count = 0;
+	fz_buffer_printf(ctx, doc->buf, "%%PDF-1.4\n");
+}
+
+static int
+begin_obj(test_doc *doc)
+{
+	doc->ofs[doc->count++] = doc->buf->len;
+	fz_buffer_printf(doc->ctx, doc->buf, "%d 0 obj\n", doc->count);
+	return doc->count;
+}
+
+static int
+add_obj(test_doc *doc, const char *obj)
+{
+	int num = begin_obj(doc);
+	fz_buffer_printf(doc->ctx, doc->buf, "%s\nendobj\n", obj);
+	return num;
+}
+
+static int
+add_stream(test_doc *doc, const char *dict, unsigned char *data, int len)
+{
+	int num = begin_obj(doc);
+	fz_buffer_printf(doc->ctx, doc->buf, "<<%s /Length %d>>\nstream\n", dict, len);
+	fz_write_buffer(doc->ctx, doc->buf, data, len);
+	fz_buffer_printf(doc->ctx, doc->buf, "\nendstream\nendobj\n");
+	return num;
+}
+
+/* Add a page drawing the image object img with the given content */
+static int
+add_image_page(test_doc *doc, int w, int h, int img, const char *content)
+{
+	char buf[256];
+	int num = doc->count + 1;
+
+	sprintf(buf, "<</Type/Page/Parent 2 0 R/MediaBox[0 0 %d %d]/Contents %d 0 R"
+		"/Resources<</XObject<</Im %d 0 R>>>>>>", w, h, num + 1, img);
+	add_obj(doc, buf);
+	add_stream(doc, "", (unsigned char *)content, strlen(content));
+	return num;
+}
+
+static fz_buffer *
+end_test_doc(test_doc *doc)
+{
+	fz_context *ctx = doc->ctx;
+	int i, xref;
+
+	xref = doc->buf->len;
+	fz_buffer_printf(ctx, doc->buf, "xref\n0 %d\n0000000000 65535 f \n", doc->count + 1);
+	for (i = 0; i < doc->count; i++)
+		fz_buffer_printf(ctx, doc->buf, "%010d 00000 n \n", doc->ofs[i]);
+	fz_buffer_printf(ctx, doc->buf, "trailer\n<</Size %d/Root 1 0 R>>\nstartxref\n%d\n%%%%EOF\n",
+		doc->count + 1, xref);
+	return doc->buf;
+}
+
+/* Errors are reported here, in the context that raised them */
+static fz_document *
+open_test_doc(fz_context *ctx, fz_buffer *buf)
+{
+	fz_stream *stm = NULL;
+	fz_document *doc = NULL;
+
+	fz_var(stm);
+
+	fz_try(ctx)
+	{
+		stm = fz_open_buffer(ctx, buf);
+		doc = (fz_document *)pdf_open_document_with_stream(ctx, stm);
+	}
+	fz_always(ctx)
+	{
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		fail("cannot open test document: %s", ctx->error->message);
+	}
+	return doc;
+}
+
+/*
+ * Render a page, whole or in square tiles of the given size. Tiles are
+ * drawn separately, as the app does, and copied into one pixmap.
+ */
+static fz_pixmap *
+render_page(fz_context *ctx, fz_document *doc, int number, fz_matrix ctm, int tile)
+{
+	fz_page *page = NULL;
+	fz_pixmap *pix = NULL, *part = NULL;
+	fz_device *dev = NULL;
+	fz_bbox bbox, tbox;
+	int x, y, row;
+
+	fz_var(page);
+	fz_var(pix);
+	fz_var(part);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		page = fz_load_page(doc, number);
+		bbox = fz_round_rect(fz_transform_rect(ctm, fz_bound_page(doc, page)));
+		pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb, bbox);
+		fz_clear_pixmap_with_value(ctx, pix, 0xff);
+		if (tile <= 0)
+		{
+			dev = fz_new_draw_device(ctx, pix);
+			fz_run_page(doc, page, dev, ctm, NULL);
+			fz_free_device(dev);
+			dev = NULL;
+		}
+		else for (y = bbox.y0; y < bbox.y1; y += tile)
+		{
+			for (x = bbox.x0; x < bbox.x1; x += tile)
+			{
+				tbox.x0 = x;
+				tbox.y0 = y;
+				tbox.x1 = fz_mini(x + tile, bbox.x1);
+				tbox.y1 = fz_mini(y + tile, bbox.y1);
+				part = fz_new_pixmap_with_bbox(ctx, fz_device_rgb, tbox);
+				fz_clear_pixmap_with_value(ctx, part, 0xff);
+				dev = fz_new_draw_device(ctx, part);
+				fz_run_page(doc, page, dev, ctm, NULL);
+				fz_free_device(dev);
+				dev = NULL;
+				for (row = 0; row < part->h; row++)
+					memcpy(pix->samples + ((y - bbox.y0 + row) * pix->w + x - bbox.x0) * pix->n,
+						part->samples + row * part->w * part->n, part->w * part->n);
+				fz_drop_pixmap(ctx, part);
+				part = NULL;
+			}
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free_device(dev);
+		fz_drop_pixmap(ctx, part);
+		if (page)
+			fz_free_page(doc, page);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		pix = NULL;
+		fail("cannot render page %d: %s", number + 1, ctx->error->message);
+	}
+	return pix;
+}
+
+/*
+ * Compare two renders of a page. Returns the number of pixels that
+ * differ at all.
+ */
+static int
+compare_renders(fz_pixmap *a, fz_pixmap *b)
+{
+	int x, y, k, d, max, bad = 0, max_all = 0;
+	unsigned char *pa, *pb;
+
+	if (a->w != b->w || a->h != b->h || a->x != b->x || a->y != b->y)
+		return -1;
+
+	for (y = 0; y < a->h; y++)
+	{
+		for (x = 0; x < a->w; x++)
+		{
+			pa = a->samples + (y * a->w + x) * a->n;
+			pb = b->samples + (y * b->w + x) * b->n;
+			max = 0;
+			for (k = 0; k < a->n; k++)
+			{
+				d = abs(pa[k] - pb[k]);
+				if (d > max)
+					max = d;
+			}
+			max_all = fz_maxi(max_all, max);
+			if (max)
+				bad++;
+		}
+	}
+
+	if (getenv("VERBOSE"))
+		printf("  max difference %d\n", max_all);
+	return bad;
+}
+
+/*
+ * Banded JPEG decoding: a JPEG image too big to keep whole in a small
+ * store is decoded in bands for each tile. Each band is scaled and
+ * painted where it lies in the whole image, so the tiles must match the
+ * whole image drawn in one go exactly, scaled, enlarged or rotated.
+ */
+
+#define JPEG_W 1200
+#define JPEG_H 900
+
+static fz_buffer *
+make_jpeg(fz_context *ctx, int w, int h)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char *row, *out = NULL;
+	unsigned long outlen = 0;
+	fz_buffer *buf;
+	int x, y;
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &out, &outlen);
+	cinfo.image_width = w;
+	cinfo.image_height = h;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 90, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+
+	/* Gradients, with a finer pattern so that misplaced bands show */
+	row = fz_malloc(ctx, w * 3);
+	for (y = 0; y < h; y++)
+	{
+		for (x = 0; x < w; x++)
+		{
+			row[x * 3 + 0] = x * 255 / w;
+			row[x * 3 + 1] = y * 255 / h;
+			row[x * 3 + 2] = ((x / 9 + y / 7) & 1) ? 224 : 32;
+		}
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	fz_free(ctx, row);
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+
+	buf = fz_new_buffer(ctx, outlen);
+	fz_write_buffer(ctx, buf, out, outlen);
+	free(out);
+	return buf;
+}
+
+static fz_buffer *
+make_jpeg_doc(fz_context *ctx)
+{
+	char dict[256];
+	fz_buffer *jpeg;
+	test_doc doc;
+	int img;
+
+	new_test_doc(ctx, &doc);
+	add_obj(&doc, "<</Type/Catalog/Pages 2 0 R>>");
+	add_obj(&doc, "<</Type/Pages/Kids[4 0 R]/Count 1>>");
+
+	jpeg = make_jpeg(ctx, JPEG_W, JPEG_H);
+	sprintf(dict, "/Type/XObject/Subtype/Image/Width %d/Height %d"
+		"/ColorSpace/DeviceRGB/BitsPerComponent 8/Filter/DCTDecode", JPEG_W, JPEG_H);
+	img = add_stream(&doc, dict, jpeg->data, jpeg->len);
+	fz_drop_buffer(ctx, jpeg);
+
+	add_image_page(&doc, 640, 490, img, "q 600 0 0 450 20 20 cm /Im Do Q");
+	return end_test_doc(&doc);
+}
+
+static const struct {
+	float zoom;
+	int rotate;
+} jpeg_cases[] = {
+	{ 0.7f, 0 },
+	{ 1.3f, 0 },
+	{ 2.3f, 0 },
+	{ 1.3f, 90 },
+	{ 1.7f, 180 },
+	{ 1.0f, 270 },
+};
+
+static void
+test_banded_jpeg(void)
+{
+	fz_context *whole_ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	fz_context *tiled_ctx = fz_new_context(NULL, NULL, 1 << 20);
+	fz_document *whole_doc, *tiled_doc;
+	fz_pixmap *whole, *tiled;
+	fz_buffer *pdf;
+	fz_matrix ctm;
+	int i, bad;
+
+	printf("banded JPEG tiles against the whole image\n");
+
+	pdf = make_jpeg_doc(whole_ctx);
+	whole_doc = open_test_doc(whole_ctx, pdf);
+	tiled_doc = open_test_doc(tiled_ctx, pdf);
+
+	for (i = 0; whole_doc && tiled_doc && i < nelem(jpeg_cases); i++)
+	{
+		ctm = fz_concat(fz_scale(jpeg_cases[i].zoom, jpeg_cases[i].zoom), fz_rotate(jpeg_cases[i].rotate));
+		whole = render_page(whole_ctx, whole_doc, 0, ctm, 0);
+		tiled = render_page(tiled_ctx, tiled_doc, 0, ctm, 256);
+		if (whole && tiled)
+		{
+			bad = compare_renders(whole, tiled);
+			if (bad)
+				fail("zoom %g, rotation %d: %d pixels differ", jpeg_cases[i].zoom, jpeg_cases[i].rotate, bad);
+		}
+		fz_drop_pixmap(whole_ctx, whole);
+		fz_drop_pixmap(tiled_ctx, tiled);
+	}
+
+	if (tiled_doc)
+		fz_close_document(tiled_doc);
+	if (whole_doc)
+		fz_close_document(whole_doc);
+	fz_drop_buffer(whole_ctx, pdf);
+	fz_free_context(tiled_ctx);
+	fz_free_context(whole_ctx);
+}
+
+/*
+ * Bilevel images stay packed in the store. Huge ones drawn at full size
+ * or larger are cut from the bitmap a part at a time for each tile, and
+ * those tiles must match the whole image drawn in one go exactly.
+ */
+
+#define BITMAP_W 1000
+#define BITMAP_H 800
+
+static fz_buffer *
+make_bitmap(fz_context *ctx, int w, int h)
+{
+	int stride = (w + 7) / 8;
+	unsigned char *bits = fz_malloc(ctx, stride * h);
+	uLongf len = compressBound(stride * h);
+	fz_buffer *buf = fz_new_buffer(ctx, len);
+	int x, y, dx, dy;
+
+	/* Rings and a grid of one pixel lines */
+	memset(bits, 0, stride * h);
+	for (y = 0; y < h; y++)
+	{
+		for (x = 0; x < w; x++)
+		{
+			dx = x - w / 2;
+			dy = y - h / 2;
+			if (((dx * dx + dy * dy) / 400) % 3 == 0 || x % 50 == 0 || y % 37 == 0)
+				bits[y * stride + x / 8] |= 0x80 >> (x & 7);
+		}
+	}
+
+	compress(buf->data, &len, bits, stride * h);
+	buf->len = len;
+	fz_free(ctx, bits);
+	return buf;
+}
+
+static fz_buffer *
+make_bitmap_doc(fz_context *ctx)
+{
+	char dict[256];
+	fz_buffer *bitmap;
+	test_doc doc;
+	int img, mask;
+
+	new_test_doc(ctx, &doc);
+	add_obj(&doc, "<</Type/Catalog/Pages 2 0 R>>");
+	add_obj(&doc, "<</Type/Pages/Kids[5 0 R 7 0 R]/Count 2>>");
+
+	bitmap = make_bitmap(ctx, BITMAP_W, BITMAP_H);
+	sprintf(dict, "/Type/XObject/Subtype/Image/Width %d/Height %d"
+		"/ColorSpace/DeviceGray/BitsPerComponent 1/Filter/FlateDecode", BITMAP_W, BITMAP_H);
+	img = add_stream(&doc, dict, bitmap->data, bitmap->len);
+	sprintf(dict, "/Type/XObject/Subtype/Image/Width %d/Height %d"
+		"/ImageMask true/Filter/FlateDecode", BITMAP_W, BITMAP_H);
+	mask = add_stream(&doc, dict, bitmap->data, bitmap->len);
+	fz_drop_buffer(ctx, bitmap);
+
+	add_image_page(&doc, 1040, 840, img, "q 1000 0 0 800 20 20 cm /Im Do Q");
+	add_image_page(&doc, 1040, 840, mask, "q 0.8 0.1 0.1 rg 1000 0 0 800 20 20 cm /Im Do Q");
+	return end_test_doc(&doc);
+}
+
+static const struct {
+	float zoom;
+	int rotate;
+} bitmap_cases[] = {
+	{ 1.0f, 0 },
+	{ 1.5f, 0 },
+	{ 1.25f, 90 },
+	{ 2.0f, 180 },
+	{ 1.0f, 270 },
+};
+
+static void
+test_bitmap_parts(void)
+{
+	fz_context *whole_ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+	fz_context *tiled_ctx = fz_new_context(NULL, NULL, 1 << 20);
+	fz_document *whole_doc, *tiled_doc;
+	fz_pixmap *whole, *tiled;
+	fz_buffer *pdf;
+	fz_matrix ctm;
+	int i, page, bad;
+
+	printf("bilevel image parts against the whole image\n");
+
+	pdf = make_bitmap_doc(whole_ctx);
+	whole_doc = open_test_doc(whole_ctx, pdf);
+	tiled_doc = open_test_doc(tiled_ctx, pdf);
+
+	for (page = 0; page < 2; page++)
+	{
+		for (i = 0; whole_doc && tiled_doc && i < nelem(bitmap_cases); i++)
+		{
+			ctm = fz_concat(fz_scale(bitmap_cases[i].zoom, bitmap_cases[i].zoom), fz_rotate(bitmap_cases[i].rotate));
+			whole = render_page(whole_ctx, whole_doc, page, ctm, 0);
+			tiled = render_page(tiled_ctx, tiled_doc, page, ctm, 256);
+			if (whole && tiled)
+			{
+				bad = compare_renders(whole, tiled);
+				if (bad)
+					fail("page %d, zoom %g, rotation %d: %d pixels differ",
+						page + 1, bitmap_cases[i].zoom, bitmap_cases[i].rotate, bad);
+			}
+			fz_drop_pixmap(whole_ctx, whole);
+			fz_drop_pixmap(tiled_ctx, tiled);
+		}
+	}
+
+	if (tiled_doc)
+		fz_close_document(tiled_doc);
+	if (whole_doc)
+		fz_close_document(whole_doc);
+	fz_drop_buffer(whole_ctx, pdf);
+	fz_free_context(tiled_ctx);
+	fz_free_context(whole_ctx);
+}
+
+/*
+ * Bilevel images drawn smaller than their size are subsampled from the
+ * bitmap, and must come out exactly as they did when they were decoded
+ * to a pixmap first: the same image loaded in a second context, with
+ * its get_bitmap callback taken away, is drawn that way. The draws follow each other in one context,
+ * so the later ones find the image in the store as it was left by those
+ * before, some of them at full size or larger. Odd sizes leave partial
+ * blocks at the right and bottom edges.
+ */
+
+#define SCALED_W 613
+#define SCALED_H 397
+
+static const struct {
+	float zoom;
+	int rotate;
+} scaled_cases[] = {
+	{ 0.12f, 0 },
+	{ 0.25f, 90 },
+	{ 1.5f, 0 },
+	{ 0.5f, 0 },
+	{ 0.37f, 30 },
+	{ 0.5f, 270 },
+	{ 0.06f, 0 },
+	{ 1.0f, 90 },
+	{ 0.25f, 180 },
+};
+
+static fz_pixmap *
+draw_bilevel(fz_context *ctx, fz_image *image, int mask, fz_matrix ctm)
+{
+	fz_bbox bbox = fz_round_rect(fz_transform_rect(ctm, fz_unit_rect));
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb, bbox);
+	fz_device *dev;
+	float color[3] = { 0.8f, 0.1f, 0.1f };
+
+	fz_clear_pixmap_with_value(ctx, pix, 0xff);
+	dev = fz_new_draw_device(ctx, pix);
+	if (mask)
+		fz_fill_image_mask(dev, image, ctm, fz_device_rgb, color, 1);
+	else
+		fz_fill_image(dev, image, ctm, 1);
+	fz_free_device(dev);
+	return pix;
+}
+
+static void
+test_bitmap_scaled(void)
+{
+	static const char *kinds[] = {
+		"/ColorSpace/DeviceGray/BitsPerComponent 1",
+		"/ImageMask true",
+		"/ImageMask true/Decode[1 0]",
+	};
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_context *ref_ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_document *doc, *ref_doc;
+	fz_image *image, *ref_image;
+	fz_pixmap *a, *b;
+	fz_buffer *bitmap, *pdf;
+	pdf_obj *obj;
+	fz_matrix ctm;
+	char dict[256];
+	test_doc tdoc;
+	int i, k, kind, bad;
+
+	printf("bilevel images scaled down against their pixmaps\n");
+
+	new_test_doc(ctx, &tdoc);
+	add_obj(&tdoc, "<</Type/Catalog/Pages 2 0 R>>");
+	add_obj(&tdoc, "<</Type/Pages/Kids[]/Count 0>>");
+	bitmap = make_bitmap(ctx, SCALED_W, SCALED_H);
+	for (kind = 0; kind < nelem(kinds); kind++)
+	{
+		sprintf(dict, "/Type/XObject/Subtype/Image/Width %d/Height %d%s/Filter/FlateDecode",
+			SCALED_W, SCALED_H, kinds[kind]);
+		add_stream(&tdoc, dict, bitmap->data, bitmap->len);
+	}
+	fz_drop_buffer(ctx, bitmap);
+	pdf = end_test_doc(&tdoc);
+
+	doc = open_test_doc(ctx, pdf);
+	ref_doc = open_test_doc(ref_ctx, pdf);
+
+	for (kind = 0; doc && ref_doc && kind < nelem(kinds); kind++)
+	{
+		obj = pdf_new_indirect(ctx, kind + 3, 0, doc);
+		image = pdf_load_image((pdf_document *)doc, obj);
+		pdf_drop_obj(obj);
+		obj = pdf_new_indirect(ref_ctx, kind + 3, 0, ref_doc);
+		ref_image = pdf_load_image((pdf_document *)ref_doc, obj);
+		pdf_drop_obj(obj);
+		if (!image->get_bitmap)
+			fail("%s: not drawn from a bitmap", kinds[kind]);
+		ref_image->get_bitmap = NULL;
+
+		for (i = 0; i < nelem(scaled_cases); i++)
+		{
+			ctm = fz_concat(fz_scale(SCALED_W * scaled_cases[i].zoom, SCALED_H * scaled_cases[i].zoom),
+				fz_rotate(scaled_cases[i].rotate));
+			ctm.e = 7.3f;
+			ctm.f = 4.6f;
+			a = draw_bilevel(ctx, image, kind > 0, ctm);
+			b = draw_bilevel(ref_ctx, ref_image, kind > 0, ctm);
+			bad = 0;
+			for (k = 0; k < a->w * a->h * a->n; k++)
+				if (a->samples[k] != b->samples[k])
+					bad++;
+			if (bad)
+				fail("%s, zoom %g, rotation %d: %d samples differ", kinds[kind],
+					scaled_cases[i].zoom, scaled_cases[i].rotate, bad);
+			fz_drop_pixmap(ctx, a);
+			fz_drop_pixmap(ref_ctx, b);
+		}
+
+		fz_drop_image(ctx, image);
+		fz_drop_image(ref_ctx, ref_image);
+	}
+
+	if (ref_doc)
+		fz_close_document(ref_doc);
+	if (doc)
+		fz_close_document(doc);
+	fz_drop_buffer(ctx, pdf);
+	fz_free_context(ref_ctx);
+	fz_free_context(ctx);
+}
+
+/*
+ * Content streams are compiled once and kept in the store, keyed by the
+ * page's /Contents (pdf_interpret.c). Page 1 has an array of two streams,
+ * and pages 2 and 3 share a stream but not their resources. Each page is
+ * drawn whole and then in tiles, from the compiled contents, and must
+ * match the page drawn the same way in a context of its own. Then the second
+ * stream of page 1 is replaced, and page 1 must be drawn from the new
+ * one.
+ */
+
+static const char contents_head[] =
+	"[4 2] 0 d 3 w 5 5 m 95 60 l S q /P <</MCID 0>> BDC\n"
+	"0 0 1 rg 10 10 50 50 re f EMC\n";
+
+static const char contents_tail[] =
+	"0.9 0 0 rg 40 30 50 60 re f Q [] 0 d 0 w 5 95 m 95 5 l S\n";
+
+static const char contents_new_tail[] =
+	"0 0.6 0 rg 20 60 70 30 re f Q [1 1] 0 d 2 w 5 80 m 95 20 l S\n";
+
+static const char contents_shared[] =
+	"q 0.4 0 0 0.6 10 20 cm /Fm Do Q q [3] 0 d 1 w 0.2 0.1 0.3 0.7 40 30 cm /Fm Do Q\n";
+
+/* Objects 6 and 7 are page 1's contents, 8 is shared by pages 2 and 3,
+ * and 9 and 10 are the forms they draw */
+static fz_buffer *
+make_contents_doc(fz_context *ctx, const char *tail)
+{
+	test_doc doc;
+
+	new_test_doc(ctx, &doc);
+	add_obj(&doc, "<</Type/Catalog/Pages 2 0 R>>");
+	add_obj(&doc, "<</Type/Pages/Kids[3 0 R 4 0 R 5 0 R]/Count 3>>");
+	add_obj(&doc, "<</Type/Page/Parent 2 0 R/MediaBox[0 0 100 100]/Contents[6 0 R 7 0 R]>>");
+	add_obj(&doc, "<</Type/Page/Parent 2 0 R/MediaBox[0 0 100 100]/Contents 8 0 R"
+		"/Resources<</XObject<</Fm 9 0 R>>>>>>");
+	add_obj(&doc, "<</Type/Page/Parent 2 0 R/MediaBox[0 0 100 100]/Contents 8 0 R"
+		"/Resources<</XObject<</Fm 10 0 R>>>>>>");
+	add_stream(&doc, "", (unsigned char *)contents_head, strlen(contents_head));
+	add_stream(&doc, "", (unsigned char *)tail, strlen(tail));
+	add_stream(&doc, "", (unsigned char *)contents_shared, strlen(contents_shared));
+	add_stream(&doc, "/Type/XObject/Subtype/Form/BBox[0 0 100 100]",
+		(unsigned char *)"1 0 0 rg 0 0 100 100 re f", 25);
+	add_stream(&doc, "/Type/XObject/Subtype/Form/BBox[0 0 100 100]",
+		(unsigned char *)"0 0 1 rg 0 0 60 100 re f", 24);
+	return end_test_doc(&doc);
+}
+
+/* Check pix against the page drawn the same way in a context of its own,
+ * where nothing has been compiled before */
+static void
+check_contents_page(fz_pixmap *pix, const char *tail, int number, fz_matrix ctm, int tile)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_buffer *pdf = make_contents_doc(ctx, tail);
+	fz_document *doc = open_test_doc(ctx, pdf);
+	fz_pixmap *ref = NULL;
+	int k, bad;
+
+	if (doc)
+		ref = render_page(ctx, doc, number, ctm, tile);
+	if (ref && pix)
+	{
+		bad = 0;
+		for (k = 0; k < ref->w * ref->h * ref->n; k++)
+			if (ref->samples[k] != pix->samples[k])
+				bad++;
+		if (bad)
+			fail("page %d, %s: %d samples differ", number + 1, tail == contents_tail ? (tile ? "tiled" : "whole") : "updated", bad);
+	}
+
+	fz_drop_pixmap(ctx, ref);
+	if (doc)
+		fz_close_document(doc);
+	fz_drop_buffer(ctx, pdf);
+	fz_free_context(ctx);
+}
+
+static void
+test_compiled_contents(void)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_matrix ctm = fz_concat(fz_scale(2.5f, 2.5f), fz_rotate(30));
+	fz_document *doc;
+	fz_pixmap *pix;
+	fz_buffer *pdf, *tail;
+	int i, tile;
+
+	printf("compiled contents against a fresh run\n");
+
+	pdf = make_contents_doc(ctx, contents_tail);
+	doc = open_test_doc(ctx, pdf);
+
+	for (i = 0; doc && i < 4; i++)
+	{
+		for (tile = 0; tile <= 64; tile += 64)
+		{
+			pix = render_page(ctx, doc, i % 3, ctm, tile);
+			check_contents_page(pix, contents_tail, i % 3, ctm, tile);
+			fz_drop_pixmap(ctx, pix);
+		}
+	}
+
+	if (doc)
+	{
+		tail = fz_new_buffer(ctx, sizeof contents_new_tail);
+		fz_write_buffer(ctx, tail, (unsigned char *)contents_new_tail, strlen(contents_new_tail));
+		pdf_update_stream((pdf_document *)doc, 7, tail);
+		fz_drop_buffer(ctx, tail);
+
+		pix = render_page(ctx, doc, 0, ctm, 64);
+		check_contents_page(pix, contents_new_tail, 0, ctm, 64);
+		fz_drop_pixmap(ctx, pix);
+		fz_close_document(doc);
+	}
+	fz_drop_buffer(ctx, pdf);
+	fz_free_context(ctx);
+}
+
+/*
+ * Form XObjects are recorded into display lists and replayed from the
+ * store (pdf_interpret.c). The replay must come out exactly as the form
+ * run directly, which it is for a device with hints, rotated or not.
+ * The form nests transforms, clips and an inline image, and is drawn
+ * at several places on the page; each page is drawn twice, the second
+ * time entirely from the lists.
+ */
+
+static const char form_contents[] =
+	"q 0.96 0.28 -0.28 0.96 3.3 1.7 cm 0.2 0.4 0.8 rg 5 5 60 40 re f Q\n"
+	"q 1.1 0 0 0.7 80 10 cm 0.966 0.259 -0.259 0.966 0 0 cm\n"
+	"0.8 0.1 0.1 RG 2.5 w 0 0 m 50 30 l 90 5 l S 0 w 3 3 m 87 41 l S Q\n"
+	"q 120 20 m 190 40 l 150 95 l h W n 0.1 0.6 0.2 rg 100 0 100 100 re f\n"
+	"41.3 0 0 29.7 130.2 35.1 cm BI /W 4 /H 3 /BPC 8 /CS /G /F /AHx ID\n"
+	"00 40 80 c0 ff 80 40 00 20 60 a0 e0> EI Q\n"
+	"q 0.99 0.13 -0.13 0.99 0.37 0.71 cm 57.3 0 0 43.1 7.7 51.3 cm\n"
+	"BI /W 5 /H 4 /BPC 8 /CS /RGB /I true /F /AHx ID\n"
+	"ff0000 00ff00 0000ff ffff00 00ffff ff00ff 808080 202020 e0e0e0 ff8000\n"
+	"0080ff 80ff00 ff0080 00ff80 8000ff 400000 004000 000040 404000 004040> EI Q\n";
+
+static const char form_page[] =
+	"q /Fm Do Q q 1 0 0 1 200.4 150.7 cm /Fm Do Q\n"
+	"q 0.5 0 0 0.5 50 300 cm /Fm Do Q q 0 1 -1 0 400 20 cm /Fm Do Q\n";
+
+static const struct {
+	float zoom;
+	int rotate;
+} form_cases[] = {
+	{ 1.0f, 30 },
+	{ 1.7f, 270 },
+	{ 0.8f, 17 },
+	{ 1.3f, 90 },
+	{ 1.0f, 0 },
+	{ 2.2f, 30 },
+	{ 1.45f, 210 },
+};
+
+static fz_buffer *
+make_form_doc(fz_context *ctx)
+{
+	char dict[256];
+	test_doc doc;
+	int form;
+
+	new_test_doc(ctx, &doc);
+	add_obj(&doc, "<</Type/Catalog/Pages 2 0 R>>");
+	add_obj(&doc, "<</Type/Pages/Kids[4 0 R]/Count 1>>");
+	form = add_stream(&doc, "/Type/XObject/Subtype/Form/BBox[0 0 200 100]/Matrix[0.9 0.2 -0.2 0.9 10 5]",
+		(unsigned char *)form_contents, strlen(form_contents));
+	sprintf(dict, "<</Type/Page/Parent 2 0 R/MediaBox[0 0 500 400]/Contents 5 0 R"
+		"/Resources<</XObject<</Fm %d 0 R>>>>>>", form);
+	add_obj(&doc, dict);
+	add_stream(&doc, "", (unsigned char *)form_page, strlen(form_page));
+	return end_test_doc(&doc);
+}
+
+/* Draw a page; with direct set, the device has a hint, and so forms
+ * are run rather than recorded */
+static fz_pixmap *
+render_form_page(fz_context *ctx, fz_document *doc, fz_matrix ctm, int direct)
+{
+	fz_page *page = NULL;
+	fz_pixmap *pix = NULL;
+	fz_device *dev = NULL;
+
+	fz_var(page);
+	fz_var(pix);
+	fz_var(dev);
+
+	fz_try(ctx)
+	{
+		page = fz_load_page(doc, 0);
+		pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb,
+			fz_round_rect(fz_transform_rect(ctm, fz_bound_page(doc, page))));
+		fz_clear_pixmap_with_value(ctx, pix, 0xff);
+		dev = fz_new_draw_device(ctx, pix);
+		if (direct)
+			dev->hints |= FZ_IGNORE_SHADE;
+		fz_run_page(doc, page, dev, ctm, NULL);
+	}
+	fz_always(ctx)
+	{
+		fz_free_device(dev);
+		if (page)
+			fz_free_page(doc, page);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, pix);
+		pix = NULL;
+		fail("cannot render the form page: %s", ctx->error->message);
+	}
+	return pix;
+}
+
+static void
+test_form_lists(void)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_document *doc;
+	fz_pixmap *direct, *replayed;
+	fz_buffer *pdf;
+	fz_matrix ctm;
+	int i, k, run, bad;
+
+	printf("form lists against running forms\n");
+
+	pdf = make_form_doc(ctx);
+	doc = open_test_doc(ctx, pdf);
+
+	for (i = 0; doc && i < nelem(form_cases); i++)
+	{
+		ctm = fz_concat(fz_scale(form_cases[i].zoom, form_cases[i].zoom), fz_rotate(form_cases[i].rotate));
+		direct = render_form_page(ctx, doc, ctm, 1);
+		for (run = 0; direct && run < 2; run++)
+		{
+			replayed = render_form_page(ctx, doc, ctm, 0);
+			if (!replayed)
+				break;
+			bad = 0;
+			for (k = 0; k < direct->w * direct->h * direct->n; k++)
+				if (direct->samples[k] != replayed->samples[k])
+					bad++;
+			if (bad)
+				fail("zoom %g, rotation %d, %s: %d samples differ", form_cases[i].zoom,
+					form_cases[i].rotate, run ? "replayed" : "recorded", bad);
+			fz_drop_pixmap(ctx, replayed);
+		}
+		fz_drop_pixmap(ctx, direct);
+	}
+
+	if (doc)
+		fz_close_document(doc);
+	fz_drop_buffer(ctx, pdf);
+	fz_free_context(ctx);
+}
+
+/*
+ * JBIG2 pages sharing their symbols through JBIG2Globals. The decoded
+ * globals are kept in the store, and contexts cloned for other threads
+ * share that store, but must not share the globals (pdf_stream.c). Each
+ * page lays out the glyphs of the global symbol dictionary in two rows,
+ * and is drawn at its size so that every pixel can be checked.
+ *
+ * There is no encoder to hand, so the segments are written out here, all
+ * Huffman coded with the standard tables of Annex B and an uncompressed
+ * collective bitmap.
+ */
+
+#define GLYPH_SIZE 16
+#define GLYPH_COUNT 4
+#define JBIG2_W (GLYPH_SIZE * 4)
+#define JBIG2_H (GLYPH_SIZE * 2)
+
+static const int jbig2_layout[2][8] = {
+	{ 0, 1, 2, 3, 3, 2, 1, 0 },
+	{ 2, 0, 3, 1, 1, 3, 0, 2 },
+};
+
+static int
+glyph_bit(int g, int x, int y)
+{
+	switch (g)
+	{
+	case 0: return x == 0 || y == 0 || x == GLYPH_SIZE - 1 || y == GLYPH_SIZE - 1;
+	case 1: return x == y || x == GLYPH_SIZE - 1 - y;
+	case 2: return y % 4 < 2;
+	default: return (x / 4 + y / 4) & 1;
+	}
+}
+
+static void
+put_bytes(fz_context *ctx, fz_buffer *buf, unsigned int val, int n)
+{
+	unsigned char data[4];
+	int i;
+
+	for (i = 0; i < n; i++)
+		data[i] = val >> ((n - 1 - i) * 8);
+	fz_write_buffer(ctx, buf, data, n);
+}
+
+/* A segment header with a one byte page association, and its data */
+static void
+put_segment(fz_context *ctx, fz_buffer *out, int number, int type, int page, int refers, fz_buffer *data)
+{
+	put_bytes(ctx, out, number, 4);
+	put_bytes(ctx, out, type, 1);
+	if (refers < 0)
+		put_bytes(ctx, out, 0, 1);
+	else
+	{
+		put_bytes(ctx, out, 1 << 5, 1);
+		put_bytes(ctx, out, refers, 1);
+	}
+	put_bytes(ctx, out, page, 1);
+	put_bytes(ctx, out, data->len, 4);
+	fz_write_buffer(ctx, out, data->data, data->len);
+}
+
+/* Segment 0: a symbol dictionary of the glyphs, in one height class */
+static fz_buffer *
+make_jbig2_globals(fz_context *ctx)
+{
+	fz_buffer *out = fz_new_buffer(ctx, 256);
+	fz_buffer *data = fz_new_buffer(ctx, 256);
+	int stride = GLYPH_SIZE * GLYPH_COUNT / 8;
+	unsigned char *row = fz_malloc(ctx, stride);
+	int i, x, y;
+
+	put_bytes(ctx, data, 0x0001, 2); /* SDHUFF */
+	put_bytes(ctx, data, GLYPH_COUNT, 4); /* SDNUMEXSYMS */
+	put_bytes(ctx, data, GLYPH_COUNT, 4); /* SDNUMNEWSYMS */
+
+	fz_write_buffer_bits(ctx, data, 0x1e, 5); /* HCDH 16, table B.4 */
+	fz_write_buffer_bits(ctx, data, 4, 6);
+	fz_write_buffer_bits(ctx, data, 0x1e, 5); /* DW 16, table B.2 */
+	fz_write_buffer_bits(ctx, data, 5, 6);
+	for (i = 1; i < GLYPH_COUNT; i++)
+		fz_write_buffer_bits(ctx, data, 0, 1); /* DW 0 */
+	fz_write_buffer_bits(ctx, data, 0x3f, 6); /* OOB */
+	fz_write_buffer_bits(ctx, data, 0, 5); /* BMSIZE 0, table B.1 */
+	fz_write_buffer_pad(ctx, data);
+
+	for (y = 0; y < GLYPH_SIZE; y++)
+	{
+		memset(row, 0, stride);
+		for (x = 0; x < GLYPH_SIZE * GLYPH_COUNT; x++)
+			if (glyph_bit(x / GLYPH_SIZE, x % GLYPH_SIZE, y))
+				row[x / 8] |= 0x80 >> (x & 7);
+		fz_write_buffer(ctx, data, row, stride);
+	}
+
+	/* Export flags: none left out, then all of them */
+	fz_write_buffer_bits(ctx, data, 0, 5);
+	fz_write_buffer_bits(ctx, data, GLYPH_COUNT, 5);
+	fz_write_buffer_pad(ctx, data);
+
+	put_segment(ctx, out, 0, 0, 0, -1, data);
+	fz_drop_buffer(ctx, data);
+	fz_free(ctx, row);
+	return out;
+}
+
+/* Segments 1 and 2: page information and a text region placing glyphs */
+static fz_buffer *
+make_jbig2_page(fz_context *ctx, const int *layout)
+{
+	fz_buffer *out = fz_new_buffer(ctx, 256);
+	fz_buffer *data = fz_new_buffer(ctx, 256);
+	int i, strip;
+
+	put_bytes(ctx, data, JBIG2_W, 4);
+	put_bytes(ctx, data, JBIG2_H, 4);
+	put_bytes(ctx, data, 0, 4);
+	put_bytes(ctx, data, 0, 4);
+	put_bytes(ctx, data, 0, 1);
+	put_bytes(ctx, data, 0, 2);
+	put_segment(ctx, out, 1, 48, 1, -1, data);
+
+	data->len = 0;
+	put_bytes(ctx, data, JBIG2_W, 4);
+	put_bytes(ctx, data, JBIG2_H, 4);
+	put_bytes(ctx, data, 0, 4);
+	put_bytes(ctx, data, 0, 4);
+	put_bytes(ctx, data, 0, 1);
+	put_bytes(ctx, data, 0x0011, 2); /* SBHUFF, REFCORNER top left */
+	put_bytes(ctx, data, 0, 2); /* standard tables */
+	put_bytes(ctx, data, 8, 4); /* SBNUMINSTANCES */
+
+	/* Symbol ID codes: runcode 2 alone, coded 0, gives them all 2 bits */
+	for (i = 0; i < 35; i++)
+		fz_write_buffer_bits(ctx, data, i == 2, 4);
+	for (i = 0; i < GLYPH_COUNT; i++)
+		fz_write_buffer_bits(ctx, data, 0, 1);
+	fz_write_buffer_pad(ctx, data);
+
+	fz_write_buffer_bits(ctx, data, 0, 1); /* STRIPT -1, table B.11 */
+	for (strip = 0; strip < 2; strip++)
+	{
+		if (strip == 0)
+			fz_write_buffer_bits(ctx, data, 0, 1); /* DT 1 */
+		else
+		{
+			fz_write_buffer_bits(ctx, data, 0x3c, 6); /* DT 16 */
+			fz_write_buffer_bits(ctx, data, 3, 2);
+		}
+		fz_write_buffer_bits(ctx, data, 0, 2); /* DFS 0, table B.6 */
+		fz_write_buffer_bits(ctx, data, 0, 7);
+		for (i = 0; i < 4; i++)
+		{
+			if (i > 0)
+			{
+				fz_write_buffer_bits(ctx, data, 0, 2); /* IDS 1, table B.8 */
+				fz_write_buffer_bits(ctx, data, 1, 1);
+			}
+			fz_write_buffer_bits(ctx, data, layout[strip * 4 + i], 2);
+		}
+		fz_write_buffer_bits(ctx, data, 1, 2); /* OOB */
+	}
+	fz_write_buffer_pad(ctx, data);
+	put_segment(ctx, out, 2, 6, 1, 0, data);
+
+	fz_drop_buffer(ctx, data);
+	return out;
+}
+
+/*
+ * The globals are always object 3. Decoded images are stored by object
+ * number too, so documents that are to decode their pages afresh against
+ * globals already stored put pad objects before their pages.
+ */
+static fz_buffer *
+make_jbig2_doc(fz_context *ctx, int pad, int pages)
+{
+	char dict[256], kids[512];
+	fz_buffer *jbig2;
+	test_doc doc;
+	int globals, first, page;
+
+	new_test_doc(ctx, &doc);
+	add_obj(&doc, "<</Type/Catalog/Pages 2 0 R>>");
+	first = 4 + pad;
+	strcpy(kids, "<</Type/Pages/Kids[");
+	for (page = 0; page < pages; page++)
+		sprintf(kids + strlen(kids), "%d 0 R ", first + page * 3);
+	sprintf(kids + strlen(kids), "]/Count %d>>", pages);
+	add_obj(&doc, kids);
+
+	jbig2 = make_jbig2_globals(ctx);
+	globals = add_stream(&doc, "", jbig2->data, jbig2->len);
+	fz_drop_buffer(ctx, jbig2);
+
+	while (pad--)
+		add_obj(&doc, "null");
+
+	for (page = 0; page < pages; page++)
+	{
+		add_image_page(&doc, JBIG2_W, JBIG2_H, doc.count + 3, "q 64 0 0 32 0 0 cm /Im Do Q");
+		jbig2 = make_jbig2_page(ctx, jbig2_layout[page & 1]);
+		sprintf(dict, "/Type/XObject/Subtype/Image/Width %d/Height %d"
+			"/ColorSpace/DeviceGray/BitsPerComponent 1"
+			"/Filter/JBIG2Decode/DecodeParms<</JBIG2Globals %d 0 R>>", JBIG2_W, JBIG2_H, globals);
+		add_stream(&doc, dict, jbig2->data, jbig2->len);
+		fz_drop_buffer(ctx, jbig2);
+	}
+	return end_test_doc(&doc);
+}
+
+/* Count the pixels of a JBIG2 page that are not as laid out */
+static int
+check_jbig2_page(fz_pixmap *pix, int page)
+{
+	int x, y, g, want, bad = 0;
+	unsigned char *p;
+
+	if (pix->w != JBIG2_W || pix->h != JBIG2_H)
+		return pix->w * pix->h;
+	for (y = 0; y < JBIG2_H; y++)
+	{
+		for (x = 0; x < JBIG2_W; x++)
+		{
+			g = jbig2_layout[page & 1][(y / GLYPH_SIZE) * 4 + x / GLYPH_SIZE];
+			want = glyph_bit(g, x % GLYPH_SIZE, y % GLYPH_SIZE) ? 0 : 255;
+			p = pix->samples + (y * pix->w + x) * pix->n;
+			if (p[0] != want || p[1] != want || p[2] != want)
+				bad++;
+		}
+	}
+	return bad;
+}
+
+#define JBIG2_PAGES 24
+
+typedef struct jbig2_worker_s jbig2_worker;
+
+struct jbig2_worker_s
+{
+	fz_context *ctx;
+	int pad;
+	int bad;
+};
+
+static void *
+jbig2_worker_run(void *arg)
+{
+	jbig2_worker *w = arg;
+	fz_context *ctx = w->ctx;
+	fz_buffer *pdf = make_jbig2_doc(ctx, w->pad, JBIG2_PAGES);
+	fz_document *doc = open_test_doc(ctx, pdf);
+	fz_pixmap *pix;
+	int page;
+
+	for (page = 0; doc && page < JBIG2_PAGES; page++)
+	{
+		pix = render_page(ctx, doc, page, fz_identity, 0);
+		if (pix)
+			w->bad += check_jbig2_page(pix, page);
+		fz_drop_pixmap(ctx, pix);
+	}
+
+	if (doc)
+		fz_close_document(doc);
+	fz_drop_buffer(ctx, pdf);
+	return NULL;
+}
+
+static void
+lock_mutex(void *user, int lock)
+{
+	pthread_mutex_lock(&((pthread_mutex_t *)user)[lock]);
+}
+
+static void
+unlock_mutex(void *user, int lock)
+{
+	pthread_mutex_unlock(&((pthread_mutex_t *)user)[lock]);
+}
+
+static void
+test_jbig2_globals(void)
+{
+	pthread_mutex_t mutexes[FZ_LOCK_MAX];
+	fz_locks_context locks = { mutexes, lock_mutex, unlock_mutex };
+	pthread_t threads[2];
+	jbig2_worker workers[2];
+	fz_context *ctx;
+	fz_document *doc;
+	fz_pixmap *pix;
+	fz_buffer *pdf;
+	int i, page, bad;
+
+	printf("JBIG2 pages sharing globals\n");
+
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&mutexes[i], NULL);
+	ctx = fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+
+	/* Both pages of one document, the second finding the globals stored */
+	pdf = make_jbig2_doc(ctx, 0, 2);
+	doc = open_test_doc(ctx, pdf);
+	for (page = 0; doc && page < 2; page++)
+	{
+		pix = render_page(ctx, doc, page, fz_identity, 0);
+		if (pix && (bad = check_jbig2_page(pix, page)))
+			fail("page %d: %d pixels differ", page + 1, bad);
+		fz_drop_pixmap(ctx, pix);
+	}
+
+	/* Documents in other threads, whose globals have the same object
+	 * number and so the same key in the shared store. Every page decodes
+	 * against them while the other thread may be doing the same. */
+	for (i = 0; i < 2; i++)
+	{
+		workers[i].ctx = fz_clone_context(ctx);
+		workers[i].pad = (i + 1) * JBIG2_PAGES * 3;
+		workers[i].bad = 0;
+		pthread_create(&threads[i], NULL, jbig2_worker_run, &workers[i]);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		pthread_join(threads[i], NULL);
+		if (workers[i].bad)
+			fail("thread %d: %d pixels differ", i + 1, workers[i].bad);
+		fz_free_context(workers[i].ctx);
+	}
+
+	if (doc)
+		fz_close_document(doc);
+	fz_drop_buffer(ctx, pdf);
+	fz_free_context(ctx);
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_destroy(&mutexes[i]);
+}
+
+/*
+ * Calculator functions are compiled to register programs, and operators
+ * on constants are worked out at load time (pdf_function.c). Each case
+ * adds an operator on constants to the input. The function must come out
+ * the same size as one that drops the constants and adds the result
+ * written out, which it only does if the operator compiles to no
+ * instruction, and must evaluate alike.
+ */
+
+static const struct {
+	const char *args;
+	const char *op;
+	const char *pops;
+	const char *value;
+} fold_cases[] = {
+	{ "7.0 2.0", "div", "pop pop", "3.5" },
+	{ "7 2", "idiv", "pop pop", "3" },
+	{ "7 3", "mod", "pop pop", "1" },
+	{ "1.0 1.0", "atan", "pop pop", "45.0" },
+	{ "2.0 3.0", "exp", "pop pop", "8.0" },
+	{ "1 4", "bitshift", "pop pop", "16" },
+	{ "1.2", "ceiling", "pop", "2.0" },
+	{ "1.7", "floor", "pop", "1.0" },
+	{ "0.0", "cos", "pop", "1.0" },
+	{ "90.0", "sin", "pop", "1.0" },
+	{ "16.0", "sqrt", "pop", "4.0" },
+	{ "1.0", "ln", "pop", "0.0" },
+	{ "100.0", "log", "pop", "2.0" },
+};
+
+/* Leave the arguments, then either the operator or the value */
+static int
+add_ps_function(test_doc *doc, const char *args, const char *op)
+{
+	char code[256];
+
+	sprintf(code, "{ %s %s add }", args, op);
+	return add_stream(doc, "/FunctionType 4/Domain[0 1]/Range[-100 100]",
+		(unsigned char *)code, strlen(code));
+}
+
+static void
+test_ps_folding(void)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	pdf_function *folded, *written;
+	pdf_document *xref;
+	fz_document *doc;
+	fz_buffer *pdf;
+	test_doc tdoc;
+	pdf_obj *obj;
+	char value[64];
+	float in, a, b;
+	int i, k, first;
+
+	printf("calculator functions folding constants\n");
+
+	new_test_doc(ctx, &tdoc);
+	add_obj(&tdoc, "<</Type/Catalog/Pages 2 0 R>>");
+	add_obj(&tdoc, "<</Type/Pages/Kids[]/Count 0>>");
+	first = tdoc.count + 1;
+	for (i = 0; i < nelem(fold_cases); i++)
+	{
+		add_ps_function(&tdoc, fold_cases[i].args, fold_cases[i].op);
+		sprintf(value, "%s %s", fold_cases[i].pops, fold_cases[i].value);
+		add_ps_function(&tdoc, fold_cases[i].args, value);
+	}
+	pdf = end_test_doc(&tdoc);
+	doc = open_test_doc(ctx, pdf);
+	xref = (pdf_document *)doc;
+
+	for (i = 0; doc && i < nelem(fold_cases); i++)
+	{
+		obj = pdf_new_indirect(ctx, first + i * 2, 0, xref);
+		folded = pdf_load_function(xref, obj, 1, 1);
+		pdf_drop_obj(obj);
+		obj = pdf_new_indirect(ctx, first + i * 2 + 1, 0, xref);
+		written = pdf_load_function(xref, obj, 1, 1);
+		pdf_drop_obj(obj);
+
+		if (pdf_function_size(folded) != pdf_function_size(written))
+			fail("%s: %u bytes compiled, %u for its value", fold_cases[i].op,
+				pdf_function_size(folded), pdf_function_size(written));
+		for (k = 0; k <= 4; k++)
+		{
+			in = k * 0.25f;
+			pdf_eval_function(ctx, folded, &in, 1, &a, 1);
+			pdf_eval_function(ctx, written, &in, 1, &b, 1);
+			if (fabsf(a - b) > 1e-5f)
+				fail("%s at %g: %g, not %g", fold_cases[i].op, in, a, b);
+		}
+
+		pdf_drop_function(ctx, folded);
+		pdf_drop_function(ctx, written);
+	}
+
+	if (doc)
+		fz_close_document(doc);
+	fz_drop_buffer(ctx, pdf);
+	fz_free_context(ctx);
+}
+
+/*
+ * Analytic path filling: coverage is the absolute winding area, so a
+ * shape must come out the same whichever way round it is wound, down to
+ * slivers covering less than a level of a pixel.
+ */
+
+static const float analytic_shapes[][6] = {
+	{ 2.3f, 1.7f, 40.6f, 9.2f, 11.1f, 27.9f },
+	{ 3.5f, 3.5f, 60.25f, 3.75f, 4.0f, 3.6f },
+	{ 10.1f, 2.0f, 10.102f, 2.0f, 10.101f, 30.0f },
+	{ 0.5f, 30.3f, 63.7f, 0.2f, 31.0f, 31.1f },
+};
+
+static fz_pixmap *
+fill_triangle(fz_context *ctx, const float *p, int reverse, int even_odd)
+{
+	fz_bbox bbox = { 0, 0, 64, 32 };
+	fz_pixmap *pix = fz_new_pixmap_with_bbox(ctx, fz_device_gray, bbox);
+	fz_path *path = fz_new_path(ctx);
+	fz_device *dev;
+	float color = 1;
+
+	fz_clear_pixmap(ctx, pix);
+	fz_moveto(ctx, path, p[0], p[1]);
+	if (reverse)
+	{
+		fz_lineto(ctx, path, p[4], p[5]);
+		fz_lineto(ctx, path, p[2], p[3]);
+	}
+	else
+	{
+		fz_lineto(ctx, path, p[2], p[3]);
+		fz_lineto(ctx, path, p[4], p[5]);
+	}
+	fz_closepath(ctx, path);
+
+	dev = fz_new_draw_device(ctx, pix);
+	fz_set_draw_device_analytic(dev, 1);
+	fz_fill_path(dev, path, even_odd, fz_identity, fz_device_gray, &color, 1);
+	fz_free_device(dev);
+	fz_free_path(ctx, path);
+	return pix;
+}
+
+static void
+test_analytic_winding(void)
+{
+	fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	fz_pixmap *a, *b;
+	int i, k, even_odd, bad;
+
+	printf("analytic fills wound either way\n");
+
+	for (i = 0; i < nelem(analytic_shapes); i++)
+	{
+		for (even_odd = 0; even_odd < 2; even_odd++)
+		{
+			a = fill_triangle(ctx, analytic_shapes[i], 0, even_odd);
+			b = fill_triangle(ctx, analytic_shapes[i], 1, even_odd);
+			bad = 0;
+			for (k = 0; k < a->w * a->h * a->n; k++)
+				if (a->samples[k] != b->samples[k])
+					bad++;
+			if (bad)
+				fail("shape %d, %s: %d samples differ", i + 1,
+					even_odd ? "even-odd" : "non-zero", bad);
+			fz_drop_pixmap(ctx, a);
+			fz_drop_pixmap(ctx, b);
+		}
+	}
+
+	fz_free_context(ctx);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_banded_jpeg();
+	test_bitmap_parts();
+	test_bitmap_scaled();
+	test_compiled_contents();
+	test_form_lists();
+	test_jbig2_globals();
+	test_ps_folding();
+	test_analytic_winding();
+
+	if (failures)
+	{
+		printf("%d check(s) failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
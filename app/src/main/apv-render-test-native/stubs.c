@@ -0,0 +1,34 @@
+#include "fitz-internal.h"
+#include "mupdf-internal.h"
+
+/*
+ * The app loads fonts and CMaps from its assets through JNI. The test
+ * documents use neither, so there is nothing to find.
+ */
+
+unsigned char *
+pdf_lookup_builtin_font(char *name, unsigned int *len)
+{
+	*len = 0;
+	return NULL;
+}
+
+unsigned char *
+pdf_lookup_substitute_font(int mono, int serif, int bold, int italic, unsigned int *len)
+{
+	*len = 0;
+	return NULL;
+}
+
+unsigned char *
+pdf_lookup_substitute_cjk_font(int ros, int serif, unsigned int *len)
+{
+	*len = 0;
+	return NULL;
+}
+
+pdf_cmap *
+pdf_load_builtin_cmap(fz_context *ctx, char *name)
+{
+	return NULL;
+}
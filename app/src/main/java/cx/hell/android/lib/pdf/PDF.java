@@ -487,6 +487,8 @@ public class PDF {
 	 */
 	public native int getHeapSize();
 	
+	public static native int[] getGlyphCacheStats();
+	
 	/**
 	 * Free memory allocated in native code.
 	 */
@@ -49,6 +49,19 @@ jbig2_generic_stats_size(Jbig2Ctx *ctx, int template)
 }
 
 
+static void
+copy_prev_row(Jbig2Image *image, int row)
+{
+  if (!row) {
+    /* no previous row */
+    memset( image->data, 0, image->stride );
+  } else {
+    /* duplicate data from the previous row */
+    uint8_t *src = image->data + (row - 1) * image->stride;
+    memcpy( src + image->stride, src, image->stride );
+  }
+}
+
 static int
 jbig2_decode_generic_template0(Jbig2Ctx *ctx,
 			       Jbig2Segment *segment,
@@ -60,10 +73,11 @@ jbig2_decode_generic_template0(Jbig2Ctx *ctx,
   const int GBW = image->width;
   const int GBH = image->height;
   const int rowstride = image->stride;
+  int LTP = 0;
   int x, y;
   byte *gbreg_line = (byte *)image->data;
 
-  /* todo: currently we only handle the nominal gbat location */
+  /* this routine only handles the nominal gbat location */
 
 #ifdef OUTPUT_PBM
   printf("P4\n%d %d\n", GBW, GBH);
@@ -76,6 +90,20 @@ jbig2_decode_generic_template0(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0x9B25]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+#ifdef OUTPUT_PBM
+	      fwrite(gbreg_line, 1, rowstride, stdout);
+#endif
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 6 : 0;
       CONTEXT = (line_m1 & 0x7f0) | (line_m2 & 0xf800);
@@ -117,52 +145,6 @@ jbig2_decode_generic_template0(Jbig2Ctx *ctx,
   return 0;
 }
 
-static int
-jbig2_decode_generic_template0_unopt(Jbig2Ctx *ctx,
-                               Jbig2Segment *segment,
-                               const Jbig2GenericRegionParams *params,
-                               Jbig2ArithState *as,
-                               Jbig2Image *image,
-                               Jbig2ArithCx *GB_stats)
-{
-  const int GBW = image->width;
-  const int GBH = image->height;
-  uint32_t CONTEXT;
-  int x,y;
-  bool bit;
-
-  /* this version is generic and easy to understand, but very slow */
-
-  for (y = 0; y < GBH; y++) {
-    for (x = 0; x < GBW; x++) {
-      CONTEXT = 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y) << 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 2, y) << 1;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 3, y) << 2;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 4, y) << 3;
-      CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[0],
-	y + params->gbat[1]) << 4;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 2, y - 1) << 5;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 6;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 0, y - 1) << 7;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 8;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 2, y - 1) << 9;
-      CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[2],
-	y + params->gbat[3]) << 10;
-      CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[4],
-	y + params->gbat[5]) << 11;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 2) << 12;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 0, y - 2) << 13;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 2) << 14;
-      CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[6],
-	y + params->gbat[7]) << 15;
-      bit = jbig2_arith_decode(as, &GB_stats[CONTEXT]);
-      jbig2_image_set_pixel(image, x, y, bit);
-    }
-  }
-  return 0;
-}
-
 static int
 jbig2_decode_generic_template1(Jbig2Ctx *ctx,
 			       Jbig2Segment *segment,
@@ -174,10 +156,11 @@ jbig2_decode_generic_template1(Jbig2Ctx *ctx,
   const int GBW = image->width;
   const int GBH = image->height;
   const int rowstride = image->stride;
+  int LTP = 0;
   int x, y;
   byte *gbreg_line = (byte *)image->data;
 
-  /* todo: currently we only handle the nominal gbat location */
+  /* this routine only handles the nominal gbat location */
 
 #ifdef OUTPUT_PBM
   printf("P4\n%d %d\n", GBW, GBH);
@@ -190,6 +173,20 @@ jbig2_decode_generic_template1(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0x0795]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+#ifdef OUTPUT_PBM
+	      fwrite(gbreg_line, 1, rowstride, stdout);
+#endif
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 5 : 0;
       CONTEXT = ((line_m1 >> 1) & 0x1f8) | ((line_m2 >> 1) & 0x1e00);
@@ -242,10 +239,11 @@ jbig2_decode_generic_template2(Jbig2Ctx *ctx,
   const int GBW = image->width;
   const int GBH = image->height;
   const int rowstride = image->stride;
+  int LTP = 0;
   int x, y;
   byte *gbreg_line = (byte *)image->data;
 
-  /* todo: currently we only handle the nominal gbat location */
+  /* this routine only handles the nominal gbat location */
 
 #ifdef OUTPUT_PBM
   printf("P4\n%d %d\n", GBW, GBH);
@@ -258,6 +256,20 @@ jbig2_decode_generic_template2(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0xE5]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+#ifdef OUTPUT_PBM
+	      fwrite(gbreg_line, 1, rowstride, stdout);
+#endif
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 4 : 0;
       CONTEXT = ((line_m1 >> 3) & 0x7c) | ((line_m2 >> 3) & 0x380);
@@ -310,6 +322,7 @@ jbig2_decode_generic_template2a(Jbig2Ctx *ctx,
   const int GBW = image->width;
   const int GBH = image->height;
   const int rowstride = image->stride;
+  int LTP = 0;
   int x, y;
   byte *gbreg_line = (byte *)image->data;
 
@@ -326,6 +339,20 @@ jbig2_decode_generic_template2a(Jbig2Ctx *ctx,
       uint32_t line_m2;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0xE5]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+#ifdef OUTPUT_PBM
+	      fwrite(gbreg_line, 1, rowstride, stdout);
+#endif
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 4 : 0;
       CONTEXT = ((line_m1 >> 3) & 0x78) | ((line_m1 >> 2) & 0x4) | ((line_m2 >> 3) & 0x380);
@@ -380,6 +407,7 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
   const int GBH = image->height;
   const int rowstride = image->stride;
   byte *gbreg_line = (byte *)image->data;
+  int LTP = 0;
   int x, y;
 
   /* this routine only handles the nominal AT location */
@@ -394,6 +422,20 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
       uint32_t line_m1;
       int padded_width = (GBW + 7) & -8;
 
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0x0195]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+#ifdef OUTPUT_PBM
+	      fwrite(gbreg_line, 1, rowstride, stdout);
+#endif
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
       line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
       CONTEXT = (line_m1 >> 1) & 0x3f0;
 
@@ -416,7 +458,7 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
 	      bit = jbig2_arith_decode(as, &GB_stats[CONTEXT]);
 	      result |= bit << (7 - x_minor);
 	      CONTEXT = ((CONTEXT & 0x1f7) << 1) | bit |
-		((line_m1 >> (10 - x_minor)) & 0x010);
+		((line_m1 >> (8 - x_minor)) & 0x010);
 	    }
 	  gbreg_line[x >> 3] = result;
 	}
@@ -429,257 +471,375 @@ jbig2_decode_generic_template3(Jbig2Ctx *ctx,
   return 0;
 }
 
-static int
-jbig2_decode_generic_template3_unopt(Jbig2Ctx *ctx,
-                               Jbig2Segment *segment,
-                               const Jbig2GenericRegionParams *params,
-                               Jbig2ArithState *as,
-                               Jbig2Image *image,
-                               Jbig2ArithCx *GB_stats)
+/*
+ * The routines above take the AT pixels at their nominal locations,
+ * where they extend the rows of the template. Elsewhere each AT pixel
+ * is read a byte at a time for the 8 pixels of the output byte being
+ * decoded, and shifted into its context bit per pixel like the rows.
+ */
+
+/* how an AT pixel at offset (dx, dy) is read during decoding */
+int
+jbig2_generic_at_kind(int dx, int dy)
 {
-  const int GBW = image->width;
-  const int GBH = image->height;
-  uint32_t CONTEXT;
-  int x,y;
-  bool bit;
-
-  /* this version is generic and easy to understand, but very slow */
-
-  for (y = 0; y < GBH; y++) {
-    for (x = 0; x < GBW; x++) {
-      CONTEXT = 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y) << 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 2, y) << 1;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 3, y) << 2;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 4, y) << 3;
-      CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[0],
-	y + params->gbat[1]) << 4;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 5;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 0, y - 1) << 6;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 7;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 2, y - 1) << 8;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 3, y - 1) << 9;
-      bit = jbig2_arith_decode(as, &GB_stats[CONTEXT]);
-      jbig2_image_set_pixel(image, x, y, bit);
-    }
-  }
-  return 0;
+  /* pixels in rows above or whole bytes back are already stored */
+  if (dy < 0 || (dy == 0 && dx <= -8))
+    return JBIG2_AT_FETCH;
+  /* pixels in the current output byte or the one before it */
+  if (dy == 0 && dx < 0)
+    return JBIG2_AT_HISTORY;
+  /* pixels not yet decoded; not allowed, read as 0 */
+  return JBIG2_AT_ZERO;
 }
 
-static void
-copy_prev_row(Jbig2Image *image, int row)
+/**
+ * jbig2_generic_at_window: Read an AT pixel for the next output byte.
+ * @image: The image being decoded, or the reference image.
+ * @kind: How the pixel is read, as returned by jbig2_generic_at_kind().
+ * @x: Column of the AT pixel of the first pixel of the output byte.
+ * @y: Row of the AT pixel.
+ * @window: The window returned for the previous output byte.
+ * @pos: Bit of the AT pixel in the context.
+ *
+ * Returns a window where the AT pixel of output pixel i (0 to 7) is bit
+ * 15 - i + @pos. For JBIG2_AT_HISTORY, which reads from the current
+ * row, the caller must add each decoded bit as it goes, at bit
+ * 15 + dx - i + @pos.
+ **/
+uint32_t
+jbig2_generic_at_window(Jbig2Image *image, int kind, int x, int y,
+			uint32_t window, int pos)
 {
-  if (!row) {
-    /* no previous row */
-    memset( image->data, 0, image->stride );
-  } else {
-    /* duplicate data from the previous row */
-    uint8_t *src = image->data + (row - 1) * image->stride;
-    memcpy( src + image->stride, src, image->stride );
-  }
+  switch (kind)
+    {
+    case JBIG2_AT_FETCH:
+      return (uint32_t)jbig2_image_get_byte(image, x, y) << (pos + 8);
+    case JBIG2_AT_HISTORY:
+      return window << 8;
+    }
+  return 0;
 }
 
 static int
-jbig2_decode_generic_template0_TPGDON(Jbig2Ctx *ctx,
-				Jbig2Segment *segment,
-				const Jbig2GenericRegionParams *params, 
-				Jbig2ArithState *as,
-				Jbig2Image *image,
-				Jbig2ArithCx *GB_stats)
+jbig2_decode_generic_template0_at(Jbig2Ctx *ctx,
+				  Jbig2Segment *segment,
+				  const Jbig2GenericRegionParams *params,
+				  Jbig2ArithState *as,
+				  Jbig2Image *image,
+				  Jbig2ArithCx *GB_stats)
 {
+  static const int at_pos[4] = { 4, 10, 11, 15 };
   const int GBW = image->width;
   const int GBH = image->height;
-  uint32_t CONTEXT;
-  int x, y;
-  bool bit;
+  const int rowstride = image->stride;
+  const int8_t *gbat = params->gbat;
+  byte *gbreg_line = (byte *)image->data;
+  int at_kind[4];
+  uint32_t at[4];
+  int history = 0;
   int LTP = 0;
+  int x, y, i;
+
+  for (i = 0; i < 4; i++)
+    {
+      at_kind[i] = jbig2_generic_at_kind(gbat[2 * i], gbat[2 * i + 1]);
+      history |= at_kind[i] == JBIG2_AT_HISTORY;
+    }
 
   for (y = 0; y < GBH; y++)
-  {
-    LTP ^= jbig2_arith_decode(as, &GB_stats[0x9B25]);
-    if (!LTP) {
-      for (x = 0; x < GBW; x++) {
-        CONTEXT  = jbig2_image_get_pixel(image, x - 1, y);
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y) << 1;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 3, y) << 2;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 4, y) << 3;
-        CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[0],
-					y + params->gbat[1]) << 4;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 2, y - 1) << 5;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 6;
-        CONTEXT |= jbig2_image_get_pixel(image, x    , y - 1) << 7;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 8;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y - 1) << 9;
-        CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[2],
-					y + params->gbat[3]) << 10;
-        CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[4],
-					y + params->gbat[5]) << 11;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 2) << 12;
-        CONTEXT |= jbig2_image_get_pixel(image, x    , y - 2) << 13;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 2) << 14;
-        CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[6],
-					y + params->gbat[7]) << 15;
-        bit = jbig2_arith_decode(as, &GB_stats[CONTEXT]);
-        jbig2_image_set_pixel(image, x, y, bit);
-      }
-    } else {
-      copy_prev_row(image, y);
+    {
+      uint32_t CONTEXT;
+      uint32_t line_m1;
+      uint32_t line_m2;
+      int padded_width = (GBW + 7) & -8;
+
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0x9B25]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
+      line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
+      line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 6 : 0;
+      CONTEXT = (line_m1 & 0xe0) | (line_m2 & 0x3000);
+      at[0] = at[1] = at[2] = at[3] = 0;
+
+      for (x = 0; x < padded_width; x += 8)
+	{
+	  byte result = 0;
+	  int x_minor;
+	  int minor_width = GBW - x > 8 ? 8 : GBW - x;
+
+	  if (y >= 1)
+	    line_m1 = (line_m1 << 8) |
+	      (x + 8 < GBW ? gbreg_line[-rowstride + (x >> 3) + 1] : 0);
+
+	  if (y >= 2)
+	    line_m2 = (line_m2 << 8) |
+	      (x + 8 < GBW ? gbreg_line[-(rowstride << 1) + (x >> 3) + 1] << 6: 0);
+
+	  for (i = 0; i < 4; i++)
+	    at[i] = jbig2_generic_at_window(image, at_kind[i],
+	      x + gbat[2 * i], y + gbat[2 * i + 1], at[i], at_pos[i]);
+
+	  for (x_minor = 0; x_minor < minor_width; x_minor++)
+	    {
+	      const int shift = 15 - x_minor;
+	      bool bit;
+
+	      bit = jbig2_arith_decode(as, &GB_stats[CONTEXT |
+		((at[0] >> shift) & 0x0010) | ((at[1] >> shift) & 0x0400) |
+		((at[2] >> shift) & 0x0800) | ((at[3] >> shift) & 0x8000)]);
+	      result |= bit << (7 - x_minor);
+	      CONTEXT = ((CONTEXT & 0x31e7) << 1) | bit |
+		((line_m1 >> (7 - x_minor)) & 0x0020) |
+		((line_m2 >> (7 - x_minor)) & 0x1000);
+	      if (history)
+		for (i = 0; i < 4; i++)
+		  if (at_kind[i] == JBIG2_AT_HISTORY)
+		    at[i] |= (uint32_t)bit << (shift + gbat[2 * i] + at_pos[i]);
+	    }
+	  gbreg_line[x >> 3] = result;
+	}
+      gbreg_line += rowstride;
     }
-  }
 
   return 0;
 }
 
 static int
-jbig2_decode_generic_template1_TPGDON(Jbig2Ctx *ctx, 
-				Jbig2Segment *segment,
-				const Jbig2GenericRegionParams *params, 
-				Jbig2ArithState *as,
-				Jbig2Image *image,
-				Jbig2ArithCx *GB_stats)
+jbig2_decode_generic_template1_at(Jbig2Ctx *ctx,
+				  Jbig2Segment *segment,
+				  const Jbig2GenericRegionParams *params,
+				  Jbig2ArithState *as,
+				  Jbig2Image *image,
+				  Jbig2ArithCx *GB_stats)
 {
   const int GBW = image->width;
   const int GBH = image->height;
-  uint32_t CONTEXT;
-  int x, y;
-  bool bit;
+  const int rowstride = image->stride;
+  const int8_t *gbat = params->gbat;
+  const int at_kind = jbig2_generic_at_kind(gbat[0], gbat[1]);
+  byte *gbreg_line = (byte *)image->data;
+  uint32_t at;
   int LTP = 0;
+  int x, y;
+
+  for (y = 0; y < GBH; y++)
+    {
+      uint32_t CONTEXT;
+      uint32_t line_m1;
+      uint32_t line_m2;
+      int padded_width = (GBW + 7) & -8;
+
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0x0795]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
+      line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
+      line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 5 : 0;
+      CONTEXT = ((line_m1 >> 1) & 0x070) | ((line_m2 >> 1) & 0xe00);
+      at = 0;
+
+      for (x = 0; x < padded_width; x += 8)
+	{
+	  byte result = 0;
+	  int x_minor;
+	  int minor_width = GBW - x > 8 ? 8 : GBW - x;
+
+	  if (y >= 1)
+	    line_m1 = (line_m1 << 8) |
+	      (x + 8 < GBW ? gbreg_line[-rowstride + (x >> 3) + 1] : 0);
+
+	  if (y >= 2)
+	    line_m2 = (line_m2 << 8) |
+	      (x + 8 < GBW ? gbreg_line[-(rowstride << 1) + (x >> 3) + 1] << 5: 0);
+
+	  at = jbig2_generic_at_window(image, at_kind,
+	    x + gbat[0], y + gbat[1], at, 3);
+
+	  for (x_minor = 0; x_minor < minor_width; x_minor++)
+	    {
+	      bool bit;
 
-  for (y = 0; y < GBH; y++) {
-    LTP ^= jbig2_arith_decode(as, &GB_stats[0x0795]);
-    if (!LTP) {
-      for (x = 0; x < GBW; x++) {
-        CONTEXT  = jbig2_image_get_pixel(image, x - 1, y);
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y) << 1;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 3, y) << 2;
-        CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[0],
-					y + params->gbat[1]) << 3;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 2, y - 1) << 4;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 5;
-        CONTEXT |= jbig2_image_get_pixel(image, x    , y - 1) << 6;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 7;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y - 1) << 8;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 2, y - 2) << 9;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 2) << 10;
-        CONTEXT |= jbig2_image_get_pixel(image, x    , y - 2) << 11;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 2) << 12;
-        bit = jbig2_arith_decode(as, &GB_stats[CONTEXT]);
-        jbig2_image_set_pixel(image, x, y, bit);
-      }
-    } else {
-      copy_prev_row(image, y);
+	      bit = jbig2_arith_decode(as, &GB_stats[CONTEXT |
+		((at >> (15 - x_minor)) & 0x008)]);
+	      result |= bit << (7 - x_minor);
+	      CONTEXT = ((CONTEXT & 0xef3) << 1) | bit |
+		((line_m1 >> (8 - x_minor)) & 0x010) |
+		((line_m2 >> (8 - x_minor)) & 0x200);
+	      if (at_kind == JBIG2_AT_HISTORY)
+		at |= (uint32_t)bit << (15 - x_minor + gbat[0] + 3);
+	    }
+	  gbreg_line[x >> 3] = result;
+	}
+      gbreg_line += rowstride;
     }
-  }
 
   return 0;
 }
 
 static int
-jbig2_decode_generic_template2_TPGDON(Jbig2Ctx *ctx, 
-				Jbig2Segment *segment,
-				const Jbig2GenericRegionParams *params,
-				Jbig2ArithState *as,
-				Jbig2Image *image,
-				Jbig2ArithCx *GB_stats)
+jbig2_decode_generic_template2_at(Jbig2Ctx *ctx,
+				  Jbig2Segment *segment,
+				  const Jbig2GenericRegionParams *params,
+				  Jbig2ArithState *as,
+				  Jbig2Image *image,
+				  Jbig2ArithCx *GB_stats)
 {
   const int GBW = image->width;
   const int GBH = image->height;
-  uint32_t CONTEXT;
-  int x, y;
-  bool bit;
+  const int rowstride = image->stride;
+  const int8_t *gbat = params->gbat;
+  const int at_kind = jbig2_generic_at_kind(gbat[0], gbat[1]);
+  byte *gbreg_line = (byte *)image->data;
+  uint32_t at;
   int LTP = 0;
+  int x, y;
 
-  for (y = 0; y < GBH; y++) {
-    LTP ^= jbig2_arith_decode(as, &GB_stats[0xE5]);
-    if (!LTP) {
-      for (x = 0; x < GBW; x++) {
-        CONTEXT  = jbig2_image_get_pixel(image, x - 1, y);
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y) << 1;
-        CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[0],
-					y + params->gbat[1]) << 2;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 3;
-        CONTEXT |= jbig2_image_get_pixel(image, x    , y - 1) << 4;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 5;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y - 1) << 6;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 2) << 7;
-        CONTEXT |= jbig2_image_get_pixel(image, x    , y - 2) << 8;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 2) << 9;
-        bit = jbig2_arith_decode(as, &GB_stats[CONTEXT]);
-        jbig2_image_set_pixel(image, x, y, bit);
-      }
-    } else {
-      copy_prev_row(image, y);
+  for (y = 0; y < GBH; y++)
+    {
+      uint32_t CONTEXT;
+      uint32_t line_m1;
+      uint32_t line_m2;
+      int padded_width = (GBW + 7) & -8;
+
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0xE5]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
+
+      line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
+      line_m2 = (y >= 2) ? gbreg_line[-(rowstride << 1)] << 4 : 0;
+      CONTEXT = ((line_m1 >> 3) & 0x018) | ((line_m2 >> 3) & 0x180);
+      at = 0;
+
+      for (x = 0; x < padded_width; x += 8)
+	{
+	  byte result = 0;
+	  int x_minor;
+	  int minor_width = GBW - x > 8 ? 8 : GBW - x;
+
+	  if (y >= 1)
+	    line_m1 = (line_m1 << 8) |
+	      (x + 8 < GBW ? gbreg_line[-rowstride + (x >> 3) + 1] : 0);
+
+	  if (y >= 2)
+	    line_m2 = (line_m2 << 8) |
+	      (x + 8 < GBW ? gbreg_line[-(rowstride << 1) + (x >> 3) + 1] << 4: 0);
+
+	  at = jbig2_generic_at_window(image, at_kind,
+	    x + gbat[0], y + gbat[1], at, 2);
+
+	  for (x_minor = 0; x_minor < minor_width; x_minor++)
+	    {
+	      bool bit;
+
+	      bit = jbig2_arith_decode(as, &GB_stats[CONTEXT |
+		((at >> (15 - x_minor)) & 0x004)]);
+	      result |= bit << (7 - x_minor);
+	      CONTEXT = ((CONTEXT & 0x1b9) << 1) | bit |
+		((line_m1 >> (10 - x_minor)) & 0x008) |
+		((line_m2 >> (10 - x_minor)) & 0x080);
+	      if (at_kind == JBIG2_AT_HISTORY)
+		at |= (uint32_t)bit << (15 - x_minor + gbat[0] + 2);
+	    }
+	  gbreg_line[x >> 3] = result;
+	}
+      gbreg_line += rowstride;
     }
-  }
 
   return 0;
 }
 
 static int
-jbig2_decode_generic_template3_TPGDON(Jbig2Ctx *ctx, 
-				Jbig2Segment *segment,
-				const Jbig2GenericRegionParams *params,
-				Jbig2ArithState *as,
-				Jbig2Image *image,
-				Jbig2ArithCx *GB_stats)
+jbig2_decode_generic_template3_at(Jbig2Ctx *ctx,
+				  Jbig2Segment *segment,
+				  const Jbig2GenericRegionParams *params,
+				  Jbig2ArithState *as,
+				  Jbig2Image *image,
+				  Jbig2ArithCx *GB_stats)
 {
   const int GBW = image->width;
   const int GBH = image->height;
-  uint32_t CONTEXT;
-  int x, y;
-  bool bit;
+  const int rowstride = image->stride;
+  const int8_t *gbat = params->gbat;
+  const int at_kind = jbig2_generic_at_kind(gbat[0], gbat[1]);
+  byte *gbreg_line = (byte *)image->data;
+  uint32_t at;
   int LTP = 0;
+  int x, y;
 
-  for (y = 0; y < GBH; y++) {
-    LTP ^= jbig2_arith_decode(as, &GB_stats[0x0195]);
-    if (!LTP) {
-      for (x = 0; x < GBW; x++) {
-        CONTEXT  = jbig2_image_get_pixel(image, x - 1, y);
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y) << 1;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 3, y) << 2;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 4, y) << 3;
-        CONTEXT |= jbig2_image_get_pixel(image, x + params->gbat[0],
-					y + params->gbat[1]) << 4;
-        CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 5;
-        CONTEXT |= jbig2_image_get_pixel(image, x    , y - 1) << 6;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 7;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 2, y - 1) << 8;
-        CONTEXT |= jbig2_image_get_pixel(image, x - 3, y - 1) << 9;
-        bit = jbig2_arith_decode(as, &GB_stats[CONTEXT]);
-        jbig2_image_set_pixel(image, x, y, bit);
-      }
-    } else {
-      copy_prev_row(image, y);
-    }
-  }
+  for (y = 0; y < GBH; y++)
+    {
+      uint32_t CONTEXT;
+      uint32_t line_m1;
+      int padded_width = (GBW + 7) & -8;
 
-  return 0;
-}
+      if (params->TPGDON)
+	{
+	  LTP ^= jbig2_arith_decode(as, &GB_stats[0x0195]);
+	  if (LTP)
+	    {
+	      copy_prev_row(image, y);
+	      gbreg_line += rowstride;
+	      continue;
+	    }
+	}
 
-static int
-jbig2_decode_generic_region_TPGDON(Jbig2Ctx *ctx,
-				Jbig2Segment *segment,
-				const Jbig2GenericRegionParams *params, 
-				Jbig2ArithState *as,
-				Jbig2Image *image,
-				Jbig2ArithCx *GB_stats)
-{
-  switch (params->GBTEMPLATE) {
-    case 0:
-      return jbig2_decode_generic_template0_TPGDON(ctx, segment, 
-			params, as, image, GB_stats);
-    case 1:
-      return jbig2_decode_generic_template1_TPGDON(ctx, segment, 
-			params, as, image, GB_stats);
-    case 2:
-      return jbig2_decode_generic_template2_TPGDON(ctx, segment, 
-			params, as, image, GB_stats);
-    case 3:
-      return jbig2_decode_generic_template3_TPGDON(ctx, segment, 
-			params, as, image, GB_stats);
-  }
+      line_m1 = (y >= 1) ? gbreg_line[-rowstride] : 0;
+      CONTEXT = (line_m1 >> 1) & 0x060;
+      at = 0;
 
-  return -1;
+      for (x = 0; x < padded_width; x += 8)
+	{
+	  byte result = 0;
+	  int x_minor;
+	  int minor_width = GBW - x > 8 ? 8 : GBW - x;
+
+	  if (y >= 1)
+	    line_m1 = (line_m1 << 8) |
+	      (x + 8 < GBW ? gbreg_line[-rowstride + (x >> 3) + 1] : 0);
+
+	  at = jbig2_generic_at_window(image, at_kind,
+	    x + gbat[0], y + gbat[1], at, 4);
+
+	  for (x_minor = 0; x_minor < minor_width; x_minor++)
+	    {
+	      bool bit;
+
+	      bit = jbig2_arith_decode(as, &GB_stats[CONTEXT |
+		((at >> (15 - x_minor)) & 0x010)]);
+	      result |= bit << (7 - x_minor);
+	      CONTEXT = ((CONTEXT & 0x1e7) << 1) | bit |
+		((line_m1 >> (8 - x_minor)) & 0x020);
+	      if (at_kind == JBIG2_AT_HISTORY)
+		at |= (uint32_t)bit << (15 - x_minor + gbat[0] + 4);
+	    }
+	  gbreg_line[x >> 3] = result;
+	}
+      gbreg_line += rowstride;
+    }
+
+  return 0;
 }
 
 /**
@@ -709,10 +869,6 @@ jbig2_decode_generic_region(Jbig2Ctx *ctx,
 {
   const int8_t *gbat = params->gbat;
 
-  if (!params->MMR && params->TPGDON) 
-     return jbig2_decode_generic_region_TPGDON(ctx, segment, params, 
-		as, image, GB_stats);
-
   if (!params->MMR && params->GBTEMPLATE == 0) {
     if (gbat[0] == +3 && gbat[1] == -1 &&
         gbat[2] == -3 && gbat[3] == -1 &&
@@ -721,26 +877,33 @@ jbig2_decode_generic_region(Jbig2Ctx *ctx,
       return jbig2_decode_generic_template0(ctx, segment, params,
                                           as, image, GB_stats);
     else
-      return jbig2_decode_generic_template0_unopt(ctx, segment, params,
+      return jbig2_decode_generic_template0_at(ctx, segment, params,
                                           as, image, GB_stats);
-  } else if (!params->MMR && params->GBTEMPLATE == 1)
-    return jbig2_decode_generic_template1(ctx, segment, params,
-					  as, image, GB_stats);
-  else if (!params->MMR && params->GBTEMPLATE == 2)
+  } else if (!params->MMR && params->GBTEMPLATE == 1) {
+    if (gbat[0] == 3 && gbat[1] == -1)
+      return jbig2_decode_generic_template1(ctx, segment, params,
+					    as, image, GB_stats);
+    else
+      return jbig2_decode_generic_template1_at(ctx, segment, params,
+					       as, image, GB_stats);
+  } else if (!params->MMR && params->GBTEMPLATE == 2)
     {
       if (gbat[0] == 3 && gbat[1] == -1)
 	return jbig2_decode_generic_template2a(ctx, segment, params,
 					       as, image, GB_stats);
-      else
+      else if (gbat[0] == 2 && gbat[1] == -1)
 	return jbig2_decode_generic_template2(ctx, segment, params,
                                               as, image, GB_stats);
+      else
+	return jbig2_decode_generic_template2_at(ctx, segment, params,
+						 as, image, GB_stats);
     }
   else if (!params->MMR && params->GBTEMPLATE == 3) {
    if (gbat[0] == 2 && gbat[1] == -1)
-     return jbig2_decode_generic_template3_unopt(ctx, segment, params,
+     return jbig2_decode_generic_template3(ctx, segment, params,
                                          as, image, GB_stats);
    else
-     return jbig2_decode_generic_template3_unopt(ctx, segment, params,
+     return jbig2_decode_generic_template3_at(ctx, segment, params,
                                          as, image, GB_stats);
   }
 
@@ -33,6 +33,20 @@ typedef struct {
 int
 jbig2_generic_stats_size(Jbig2Ctx *ctx, int template);
 
+/* how an adaptive template pixel is read by the region decoders */
+enum {
+  JBIG2_AT_ZERO,
+  JBIG2_AT_FETCH,
+  JBIG2_AT_HISTORY
+};
+
+int
+jbig2_generic_at_kind(int dx, int dy);
+
+uint32_t
+jbig2_generic_at_window(Jbig2Image *image, int kind, int x, int y,
+			uint32_t window, int pos);
+
 int
 jbig2_decode_generic_region(Jbig2Ctx *ctx,
 			    Jbig2Segment *segment,
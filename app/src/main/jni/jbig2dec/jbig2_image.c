@@ -174,92 +174,116 @@ int jbig2_image_compose_unopt(Jbig2Ctx *ctx,
     return 0;
 }
 
-/* composite one jbig2_image onto another */
+/* combine one byte of a composite under a mask */
+static void
+jbig2_image_compose_byte(uint8_t *d, uint8_t v, uint8_t mask,
+			Jbig2ComposeOp op)
+{
+    switch (op) {
+	case JBIG2_COMPOSE_OR: *d |= v & mask; break;
+	case JBIG2_COMPOSE_AND: *d &= v | ~mask; break;
+	case JBIG2_COMPOSE_XOR: *d ^= v & mask; break;
+	case JBIG2_COMPOSE_XNOR: *d ^= ~v & mask; break;
+	case JBIG2_COMPOSE_REPLACE: *d = (*d & ~mask) | (v & mask); break;
+    }
+}
+
+/* composite one jbig2_image onto another
+
+   the source rows are realigned to the destination a byte at a time,
+   so the whole bytes in the middle of a row are combined without
+   masking, and only the partial bytes at either end need a mask */
 int jbig2_image_compose(Jbig2Ctx *ctx, Jbig2Image *dst, Jbig2Image *src,
 			int x, int y, Jbig2ComposeOp op)
 {
     int i, j;
     int w, h;
+    int sx = 0;
+    int sy = 0;
     int leftbyte, rightbyte;
-    int shift;
-    uint8_t *s, *ss;
-    uint8_t *d, *dd;
-    uint8_t mask, rightmask;
-
-    if (op != JBIG2_COMPOSE_OR) {
-	/* hand off the the general routine */
-	return jbig2_image_compose_unopt(ctx, dst, src, x, y, op);
-    }
+    int sbyte, shift;
+    uint8_t leftmask, rightmask;
 
-    /* clip */
+    /* clip to the dst image boundaries */
     w = src->width;
     h = src->height;
-    ss = src->data;
-    /* FIXME: this isn't sufficient for the < 0 cases */
-    if (x < 0) { w += x; x = 0; }
-    if (y < 0) { h += y; y = 0; }
-    w = (x + w < dst->width) ? w : dst->width - x;
-    h = (y + h < dst->height) ? h : dst->height - y;
+    if (x < 0) { sx = -x; w += x; x = 0; }
+    if (y < 0) { sy = -y; h += y; y = 0; }
+    if (x + w > dst->width) w = dst->width - x;
+    if (y + h > dst->height) h = dst->height - y;
+    if (w <= 0 || h <= 0)
+	return 0;
 #ifdef JBIG2_DEBUG
     jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, -1,
       "compositing %dx%d at (%d, %d) after clipping\n",
         w, h, x, y);
 #endif
 
-#if 0
-    /* special case complete/strip replacement */
-    /* disabled because it's only safe to do when the destination
-       buffer is all-blank. */
-    if ((x == 0) && (w == src->width)) {
-        memcpy(dst->data + y*dst->stride, src->data, h*src->stride);
-        return 0;
-    }
-#endif
-
     leftbyte = x >> 3;
     rightbyte = (x + w - 1) >> 3;
-    shift = x & 7;
-
-    /* general OR case */
-    s = ss;
-    d = dd = dst->data + y*dst->stride + leftbyte;
-    if (leftbyte == rightbyte) {
-	mask = 0x100 - (0x100 >> w);
-        for (j = 0; j < h; j++) {
-            *d |= (*s & mask) >> shift;
-            d += dst->stride;
-            s += src->stride;
-        }
-    } else if (shift == 0) {
-	rightmask = (w & 7) ? 0x100 - (1 << (8 - (w & 7))) : 0xFF;
-        for (j = 0; j < h; j++) {
-	    for (i = leftbyte; i < rightbyte; i++)
-		*d++ |= *s++;
-	    *d |= *s & rightmask;
-            d = (dd += dst->stride);
-            s = (ss += src->stride);
+    leftmask = 0xFF >> (x & 7);
+    rightmask = 0xFF << (7 - ((x + w - 1) & 7));
+    if (leftbyte == rightbyte)
+	leftmask &= rightmask;
+
+    /* the source pixel under the first pixel of byte leftbyte; this
+       is negative when it lies left of the source row, in which case
+       the missing byte reads as 0 and is masked out anyway */
+    sbyte = sx - (x & 7);
+    shift = 8 - (sbyte & 7);
+    sbyte = (sbyte + 8) / 8 - 1;
+
+    for (j = 0; j < h; j++) {
+	const uint8_t *s = src->data + (sy + j) * src->stride;
+	uint8_t *d = dst->data + (y + j) * dst->stride + leftbyte;
+	int si = sbyte;
+	uint32_t bits = si >= 0 ? s[si] : 0;
+	int n = rightbyte - leftbyte;
+
+	/* only the last byte may need a source byte past the row */
+	if (n == 0) {
+	    bits = (si + 1 < src->stride) ? (bits << 8) | s[si + 1] : bits << 8;
+	    jbig2_image_compose_byte(d, bits >> shift, leftmask, op);
+	    continue;
 	}
-    } else {
-	bool overlap = (((w + 7) >> 3) < ((x + w + 7) >> 3) - (x >> 3));
-	mask = 0x100 - (1 << shift);
-	if (overlap)
-	    rightmask = (0x100 - (0x100 >> ((x + w) & 7))) >> (8 - shift);
-	else
-	    rightmask = 0x100 - (0x100 >> (w & 7));
-        for (j = 0; j < h; j++) {
-	    *d++ |= (*s & mask) >> shift;
-            for(i = leftbyte; i < rightbyte - 1; i++) {
-		*d |= ((*s++ & ~mask) << (8 - shift));
-		*d++ |= ((*s & mask) >> shift);
-	    }
-	    if (overlap)
-		*d |= (*s & rightmask) << (8 - shift);
-	    else
-		*d |= ((s[0] & ~mask) << (8 - shift)) |
-		    ((s[1] & rightmask) >> shift);
-	    d = (dd += dst->stride);
-	    s = (ss += src->stride);
+	bits = (bits << 8) | s[++si];
+	jbig2_image_compose_byte(d++, bits >> shift, leftmask, op);
+
+	switch (op) {
+	    case JBIG2_COMPOSE_OR:
+		for (i = 1; i < n; i++) {
+		    bits = (bits << 8) | s[++si];
+		    *d++ |= bits >> shift;
+		}
+		break;
+	    case JBIG2_COMPOSE_AND:
+		for (i = 1; i < n; i++) {
+		    bits = (bits << 8) | s[++si];
+		    *d++ &= bits >> shift;
+		}
+		break;
+	    case JBIG2_COMPOSE_XOR:
+		for (i = 1; i < n; i++) {
+		    bits = (bits << 8) | s[++si];
+		    *d++ ^= bits >> shift;
+		}
+		break;
+	    case JBIG2_COMPOSE_XNOR:
+		for (i = 1; i < n; i++) {
+		    bits = (bits << 8) | s[++si];
+		    *d++ ^= ~bits >> shift;
+		}
+		break;
+	    case JBIG2_COMPOSE_REPLACE:
+		for (i = 1; i < n; i++) {
+		    bits = (bits << 8) | s[++si];
+		    *d++ = bits >> shift;
+		}
+		break;
 	}
+
+	bits = (si + 1 < src->stride) ? (bits << 8) | s[si + 1] : bits << 8;
+	jbig2_image_compose_byte(d, bits >> shift, rightmask, op);
     }
 
     return 0;
@@ -291,6 +315,36 @@ int jbig2_image_get_pixel(Jbig2Image *image, int x, int y)
   return ((image->data[byte]>>bit) & 1);
 }
 
+/* look up the 8 pixels of row y starting at column x, packed into
+   a byte with the first pixel in the high bit. like
+   jbig2_image_get_pixel, pixels outside the image frame read as 0 */
+int jbig2_image_get_byte(Jbig2Image *image, int x, int y)
+{
+  const int w = image->width;
+  const uint8_t *line;
+  int v;
+
+  if ((x <= -8) || (x >= w)) return 0;
+  if ((y < 0) || (y >= image->height)) return 0;
+
+  line = image->data + y*image->stride;
+  if (x < 0) {
+    v = line[0] >> -x;
+  } else {
+    const int byte = x >> 3;
+    const int shift = x & 7;
+
+    v = line[byte] << shift;
+    if (shift && byte + 1 < image->stride)
+      v |= line[byte + 1] >> (8 - shift);
+  }
+  /* the padding bits of the last byte are not guaranteed to be clear */
+  if (x + 8 > w)
+    v &= 0xFF << (x + 8 - w);
+
+  return v & 0xFF;
+}
+
 /* set an individual pixel value in an image */
 int jbig2_image_set_pixel(Jbig2Image *image, int x, int y, bool value)
 {
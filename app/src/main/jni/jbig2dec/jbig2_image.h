@@ -18,6 +18,7 @@
 #define _JBIG2_IMAGE_H
 
 int jbig2_image_get_pixel(Jbig2Image *image, int x, int y);
+int jbig2_image_get_byte(Jbig2Image *image, int x, int y);
 int jbig2_image_set_pixel(Jbig2Image *image, int x, int y, int value);
 
 /* routines for dumping the image data in various formats */
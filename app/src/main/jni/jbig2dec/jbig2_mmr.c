@@ -44,6 +44,11 @@ typedef struct {
 	int data_index;
 	int bit_index;
 	uint32_t word;
+	int *ref;	/* changing elements of the reference line */
+	int *cur;	/* changing elements of the coding line */
+	int ref_index;
+	int cur_n;
+	int bad;
 } Jbig2MmrCtx;
 
 
@@ -59,6 +64,11 @@ jbig2_decode_mmr_init(Jbig2MmrCtx *mmr, int width, int height, const byte *data,
 	mmr->size = size;
 	mmr->data_index = 0;
 	mmr->bit_index = 0;
+	mmr->ref = NULL;
+	mmr->cur = NULL;
+	mmr->ref_index = 0;
+	mmr->cur_n = 0;
+	mmr->bad = 0;
 
 	for (i = 0; i < size && i < 4; i++)
 		word |= (data[i] << ((3 - i) << 3));
@@ -729,6 +739,48 @@ const mmr_table_node jbig2_mmr_black_decode[] = {
 { 0, 3 }
 };
 
+/* 2d mode codes, indexed by the next 7 bits; the extension and EOL
+   codes, and anything else that does not fit, end the line */
+enum {
+	MMR_VR3, MMR_VR2, MMR_VR1, MMR_V0, MMR_VL1, MMR_VL2, MMR_VL3,
+	MMR_P, MMR_H, MMR_ERROR
+};
+
+static const mmr_table_node jbig2_mmr_2d_decode[128] = {
+	{ MMR_ERROR, 0 }, { MMR_ERROR, 0 }, { MMR_VL3, 7 }, { MMR_VR3, 7 },
+	{ MMR_VL2, 6 }, { MMR_VL2, 6 }, { MMR_VR2, 6 }, { MMR_VR2, 6 },
+	{ MMR_P, 4 }, { MMR_P, 4 }, { MMR_P, 4 }, { MMR_P, 4 },
+	{ MMR_P, 4 }, { MMR_P, 4 }, { MMR_P, 4 }, { MMR_P, 4 },
+	{ MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 },
+	{ MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 },
+	{ MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 },
+	{ MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 }, { MMR_H, 3 },
+	{ MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 },
+	{ MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 },
+	{ MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 },
+	{ MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 }, { MMR_VL1, 3 },
+	{ MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 },
+	{ MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 },
+	{ MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 },
+	{ MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 }, { MMR_VR1, 3 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 },
+	{ MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }, { MMR_V0, 1 }
+};
+
 #define getbit(buf, x) ( ( buf[x >> 3] >> ( 7 - (x & 7) ) ) & 1 )
 
 static int
@@ -758,24 +810,13 @@ jbig2_find_changing_element(const byte *line, int x, int w)
 	return x;
 }
 
-static int
-jbig2_find_changing_element_of_color(const byte *line, int x, int w, int color)
-{
-	if (line == 0)
-		return w;
-	x = jbig2_find_changing_element(line, x, w);
-	if (x < w && getbit(line, x) != color)
-		x = jbig2_find_changing_element(line, x, w);
-	return x;
-}
-
 static const byte lm[8] = { 0xFF, 0x7F, 0x3F, 0x1F, 0x0F, 0x07, 0x03, 0x01 };
 static const byte rm[8] = { 0x00, 0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE };
 
 static void
 jbig2_set_bits(byte *line, int x0, int x1)
 {
-	int a0, a1, b0, b1, a;
+	int a0, a1, b0, b1;
 
 	a0 = x0 >> 3;
 	a1 = x1 >> 3;
@@ -788,10 +829,97 @@ jbig2_set_bits(byte *line, int x0, int x1)
 	}
 	else {
 		line[a0] |= lm[b0];
-		for (a = a0 + 1; a < a1; a++)
-			line[a] = 0xFF;
-		line[a1] |= rm[b1];
+		if (a1 > a0 + 1)
+			memset(line + a0 + 1, 0xFF, a1 - a0 - 1);
+		if (b1)
+			line[a1] |= rm[b1];
+	}
+}
+
+/*
+   The 2d codes only ever look at the changing elements of the
+   reference line, so rather than scanning its bits we keep it as a
+   sorted list of positions. Even entries are white to black changes,
+   odd entries black to white, and three entries equal to the width
+   end the list.
+
+   The coding line builds its list as the black runs are painted.
+   Only corrupt data paints a run left of the previous one; such a
+   line is marked bad and its list is rebuilt from the bitmap.
+*/
+
+static void
+jbig2_decode_mmr_fill(Jbig2MmrCtx *mmr, byte *dst, int x0, int x1)
+{
+	int n = mmr->cur_n;
+
+	if (x0 < 0)
+		x0 = 0;
+	if (x1 <= x0)
+		return;
+
+	jbig2_set_bits(dst, x0, x1);
+
+	if (mmr->bad)
+		return;
+
+	if (n > 0 && x0 < mmr->cur[n - 1]) {
+		mmr->bad = 1;
+		return;
+	}
+
+	if (n > 0 && x0 == mmr->cur[n - 1])
+		n--;
+	else
+		mmr->cur[n++] = x0;
+	mmr->cur[n++] = x1;
+	mmr->cur_n = n;
+}
+
+/* first changing element right of a0 and of the opposite colour to c */
+static int
+jbig2_decode_mmr_b1(Jbig2MmrCtx *mmr, int a0, int c)
+{
+	const int *ref = mmr->ref;
+	int i = mmr->ref_index;
+
+	while (i > 0 && ref[i - 1] > a0)
+		i--;
+	while (ref[i] <= a0)
+		i++;
+	if ((i & 1) != c)
+		i++;
+
+	mmr->ref_index = i;
+	return ref[i];
+}
+
+/* the coding line becomes the reference line */
+static void
+jbig2_decode_mmr_next_ref(Jbig2MmrCtx *mmr, const byte *dst)
+{
+	int *tmp;
+	int x;
+
+	if (mmr->bad) {
+		mmr->cur_n = 0;
+		x = jbig2_find_changing_element(dst, -1, mmr->width);
+		while (x < mmr->width) {
+			mmr->cur[mmr->cur_n++] = x;
+			x = jbig2_find_changing_element(dst, x, mmr->width);
+		}
 	}
+
+	mmr->cur[mmr->cur_n] = mmr->width;
+	mmr->cur[mmr->cur_n + 1] = mmr->width;
+	mmr->cur[mmr->cur_n + 2] = mmr->width;
+
+	tmp = mmr->ref;
+	mmr->ref = mmr->cur;
+	mmr->cur = tmp;
+	mmr->ref_index = 0;
+	mmr->cur_n = 0;
+	mmr->bad = 0;
 }
 
 
@@ -830,8 +958,9 @@ jbig2_decode_get_run(Jbig2MmrCtx *mmr, const mmr_table_node *table, int initial_
 }
 
 static void
-jbig2_decode_mmr_line(Jbig2MmrCtx *mmr, const byte *ref, byte *dst)
+jbig2_decode_mmr_line(Jbig2MmrCtx *mmr, byte *dst)
 {
+	const mmr_table_node *node;
 	int a0, a1, a2, b1, b2;
 	int c;
 
@@ -840,18 +969,18 @@ jbig2_decode_mmr_line(Jbig2MmrCtx *mmr, const byte *ref, byte *dst)
 
 	while (1)
 	{
-		uint32_t word = mmr->word;
-		/* printf ("%08x\n", word); */
-
 		if (a0 >= mmr->width)
 			break;
 
-		if ((word >> (32 - 3)) == 1)
+		node = &jbig2_mmr_2d_decode[mmr->word >> (32 - 7)];
+		if (node->val == MMR_ERROR)
+			break;
+		jbig2_decode_mmr_consume(mmr, node->n_bits);
+
+		if (node->val == MMR_H)
 		{
 			int white_run, black_run;
 
-			jbig2_decode_mmr_consume(mmr, 3);
-
 			if (a0 == -1)
 				a0 = 0;
 
@@ -862,9 +991,8 @@ jbig2_decode_mmr_line(Jbig2MmrCtx *mmr, const byte *ref, byte *dst)
 				a2 = a1 + black_run;
 				if (a1 > mmr->width) a1 = mmr->width;
 				if (a2 > mmr->width) a2 = mmr->width;
-				jbig2_set_bits(dst, a1, a2);
+				jbig2_decode_mmr_fill(mmr, dst, a1, a2);
 				a0 = a2;
-				/* printf ("H %d %d\n", white_run, black_run); */
 			}
 			else
 			{
@@ -874,100 +1002,31 @@ jbig2_decode_mmr_line(Jbig2MmrCtx *mmr, const byte *ref, byte *dst)
 				a2 = a1 + white_run;
 				if (a1 > mmr->width) a1 = mmr->width;
 				if (a2 > mmr->width) a2 = mmr->width;
-				jbig2_set_bits(dst, a0, a1);
+				jbig2_decode_mmr_fill(mmr, dst, a0, a1);
 				a0 = a2;
-				/* printf ("H %d %d\n", black_run, white_run); */
 			}
 		}
 
-		else if ((word >> (32 - 4)) == 1)
+		else if (node->val == MMR_P)
 		{
-			/* printf ("P\n"); */
-			jbig2_decode_mmr_consume(mmr, 4);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			b2 = jbig2_find_changing_element(ref, b1, mmr->width);
-			if (c) jbig2_set_bits(dst, a0, b2);
+			b1 = jbig2_decode_mmr_b1(mmr, a0, c);
+			if (b1 < mmr->width)
+				b2 = mmr->ref[mmr->ref_index + 1];
+			else
+				b2 = mmr->width;
+			if (c) jbig2_decode_mmr_fill(mmr, dst, a0, b2);
 			a0 = b2;
 		}
 
-		else if ((word >> (32 - 1)) == 1)
+		else
 		{
-			/* printf ("V(0)\n"); */
-			jbig2_decode_mmr_consume(mmr, 1);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			if (c) jbig2_set_bits(dst, a0, b1);
+			/* V(0), VR(1..3) and VL(1..3) */
+			b1 = jbig2_decode_mmr_b1(mmr, a0, c) + MMR_V0 - node->val;
+			if (b1 < 0 || b1 > mmr->width) break;
+			if (c) jbig2_decode_mmr_fill(mmr, dst, a0, b1);
 			a0 = b1;
 			c = !c;
 		}
-
-		else if ((word >> (32 - 3)) == 3)
-		{
-			/* printf ("VR(1)\n"); */
-			jbig2_decode_mmr_consume(mmr, 3);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			if (b1 + 1 > mmr->width) break;
-			if (c) jbig2_set_bits(dst, a0, b1 + 1);
-			a0 = b1 + 1;
-			c = !c;
-		}
-
-		else if ((word >> (32 - 6)) == 3)
-		{
-			/* printf ("VR(2)\n"); */
-			jbig2_decode_mmr_consume(mmr, 6);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			if (b1 + 2 > mmr->width) break;
-			if (c) jbig2_set_bits(dst, a0, b1 + 2);
-			a0 = b1 + 2;
-			c = !c;
-		}
-
-		else if ((word >> (32 - 7)) == 3)
-		{
-			/* printf ("VR(3)\n"); */
-			jbig2_decode_mmr_consume(mmr, 7);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			if (b1 + 3 > mmr->width) break;
-			if (c) jbig2_set_bits(dst, a0, b1 + 3);
-			a0 = b1 + 3;
-			c = !c;
-		}
-
-		else if ((word >> (32 - 3)) == 2)
-		{
-			/* printf ("VL(1)\n"); */
-			jbig2_decode_mmr_consume(mmr, 3);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			if (b1 - 1 < 0) break;
-			if (c) jbig2_set_bits(dst, a0, b1 - 1);
-			a0 = b1 - 1;
-			c = !c;
-		}
-
-		else if ((word >> (32 - 6)) == 2)
-		{
-			/* printf ("VL(2)\n"); */
-			jbig2_decode_mmr_consume(mmr, 6);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			if (b1 - 2 < 0) break;
-			if (c) jbig2_set_bits(dst, a0, b1 - 2);
-			a0 = b1 - 2;
-			c = !c;
-		}
-
-		else if ((word >> (32 - 7)) == 2)
-		{
-			/* printf ("VL(3)\n"); */
-			jbig2_decode_mmr_consume(mmr, 7);
-			b1 = jbig2_find_changing_element_of_color(ref, a0, mmr->width, !c);
-			if (b1 - 3 < 0) break;
-			if (c) jbig2_set_bits(dst, a0, b1 - 3);
-			a0 = b1 - 3;
-			c = !c;
-		}
-
-		else
-			break;
 	}
 }
 
@@ -981,18 +1040,34 @@ jbig2_decode_generic_mmr(Jbig2Ctx *ctx,
 	Jbig2MmrCtx mmr;
 	const int rowstride = image->stride;
 	byte *dst = image->data;
-	byte *ref = NULL;
+	int code = 0;
 	int y;
 
 	jbig2_decode_mmr_init(&mmr, image->width, image->height, data, size);
 
-	for (y = 0; y < image->height; y++) {
-		memset(dst, 0, rowstride);
-		jbig2_decode_mmr_line(&mmr, ref, dst);
-		ref = dst;
-		dst += rowstride;
+	/* at most width + 1 changing elements per line, and the sentinels */
+	mmr.ref = jbig2_new(ctx, int, image->width + 4);
+	mmr.cur = jbig2_new(ctx, int, image->width + 4);
+	if (mmr.ref == NULL || mmr.cur == NULL) {
+		code = jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
+			"could not allocate MMR changing element lists");
 	}
+	else {
+		/* the line above the first one is all white */
+		mmr.ref[0] = mmr.ref[1] = mmr.ref[2] = image->width;
 
-	return 0;
-}
+		for (y = 0; y < image->height; y++) {
+			memset(dst, 0, rowstride);
+			jbig2_decode_mmr_line(&mmr, dst);
+			jbig2_decode_mmr_next_ref(&mmr, dst);
+			dst += rowstride;
+		}
+	}
 
+	if (mmr.cur != NULL)
+		jbig2_free(ctx->allocator, mmr.cur);
+	if (mmr.ref != NULL)
+		jbig2_free(ctx->allocator, mmr.ref);
+
+	return code;
+}
@@ -36,75 +36,43 @@
 #include "jbig2_generic.h"
 #include "jbig2_image.h"
 
-static int
-jbig2_decode_refinement_template0(Jbig2Ctx *ctx,
-                              Jbig2Segment *segment,
-                              const Jbig2RefinementRegionParams *params,
-                              Jbig2ArithState *as,
-                              Jbig2Image *image,
-                              Jbig2ArithCx *GR_stats)
+/*
+ * The refinement decoders keep each row of the template in a register,
+ * in the layout the generic region decoders use: after the per byte
+ * update, pixel x + i of the row, for the current output byte at x,
+ * is bit 15 - i (plus a per-row pre-shift). The rows of the reference
+ * bitmap are offset by (DX, DY) and are read with jbig2_image_get_byte(),
+ * which keeps pixels outside the reference at 0.
+ */
+
+/* load the reference row ry for the output row, ahead of the first byte */
+static uint32_t
+refinement_row_start(Jbig2Image *ref, int dx, int ry, int shift)
 {
-  return jbig2_error(ctx, JBIG2_SEVERITY_FATAL, segment->number,
-    "refinement region template 0 NYI");
+  return ((jbig2_image_get_byte(ref, -dx - 8, ry) << 8) |
+	  jbig2_image_get_byte(ref, -dx, ry)) << shift;
 }
 
-static int
-jbig2_decode_refinement_template0_unopt(Jbig2Ctx *ctx,
-                              Jbig2Segment *segment,
-                              const Jbig2RefinementRegionParams *params,
-                              Jbig2ArithState *as,
-                              Jbig2Image *image,
-                              Jbig2ArithCx *GR_stats)
+/* pixels whose 3x3 reference neighbourhood is all 1 (or all 0), for the
+   typical prediction (TPGRON); the rows are normalised to pixel x + i
+   at bit 15 - i and the result uses the same layout */
+static uint32_t
+refinement_typical(uint32_t m1, uint32_t r0, uint32_t p1, int value)
 {
-  const int GRW = image->width;
-  const int GRH = image->height;
-  const int dx = params->DX;
-  const int dy = params->DY;
-  Jbig2Image *ref = params->reference;
-  uint32_t CONTEXT;
-  int x,y;
-  bool bit;
+  uint32_t t;
 
-  for (y = 0; y < GRH; y++) {
-    for (x = 0; x < GRW; x++) {
-      CONTEXT = 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y + 0) << 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 1;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 0, y - 1) << 2;
-      CONTEXT |= jbig2_image_get_pixel(image, x + params->grat[0],
-	y + params->grat[1]) << 3;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+1, y-dy+1) << 4;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+0, y-dy+1) << 5;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx-1, y-dy+1) << 6;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+1, y-dy+0) << 7;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+0, y-dy+0) << 8;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx-1, y-dy+0) << 9;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+1, y-dy-1) << 10;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+0, y-dy-1) << 11;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+params->grat[2],
-	y-dy+params->grat[3]) << 12;
-      bit = jbig2_arith_decode(as, &GR_stats[CONTEXT]);
-      jbig2_image_set_pixel(image, x, y, bit);
+  if (!value)
+    {
+      m1 = ~m1;
+      r0 = ~r0;
+      p1 = ~p1;
     }
-  }
-#ifdef JBIG2_DEBUG_DUMP
-  {
-    static count = 0;
-    char name[32];
-    snprintf(name, 32, "refin-%d.pbm", count);
-    jbig2_image_write_pbm_file(ref, name);
-    snprintf(name, 32, "refout-%d.pbm", count);
-    jbig2_image_write_pbm_file(image, name);
-    count++;
-  }
-#endif
-
-  return 0;
+  t = m1 & r0 & p1;
+  return t & (t << 1) & (t >> 1);
 }
 
-
 static int
-jbig2_decode_refinement_template1_unopt(Jbig2Ctx *ctx,
+jbig2_decode_refinement_template0(Jbig2Ctx *ctx,
                               Jbig2Segment *segment,
                               const Jbig2RefinementRegionParams *params,
                               Jbig2ArithState *as,
@@ -113,42 +81,91 @@ jbig2_decode_refinement_template1_unopt(Jbig2Ctx *ctx,
 {
   const int GRW = image->width;
   const int GRH = image->height;
+  const int stride = image->stride;
   const int dx = params->DX;
   const int dy = params->DY;
+  const int8_t *grat = params->grat;
+  const int at_kind = jbig2_generic_at_kind(grat[0], grat[1]);
   Jbig2Image *ref = params->reference;
-  uint32_t CONTEXT;
-  int x,y;
-  bool bit;
+  byte *grreg_line = (byte *)image->data;
+  int LTP = 0;
+  int x, y;
 
   for (y = 0; y < GRH; y++) {
-    for (x = 0; x < GRW; x++) {
-      CONTEXT = 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y + 0) << 0;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 1, y - 1) << 1;
-      CONTEXT |= jbig2_image_get_pixel(image, x + 0, y - 1) << 2;
-      CONTEXT |= jbig2_image_get_pixel(image, x - 1, y - 1) << 3;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+1, y-dy+1) << 4;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+0, y-dy+1) << 5;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+1, y-dy+0) << 6;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+0, y-dy+0) << 7;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx-1, y-dy+0) << 8;
-      CONTEXT |= jbig2_image_get_pixel(ref, x-dx+0, y-dy-1) << 9;
-      bit = jbig2_arith_decode(as, &GR_stats[CONTEXT]);
-      jbig2_image_set_pixel(image, x, y, bit);
+    const int padded_width = (GRW + 7) & -8;
+    const int ry = y - dy;
+    uint32_t CONTEXT;
+    uint32_t line_m1;    /* previous line of the decoded bitmap */
+    uint32_t refline_m1; /* previous line of the reference bitmap */
+    uint32_t refline_0;  /* current line of the reference bitmap */
+    uint32_t refline_1;  /* next line of the reference bitmap */
+    uint32_t at1 = 0, at2 = 0;
+
+    if (params->TPGRON)
+      LTP ^= jbig2_arith_decode(as, &GR_stats[0x100]);
+
+    line_m1 = (y >= 1) ? grreg_line[-stride] : 0;
+    refline_m1 = refinement_row_start(ref, dx, ry - 1, 4);
+    refline_0 = refinement_row_start(ref, dx, ry, 1);
+    refline_1 = refinement_row_start(ref, dx, ry + 1, 0);
+    CONTEXT = ((line_m1 >> 5) & 0x006) |
+	      ((refline_1 >> 2) & 0x070) |
+	      (refline_0 & 0x380) |
+	      (refline_m1 & 0xc00);
+
+    for (x = 0; x < padded_width; x += 8) {
+      byte result = 0;
+      uint32_t tp = 0, tpval = 0;
+      int x_minor;
+      const int minor_width = GRW - x > 8 ? 8 : GRW - x;
+
+      if (y >= 1)
+	line_m1 = (line_m1 << 8) |
+	  (x + 8 < GRW ? grreg_line[-stride + (x >> 3) + 1] : 0);
+      refline_m1 = (refline_m1 << 8) |
+	(jbig2_image_get_byte(ref, x - dx + 8, ry - 1) << 4);
+      refline_0 = (refline_0 << 8) |
+	(jbig2_image_get_byte(ref, x - dx + 8, ry) << 1);
+      refline_1 = (refline_1 << 8) |
+	jbig2_image_get_byte(ref, x - dx + 8, ry + 1);
+
+      at1 = jbig2_generic_at_window(image, at_kind,
+	x + grat[0], y + grat[1], at1, 3);
+      at2 = jbig2_generic_at_window(ref, JBIG2_AT_FETCH,
+	x - dx + grat[2], ry + grat[3], at2, 12);
+
+      if (LTP) {
+	tpval = refinement_typical(refline_m1 >> 4, refline_0 >> 1,
+				   refline_1, 1);
+	tp = tpval | refinement_typical(refline_m1 >> 4, refline_0 >> 1,
+					refline_1, 0);
+      }
+
+      /* this is the speed critical inner-loop */
+      for (x_minor = 0; x_minor < minor_width; x_minor++) {
+	bool bit;
+
+	if ((tp >> (15 - x_minor)) & 1)
+	  bit = (tpval >> (15 - x_minor)) & 1;
+	else
+	  bit = jbig2_arith_decode(as, &GR_stats[CONTEXT |
+	    ((at1 >> (15 - x_minor)) & 0x008) |
+	    ((at2 >> (15 - x_minor)) & 0x1000)]);
+	result |= bit << (7 - x_minor);
+	CONTEXT = ((CONTEXT & 0x5b2) << 1) | bit |
+	  ((line_m1 >> (12 - x_minor)) & 0x002) |
+	  ((refline_1 >> (9 - x_minor)) & 0x010) |
+	  ((refline_0 >> (7 - x_minor)) & 0x080) |
+	  ((refline_m1 >> (7 - x_minor)) & 0x400);
+	if (at_kind == JBIG2_AT_HISTORY)
+	  at1 |= (uint32_t)bit << (15 - x_minor + grat[0] + 3);
+      }
+
+      grreg_line[x >> 3] = result;
     }
-  }
 
-#ifdef JBIG2_DEBUG_DUMP
-  {
-    static count = 0;
-    char name[32];
-    snprintf(name, 32, "refin-%d.pbm", count);
-    jbig2_image_write_pbm_file(ref, name);
-    snprintf(name, 32, "refout-%d.pbm", count);
-    jbig2_image_write_pbm_file(image, name);
-    count++;
+    grreg_line += stride;
   }
-#endif
 
   return 0;
 }
@@ -164,74 +181,80 @@ jbig2_decode_refinement_template1(Jbig2Ctx *ctx,
   const int GRW = image->width;
   const int GRH = image->height;
   const int stride = image->stride;
-  const int refstride = params->reference->stride;
+  const int dx = params->DX;
   const int dy = params->DY;
+  Jbig2Image *ref = params->reference;
   byte *grreg_line = (byte *)image->data;
-  byte *grref_line = (byte *)params->reference->data;
-  int x,y;
+  int LTP = 0;
+  int x, y;
 
   for (y = 0; y < GRH; y++) {
     const int padded_width = (GRW + 7) & -8;
+    const int ry = y - dy;
     uint32_t CONTEXT;
+    uint32_t line_m1;    /* previous line of the decoded bitmap */
     uint32_t refline_m1; /* previous line of the reference bitmap */
     uint32_t refline_0;  /* current line of the reference bitmap */
     uint32_t refline_1;  /* next line of the reference bitmap */
-    uint32_t line_m1;    /* previous line of the decoded bitmap */
+
+    if (params->TPGRON)
+      LTP ^= jbig2_arith_decode(as, &GR_stats[0x040]);
 
     line_m1 = (y >= 1) ? grreg_line[-stride] : 0;
-    refline_m1 = ((y-dy) >= 1) ? grref_line[(-1-dy)*stride] << 2: 0;
-    refline_0  = (((y-dy) > 0) && ((y-dy) < GRH)) ? grref_line[(0-dy)*stride] << 4 : 0;
-    refline_1  = (y < GRH - 1) ? grref_line[(+1-dy)*stride] << 7 : 0;
+    refline_m1 = refinement_row_start(ref, dx, ry - 1, 2);
+    refline_0 = refinement_row_start(ref, dx, ry, 0);
+    refline_1 = refinement_row_start(ref, dx, ry + 1, 0);
     CONTEXT = ((line_m1 >> 5) & 0x00e) |
-	      ((refline_1 >> 5) & 0x030) |
-	      ((refline_0 >> 5) & 0x1c0) |
-	      ((refline_m1 >> 5) & 0x200);
+	      ((refline_1 >> 2) & 0x030) |
+	      (refline_0 & 0x1c0) |
+	      (refline_m1 & 0x200);
 
     for (x = 0; x < padded_width; x += 8) {
       byte result = 0;
+      uint32_t tp = 0, tpval = 0;
       int x_minor;
       const int minor_width = GRW - x > 8 ? 8 : GRW - x;
 
-      if (y >= 1) {
+      if (y >= 1)
 	line_m1 = (line_m1 << 8) |
 	  (x + 8 < GRW ? grreg_line[-stride + (x >> 3) + 1] : 0);
-	refline_m1 = (refline_m1 << 8) |
-	  (x + 8 < GRW ? grref_line[-refstride + (x >> 3) + 1] << 2 : 0);
-      }
-
+      refline_m1 = (refline_m1 << 8) |
+	(jbig2_image_get_byte(ref, x - dx + 8, ry - 1) << 2);
       refline_0 = (refline_0 << 8) |
-	  (x + 8 < GRW ? grref_line[(x >> 3) + 1] << 4 : 0);
-
-      if (y < GRH - 1)
-	refline_1 = (refline_1 << 8) |
-	  (x + 8 < GRW ? grref_line[+refstride + (x >> 3) + 1] << 7 : 0);
-      else
-	refline_1 = 0;
+	jbig2_image_get_byte(ref, x - dx + 8, ry);
+      refline_1 = (refline_1 << 8) |
+	jbig2_image_get_byte(ref, x - dx + 8, ry + 1);
+
+      if (LTP) {
+	tpval = refinement_typical(refline_m1 >> 2, refline_0,
+				   refline_1, 1);
+	tp = tpval | refinement_typical(refline_m1 >> 2, refline_0,
+					refline_1, 0);
+      }
 
       /* this is the speed critical inner-loop */
       for (x_minor = 0; x_minor < minor_width; x_minor++) {
 	bool bit;
 
-	bit = jbig2_arith_decode(as, &GR_stats[CONTEXT]);
+	if ((tp >> (15 - x_minor)) & 1)
+	  bit = (tpval >> (15 - x_minor)) & 1;
+	else
+	  bit = jbig2_arith_decode(as, &GR_stats[CONTEXT]);
 	result |= bit << (7 - x_minor);
 	CONTEXT = ((CONTEXT & 0x0d6) << 1) | bit |
-	  ((line_m1 >> (9 - x_minor)) & 0x002) |
+	  ((line_m1 >> (12 - x_minor)) & 0x002) |
 	  ((refline_1 >> (9 - x_minor)) & 0x010) |
-	  ((refline_0 >> (9 - x_minor)) & 0x040) |
-	  ((refline_m1 >> (9 - x_minor)) & 0x200);
+	  ((refline_0 >> (7 - x_minor)) & 0x040) |
+	  ((refline_m1 >> (7 - x_minor)) & 0x200);
       }
 
-      grreg_line[x>>3] = result;
-
+      grreg_line[x >> 3] = result;
     }
 
     grreg_line += stride;
-    grref_line += refstride;
-
   }
 
   return 0;
-
 }
 
 
@@ -260,6 +283,8 @@ jbig2_decode_refinement_region(Jbig2Ctx *ctx,
 			    Jbig2Image *image,
 			    Jbig2ArithCx *GR_stats)
 {
+  int code;
+
   {
     jbig2_error(ctx, JBIG2_SEVERITY_DEBUG, segment->number,
       "decoding generic refinement region with offset %d,%x,\n"
@@ -267,15 +292,25 @@ jbig2_decode_refinement_region(Jbig2Ctx *ctx,
       params->DX, params->DY, params->GRTEMPLATE, params->TPGRON,
       params->grat[0], params->grat[1], params->grat[2], params->grat[3]);
   }
-  if (params->TPGRON)
-    return jbig2_error(ctx, JBIG2_SEVERITY_WARNING, segment->number,
-        "decode_refinement_region: typical prediction coding NYI");
   if (params->GRTEMPLATE)
-    return jbig2_decode_refinement_template1_unopt(ctx, segment, params,
+    code = jbig2_decode_refinement_template1(ctx, segment, params,
                                              as, image, GR_stats);
   else
-    return jbig2_decode_refinement_template0_unopt(ctx, segment, params,
+    code = jbig2_decode_refinement_template0(ctx, segment, params,
                                              as, image, GR_stats);
+#ifdef JBIG2_DEBUG_DUMP
+  {
+    static count = 0;
+    char name[32];
+    snprintf(name, 32, "refin-%d.pbm", count);
+    jbig2_image_write_pbm_file(params->reference, name);
+    snprintf(name, 32, "refout-%d.pbm", count);
+    jbig2_image_write_pbm_file(image, name);
+    count++;
+  }
+#endif
+
+  return code;
 }
 
 /**
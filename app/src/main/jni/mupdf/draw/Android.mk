@@ -29,4 +29,20 @@ LOCAL_SRC_FILES := \
         draw_paint.c \
 	draw_edge.c
 
+# NEON is optional on ARMv7: build only the SIMD kernels with it, and let
+# fz_accelerate check for it at run time.
+SIMD_SRC_FILES := \
+	draw_paint_simd.c \
+	draw_scale_simd.c \
+	draw_affine_simd.c \
+	draw_unpack_simd.c \
+	draw_blend_simd.c \
+	draw_mesh_simd.c
+
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_SRC_FILES += $(addsuffix .neon,$(SIMD_SRC_FILES))
+else
+LOCAL_SRC_FILES += $(SIMD_SRC_FILES)
+endif
+
 include $(BUILD_STATIC_LIBRARY)
@@ -2,6 +2,8 @@
 
 typedef unsigned char byte;
 
+fz_affine_table fz_affine_funcs = { NULL, NULL };
+
 static inline float roundup(float x)
 {
 	return (x < 0) ? floorf(x) : ceilf(x);
@@ -26,6 +28,77 @@ static inline byte *sample_nearest(byte *s, int w, int h, int n, int u, int v)
 	return s + (v * w + u) * n;
 }
 
+/*
+ * The pixels of a row whose sample lies inside the image form one run,
+ * found here so that the painters need not test every pixel, and so that
+ * rows which miss the image cost nothing. Sample i of the row is at u
+ * plus i steps of fa; it is inside when 0 <= u < lim << 16. The sums are
+ * done in doubles, where they are exact. The divisions give first guesses
+ * that may be a pixel out either way, which the loops then correct.
+ */
+
+static inline int affine_inside(double u, double fa, int i, double lim)
+{
+	double x = u + fa * i;
+	return x >= 0 && x < lim;
+}
+
+static void
+fz_affine_clip_axis(int u, int fa, int lim, int *i0, int *i1)
+{
+	double du = u;
+	double df = fa;
+	double dl = lim * 65536.0;
+	double a, b, t;
+	int lo = *i0;
+	int hi = *i1;
+
+	if (lo >= hi)
+		return;
+	if (fa == 0)
+	{
+		if (du < 0 || du >= dl)
+			*i1 = *i0;
+		return;
+	}
+
+	a = -du / df;
+	b = (dl - du) / df;
+	if (fa < 0)
+	{
+		t = a;
+		a = b;
+		b = t;
+	}
+	if (a > lo)
+		lo = a >= hi ? hi : (int)ceil(a);
+	if (b < hi)
+		hi = b < lo ? lo : (int)floor(b) + 1;
+
+	while (lo < hi && !affine_inside(du, df, lo, dl))
+		lo++;
+	while (lo > *i0 && affine_inside(du, df, lo - 1, dl))
+		lo--;
+	while (hi < *i1 && affine_inside(du, df, hi, dl))
+		hi++;
+	while (hi > lo && !affine_inside(du, df, hi - 1, dl))
+		hi--;
+	*i0 = lo;
+	*i1 = hi;
+}
+
+static void
+fz_affine_clip_span(int u, int v, int fa, int fb, int sw, int sh, int *i0, int *i1)
+{
+	fz_affine_clip_axis(u, fa, sw, i0, i1);
+	fz_affine_clip_axis(v, fb, sh, i0, i1);
+}
+
+static inline int affine_step(int u, int fa, int i)
+{
+	return (int)(u + (double)fa * i);
+}
+
 /* Blend premultiplied source image in constant alpha over destination */
 
 static inline void
@@ -356,8 +429,133 @@ fz_paint_affine_color_N_near(byte *dp, byte *sp, int sw, int sh, int u, int v, i
 	}
 }
 
+/* Paint images that are rotated by a multiple of 90 degrees, but not
+ * scaled. Each destination pixel takes one source pixel, and a row steps
+ * through the source by one pixel along a row or a column, so there are no
+ * positions to track. The caller has clipped the run to the image. */
+
+static inline void
+fz_paint_affine_alpha_N_blit(byte *dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int n, int alpha, byte *hp)
+{
+	int step = ((fa >> 16) + (fb >> 16) * sw) * n;
+	byte *sample = sp + ((v >> 16) * sw + (u >> 16)) * n;
+	int k;
+	int n1 = n-1;
+
+	while (w--)
+	{
+		int a = fz_mul255(sample[n1], alpha);
+		int t = 255 - a;
+		for (k = 0; k < n1; k++)
+			dp[k] = fz_mul255(sample[k], alpha) + fz_mul255(dp[k], t);
+		dp[n1] = a + fz_mul255(dp[n1], t);
+		if (hp)
+			hp[0] = a + fz_mul255(hp[0], t);
+		dp += n;
+		if (hp)
+			hp++;
+		sample += step;
+	}
+}
+
+static inline void
+fz_paint_affine_N_blit(byte *dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int n, byte *hp)
+{
+	int step = ((fa >> 16) + (fb >> 16) * sw) * n;
+	byte *sample = sp + ((v >> 16) * sw + (u >> 16)) * n;
+	int k;
+	int n1 = n-1;
+
+	while (w--)
+	{
+		int a = sample[n1];
+		int t = 255 - a;
+		for (k = 0; k < n1; k++)
+			dp[k] = sample[k] + fz_mul255(dp[k], t);
+		dp[n1] = a + fz_mul255(dp[n1], t);
+		if (hp)
+			hp[0] = a + fz_mul255(hp[0], t);
+		dp += n;
+		if (hp)
+			hp++;
+		sample += step;
+	}
+}
+
+static inline void
+fz_paint_affine_alpha_g2rgb_blit(byte *dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int alpha, byte *hp)
+{
+	int step = ((fa >> 16) + (fb >> 16) * sw) * 2;
+	byte *sample = sp + ((v >> 16) * sw + (u >> 16)) * 2;
+
+	while (w--)
+	{
+		int x = fz_mul255(sample[0], alpha);
+		int a = fz_mul255(sample[1], alpha);
+		int t = 255 - a;
+		dp[0] = x + fz_mul255(dp[0], t);
+		dp[1] = x + fz_mul255(dp[1], t);
+		dp[2] = x + fz_mul255(dp[2], t);
+		dp[3] = a + fz_mul255(dp[3], t);
+		if (hp)
+			hp[0] = a + fz_mul255(hp[0], t);
+		dp += 4;
+		if (hp)
+			hp++;
+		sample += step;
+	}
+}
+
+static inline void
+fz_paint_affine_solid_g2rgb_blit(byte *dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, byte *hp)
+{
+	int step = ((fa >> 16) + (fb >> 16) * sw) * 2;
+	byte *sample = sp + ((v >> 16) * sw + (u >> 16)) * 2;
+
+	while (w--)
+	{
+		int x = sample[0];
+		int a = sample[1];
+		int t = 255 - a;
+		dp[0] = x + fz_mul255(dp[0], t);
+		dp[1] = x + fz_mul255(dp[1], t);
+		dp[2] = x + fz_mul255(dp[2], t);
+		dp[3] = a + fz_mul255(dp[3], t);
+		if (hp)
+			hp[0] = a + fz_mul255(hp[0], t);
+		dp += 4;
+		if (hp)
+			hp++;
+		sample += step;
+	}
+}
+
+static inline void
+fz_paint_affine_color_N_blit(byte *dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
+{
+	int step = (fa >> 16) + (fb >> 16) * sw;
+	byte *sample = sp + (v >> 16) * sw + (u >> 16);
+	int n1 = n-1;
+	int sa = color[n1];
+	int k;
+
+	while (w--)
+	{
+		int masa = FZ_COMBINE(FZ_EXPAND(*sample), sa);
+		for (k = 0; k < n1; k++)
+			dp[k] = FZ_BLEND(color[k], dp[k], masa);
+		dp[n1] = FZ_BLEND(255, dp[n1], masa);
+		if (hp)
+			hp[0] = FZ_BLEND(255, hp[0], masa);
+		dp += n;
+		if (hp)
+			hp++;
+		sample += step;
+	}
+}
+
 static void
-fz_paint_affine_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+fz_paint_affine_lerp_c(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *hp)
 {
 	if (alpha == 255)
 	{
@@ -381,6 +579,37 @@ fz_paint_affine_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, i
 	}
 }
 
+/* Where a run of 2 or 4 component pixels has samples whose neighbours are
+ * all inside the image too, hand it to the SIMD sampler; only the pixels
+ * next to the image edges need the clamping C loop. */
+static void
+fz_paint_affine_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+{
+	void (*lerp)(byte * restrict dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int alpha) = NULL;
+	int i0 = 0;
+	int i1 = w;
+
+	if (n == 2)
+		lerp = fz_affine_funcs.lerp_2;
+	else if (n == 4)
+		lerp = fz_affine_funcs.lerp_4;
+	if (!lerp || hp || alpha == 0)
+	{
+		fz_paint_affine_lerp_c(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, hp);
+		return;
+	}
+
+	fz_affine_clip_span(u, v, fa, fb, sw - 1, sh - 1, &i0, &i1);
+	if (i0 >= i1)
+	{
+		fz_paint_affine_lerp_c(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, hp);
+		return;
+	}
+	fz_paint_affine_lerp_c(dp, sp, sw, sh, u, v, fa, fb, i0, n, alpha, hp);
+	lerp(dp + i0 * n, sp, sw, affine_step(u, fa, i0), affine_step(v, fb, i0), fa, fb, i1 - i0, alpha);
+	fz_paint_affine_lerp_c(dp + i1 * n, sp, sw, sh, affine_step(u, fa, i1), affine_step(v, fb, i1), fa, fb, w - i1, n, alpha, hp);
+}
+
 static void
 fz_paint_affine_g2rgb_lerp(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
 {
@@ -454,6 +683,253 @@ fz_paint_affine_color_near(byte *dp, byte *sp, int sw, int sh, int u, int v, int
 	}
 }
 
+static void
+fz_paint_affine_blit(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+{
+	if (alpha == 255)
+	{
+		switch (n)
+		{
+		case 1: fz_paint_affine_N_blit(dp, sp, sw, u, v, fa, fb, w, 1, hp); break;
+		case 2: fz_paint_affine_N_blit(dp, sp, sw, u, v, fa, fb, w, 2, hp); break;
+		case 4: fz_paint_affine_N_blit(dp, sp, sw, u, v, fa, fb, w, 4, hp); break;
+		default: fz_paint_affine_N_blit(dp, sp, sw, u, v, fa, fb, w, n, hp); break;
+		}
+	}
+	else if (alpha > 0)
+	{
+		switch (n)
+		{
+		case 1: fz_paint_affine_alpha_N_blit(dp, sp, sw, u, v, fa, fb, w, 1, alpha, hp); break;
+		case 2: fz_paint_affine_alpha_N_blit(dp, sp, sw, u, v, fa, fb, w, 2, alpha, hp); break;
+		case 4: fz_paint_affine_alpha_N_blit(dp, sp, sw, u, v, fa, fb, w, 4, alpha, hp); break;
+		default: fz_paint_affine_alpha_N_blit(dp, sp, sw, u, v, fa, fb, w, n, alpha, hp); break;
+		}
+	}
+}
+
+static void
+fz_paint_affine_g2rgb_blit(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color/*unused*/, byte *hp)
+{
+	if (alpha == 255)
+	{
+		fz_paint_affine_solid_g2rgb_blit(dp, sp, sw, u, v, fa, fb, w, hp);
+	}
+	else if (alpha > 0)
+	{
+		fz_paint_affine_alpha_g2rgb_blit(dp, sp, sw, u, v, fa, fb, w, alpha, hp);
+	}
+}
+
+static void
+fz_paint_affine_color_blit(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha/*unused*/, byte *color, byte *hp)
+{
+	switch (n)
+	{
+	case 2: fz_paint_affine_color_N_blit(dp, sp, sw, u, v, fa, fb, w, 2, color, hp); break;
+	case 4: fz_paint_affine_color_N_blit(dp, sp, sw, u, v, fa, fb, w, 4, color, hp); break;
+	default: fz_paint_affine_color_N_blit(dp, sp, sw, u, v, fa, fb, w, n, color, hp); break;
+	}
+}
+
+/* Paint from a 1 bpp bitmap, as the image mask painters above would from
+ * the pixmap of 0s and 255s it unpacks to. Without color, the bitmap is
+ * painted as the alpha of a one component destination. */
+
+static inline int
+bitmap_sample(byte *sp, int stride, int u, int v)
+{
+	return ((sp[v * stride + (u >> 3)] >> (7 - (u & 7))) & 1) * 255;
+}
+
+static inline int
+bitmap_sample_clamped(byte *sp, int stride, int sw, int sh, int u, int v)
+{
+	if (u < 0) u = 0;
+	if (v < 0) v = 0;
+	if (u >= sw) u = sw - 1;
+	if (v >= sh) v = sh - 1;
+	return bitmap_sample(sp, stride, u, v);
+}
+
+static inline void
+fz_paint_bitmap_pixel(byte *dp, int n, int ma, byte *color, byte *hp)
+{
+	int k, masa, t;
+
+	if (color)
+	{
+		masa = FZ_COMBINE(FZ_EXPAND(ma), color[n - 1]);
+		for (k = 0; k < n - 1; k++)
+			dp[k] = FZ_BLEND(color[k], dp[k], masa);
+		dp[n - 1] = FZ_BLEND(255, dp[n - 1], masa);
+		if (hp)
+			hp[0] = FZ_BLEND(255, hp[0], masa);
+	}
+	else
+	{
+		t = 255 - ma;
+		dp[0] = ma + fz_mul255(dp[0], t);
+		if (hp)
+			hp[0] = ma + fz_mul255(hp[0], t);
+	}
+}
+
+static inline void
+fz_paint_affine_bitmap_lerp(byte *dp, byte *sp, int stride, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
+{
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh)
+		{
+			int a, b, c, d, ma;
+			if (ui + 1 < sw && vi + 1 < sh)
+			{
+				byte *r0 = sp + vi * stride;
+				byte *r1 = r0 + stride;
+				int i0 = ui >> 3, s0 = 7 - (ui & 7);
+				int i1 = (ui + 1) >> 3, s1 = 7 - ((ui + 1) & 7);
+				a = ((r0[i0] >> s0) & 1) * 255;
+				b = ((r0[i1] >> s1) & 1) * 255;
+				c = ((r1[i0] >> s0) & 1) * 255;
+				d = ((r1[i1] >> s1) & 1) * 255;
+			}
+			else
+			{
+				a = bitmap_sample_clamped(sp, stride, sw, sh, ui, vi);
+				b = bitmap_sample_clamped(sp, stride, sw, sh, ui+1, vi);
+				c = bitmap_sample_clamped(sp, stride, sw, sh, ui, vi+1);
+				d = bitmap_sample_clamped(sp, stride, sw, sh, ui+1, vi+1);
+			}
+			/* Most of a scan is all white or all black */
+			if ((a & b & c & d) || !(a | b | c | d))
+				ma = a;
+			else
+				ma = bilerp(a, b, c, d, u & 0xffff, v & 0xffff);
+			if (ma)
+				fz_paint_bitmap_pixel(dp, n, ma, color, hp);
+		}
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+static inline void
+fz_paint_affine_bitmap_near(byte *dp, byte *sp, int stride, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
+{
+	while (w--)
+	{
+		int ui = u >> 16;
+		int vi = v >> 16;
+		if (ui >= 0 && ui < sw && vi >= 0 && vi < sh && bitmap_sample(sp, stride, ui, vi))
+			fz_paint_bitmap_pixel(dp, n, 255, color, hp);
+		dp += n;
+		if (hp)
+			hp++;
+		u += fa;
+		v += fb;
+	}
+}
+
+/* As the blit painters, one source pixel for each destination pixel; the
+ * caller has clipped the run to the image. A run along a row of the
+ * bitmap takes a byte of it at a time, skipping empty ones. */
+static inline void
+fz_paint_affine_bitmap_blit(byte *dp, byte *sp, int stride, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp)
+{
+	int du = fa >> 16;
+	int dv = fb >> 16;
+	int ui = u >> 16;
+	int vi = v >> 16;
+	byte *row;
+	int bits, m;
+
+	if (du == 1)
+	{
+		row = sp + vi * stride;
+		while (w > 0)
+		{
+			m = 8 - (ui & 7);
+			if (m > w)
+				m = w;
+			bits = row[ui >> 3] << (ui & 7);
+			if ((bits & 0xff) == 0)
+			{
+				dp += m * n;
+				if (hp)
+					hp += m;
+			}
+			else
+			{
+				int k;
+				for (k = 0; k < m; k++)
+				{
+					if (bits & 0x80)
+						fz_paint_bitmap_pixel(dp, n, 255, color, hp);
+					bits <<= 1;
+					dp += n;
+					if (hp)
+						hp++;
+				}
+			}
+			ui += m;
+			w -= m;
+		}
+		return;
+	}
+
+	while (w--)
+	{
+		if (bitmap_sample(sp, stride, ui, vi))
+			fz_paint_bitmap_pixel(dp, n, 255, color, hp);
+		dp += n;
+		if (hp)
+			hp++;
+		ui += du;
+		vi += dv;
+	}
+}
+
+static void
+fz_paint_affine_bitmap(byte *dp, byte *sp, int stride, int sw, int sh, int u, int v, int fa, int fb, int w, int n, byte *color, byte *hp, int dolerp, int doblit)
+{
+	if (doblit)
+	{
+		switch (n)
+		{
+		case 1: fz_paint_affine_bitmap_blit(dp, sp, stride, u, v, fa, fb, w, 1, color, hp); break;
+		case 2: fz_paint_affine_bitmap_blit(dp, sp, stride, u, v, fa, fb, w, 2, color, hp); break;
+		case 4: fz_paint_affine_bitmap_blit(dp, sp, stride, u, v, fa, fb, w, 4, color, hp); break;
+		default: fz_paint_affine_bitmap_blit(dp, sp, stride, u, v, fa, fb, w, n, color, hp); break;
+		}
+	}
+	else if (dolerp)
+	{
+		switch (n)
+		{
+		case 1: fz_paint_affine_bitmap_lerp(dp, sp, stride, sw, sh, u, v, fa, fb, w, 1, color, hp); break;
+		case 2: fz_paint_affine_bitmap_lerp(dp, sp, stride, sw, sh, u, v, fa, fb, w, 2, color, hp); break;
+		case 4: fz_paint_affine_bitmap_lerp(dp, sp, stride, sw, sh, u, v, fa, fb, w, 4, color, hp); break;
+		default: fz_paint_affine_bitmap_lerp(dp, sp, stride, sw, sh, u, v, fa, fb, w, n, color, hp); break;
+		}
+	}
+	else
+	{
+		switch (n)
+		{
+		case 1: fz_paint_affine_bitmap_near(dp, sp, stride, sw, sh, u, v, fa, fb, w, 1, color, hp); break;
+		case 2: fz_paint_affine_bitmap_near(dp, sp, stride, sw, sh, u, v, fa, fb, w, 2, color, hp); break;
+		case 4: fz_paint_affine_bitmap_near(dp, sp, stride, sw, sh, u, v, fa, fb, w, 4, color, hp); break;
+		default: fz_paint_affine_bitmap_near(dp, sp, stride, sw, sh, u, v, fa, fb, w, n, color, hp); break;
+		}
+	}
+}
+
 /* RJW: The following code was originally written to be sensitive to
  * FLT_EPSILON. Given the way the 'minimum representable difference'
  * between 2 floats changes size as we scale, we now pick a larger
@@ -594,62 +1070,63 @@ fz_gridfit_matrix(fz_matrix *m)
 	}
 }
 
-/* Draw an image with an affine transform on destination */
+/* Draw an image, or a bitmap, with an affine transform on destination */
 
 static void
-fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, byte *color, int alpha)
+fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_bitmap *bit, int px, int py, int fw, int fh, fz_matrix ctm, byte *color, int alpha)
 {
 	byte *dp, *sp, *hp;
 	int u, v, fa, fb, fc, fd;
 	int x, y, w, h;
-	int sw, sh, n, hw;
+	int sw, sh, n, hw, interpolate;
+	float sx, sy;
 	fz_matrix inv;
 	fz_bbox bbox;
-	int dolerp;
+	int dolerp, doblit;
 	void (*paintfn)(byte *dp, byte *sp, int sw, int sh, int u, int v, int fa, int fb, int w, int n, int alpha, byte *color, byte *hp);
 
-	/* grid fit the image */
-	fz_gridfit_matrix(&ctm);
+	if (bit)
+	{
+		sp = bit->samples;
+		sw = bit->w;
+		sh = bit->h;
+		interpolate = bit->interpolate;
+	}
+	else
+	{
+		sp = img->samples;
+		sw = img->w;
+		sh = img->h;
+		interpolate = img->interpolate;
+	}
+
+	sx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
+	sy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
 
 	/* turn on interpolation for upscaled and non-rectilinear transforms */
 	dolerp = 0;
 	if (!fz_is_rectilinear(ctm))
 		dolerp = 1;
-	if (sqrtf(ctm.a * ctm.a + ctm.b * ctm.b) > img->w)
+	if (sx > fw)
 		dolerp = 1;
-	if (sqrtf(ctm.c * ctm.c + ctm.d * ctm.d) > img->h)
+	if (sy > fh)
 		dolerp = 1;
 
 	/* except when we shouldn't, at large magnifications */
-	if (!img->interpolate)
+	if (!interpolate)
 	{
-		if (sqrtf(ctm.a * ctm.a + ctm.b * ctm.b) > img->w * 2)
+		if (sx > fw * 2)
 			dolerp = 0;
-		if (sqrtf(ctm.c * ctm.c + ctm.d * ctm.d) > img->h * 2)
+		if (sy > fh * 2)
 			dolerp = 0;
 	}
 
 	bbox = fz_bbox_covering_rect(fz_transform_rect(ctm, fz_unit_rect));
-	bbox = fz_intersect_bbox(bbox, scissor);
 	x = bbox.x0;
-	if (shape && shape->x > x)
-		x = shape->x;
 	y = bbox.y0;
-	if (shape && shape->y > y)
-		y = shape->y;
-	w = bbox.x1;
-	if (shape && shape->x + shape->w < w)
-		w = shape->x + shape->w;
-	w -= x;
-	h = bbox.y1;
-	if (shape && shape->y + shape->h < h)
-		h = shape->y + shape->h;
-	h -= y;
-	if (w < 0 || h < 0)
-		return;
 
 	/* map from screen space (x,y) to image space (u,v) */
-	inv = fz_scale(1.0f / img->w, 1.0f / img->h);
+	inv = fz_scale(1.0f / fw, 1.0f / fh);
 	inv = fz_concat(inv, ctm);
 	inv = fz_invert_matrix(inv);
 
@@ -660,7 +1137,8 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 	inv.e *= 65536.0f;
 	inv.f *= 65536.0f;
 
-	/* Calculate initial texture positions. Do a half step to start. */
+	/* Calculate texture positions at the corner of the image's bbox.
+	 * Do a half step to start. */
 	/* Bug 693021: Keep calculation in float for as long as possible to
 	 * avoid overflow. */
 	u = (int)((inv.a * x) + (inv.c * y) + inv.e + ((inv.a + inv.c) * .5f));
@@ -674,11 +1152,36 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 		v -= 32768;
 	}
 
+	/* img may hold just the part at px, py of an fw x fh image */
+	u -= px << 16;
+	v -= py << 16;
+
+	bbox = fz_intersect_bbox(bbox, scissor);
+	if (shape && shape->x > bbox.x0)
+		bbox.x0 = shape->x;
+	if (shape && shape->y > bbox.y0)
+		bbox.y0 = shape->y;
+	w = bbox.x1;
+	if (shape && shape->x + shape->w < w)
+		w = shape->x + shape->w;
+	w -= bbox.x0;
+	h = bbox.y1;
+	if (shape && shape->y + shape->h < h)
+		h = shape->y + shape->h;
+	h -= bbox.y0;
+	if (w < 0 || h < 0)
+		return;
+
+	/* Step on from the corner in whole steps, so that any part of the
+	 * image painted on its own (a tile, say) comes out exactly as it
+	 * does when the image is painted in one go. */
+	u = affine_step(affine_step(u, fa, bbox.x0 - x), fc, bbox.y0 - y);
+	v = affine_step(affine_step(v, fb, bbox.x0 - x), fd, bbox.y0 - y);
+	x = bbox.x0;
+	y = bbox.y0;
+
 	dp = dst->samples + (unsigned int)(((y - dst->y) * dst->w + (x - dst->x)) * dst->n);
 	n = dst->n;
-	sp = img->samples;
-	sw = img->w;
-	sh = img->h;
 	if (shape)
 	{
 		hw = shape->w;
@@ -690,19 +1193,35 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 		hp = NULL;
 	}
 
-	/* TODO: if (fb == 0 && fa == 1) call fz_paint_span */
+	/* unscaled, and unrotated or turned through a multiple of 90 degrees */
+	doblit = !dolerp &&
+		((fb == 0 && (fa == 65536 || fa == -65536)) ||
+		(fa == 0 && (fb == 65536 || fb == -65536)));
 
-	if (dst->n == 4 && img->n == 2)
+	if (bit)
+	{
+		paintfn = NULL;
+	}
+	else if (dst->n == 4 && img->n == 2)
 	{
 		assert(!color);
-		if (dolerp)
+		if (doblit)
+			paintfn = fz_paint_affine_g2rgb_blit;
+		else if (dolerp)
 			paintfn = fz_paint_affine_g2rgb_lerp;
 		else
 			paintfn = fz_paint_affine_g2rgb_near;
 	}
 	else
 	{
-		if (dolerp)
+		if (doblit)
+		{
+			if (color)
+				paintfn = fz_paint_affine_color_blit;
+			else
+				paintfn = fz_paint_affine_blit;
+		}
+		else if (dolerp)
 		{
 			if (color)
 				paintfn = fz_paint_affine_color_lerp;
@@ -720,7 +1239,13 @@ fz_paint_image_imp(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap
 
 	while (h--)
 	{
-		paintfn(dp, sp, sw, sh, u, v, fa, fb, w, n, alpha, color, hp);
+		int i0 = 0;
+		int i1 = w;
+		fz_affine_clip_span(u, v, fa, fb, sw, sh, &i0, &i1);
+		if (i0 < i1 && bit)
+			fz_paint_affine_bitmap(dp + i0 * n, sp, bit->stride, sw, sh, affine_step(u, fa, i0), affine_step(v, fb, i0), fa, fb, i1 - i0, n, color, hp ? hp + i0 : NULL, dolerp, doblit);
+		else if (i0 < i1)
+			paintfn(dp + i0 * n, sp, sw, sh, affine_step(u, fa, i0), affine_step(v, fb, i0), fa, fb, i1 - i0, n, alpha, color, hp ? hp + i0 : NULL);
 		dp += dst->w * n;
 		hp += hw;
 		u += fc;
@@ -732,12 +1257,40 @@ void
 fz_paint_image_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, byte *color)
 {
 	assert(img->n == 1);
-	fz_paint_image_imp(dst, scissor, shape, img, ctm, color, 255);
+	fz_paint_image_imp(dst, scissor, shape, img, NULL, 0, 0, img->w, img->h, ctm, color, 255);
 }
 
 void
 fz_paint_image(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, int alpha)
 {
 	assert(dst->n == img->n || (dst->n == 4 && img->n == 2));
-	fz_paint_image_imp(dst, scissor, shape, img, ctm, NULL, alpha);
+	fz_paint_image_imp(dst, scissor, shape, img, NULL, 0, 0, img->w, img->h, ctm, NULL, alpha);
+}
+
+void
+fz_paint_image_part(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, int w, int h, fz_matrix ctm, int alpha)
+{
+	assert(dst->n == img->n || (dst->n == 4 && img->n == 2));
+	fz_paint_image_imp(dst, scissor, shape, img, NULL, img->x, img->y, w, h, ctm, NULL, alpha);
+}
+
+void
+fz_paint_image_part_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, int w, int h, fz_matrix ctm, byte *color)
+{
+	assert(img->n == 1);
+	fz_paint_image_imp(dst, scissor, shape, img, NULL, img->x, img->y, w, h, ctm, color, 255);
+}
+
+void
+fz_paint_bitmap_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, fz_matrix ctm, byte *color)
+{
+	assert(bit->n == 1);
+	fz_paint_image_imp(dst, scissor, shape, NULL, bit, 0, 0, bit->w, bit->h, ctm, color, 255);
+}
+
+void
+fz_paint_bitmap(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, fz_matrix ctm)
+{
+	assert(bit->n == 1 && dst->n == 1);
+	fz_paint_image_imp(dst, scissor, shape, NULL, bit, 0, 0, bit->w, bit->h, ctm, NULL, 255);
 }
@@ -0,0 +1,219 @@
+#include "fitz-internal.h"
+#include "draw_simd.h"
+
+/*
+Bilinear affine sampling, 16 bytes of destination (4 rgba or 8 grey+alpha
+pixels) at a time. Each of a sample's four neighbours is gathered into
+its own vector, with the sample's fractions spread over its lanes, and
+then interpolated and blended with the same integer steps as the C code
+in draw_affine.c. The caller has kept every neighbour in the image.
+*/
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+#ifdef HAVE_SSE2
+
+/* a + (((b - a) * t) >> 16) for t in 0..65535, as the affine sampler's
+ * lerp. The signed high multiply sees t >= 32768 as t - 65536, and so
+ * comes out b - a short; adding it back where t's top bit is set makes
+ * the result exact. */
+static inline v16 v_lerp(v16 a, v16 b, v16 t)
+{
+	__m128i d = _mm_sub_epi16(b, a);
+	__m128i r = _mm_mulhi_epi16(d, t);
+	r = _mm_add_epi16(r, _mm_and_si128(d, _mm_srai_epi16(t, 15)));
+	return _mm_add_epi16(a, r);
+}
+
+/* One pixel of n (2 or 4) bytes from each of 16 / n places, widened */
+static inline void v_gather(byte **s, int off, int n, v16 *lo, v16 *hi)
+{
+	__m128i x;
+	if (n == 4)
+	{
+		unsigned int a, b, c, d;
+		memcpy(&a, s[0] + off, 4);
+		memcpy(&b, s[1] + off, 4);
+		memcpy(&c, s[2] + off, 4);
+		memcpy(&d, s[3] + off, 4);
+		x = _mm_set_epi32(d, c, b, a);
+	}
+	else
+	{
+		unsigned short a[8];
+		int i;
+		for (i = 0; i < 8; i++)
+			memcpy(&a[i], s[i] + off, 2);
+		x = _mm_set_epi16(a[7], a[6], a[5], a[4], a[3], a[2], a[1], a[0]);
+	}
+	*lo = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+	*hi = _mm_unpackhi_epi8(x, _mm_setzero_si128());
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+/* a + (((b - a) * t) >> 16) for t in 0..65535; see the SSE2 version */
+static inline v16 v_lerp(v16 a, v16 b, v16 t)
+{
+	int16x8_t d = vreinterpretq_s16_u16(vsubq_u16(b, a));
+	int16x8_t ts = vreinterpretq_s16_u16(t);
+	int16x8_t r = vcombine_s16(
+		vshrn_n_s32(vmull_s16(vget_low_s16(d), vget_low_s16(ts)), 16),
+		vshrn_n_s32(vmull_s16(vget_high_s16(d), vget_high_s16(ts)), 16));
+	r = vaddq_s16(r, vandq_s16(d, vshrq_n_s16(ts, 15)));
+	return vaddq_u16(a, vreinterpretq_u16_s16(r));
+}
+
+/* One pixel of n (2 or 4) bytes from each of 16 / n places, widened */
+static inline void v_gather(byte **s, int off, int n, v16 *lo, v16 *hi)
+{
+	uint8x16_t x;
+	if (n == 4)
+	{
+		uint32x4_t y = vdupq_n_u32(0);
+		unsigned int a;
+		memcpy(&a, s[0] + off, 4);
+		y = vsetq_lane_u32(a, y, 0);
+		memcpy(&a, s[1] + off, 4);
+		y = vsetq_lane_u32(a, y, 1);
+		memcpy(&a, s[2] + off, 4);
+		y = vsetq_lane_u32(a, y, 2);
+		memcpy(&a, s[3] + off, 4);
+		y = vsetq_lane_u32(a, y, 3);
+		x = vreinterpretq_u8_u32(y);
+	}
+	else
+	{
+		unsigned short a[8];
+		int i;
+		for (i = 0; i < 8; i++)
+			memcpy(&a[i], s[i] + off, 2);
+		x = vreinterpretq_u8_u16(vld1q_u16(a));
+	}
+	*lo = vmovl_u8(vget_low_u8(x));
+	*hi = vmovl_u8(vget_high_u8(x));
+}
+
+#endif /* HAVE_NEON */
+
+static inline int affine_lerp(int a, int b, int t)
+{
+	return a + (((b - a) * t) >> 16);
+}
+
+static inline int affine_bilerp(int a, int b, int c, int d, int u, int v)
+{
+	return affine_lerp(affine_lerp(a, b, u), affine_lerp(c, d, u), v);
+}
+
+static inline void
+paint_affine_lerp_simd(byte * restrict dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int n, int alpha)
+{
+	int stride = sw * n;
+	int n1 = n - 1;
+	int i, k;
+	unsigned short su[16], sv[16];
+	v16 v255 = v_splat(255);
+	v16 va = v_splat(alpha);
+	v16 ul, uh, vl, vh, ful, fuh, fvl, fvh;
+
+	/* The fractions are the low halves of u and v, and so step by the
+	 * low halves of fa and fb in 16-bit lanes, wrapping as they go */
+	for (k = 0; k < 16; k++)
+	{
+		su[k] = (k / n) * fa;
+		sv[k] = (k / n) * fb;
+	}
+	ul = v_set(su);
+	uh = v_set(su + 8);
+	vl = v_set(sv);
+	vh = v_set(sv + 8);
+	ful = v_splat(u & 0xffff);
+	fvl = v_splat(v & 0xffff);
+	fuh = v_add(ful, uh);
+	fvh = v_add(fvl, vh);
+	ful = v_add(ful, ul);
+	fvl = v_add(fvl, vl);
+	ul = v_splat((unsigned short)((16 / n) * fa));
+	vl = v_splat((unsigned short)((16 / n) * fb));
+
+	for (; w >= 16 / n; w -= 16 / n)
+	{
+		byte *s[8];
+		v16 al, ah, bl, bh, cl, ch, dl, dh, xl, xh;
+
+		for (i = 0; i < 16 / n; i++)
+		{
+			s[i] = sp + (v >> 16) * stride + (u >> 16) * n;
+			u += fa;
+			v += fb;
+		}
+
+		v_gather(s, 0, n, &al, &ah);
+		v_gather(s, n, n, &bl, &bh);
+		v_gather(s, stride, n, &cl, &ch);
+		v_gather(s, stride + n, n, &dl, &dh);
+		xl = v_lerp(v_lerp(al, bl, ful), v_lerp(cl, dl, ful), fvl);
+		xh = v_lerp(v_lerp(ah, bh, fuh), v_lerp(ch, dh, fuh), fvh);
+		if (alpha != 255)
+		{
+			xl = v_mul255(xl, va);
+			xh = v_mul255(xh, va);
+		}
+		v_load(dp, &dl, &dh);
+		dl = v_add(xl, v_mul255(dl, v_sub(v255, v_alpha(xl, n))));
+		dh = v_add(xh, v_mul255(dh, v_sub(v255, v_alpha(xh, n))));
+		v_store(dp, dl, dh);
+		dp += 16;
+		ful = v_add(ful, ul);
+		fuh = v_add(fuh, ul);
+		fvl = v_add(fvl, vl);
+		fvh = v_add(fvh, vl);
+	}
+
+	while (w--)
+	{
+		int uf = u & 0xffff;
+		int vf = v & 0xffff;
+		byte *a = sp + (v >> 16) * stride + (u >> 16) * n;
+		byte *b = a + n;
+		byte *c = a + stride;
+		byte *d = c + n;
+		int y = fz_mul255(affine_bilerp(a[n1], b[n1], c[n1], d[n1], uf, vf), alpha);
+		int t = 255 - y;
+		for (k = 0; k < n1; k++)
+		{
+			int x = affine_bilerp(a[k], b[k], c[k], d[k], uf, vf);
+			dp[k] = fz_mul255(x, alpha) + fz_mul255(dp[k], t);
+		}
+		dp[n1] = y + fz_mul255(dp[n1], t);
+		dp += n;
+		u += fa;
+		v += fb;
+	}
+}
+
+static void
+paint_affine_lerp_2_simd(byte * restrict dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int alpha)
+{
+	paint_affine_lerp_simd(dp, sp, sw, u, v, fa, fb, w, 2, alpha);
+}
+
+static void
+paint_affine_lerp_4_simd(byte * restrict dp, byte *sp, int sw, int u, int v, int fa, int fb, int w, int alpha)
+{
+	paint_affine_lerp_simd(dp, sp, sw, u, v, fa, fb, w, 4, alpha);
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+void
+fz_accelerate_affine(void)
+{
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	fz_affine_funcs.lerp_2 = paint_affine_lerp_2_simd;
+	fz_affine_funcs.lerp_4 = paint_affine_lerp_4_simd;
+#endif
+}
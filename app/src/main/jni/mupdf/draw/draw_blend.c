@@ -4,6 +4,8 @@
 
 typedef unsigned char byte;
 
+fz_blend_table fz_blend_funcs = { NULL, NULL };
+
 static const char *fz_blendmode_names[] =
 {
 	"Normal",
@@ -231,6 +233,27 @@ fz_hue_rgb(unsigned char *rr, unsigned char *rg, unsigned char *rb, int br, int
 	fz_saturation_rgb(rr, rg, rb, tr, tg, tb, br, bg, bb);
 }
 
+static inline int
+fz_blend_separable_byte(int b, int s, int blendmode)
+{
+	switch (blendmode)
+	{
+	default:
+	case FZ_BLEND_NORMAL: return s;
+	case FZ_BLEND_MULTIPLY: return fz_mul255(b, s);
+	case FZ_BLEND_SCREEN: return fz_screen_byte(b, s);
+	case FZ_BLEND_OVERLAY: return fz_overlay_byte(b, s);
+	case FZ_BLEND_DARKEN: return fz_darken_byte(b, s);
+	case FZ_BLEND_LIGHTEN: return fz_lighten_byte(b, s);
+	case FZ_BLEND_COLOR_DODGE: return fz_color_dodge_byte(b, s);
+	case FZ_BLEND_COLOR_BURN: return fz_color_burn_byte(b, s);
+	case FZ_BLEND_HARD_LIGHT: return fz_hard_light_byte(b, s);
+	case FZ_BLEND_SOFT_LIGHT: return fz_soft_light_byte(b, s);
+	case FZ_BLEND_DIFFERENCE: return fz_difference_byte(b, s);
+	case FZ_BLEND_EXCLUSION: return fz_exclusion_byte(b, s);
+	}
+}
+
 void
 fz_blend_pixel(unsigned char dp[3], unsigned char bp[3], unsigned char sp[3], int blendmode)
 {
@@ -245,30 +268,29 @@ fz_blend_pixel(unsigned char dp[3], unsigned char bp[3], unsigned char sp[3], in
 	}
 	/* separable blend modes */
 	for (k = 0; k < 3; k++)
-	{
-		switch (blendmode)
-		{
-		default:
-		case FZ_BLEND_NORMAL: dp[k] = sp[k]; break;
-		case FZ_BLEND_MULTIPLY: dp[k] = fz_mul255(bp[k], sp[k]); break;
-		case FZ_BLEND_SCREEN: dp[k] = fz_screen_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_OVERLAY: dp[k] = fz_overlay_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_DARKEN: dp[k] = fz_darken_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_LIGHTEN: dp[k] = fz_lighten_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_COLOR_DODGE: dp[k] = fz_color_dodge_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_COLOR_BURN: dp[k] = fz_color_burn_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_HARD_LIGHT: dp[k] = fz_hard_light_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_SOFT_LIGHT: dp[k] = fz_soft_light_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_DIFFERENCE: dp[k] = fz_difference_byte(bp[k], sp[k]); break;
-		case FZ_BLEND_EXCLUSION: dp[k] = fz_exclusion_byte(bp[k], sp[k]); break;
-		}
-	}
+		dp[k] = fz_blend_separable_byte(bp[k], sp[k], blendmode);
 }
 
 /* Blending loops */
 
-void
-fz_blend_separable(byte * restrict bp, byte * restrict sp, int n, int w, int blendmode)
+/*
+ * Two cases skip the general formula below, with identical results: a
+ * source pixel that is entirely zero leaves the backdrop as it was, and
+ * where source and backdrop are both opaque there is no alpha to divide
+ * out or composite with, so the blend result is the answer.
+ */
+static inline int
+fz_is_clear_pixel(byte *p, int n)
+{
+	int k;
+	for (k = 0; k < n; k++)
+		if (p[k])
+			return 0;
+	return 1;
+}
+
+static void
+fz_blend_separable_pixels(byte * restrict bp, byte * restrict sp, int n, int w, int blendmode)
 {
 	int k;
 	int n1 = n - 1;
@@ -276,45 +298,78 @@ fz_blend_separable(byte * restrict bp, byte * restrict sp, int n, int w, int ble
 	{
 		int sa = sp[n1];
 		int ba = bp[n1];
-		int saba = fz_mul255(sa, ba);
-
-		/* ugh, division to get non-premul components */
-		int invsa = sa ? 255 * 256 / sa : 0;
-		int invba = ba ? 255 * 256 / ba : 0;
 
-		for (k = 0; k < n1; k++)
+		if (sa == 0 && fz_is_clear_pixel(sp, n1))
 		{
-			int sc = (sp[k] * invsa) >> 8;
-			int bc = (bp[k] * invba) >> 8;
-			int rc;
+			/* nothing to do */
+		}
+		else if (sa == 255 && ba == 255)
+		{
+			for (k = 0; k < n1; k++)
+				bp[k] = fz_blend_separable_byte(bp[k], sp[k], blendmode);
+		}
+		else
+		{
+			int saba = fz_mul255(sa, ba);
+
+			/* ugh, division to get non-premul components */
+			int invsa = sa ? 255 * 256 / sa : 0;
+			int invba = ba ? 255 * 256 / ba : 0;
 
-			switch (blendmode)
+			for (k = 0; k < n1; k++)
 			{
-			default:
-			case FZ_BLEND_NORMAL: rc = sc; break;
-			case FZ_BLEND_MULTIPLY: rc = fz_mul255(bc, sc); break;
-			case FZ_BLEND_SCREEN: rc = fz_screen_byte(bc, sc); break;
-			case FZ_BLEND_OVERLAY: rc = fz_overlay_byte(bc, sc); break;
-			case FZ_BLEND_DARKEN: rc = fz_darken_byte(bc, sc); break;
-			case FZ_BLEND_LIGHTEN: rc = fz_lighten_byte(bc, sc); break;
-			case FZ_BLEND_COLOR_DODGE: rc = fz_color_dodge_byte(bc, sc); break;
-			case FZ_BLEND_COLOR_BURN: rc = fz_color_burn_byte(bc, sc); break;
-			case FZ_BLEND_HARD_LIGHT: rc = fz_hard_light_byte(bc, sc); break;
-			case FZ_BLEND_SOFT_LIGHT: rc = fz_soft_light_byte(bc, sc); break;
-			case FZ_BLEND_DIFFERENCE: rc = fz_difference_byte(bc, sc); break;
-			case FZ_BLEND_EXCLUSION: rc = fz_exclusion_byte(bc, sc); break;
+				int sc = (sp[k] * invsa) >> 8;
+				int bc = (bp[k] * invba) >> 8;
+				int rc = fz_blend_separable_byte(bc, sc, blendmode);
+
+				bp[k] = fz_mul255(255 - sa, bp[k]) + fz_mul255(255 - ba, sp[k]) + fz_mul255(saba, rc);
 			}
 
-			bp[k] = fz_mul255(255 - sa, bp[k]) + fz_mul255(255 - ba, sp[k]) + fz_mul255(saba, rc);
+			bp[k] = ba + sa - saba;
 		}
 
-		bp[k] = ba + sa - saba;
-
 		sp += n;
 		bp += n;
 	}
 }
 
+void
+fz_blend_separable(byte * restrict bp, byte * restrict sp, int n, int w, int blendmode)
+{
+	int (*blend)(byte * restrict, byte * restrict, int, int) = NULL;
+
+	if (blendmode != FZ_BLEND_COLOR_DODGE && blendmode != FZ_BLEND_COLOR_BURN && blendmode != FZ_BLEND_SOFT_LIGHT)
+	{
+		if (n == 2)
+			blend = fz_blend_funcs.separable_2;
+		else if (n == 4)
+			blend = fz_blend_funcs.separable_4;
+	}
+
+	if (!blend)
+	{
+		fz_blend_separable_pixels(bp, sp, n, w, blendmode);
+		return;
+	}
+
+	while (w > 0)
+	{
+		/* The SIMD kernel does whole blocks of 16 bytes, and stops
+		 * at one that is not premultiplied; we do that block or the
+		 * partial one at the end. */
+		int done = blend(bp, sp, w, blendmode);
+		bp += done * n;
+		sp += done * n;
+		w -= done;
+
+		done = fz_mini(w, 16 / n);
+		fz_blend_separable_pixels(bp, sp, n, done, blendmode);
+		bp += done * n;
+		sp += done * n;
+		w -= done;
+	}
+}
+
 void
 fz_blend_nonseparable(byte * restrict bp, byte * restrict sp, int w, int blendmode)
 {
@@ -324,19 +379,28 @@ fz_blend_nonseparable(byte * restrict bp, byte * restrict sp, int w, int blendmo
 
 		int sa = sp[3];
 		int ba = bp[3];
-		int saba = fz_mul255(sa, ba);
+		int saba, invsa, invba, sr, sg, sb, br, bg, bb;
+
+		if (sa == 0 && fz_is_clear_pixel(sp, 3))
+		{
+			sp += 4;
+			bp += 4;
+			continue;
+		}
+
+		saba = fz_mul255(sa, ba);
 
 		/* ugh, division to get non-premul components */
-		int invsa = sa ? 255 * 256 / sa : 0;
-		int invba = ba ? 255 * 256 / ba : 0;
+		invsa = sa ? 255 * 256 / sa : 0;
+		invba = ba ? 255 * 256 / ba : 0;
 
-		int sr = (sp[0] * invsa) >> 8;
-		int sg = (sp[1] * invsa) >> 8;
-		int sb = (sp[2] * invsa) >> 8;
+		sr = (sp[0] * invsa) >> 8;
+		sg = (sp[1] * invsa) >> 8;
+		sb = (sp[2] * invsa) >> 8;
 
-		int br = (bp[0] * invba) >> 8;
-		int bg = (bp[1] * invba) >> 8;
-		int bb = (bp[2] * invba) >> 8;
+		br = (bp[0] * invba) >> 8;
+		bg = (bp[1] * invba) >> 8;
+		bb = (bp[2] * invba) >> 8;
 
 		switch (blendmode)
 		{
@@ -355,9 +419,18 @@ fz_blend_nonseparable(byte * restrict bp, byte * restrict sp, int w, int blendmo
 			break;
 		}
 
-		bp[0] = fz_mul255(255 - sa, bp[0]) + fz_mul255(255 - ba, sp[0]) + fz_mul255(saba, rr);
-		bp[1] = fz_mul255(255 - sa, bp[1]) + fz_mul255(255 - ba, sp[1]) + fz_mul255(saba, rg);
-		bp[2] = fz_mul255(255 - sa, bp[2]) + fz_mul255(255 - ba, sp[2]) + fz_mul255(saba, rb);
+		if (saba == 255)
+		{
+			bp[0] = rr;
+			bp[1] = rg;
+			bp[2] = rb;
+		}
+		else
+		{
+			bp[0] = fz_mul255(255 - sa, bp[0]) + fz_mul255(255 - ba, sp[0]) + fz_mul255(saba, rr);
+			bp[1] = fz_mul255(255 - sa, bp[1]) + fz_mul255(255 - ba, sp[1]) + fz_mul255(saba, rg);
+			bp[2] = fz_mul255(255 - sa, bp[2]) + fz_mul255(255 - ba, sp[2]) + fz_mul255(saba, rb);
+		}
 		bp[3] = ba + sa - saba;
 
 		sp += 4;
@@ -460,22 +533,8 @@ fz_blend_separable_nonisolated(byte * restrict bp, byte * restrict sp, int n, in
 				if (sc < 0) sc = 0;
 				if (sc > 255) sc = 255;
 
-				switch (blendmode)
-				{
-				default:
-				case FZ_BLEND_NORMAL: rc = sc; break;
-				case FZ_BLEND_MULTIPLY: rc = fz_mul255(bc, sc); break;
-				case FZ_BLEND_SCREEN: rc = fz_screen_byte(bc, sc); break;
-				case FZ_BLEND_OVERLAY: rc = fz_overlay_byte(bc, sc); break;
-				case FZ_BLEND_DARKEN: rc = fz_darken_byte(bc, sc); break;
-				case FZ_BLEND_LIGHTEN: rc = fz_lighten_byte(bc, sc); break;
-				case FZ_BLEND_COLOR_DODGE: rc = fz_color_dodge_byte(bc, sc); break;
-				case FZ_BLEND_COLOR_BURN: rc = fz_color_burn_byte(bc, sc); break;
-				case FZ_BLEND_HARD_LIGHT: rc = fz_hard_light_byte(bc, sc); break;
-				case FZ_BLEND_SOFT_LIGHT: rc = fz_soft_light_byte(bc, sc); break;
-				case FZ_BLEND_DIFFERENCE: rc = fz_difference_byte(bc, sc); break;
-				case FZ_BLEND_EXCLUSION: rc = fz_exclusion_byte(bc, sc); break;
-				}
+				rc = fz_blend_separable_byte(bc, sc, blendmode);
+
 				/* Composition formula, as given in pdf_reference17.pdf:
 				 * rc = ( 1 - (ha/ra)) * bc + (ha/ra) * ((1-ba)*sc + ba * rc)
 				 */
@@ -575,19 +634,7 @@ fz_blend_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha, int blendmode, int is
 {
 	unsigned char *sp, *dp;
 	fz_bbox bbox;
-	int x, y, w, h, n;
-
-	/* TODO: fix this hack! */
-	if (isolated && alpha < 255)
-	{
-		sp = src->samples;
-		n = src->w * src->h * src->n;
-		while (n--)
-		{
-			*sp = fz_mul255(*sp, alpha);
-			sp++;
-		}
-	}
+	int x, y, w, h, n, k;
 
 	bbox = fz_pixmap_bbox_no_ctx(dst);
 	bbox = fz_intersect_bbox(bbox, fz_pixmap_bbox_no_ctx(src));
@@ -622,6 +669,13 @@ fz_blend_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha, int blendmode, int is
 	{
 		while (h--)
 		{
+			/* TODO: fix this hack! The group alpha is applied to
+			 * the source in place, which is dropped once blended; we
+			 * do it just for the part we blend, a row at a time so
+			 * that it is still in cache for the blend. */
+			if (alpha < 255)
+				for (k = 0; k < w * n; k++)
+					sp[k] = fz_mul255(sp[k], alpha);
 			if (n == 4 && blendmode >= FZ_BLEND_HUE)
 				fz_blend_nonseparable(dp, sp, w, blendmode);
 			else
@@ -0,0 +1,194 @@
+#include "fitz-internal.h"
+#include "draw_simd.h"
+
+/*
+
+Separable blend modes, as fz_blend_separable in draw_blend.c. Pixels are
+un-premultiplied with the C code's own 255 * 256 / alpha, which we look
+up per pixel; premultiplied colors keep every intermediate within 16
+bits.
+
+*/
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+#ifdef HAVE_SSE2
+
+/* Lane helpers for the blend modes; the lanes hold bytes or masks */
+#define v_min(a, b) _mm_min_epi16(a, b)
+#define v_max(a, b) _mm_max_epi16(a, b)
+#define v_gt(a, b) _mm_cmpgt_epi16(a, b)
+#define v_or(a, b) _mm_or_si128(a, b)
+#define v_shl(a, n) _mm_slli_epi16(a, n)
+#define v_mulhi(a, b) _mm_mulhi_epu16(a, b)
+
+/* m ? a : b, lane by lane */
+static inline v16 v_select(v16 m, v16 a, v16 b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+/* Is any lane of a mask set? */
+static inline int v_any(v16 m)
+{
+	return _mm_movemask_epi8(m) != 0;
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+/* Lane helpers for the blend modes; the lanes hold bytes or masks */
+#define v_min(a, b) vminq_u16(a, b)
+#define v_max(a, b) vmaxq_u16(a, b)
+#define v_gt(a, b) vcgtq_u16(a, b)
+#define v_or(a, b) vorrq_u16(a, b)
+#define v_shl(a, n) vshlq_n_u16(a, n)
+#define v_select(m, a, b) vbslq_u16(m, a, b)
+
+/* (a * b) >> 16 */
+static inline v16 v_mulhi(v16 a, v16 b)
+{
+	return vcombine_u16(
+		vshrn_n_u32(vmull_u16(vget_low_u16(a), vget_low_u16(b)), 16),
+		vshrn_n_u32(vmull_u16(vget_high_u16(a), vget_high_u16(b)), 16));
+}
+
+static inline int v_any(v16 m)
+{
+	return vget_lane_u64(vreinterpret_u64_u16(vorr_u16(vget_low_u16(m), vget_high_u16(m))), 0) != 0;
+}
+
+#endif /* HAVE_NEON */
+
+static unsigned short blend_recip[256];
+
+static const unsigned short blend_alpha_2[8] = { 0, 0xFFFF, 0, 0xFFFF, 0, 0xFFFF, 0, 0xFFFF };
+static const unsigned short blend_alpha_4[8] = { 0, 0, 0, 0xFFFF, 0, 0, 0, 0xFFFF };
+
+static inline v16 v_recip(const byte *p, int n)
+{
+	unsigned short r[8];
+	int i, k;
+	for (i = 0; i < 8; i += n)
+	{
+		unsigned short x = blend_recip[p[i + n - 1]];
+		for (k = 0; k < n; k++)
+			r[i + k] = x;
+	}
+	return v_set(r);
+}
+
+static inline v16 v_screen(v16 b, v16 s)
+{
+	return v_sub(v_add(b, s), v_mul255(b, s));
+}
+
+/* Both halves of hard light, then the one that applies; each overflows
+ * only in the lanes where it is not chosen */
+static inline v16 v_hard_light(v16 b, v16 s)
+{
+	v16 s2 = v_shl(s, 1);
+	return v_select(v_gt(s, v_splat(127)), v_screen(b, v_sub(s2, v_splat(255))), v_mul255(b, s2));
+}
+
+static inline v16 v_blend_mode(v16 b, v16 s, int blendmode)
+{
+	switch (blendmode)
+	{
+	default:
+	case FZ_BLEND_NORMAL: return s;
+	case FZ_BLEND_MULTIPLY: return v_mul255(b, s);
+	case FZ_BLEND_SCREEN: return v_screen(b, s);
+	case FZ_BLEND_OVERLAY: return v_hard_light(s, b);
+	case FZ_BLEND_DARKEN: return v_min(b, s);
+	case FZ_BLEND_LIGHTEN: return v_max(b, s);
+	case FZ_BLEND_HARD_LIGHT: return v_hard_light(b, s);
+	case FZ_BLEND_DIFFERENCE: return v_sub(v_max(b, s), v_min(b, s));
+	case FZ_BLEND_EXCLUSION: return v_sub(v_add(b, s), v_shl(v_mul255(b, s), 1));
+	}
+}
+
+static inline v16
+v_blend_separable(v16 b, v16 s, v16 ba, v16 sa, v16 invba, v16 invsa, v16 am, int blendmode)
+{
+	v16 v255 = v_splat(255);
+	v16 bc = v_mulhi(v_shl(b, 8), invba);
+	v16 sc = v_mulhi(v_shl(s, 8), invsa);
+	v16 saba = v_mul255(sa, ba);
+	v16 rc = v_blend_mode(bc, sc, blendmode);
+	v16 c = v_add(v_add(v_mul255(v_sub(v255, sa), b), v_mul255(v_sub(v255, ba), s)), v_mul255(saba, rc));
+	return v_select(am, v_sub(v_add(ba, sa), saba), c);
+}
+
+static inline int
+blend_separable_simd(byte * restrict bp, byte * restrict sp, int w, int n, int blendmode)
+{
+	v16 zero = v_splat(0);
+	v16 v255 = v_splat(255);
+	v16 am = v_set(n == 2 ? blend_alpha_2 : blend_alpha_4);
+	int pixels = 16 / n;
+	int done = 0;
+
+	for (; w >= pixels; w -= pixels)
+	{
+		v16 sl, sh, bl, bh, sal, sah, bal, bah;
+
+		v_load(sp, &sl, &sh);
+		/* A clear source block leaves the backdrop as it is */
+		if (v_any(v_or(v_gt(sl, zero), v_gt(sh, zero))))
+		{
+			v_load(bp, &bl, &bh);
+			sal = v_alpha(sl, n);
+			sah = v_alpha(sh, n);
+			bal = v_alpha(bl, n);
+			bah = v_alpha(bh, n);
+			if (v_any(v_or(v_or(v_gt(sl, sal), v_gt(sh, sah)), v_or(v_gt(bl, bal), v_gt(bh, bah)))))
+				break;
+			if (v_any(v_or(v_or(v_gt(v255, sal), v_gt(v255, sah)), v_or(v_gt(v255, bal), v_gt(v255, bah)))))
+			{
+				bl = v_blend_separable(bl, sl, bal, sal, v_recip(bp, n), v_recip(sp, n), am, blendmode);
+				bh = v_blend_separable(bh, sh, bah, sah, v_recip(bp + 8, n), v_recip(sp + 8, n), am, blendmode);
+			}
+			else
+			{
+				/* All opaque: the blend is the result */
+				bl = v_select(am, v255, v_blend_mode(bl, sl, blendmode));
+				bh = v_select(am, v255, v_blend_mode(bh, sh, blendmode));
+			}
+			v_store(bp, bl, bh);
+		}
+		sp += 16;
+		bp += 16;
+		done += pixels;
+	}
+
+	return done;
+}
+
+static int
+blend_separable_2_simd(byte * restrict bp, byte * restrict sp, int w, int blendmode)
+{
+	return blend_separable_simd(bp, sp, w, 2, blendmode);
+}
+
+static int
+blend_separable_4_simd(byte * restrict bp, byte * restrict sp, int w, int blendmode)
+{
+	return blend_separable_simd(bp, sp, w, 4, blendmode);
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+void
+fz_accelerate_blend(void)
+{
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	int i;
+
+	for (i = 1; i < 256; i++)
+		blend_recip[i] = 255 * 256 / i;
+	fz_blend_funcs.separable_2 = blend_separable_2_simd;
+	fz_blend_funcs.separable_4 = blend_separable_4_simd;
+#endif
+}
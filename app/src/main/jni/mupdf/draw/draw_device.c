@@ -6,6 +6,16 @@
 
 #define STACK_SIZE 96
 
+/* Glyphs are painted in batches of up to GLYPH_BATCH; glyphs bigger
+ * than the glyph cache keeps end a batch early. */
+#define GLYPH_BATCH 64
+#define MAX_BATCHED_GLYPH_SIZE 256
+
+/* Scaled images with at most SCALED_IMAGE_WHOLE pixels are cached whole;
+ * bigger ones in blocks SCALED_IMAGE_GRID device pixels square. */
+#define SCALED_IMAGE_WHOLE (1024 * 1024)
+#define SCALED_IMAGE_GRID 512
+
 /* Enable the following to attempt to support knockout and/or isolated
  * blending groups. */
 #define ATTEMPT_KNOCKOUT_AND_ISOLATED
@@ -17,6 +27,7 @@ typedef struct fz_draw_device_s fz_draw_device;
 
 enum {
 	FZ_DRAWDEV_FLAGS_TYPE3 = 1,
+	FZ_DRAWDEV_FLAGS_ANALYTIC = 2,
 };
 
 typedef struct fz_draw_state_s fz_draw_state;
@@ -254,6 +265,7 @@ fz_draw_fill_path(fz_device *devp, fz_path *path, int even_odd, fz_matrix ctm,
 	if (model == NULL)
 		model = fz_device_gray;
 
+	fz_set_gel_analytic(dev->gel, dev->flags & FZ_DRAWDEV_FLAGS_ANALYTIC);
 	fz_reset_gel(dev->gel, state->scissor);
 	fz_flatten_fill_path(dev->gel, path, ctm, flatness);
 	fz_sort_gel(dev->gel);
@@ -308,6 +320,9 @@ fz_draw_stroke_path(fz_device *devp, fz_path *path, fz_stroke_state *stroke, fz_
 	if (linewidth * expansion < 0.1f)
 		linewidth = 1 / expansion;
 
+	/* The stroker emits overlapping pieces of either winding, which
+	 * cancel out under area coverage; always supersample strokes. */
+	fz_set_gel_analytic(dev->gel, 0);
 	fz_reset_gel(dev->gel, state->scissor);
 	if (stroke->dash_len > 0)
 		fz_flatten_dash_path(dev->gel, path, stroke, ctm, flatness, linewidth);
@@ -358,6 +373,7 @@ fz_draw_clip_path(fz_device *devp, fz_path *path, fz_rect *rect, int even_odd, f
 	fz_colorspace *model;
 	fz_context *ctx = dev->ctx;
 
+	fz_set_gel_analytic(dev->gel, dev->flags & FZ_DRAWDEV_FLAGS_ANALYTIC);
 	fz_reset_gel(dev->gel, state->scissor);
 	fz_flatten_fill_path(dev->gel, path, ctm, flatness);
 	fz_sort_gel(dev->gel);
@@ -421,6 +437,9 @@ fz_draw_clip_stroke_path(fz_device *devp, fz_path *path, fz_rect *rect, fz_strok
 	if (linewidth * expansion < 0.1f)
 		linewidth = 1 / expansion;
 
+	/* The stroker emits overlapping pieces of either winding, which
+	 * cancel out under area coverage; always supersample strokes. */
+	fz_set_gel_analytic(dev->gel, 0);
 	fz_reset_gel(dev->gel, state->scissor);
 	if (stroke->dash_len > 0)
 		fz_flatten_dash_path(dev->gel, path, stroke, ctm, flatness, linewidth);
@@ -495,52 +514,102 @@ draw_glyph(unsigned char *colorbv, fz_pixmap *dst, fz_pixmap *msk,
 	}
 }
 
-static void
-fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
-	fz_colorspace *colorspace, float *color, float alpha)
+/* Reduce a glyph transform to its subpixel offset, and find the whole
+ * pixel (*x, *y) it goes at. Glyphs are rendered and cached at a few
+ * offsets only; big glyphs get fewer of them, as the difference does
+ * not show and it bounds the number of variants. Those are rounded to
+ * the nearest offset, so that a glyph with a single one does not snap
+ * up to a whole pixel left and up. */
+static fz_matrix
+fz_subpixel_trm(fz_matrix trm, int *x, int *y)
+{
+	float size = fz_matrix_expansion(trm);
+	float hsubpix = HSUBPIX;
+	float vsubpix = VSUBPIX;
+	float e = trm.e;
+	float f = trm.f;
+
+	if (size >= 24)
+	{
+		if (size >= 48)
+			hsubpix = vsubpix = 1;
+		else
+			hsubpix = vsubpix = 2;
+		e += 0.5f / hsubpix;
+		f += 0.5f / vsubpix;
+	}
+
+	*x = floorf(e);
+	*y = floorf(f);
+	trm.e = QUANT(e - *x, hsubpix);
+	trm.f = QUANT(f - *y, vsubpix);
+	return trm;
+}
+
+/* A glyph of a text run, resolved before any of the run is painted */
+typedef struct fz_text_glyph_s fz_text_glyph;
+
+struct fz_text_glyph_s
 {
-	fz_draw_device *dev = devp->user;
-	unsigned char colorbv[FZ_MAX_COLORS + 1];
-	unsigned char shapebv;
-	float colorfv[FZ_MAX_COLORS];
-	fz_matrix tm, trm, trunc_trm;
 	fz_pixmap *glyph;
-	int i, x, y, gid;
-	fz_draw_state *state = &dev->stack[dev->top];
-	fz_colorspace *model = state->dest->colorspace;
-	fz_bbox scissor = state->scissor;
+	fz_matrix trm;
+	int x, y;
+	int gid;
+};
 
-	if (state->blendmode & FZ_BLEND_KNOCKOUT)
-		state = fz_knockout_begin(dev);
+static int
+fz_text_glyphs_overlap(fz_text_glyph *a, fz_text_glyph *b)
+{
+	fz_pixmap *ga = a->glyph;
+	fz_pixmap *gb = b->glyph;
+	int ax = a->x + ga->x, ay = a->y + ga->y;
+	int bx = b->x + gb->x, by = b->y + gb->y;
 
-	fz_convert_color(dev->ctx, model, colorfv, colorspace, color);
-	for (i = 0; i < model->n; i++)
-		colorbv[i] = colorfv[i] * 255;
-	colorbv[i] = alpha * 255;
-	shapebv = 255;
+	return ax < bx + gb->w && bx < ax + ga->w && ay < by + gb->h && by < ay + ga->h;
+}
 
-	tm = text->trm;
+/* Sort a batch by the top scanline of each glyph, so that the batch
+ * walks down the destination once. A glyph only moves ahead of glyphs
+ * it does not touch, and glyphs drawn as outlines do not move at all,
+ * so the result is the same as painting in the order of the run. */
+static void
+fz_sort_text_glyphs(fz_text_glyph *glyphs, int n)
+{
+	fz_text_glyph t;
+	int j, k;
 
-	for (i = 0; i < text->len; i++)
+	for (k = 1; k < n; k++)
 	{
-		gid = text->items[i].gid;
-		if (gid < 0)
+		t = glyphs[k];
+		if (!t.glyph)
 			continue;
+		j = k;
+		while (j > 0 && glyphs[j-1].glyph &&
+			glyphs[j-1].y + glyphs[j-1].glyph->y > t.y + t.glyph->y &&
+			!fz_text_glyphs_overlap(&glyphs[j-1], &t))
+		{
+			glyphs[j] = glyphs[j-1];
+			j--;
+		}
+		glyphs[j] = t;
+	}
+}
 
-		tm.e = text->items[i].x;
-		tm.f = text->items[i].y;
-		trm = fz_concat(tm, ctm);
-		x = floorf(trm.e);
-		y = floorf(trm.f);
-
-		trunc_trm = trm;
-		trunc_trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-		trunc_trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
-
-		scissor.x0 -= x; scissor.x1 -= x;
-		scissor.y0 -= y; scissor.y1 -= y;
+static void
+fz_draw_text_glyphs(fz_device *devp, fz_draw_state *state, fz_text *text,
+	fz_text_glyph *glyphs, int n, unsigned char *colorbv,
+	fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_draw_device *dev = devp->user;
+	unsigned char shapebv = 255;
+	fz_pixmap *glyph;
+	int k, x, y;
 
-		glyph = fz_render_glyph(dev->ctx, text->font, gid, trunc_trm, model, scissor);
+	for (k = 0; k < n; k++)
+	{
+		glyph = glyphs[k].glyph;
+		x = glyphs[k].x;
+		y = glyphs[k].y;
 		if (glyph)
 		{
 			if (glyph->n == 1)
@@ -554,11 +623,10 @@ fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
 				fz_matrix ctm = {glyph->w, 0.0, 0.0, glyph->h, x + glyph->x, y + glyph->y};
 				fz_paint_image(state->dest, state->scissor, state->shape, glyph, ctm, alpha * 255);
 			}
-			fz_drop_pixmap(dev->ctx, glyph);
 		}
 		else
 		{
-			fz_path *path = fz_outline_glyph(dev->ctx, text->font, gid, trm);
+			fz_path *path = fz_outline_glyph(dev->ctx, text->font, glyphs[k].gid, glyphs[k].trm);
 			if (path)
 			{
 				fz_draw_fill_path(devp, path, 0, fz_identity, colorspace, color, alpha);
@@ -570,6 +638,87 @@ fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
 			}
 		}
 	}
+}
+
+static void
+fz_draw_fill_text(fz_device *devp, fz_text *text, fz_matrix ctm,
+	fz_colorspace *colorspace, float *color, float alpha)
+{
+	fz_draw_device *dev = devp->user;
+	fz_context *ctx = dev->ctx;
+	unsigned char colorbv[FZ_MAX_COLORS + 1];
+	float colorfv[FZ_MAX_COLORS];
+	fz_text_glyph glyphs[GLYPH_BATCH];
+	fz_matrix tm, trm, trunc_trm;
+	int i, k, n, x, y, gid;
+	fz_draw_state *state = &dev->stack[dev->top];
+	fz_colorspace *model = state->dest->colorspace;
+	fz_bbox scissor;
+
+	if (state->blendmode & FZ_BLEND_KNOCKOUT)
+		state = fz_knockout_begin(dev);
+
+	fz_convert_color(ctx, model, colorfv, colorspace, color);
+	for (i = 0; i < model->n; i++)
+		colorbv[i] = colorfv[i] * 255;
+	colorbv[i] = alpha * 255;
+
+	tm = text->trm;
+	i = 0;
+	n = 0;
+
+	fz_var(i);
+	fz_var(n);
+	fz_var(state);
+
+	fz_try(ctx)
+	{
+		while (i < text->len)
+		{
+			/* Look up (or render) the glyph masks for a batch of
+			 * the run first, so that painting them is a tight loop
+			 * of blits in scanline order. A glyph too big for the
+			 * glyph cache ends the batch, so at most one of those
+			 * is held at once. */
+			while (i < text->len && n < GLYPH_BATCH)
+			{
+				gid = text->items[i].gid;
+				tm.e = text->items[i].x;
+				tm.f = text->items[i].y;
+				i++;
+				if (gid < 0)
+					continue;
+
+				trm = fz_concat(tm, ctm);
+				trunc_trm = fz_subpixel_trm(trm, &x, &y);
+
+				scissor = fz_translate_bbox(state->scissor, -x, -y);
+
+				glyphs[n].glyph = fz_render_glyph(ctx, text->font, gid, trunc_trm, model, scissor);
+				glyphs[n].trm = trm;
+				glyphs[n].x = x;
+				glyphs[n].y = y;
+				glyphs[n].gid = gid;
+				n++;
+
+				if (fz_matrix_expansion(trm) > MAX_BATCHED_GLYPH_SIZE)
+					break;
+			}
+
+			fz_sort_text_glyphs(glyphs, n);
+			fz_draw_text_glyphs(devp, state, text, glyphs, n, colorbv, colorspace, color, alpha);
+
+			for (k = 0; k < n; k++)
+				fz_drop_pixmap(ctx, glyphs[k].glyph);
+			n = 0;
+		}
+	}
+	fz_catch(ctx)
+	{
+		for (k = 0; k < n; k++)
+			fz_drop_pixmap(ctx, glyphs[k].glyph);
+		fz_rethrow(ctx);
+	}
 
 	if (state->blendmode & FZ_BLEND_KNOCKOUT)
 		fz_knockout_end(dev);
@@ -608,12 +757,7 @@ fz_draw_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke, fz_
 		tm.e = text->items[i].x;
 		tm.f = text->items[i].y;
 		trm = fz_concat(tm, ctm);
-		x = floorf(trm.e);
-		y = floorf(trm.f);
-
-		trunc_trm = trm;
-		trunc_trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-		trunc_trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
+		trunc_trm = fz_subpixel_trm(trm, &x, &y);
 
 		scissor.x0 -= x; scissor.x1 -= x;
 		scissor.y0 -= y; scissor.y1 -= y;
@@ -721,12 +865,7 @@ fz_draw_clip_text(fz_device *devp, fz_text *text, fz_matrix ctm, int accumulate)
 				tm.e = text->items[i].x;
 				tm.f = text->items[i].y;
 				trm = fz_concat(tm, ctm);
-				x = floorf(trm.e);
-				y = floorf(trm.f);
-
-				trunc_trm = trm;
-				trunc_trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-				trunc_trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
+				trunc_trm = fz_subpixel_trm(trm, &x, &y);
 
 				glyph = fz_render_glyph(dev->ctx, text->font, gid, trunc_trm, model, bbox);
 				if (glyph)
@@ -829,12 +968,7 @@ fz_draw_clip_stroke_text(fz_device *devp, fz_text *text, fz_stroke_state *stroke
 				tm.e = text->items[i].x;
 				tm.f = text->items[i].y;
 				trm = fz_concat(tm, ctm);
-				x = floorf(trm.e);
-				y = floorf(trm.f);
-
-				trunc_trm = trm;
-				trunc_trm.e = QUANT(trm.e - floorf(trm.e), HSUBPIX);
-				trunc_trm.f = QUANT(trm.f - floorf(trm.f), VSUBPIX);
+				trunc_trm = fz_subpixel_trm(trm, &x, &y);
 
 				glyph = fz_render_stroked_glyph(dev->ctx, text->font, gid, trunc_trm, ctm, stroke, bbox);
 				if (glyph)
@@ -983,19 +1117,333 @@ fz_draw_fill_shade(fz_device *devp, fz_shade *shade, fz_matrix ctm, float alpha)
 		fz_knockout_end(dev);
 }
 
+/*
+	Scaled image cache. Every tile of a page that shows an image would
+	otherwise scale it again; instead we keep the results in the store,
+	keyed on the image, the pixmap we scale (which pins down the decode
+	subsampling and colour conversion, and for images decoded in parts
+	the part) and the scale. Images small
+	enough once scaled are done whole, so that one pass serves every
+	tile; bigger ones are done in blocks of a fixed device space grid.
+	The scaler weights each output pixel independently of the patch it
+	is asked for, so a tile painted from a larger patch comes out the
+	same. A part of an image only has the source pixels for the tile it
+	was fetched for, so it is scaled just for that tile.
+*/
+
+typedef struct fz_scaled_key_s fz_scaled_key;
+
+struct fz_scaled_key_s
+{
+	int refs;
+	fz_image *image;
+	fz_colorspace *colorspace;
+	int w, h; /* of the whole image, as decoded */
+	fz_bbox part; /* of it, that we have */
+	float sx, sy, sw, sh;
+	fz_bbox block;
+};
+
+typedef struct fz_scaled_image_s fz_scaled_image;
+
+struct fz_scaled_image_s
+{
+	fz_storable storable;
+	fz_scaled_key *key;
+	fz_pixmap *pixmap;
+};
+
+static int
+fz_make_hash_scaled_key(fz_store_hash *hash, void *key_)
+{
+	fz_scaled_key *key = (fz_scaled_key *)key_;
+
+	hash->u.pi.ptr = key->image;
+	hash->u.pi.i = (int)(key->sw * 64) * 31 + (int)(key->sh * 64) + key->block.x0 * 7 + key->block.y0 * 13 +
+		key->part.x0 * 3 + key->part.y0 * 5 + key->w * 11 +
+		key->part.x1 * 17 + key->part.y1 * 19 + key->h * 23 +
+		(int)(key->sx * 64) * 29 + (int)(key->sy * 64) * 37;
+	return 1;
+}
+
+static void *
+fz_keep_scaled_key(fz_context *ctx, void *key_)
+{
+	fz_scaled_key *key = (fz_scaled_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+fz_drop_scaled_key(fz_context *ctx, void *key_)
+{
+	fz_scaled_key *key = (fz_scaled_key *)key_;
+	int drop;
+
+	if (key == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+	{
+		fz_drop_image(ctx, key->image);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_scaled_key(void *k0_, void *k1_)
+{
+	fz_scaled_key *k0 = (fz_scaled_key *)k0_;
+	fz_scaled_key *k1 = (fz_scaled_key *)k1_;
+
+	return k0->image != k1->image || k0->colorspace != k1->colorspace ||
+		k0->w != k1->w || k0->h != k1->h ||
+		k0->part.x0 != k1->part.x0 || k0->part.y0 != k1->part.y0 ||
+		k0->part.x1 != k1->part.x1 || k0->part.y1 != k1->part.y1 ||
+		k0->sx != k1->sx || k0->sy != k1->sy ||
+		k0->sw != k1->sw || k0->sh != k1->sh ||
+		k0->block.x0 != k1->block.x0 || k0->block.y0 != k1->block.y0 ||
+		k0->block.x1 != k1->block.x1 || k0->block.y1 != k1->block.y1;
+}
+
+#ifndef NDEBUG
+static void
+fz_debug_scaled_key(void *key_)
+{
+	fz_scaled_key *key = (fz_scaled_key *)key_;
+
+	printf("(scaled image %d x %d to %g x %g) ", key->w, key->h, key->sw, key->sh);
+}
+#endif
+
+static fz_store_type fz_scaled_image_store_type =
+{
+	fz_make_hash_scaled_key,
+	fz_keep_scaled_key,
+	fz_drop_scaled_key,
+	fz_cmp_scaled_key,
+#ifndef NDEBUG
+	fz_debug_scaled_key
+#endif
+};
+
+static void
+fz_free_scaled_image_imp(fz_context *ctx, fz_storable *si_)
+{
+	fz_scaled_image *si = (fz_scaled_image *)si_;
+
+	fz_drop_scaled_key(ctx, si->key);
+	fz_drop_pixmap(ctx, si->pixmap);
+	fz_free(ctx, si);
+}
+
+static int
+grid_floor(int v)
+{
+	if (v < 0)
+		return -((-v + SCALED_IMAGE_GRID - 1) / SCALED_IMAGE_GRID) * SCALED_IMAGE_GRID;
+	return v / SCALED_IMAGE_GRID * SCALED_IMAGE_GRID;
+}
+
+/* The part of an fw x fh image that pixmap holds */
+static fz_bbox
+fz_image_part(fz_pixmap *pixmap, int fw, int fh)
+{
+	fz_bbox part;
+
+	if (pixmap->w == fw && pixmap->h == fh)
+	{
+		part.x0 = 0;
+		part.y0 = 0;
+	}
+	else
+	{
+		part.x0 = pixmap->x;
+		part.y0 = pixmap->y;
+	}
+	part.x1 = part.x0 + pixmap->w;
+	part.y1 = part.y0 + pixmap->h;
+	return part;
+}
+
+/* Scale pixmap, which holds the part of an fw x fh image that
+ * fz_image_part says; clip must be given for a part */
 static fz_pixmap *
-fz_transform_pixmap(fz_draw_device *dev, fz_pixmap *image, fz_matrix *ctm, int x, int y, int dx, int dy, int gridfit, fz_bbox *clip)
+fz_scale_image_part(fz_draw_device *dev, fz_pixmap *pixmap, int fw, int fh, float x, float y, float w, float h, fz_bbox *clip)
+{
+	if (pixmap->w != fw || pixmap->h != fh)
+		return fz_scale_pixmap_part(dev->ctx, pixmap, fw, fh, x, y, w, h, clip, dev->cache_x, dev->cache_y);
+	return fz_scale_pixmap_cached(dev->ctx, pixmap, x, y, w, h, clip, dev->cache_x, dev->cache_y);
+}
+
+static fz_pixmap *
+fz_scale_image_pixmap(fz_draw_device *dev, fz_image *image, fz_pixmap *pixmap, int fw, int fh, float x, float y, float w, float h, fz_bbox *clip)
 {
-	fz_pixmap *scaled;
 	fz_context *ctx = dev->ctx;
+	fz_scaled_key *key;
+	fz_scaled_image *si;
+	fz_pixmap *scaled = NULL;
+	fz_bbox *patch = NULL;
+
+	key = fz_malloc_no_throw(ctx, sizeof *key);
+	if (!key)
+		return fz_scale_image_part(dev, pixmap, fw, fh, x, y, w, h, clip);
+	key->refs = 1;
+	key->image = fz_keep_image(ctx, image);
+	key->colorspace = pixmap->colorspace;
+	key->w = fw;
+	key->h = fh;
+	key->part = fz_image_part(pixmap, fw, fh);
+	key->sx = x;
+	key->sy = y;
+	key->sw = w;
+	key->sh = h;
+	key->block = fz_infinite_bbox;
+	if (clip && (pixmap->w != fw || pixmap->h != fh))
+	{
+		key->block = *clip;
+		patch = &key->block;
+	}
+	else if (clip && fabsf(w * h) > SCALED_IMAGE_WHOLE)
+	{
+		key->block.x0 = grid_floor(clip->x0);
+		key->block.y0 = grid_floor(clip->y0);
+		key->block.x1 = grid_floor(clip->x1 - 1) + SCALED_IMAGE_GRID;
+		key->block.y1 = grid_floor(clip->y1 - 1) + SCALED_IMAGE_GRID;
+		patch = &key->block;
+	}
+
+	si = fz_find_item(ctx, fz_free_scaled_image_imp, key, &fz_scaled_image_store_type);
+	if (si)
+	{
+		scaled = fz_keep_pixmap(ctx, si->pixmap);
+		fz_drop_storable(ctx, &si->storable);
+		fz_drop_scaled_key(ctx, key);
+		return scaled;
+	}
+
+	fz_var(scaled);
+	fz_var(patch);
+
+	fz_try(ctx)
+	{
+		scaled = fz_scale_image_part(dev, pixmap, fw, fh, x, y, w, h, patch);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_scaled_key(ctx, key);
+		fz_rethrow(ctx);
+	}
+
+	if (scaled)
+	{
+		si = fz_malloc_no_throw(ctx, sizeof *si);
+		if (si)
+		{
+			fz_scaled_image *existing;
+
+			FZ_INIT_STORABLE(si, 1, fz_free_scaled_image_imp);
+			si->key = fz_keep_scaled_key(ctx, key);
+			si->pixmap = fz_keep_pixmap(ctx, scaled);
+			existing = fz_store_item(ctx, key, si, sizeof(*si) + fz_pixmap_size(ctx, scaled), &fz_scaled_image_store_type);
+			if (existing)
+				fz_drop_storable(ctx, &existing->storable);
+			fz_drop_storable(ctx, &si->storable);
+		}
+	}
+	fz_drop_scaled_key(ctx, key);
+	return scaled;
+}
+
+/*
+	Images with more components than the device (cmyk onto rgb) are
+	converted whole before they are scaled, which would otherwise be
+	redone for every tile. The result goes in the store under the same
+	kind of key as a scaled image, with an empty block and no scale.
+*/
+static fz_pixmap *
+fz_convert_image_pixmap(fz_draw_device *dev, fz_image *image, fz_pixmap *pixmap, int fw, int fh, fz_colorspace *model)
+{
+	fz_context *ctx = dev->ctx;
+	fz_scaled_key *key;
+	fz_scaled_image *si;
+	fz_pixmap *converted = NULL;
+
+	key = fz_malloc_no_throw(ctx, sizeof *key);
+	if (key)
+	{
+		key->refs = 1;
+		key->image = fz_keep_image(ctx, image);
+		key->colorspace = model;
+		key->w = fw;
+		key->h = fh;
+		key->part = fz_image_part(pixmap, fw, fh);
+		key->sx = 0;
+		key->sy = 0;
+		key->sw = 0;
+		key->sh = 0;
+		key->block = fz_empty_bbox;
+
+		si = fz_find_item(ctx, fz_free_scaled_image_imp, key, &fz_scaled_image_store_type);
+		if (si)
+		{
+			converted = fz_keep_pixmap(ctx, si->pixmap);
+			fz_drop_storable(ctx, &si->storable);
+			fz_drop_scaled_key(ctx, key);
+			return converted;
+		}
+	}
+
+	fz_var(converted);
+
+	fz_try(ctx)
+	{
+		converted = fz_new_pixmap_with_bbox(ctx, model, fz_pixmap_bbox(ctx, pixmap));
+		fz_convert_pixmap(ctx, converted, pixmap);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, converted);
+		fz_drop_scaled_key(ctx, key);
+		fz_rethrow(ctx);
+	}
+
+	if (key)
+	{
+		si = fz_malloc_no_throw(ctx, sizeof *si);
+		if (si)
+		{
+			fz_scaled_image *existing;
+
+			FZ_INIT_STORABLE(si, 1, fz_free_scaled_image_imp);
+			si->key = fz_keep_scaled_key(ctx, key);
+			si->pixmap = fz_keep_pixmap(ctx, converted);
+			existing = fz_store_item(ctx, key, si, sizeof(*si) + fz_pixmap_size(ctx, converted), &fz_scaled_image_store_type);
+			if (existing)
+				fz_drop_storable(ctx, &existing->storable);
+			fz_drop_storable(ctx, &si->storable);
+		}
+		fz_drop_scaled_key(ctx, key);
+	}
+	return converted;
+}
+
+static fz_pixmap *
+fz_transform_pixmap(fz_draw_device *dev, fz_image *image, fz_pixmap *pixmap, int fw, int fh, fz_matrix *ctm, int x, int y, int dx, int dy, fz_bbox *clip)
+{
+	fz_pixmap *scaled;
 
 	if (ctm->a != 0 && ctm->b == 0 && ctm->c == 0 && ctm->d != 0)
 	{
 		/* Unrotated or X-flip or Y-flip or XY-flip */
 		fz_matrix m = *ctm;
-		if (gridfit)
-			fz_gridfit_matrix(&m);
-		scaled = fz_scale_pixmap_cached(ctx, image, m.e, m.f, m.a, m.d, clip, dev->cache_x, dev->cache_y);
+		scaled = fz_scale_image_pixmap(dev, image, pixmap, fw, fh, m.e, m.f, m.a, m.d, clip);
 		if (!scaled)
 			return NULL;
 		ctm->a = scaled->w;
@@ -1010,8 +1458,6 @@ fz_transform_pixmap(fz_draw_device *dev, fz_pixmap *image, fz_matrix *ctm, int x
 		/* Other orthogonal flip/rotation cases */
 		fz_matrix m = *ctm;
 		fz_bbox rclip;
-		if (gridfit)
-			fz_gridfit_matrix(&m);
 		if (clip)
 		{
 			rclip.x0 = clip->y0;
@@ -1019,7 +1465,7 @@ fz_transform_pixmap(fz_draw_device *dev, fz_pixmap *image, fz_matrix *ctm, int x
 			rclip.x1 = clip->y1;
 			rclip.y1 = clip->x1;
 		}
-		scaled = fz_scale_pixmap_cached(ctx, image, m.f, m.e, m.b, m.c, (clip ? &rclip : 0), dev->cache_x, dev->cache_y);
+		scaled = fz_scale_image_pixmap(dev, image, pixmap, fw, fh, m.f, m.e, m.b, m.c, (clip ? &rclip : 0));
 		if (!scaled)
 			return NULL;
 		ctm->b = scaled->w;
@@ -1032,13 +1478,94 @@ fz_transform_pixmap(fz_draw_device *dev, fz_pixmap *image, fz_matrix *ctm, int x
 	/* Downscale, non rectilinear case */
 	if (dx > 0 && dy > 0)
 	{
-		scaled = fz_scale_pixmap_cached(ctx, image, 0, 0, (float)dx, (float)dy, NULL, dev->cache_x, dev->cache_y);
+		scaled = fz_scale_image_pixmap(dev, image, pixmap, fw, fh, 0, 0, (float)dx, (float)dy, NULL);
 		return scaled;
 	}
 
 	return NULL;
 }
 
+/*
+	Fetch the pixmap to draw an image with, and settle how to draw it:
+	whether it is to be scaled down first (scale), and the matrix to
+	paint it with, snapped to whole device pixels if it is to be
+	painted as it is or the caller asked for gridfitting.
+
+	Images that can be decoded in parts (huge scans) are only asked
+	for as much as shows through clip. The pixmap may then hold just
+	the part at pixmap->x, pixmap->y of the fw x fh pixels of the whole
+	image; it is scaled and painted as the whole image would be, so
+	each tile of a page comes out exactly as it would from the whole.
+	That does not hold for a scale that is not rectilinear, which
+	needs the whole image scaled first, so those get it whole.
+*/
+static fz_pixmap *
+fz_draw_image_pixmap(fz_draw_device *dev, fz_image *image, fz_matrix *ctm, fz_bbox clip, int gridfit, int *dx, int *dy, int *scale, int *fw, int *fh)
+{
+	fz_context *ctx = dev->ctx;
+	fz_pixmap *pixmap;
+	fz_rect r;
+
+	*dx = sqrtf(ctm->a * ctm->a + ctm->b * ctm->b);
+	*dy = sqrtf(ctm->c * ctm->c + ctm->d * ctm->d);
+
+	if (image->get_pixmap_area && !fz_is_empty_bbox(clip) && ctm->a * ctm->d - ctm->b * ctm->c != 0)
+	{
+		/* Leave a little over for the scaler's filter, and for
+		 * gridfitting moving the image by up to a pixel */
+		r.x0 = clip.x0 - 3;
+		r.y0 = clip.y0 - 3;
+		r.x1 = clip.x1 + 3;
+		r.y1 = clip.y1 + 3;
+		r = fz_transform_rect(fz_invert_matrix(*ctm), r);
+		r = fz_intersect_rect(r, fz_unit_rect);
+		pixmap = fz_image_to_pixmap_area(ctx, image, *dx, *dy, r, fw, fh);
+		if ((pixmap->w != *fw || pixmap->h != *fh) &&
+			*dx < *fw && *dy < *fh && !fz_is_rectilinear(*ctm))
+		{
+			fz_drop_pixmap(ctx, pixmap);
+			pixmap = fz_image_to_pixmap(ctx, image, *dx, *dy);
+			*fw = pixmap->w;
+			*fh = pixmap->h;
+		}
+	}
+	else
+	{
+		pixmap = fz_image_to_pixmap(ctx, image, *dx, *dy);
+		*fw = pixmap->w;
+		*fh = pixmap->h;
+	}
+
+	*scale = *dx < *fw && *dy < *fh;
+	if (!*scale || gridfit)
+		fz_gridfit_matrix(ctm);
+
+	return pixmap;
+}
+
+/*
+	Bilevel images drawn at their full size or larger (so that they
+	would not be scaled) are painted from their 1 bpp bitmap, snapped to
+	whole device pixels as fz_draw_image_pixmap would have done.
+*/
+static fz_bitmap *
+fz_draw_image_bitmap(fz_draw_device *dev, fz_image *image, fz_matrix *ctm)
+{
+	fz_bitmap *bitmap;
+	int dx, dy;
+
+	if (!image->get_bitmap)
+		return NULL;
+	dx = sqrtf(ctm->a * ctm->a + ctm->b * ctm->b);
+	dy = sqrtf(ctm->c * ctm->c + ctm->d * ctm->d);
+	if (dx < image->w && dy < image->h)
+		return NULL;
+	bitmap = fz_image_to_bitmap(dev->ctx, image);
+	if (bitmap)
+		fz_gridfit_matrix(ctm);
+	return bitmap;
+}
+
 static void
 fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 {
@@ -1048,7 +1575,7 @@ fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 	fz_pixmap *pixmap;
 	fz_pixmap *orig_pixmap;
 	int after;
-	int dx, dy;
+	int dx, dy, scale, fw, fh;
 	fz_context *ctx = dev->ctx;
 	fz_draw_state *state = &dev->stack[dev->top];
 	fz_colorspace *model = state->dest->colorspace;
@@ -1067,10 +1594,7 @@ fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 	if (image->w == 0 || image->h == 0)
 		return;
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-
-	pixmap = fz_image_to_pixmap(ctx, image, dx, dy);
+	pixmap = fz_draw_image_pixmap(dev, image, &ctm, clip, alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3), &dx, &dy, &scale, &fw, &fh);
 	orig_pixmap = pixmap;
 
 	/* convert images with more components (cmyk->rgb) before scaling */
@@ -1088,25 +1612,28 @@ fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 
 		if (pixmap->colorspace != model && !after)
 		{
-			converted = fz_new_pixmap_with_bbox(ctx, model, fz_pixmap_bbox(ctx, pixmap));
-			fz_convert_pixmap(ctx, converted, pixmap);
+			converted = fz_convert_image_pixmap(dev, image, pixmap, fw, fh, model);
 			pixmap = converted;
 		}
 
-		if (dx < pixmap->w && dy < pixmap->h)
+		if (scale)
 		{
-			int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-			scaled = fz_transform_pixmap(dev, pixmap, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
-			if (!scaled)
+			scaled = fz_transform_pixmap(dev, image, pixmap, fw, fh, &ctm, state->dest->x, state->dest->y, dx, dy, &clip);
+			if (!scaled && pixmap->w == fw && pixmap->h == fh)
 			{
 				if (dx < 1)
 					dx = 1;
 				if (dy < 1)
 					dy = 1;
-				scaled = fz_scale_pixmap_cached(ctx, pixmap, pixmap->x, pixmap->y, dx, dy, NULL, dev->cache_x, dev->cache_y);
+				scaled = fz_scale_image_pixmap(dev, image, pixmap, fw, fh, pixmap->x, pixmap->y, dx, dy, NULL);
 			}
 			if (scaled)
+			{
+				/* The scaled pixmap is painted whole */
 				pixmap = scaled;
+				fw = pixmap->w;
+				fh = pixmap->h;
+			}
 		}
 
 		if (pixmap->colorspace != model)
@@ -1124,7 +1651,10 @@ fz_draw_fill_image(fz_device *devp, fz_image *image, fz_matrix ctm, float alpha)
 			}
 		}
 
-		fz_paint_image(state->dest, state->scissor, state->shape, pixmap, ctm, alpha * 255);
+		if (pixmap->w != fw || pixmap->h != fh)
+			fz_paint_image_part(state->dest, state->scissor, state->shape, pixmap, fw, fh, ctm, alpha * 255);
+		else
+			fz_paint_image(state->dest, state->scissor, state->shape, pixmap, ctm, alpha * 255);
 
 		if (state->blendmode & FZ_BLEND_KNOCKOUT)
 			fz_knockout_end(dev);
@@ -1149,9 +1679,10 @@ fz_draw_fill_image_mask(fz_device *devp, fz_image *image, fz_matrix ctm,
 	unsigned char colorbv[FZ_MAX_COLORS + 1];
 	float colorfv[FZ_MAX_COLORS];
 	fz_pixmap *scaled = NULL;
-	fz_pixmap *pixmap;
+	fz_pixmap *pixmap = NULL;
 	fz_pixmap *orig_pixmap;
-	int dx, dy;
+	fz_bitmap *bitmap;
+	int dx, dy, scale = 0, fw = 0, fh = 0;
 	int i;
 	fz_context *ctx = dev->ctx;
 	fz_draw_state *state = &dev->stack[dev->top];
@@ -1160,12 +1691,14 @@ fz_draw_fill_image_mask(fz_device *devp, fz_image *image, fz_matrix ctm,
 
 	clip = fz_intersect_bbox(clip, state->scissor);
 
+	fz_var(pixmap);
+
 	if (image->w == 0 || image->h == 0)
 		return;
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-	pixmap = fz_image_to_pixmap(ctx, image, dx, dy);
+	bitmap = fz_draw_image_bitmap(dev, image, &ctm);
+	if (!bitmap)
+		pixmap = fz_draw_image_pixmap(dev, image, &ctm, clip, alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3), &dx, &dy, &scale, &fw, &fh);
 	orig_pixmap = pixmap;
 
 	fz_try(ctx)
@@ -1173,20 +1706,24 @@ fz_draw_fill_image_mask(fz_device *devp, fz_image *image, fz_matrix ctm,
 		if (state->blendmode & FZ_BLEND_KNOCKOUT)
 			state = fz_knockout_begin(dev);
 
-		if (dx < pixmap->w && dy < pixmap->h)
+		if (scale)
 		{
-			int gridfit = alpha == 1.0f && !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-			scaled = fz_transform_pixmap(dev, pixmap, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
-			if (!scaled)
+			scaled = fz_transform_pixmap(dev, image, pixmap, fw, fh, &ctm, state->dest->x, state->dest->y, dx, dy, &clip);
+			if (!scaled && pixmap->w == fw && pixmap->h == fh)
 			{
 				if (dx < 1)
 					dx = 1;
 				if (dy < 1)
 					dy = 1;
-				scaled = fz_scale_pixmap_cached(dev->ctx, pixmap, pixmap->x, pixmap->y, dx, dy, NULL, dev->cache_x, dev->cache_y);
+				scaled = fz_scale_image_pixmap(dev, image, pixmap, fw, fh, pixmap->x, pixmap->y, dx, dy, NULL);
 			}
 			if (scaled)
+			{
+				/* The scaled pixmap is painted whole */
 				pixmap = scaled;
+				fw = pixmap->w;
+				fh = pixmap->h;
+			}
 		}
 
 		fz_convert_color(dev->ctx, model, colorfv, colorspace, color);
@@ -1194,7 +1731,12 @@ fz_draw_fill_image_mask(fz_device *devp, fz_image *image, fz_matrix ctm,
 			colorbv[i] = colorfv[i] * 255;
 		colorbv[i] = alpha * 255;
 
-		fz_paint_image_with_color(state->dest, state->scissor, state->shape, pixmap, ctm, colorbv);
+		if (bitmap)
+			fz_paint_bitmap_with_color(state->dest, state->scissor, state->shape, bitmap, ctm, colorbv);
+		else if (pixmap->w != fw || pixmap->h != fh)
+			fz_paint_image_part_with_color(state->dest, state->scissor, state->shape, pixmap, fw, fh, ctm, colorbv);
+		else
+			fz_paint_image_with_color(state->dest, state->scissor, state->shape, pixmap, ctm, colorbv);
 
 		if (scaled)
 			fz_drop_pixmap(dev->ctx, scaled);
@@ -1205,6 +1747,7 @@ fz_draw_fill_image_mask(fz_device *devp, fz_image *image, fz_matrix ctm,
 	fz_always(ctx)
 	{
 		fz_drop_pixmap(dev->ctx, orig_pixmap);
+		fz_drop_bitmap(dev->ctx, bitmap);
 	}
 	fz_catch(ctx)
 	{
@@ -1224,7 +1767,8 @@ fz_draw_clip_image_mask(fz_device *devp, fz_image *image, fz_rect *rect, fz_matr
 	fz_pixmap *scaled = NULL;
 	fz_pixmap *pixmap = NULL;
 	fz_pixmap *orig_pixmap = NULL;
-	int dx, dy;
+	fz_bitmap *bitmap = NULL;
+	int dx, dy, scale = 0, fw = 0, fh = 0;
 	fz_draw_state *state = push_stack(dev);
 	fz_colorspace *model = state->dest->colorspace;
 	fz_bbox clip = fz_pixmap_bbox(ctx, state->dest);
@@ -1236,6 +1780,7 @@ fz_draw_clip_image_mask(fz_device *devp, fz_image *image, fz_rect *rect, fz_matr
 	fz_var(shape);
 	fz_var(pixmap);
 	fz_var(orig_pixmap);
+	fz_var(bitmap);
 
 	if (image->w == 0 || image->h == 0)
 	{
@@ -1256,12 +1801,11 @@ fz_draw_clip_image_mask(fz_device *devp, fz_image *image, fz_rect *rect, fz_matr
 	if (rect)
 		bbox = fz_intersect_bbox(bbox, fz_bbox_covering_rect(*rect));
 
-	dx = sqrtf(ctm.a * ctm.a + ctm.b * ctm.b);
-	dy = sqrtf(ctm.c * ctm.c + ctm.d * ctm.d);
-
 	fz_try(ctx)
 	{
-		pixmap = fz_image_to_pixmap(ctx, image, dx, dy);
+		bitmap = fz_draw_image_bitmap(dev, image, &ctm);
+		if (!bitmap)
+			pixmap = fz_draw_image_pixmap(dev, image, &ctm, clip, !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3), &dx, &dy, &scale, &fw, &fh);
 		orig_pixmap = pixmap;
 
 		state[1].mask = mask = fz_new_pixmap_with_bbox(dev->ctx, NULL, bbox);
@@ -1278,27 +1822,37 @@ fz_draw_clip_image_mask(fz_device *devp, fz_image *image, fz_rect *rect, fz_matr
 		state[1].blendmode |= FZ_BLEND_ISOLATED;
 		state[1].scissor = bbox;
 
-		if (dx < pixmap->w && dy < pixmap->h)
+		if (scale)
 		{
-			int gridfit = !(dev->flags & FZ_DRAWDEV_FLAGS_TYPE3);
-			scaled = fz_transform_pixmap(dev, pixmap, &ctm, state->dest->x, state->dest->y, dx, dy, gridfit, &clip);
-			if (!scaled)
+			scaled = fz_transform_pixmap(dev, image, pixmap, fw, fh, &ctm, state->dest->x, state->dest->y, dx, dy, &clip);
+			if (!scaled && pixmap->w == fw && pixmap->h == fh)
 			{
 				if (dx < 1)
 					dx = 1;
 				if (dy < 1)
 					dy = 1;
-				scaled = fz_scale_pixmap_cached(dev->ctx, pixmap, pixmap->x, pixmap->y, dx, dy, NULL, dev->cache_x, dev->cache_y);
+				scaled = fz_scale_image_pixmap(dev, image, pixmap, fw, fh, pixmap->x, pixmap->y, dx, dy, NULL);
 			}
 			if (scaled)
+			{
+				/* The scaled pixmap is painted whole */
 				pixmap = scaled;
+				fw = pixmap->w;
+				fh = pixmap->h;
+			}
 		}
-		fz_paint_image(mask, bbox, state->shape, pixmap, ctm, 255);
+		if (bitmap)
+			fz_paint_bitmap(mask, bbox, state->shape, bitmap, ctm);
+		else if (pixmap->w != fw || pixmap->h != fh)
+			fz_paint_image_part(mask, bbox, state->shape, pixmap, fw, fh, ctm, 255);
+		else
+			fz_paint_image(mask, bbox, state->shape, pixmap, ctm, 255);
 	}
 	fz_always(ctx)
 	{
 		fz_drop_pixmap(ctx, scaled);
 		fz_drop_pixmap(ctx, orig_pixmap);
+		fz_drop_bitmap(ctx, bitmap);
 	}
 	fz_catch(ctx)
 	{
@@ -1777,6 +2331,8 @@ fz_new_draw_device(fz_context *ctx, fz_pixmap *dest)
 	{
 		ddev->gel = fz_new_gel(ctx);
 		ddev->flags = 0;
+		if (fz_aa_analytic(ctx))
+			ddev->flags |= FZ_DRAWDEV_FLAGS_ANALYTIC;
 		ddev->ctx = ctx;
 		ddev->top = 0;
 		ddev->cache_x = fz_new_scale_cache(ctx);
@@ -1850,6 +2406,17 @@ fz_new_draw_device_with_bbox(fz_context *ctx, fz_pixmap *dest, fz_bbox clip)
 	return dev;
 }
 
+void
+fz_set_draw_device_analytic(fz_device *dev, int analytic)
+{
+	fz_draw_device *ddev = dev->user;
+
+	if (analytic)
+		ddev->flags |= FZ_DRAWDEV_FLAGS_ANALYTIC;
+	else
+		ddev->flags &= ~FZ_DRAWDEV_FLAGS_ANALYTIC;
+}
+
 fz_device *
 fz_new_draw_device_type3(fz_context *ctx, fz_pixmap *dest)
 {
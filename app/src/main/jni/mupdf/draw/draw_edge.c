@@ -21,6 +21,7 @@ struct fz_aa_context_s
 	int vscale;
 	int scale;
 	int bits;
+	int analytic;
 };
 
 void fz_new_aa_context(fz_context *ctx)
@@ -31,6 +32,7 @@ void fz_new_aa_context(fz_context *ctx)
 	ctx->aa->vscale = 15;
 	ctx->aa->scale = 256;
 	ctx->aa->bits = 8;
+	ctx->aa->analytic = 0;
 
 #define fz_aa_hscale ((ctxaa)->hscale)
 #define fz_aa_vscale ((ctxaa)->vscale)
@@ -138,14 +140,41 @@ fz_set_aa_level(fz_context *ctx, int level)
 #endif
 }
 
+int
+fz_aa_analytic(fz_context *ctx)
+{
+#ifdef AA_BITS
+	return 0;
+#else
+	return ctx->aa->analytic;
+#endif
+}
+
+void
+fz_set_aa_analytic(fz_context *ctx, int analytic)
+{
+#ifdef AA_BITS
+	if (analytic)
+		fz_warn(ctx, "anti-aliasing was compiled with a fixed precision of %d bits", fz_aa_bits);
+#else
+	ctx->aa->analytic = !!analytic;
+#endif
+}
+
 /*
  * Global Edge List -- list of straight path segments for scan conversion
  *
  * Stepping along the edges is with Bresenham's line algorithm.
  *
  * See Mike Abrash -- Graphics Programming Black Book (notably chapter 40)
+ *
+ * When the gel is analytic, edges are held on a 256x256 sub pixel grid
+ * and scan converted by accumulating exact cell coverage instead.
  */
 
+#define AN_BITS 8
+#define AN_ONE (1<<AN_BITS)
+
 typedef struct fz_edge_s fz_edge;
 
 struct fz_edge_s
@@ -154,6 +183,7 @@ struct fz_edge_s
 	int adj_up, adj_down;
 	int xmove;
 	int xdir, ydir; /* -1 or +1 */
+	int x1; /* end point, for the analytic scan converter */
 };
 
 struct fz_gel_s
@@ -164,9 +194,28 @@ struct fz_gel_s
 	fz_edge *edges;
 	int acap, alen;
 	fz_edge **active;
+	int analytic;
+	int hscale, vscale;
 	fz_context *ctx;
 };
 
+static void
+fz_set_gel_scale(fz_gel *gel)
+{
+	fz_aa_context *ctxaa = gel->ctx->aa;
+
+	if (gel->analytic && fz_aa_bits > 0)
+	{
+		gel->hscale = AN_ONE;
+		gel->vscale = AN_ONE;
+	}
+	else
+	{
+		gel->hscale = fz_aa_hscale;
+		gel->vscale = fz_aa_vscale;
+	}
+}
+
 fz_gel *
 fz_new_gel(fz_context *ctx)
 {
@@ -190,6 +239,9 @@ fz_new_gel(fz_context *ctx)
 		gel->acap = 64;
 		gel->alen = 0;
 		gel->active = fz_malloc_array(ctx, gel->acap, sizeof(fz_edge*));
+
+		gel->analytic = 0;
+		fz_set_gel_scale(gel);
 	}
 	fz_catch(ctx)
 	{
@@ -202,10 +254,16 @@ fz_new_gel(fz_context *ctx)
 	return gel;
 }
 
+void
+fz_set_gel_analytic(fz_gel *gel, int analytic)
+{
+	gel->analytic = !!analytic;
+}
+
 void
 fz_reset_gel(fz_gel *gel, fz_bbox clip)
 {
-	fz_aa_context *ctxaa = gel->ctx->aa;
+	fz_set_gel_scale(gel);
 
 	if (fz_is_infinite_rect(clip))
 	{
@@ -213,10 +271,10 @@ fz_reset_gel(fz_gel *gel, fz_bbox clip)
 		gel->clip.x1 = gel->clip.y1 = BBOX_MIN;
 	}
 	else {
-		gel->clip.x0 = clip.x0 * fz_aa_hscale;
-		gel->clip.x1 = clip.x1 * fz_aa_hscale;
-		gel->clip.y0 = clip.y0 * fz_aa_vscale;
-		gel->clip.y1 = clip.y1 * fz_aa_vscale;
+		gel->clip.x0 = clip.x0 * gel->hscale;
+		gel->clip.x1 = clip.x1 * gel->hscale;
+		gel->clip.y0 = clip.y0 * gel->vscale;
+		gel->clip.y1 = clip.y1 * gel->vscale;
 	}
 
 	gel->bbox.x0 = gel->bbox.y0 = BBOX_MAX;
@@ -239,13 +297,12 @@ fz_bbox
 fz_bound_gel(fz_gel *gel)
 {
 	fz_bbox bbox;
-	fz_aa_context *ctxaa = gel->ctx->aa;
 	if (gel->len == 0)
 		return fz_empty_bbox;
-	bbox.x0 = fz_idiv(gel->bbox.x0, fz_aa_hscale);
-	bbox.y0 = fz_idiv(gel->bbox.y0, fz_aa_vscale);
-	bbox.x1 = fz_idiv(gel->bbox.x1, fz_aa_hscale) + 1;
-	bbox.y1 = fz_idiv(gel->bbox.y1, fz_aa_vscale) + 1;
+	bbox.x0 = fz_idiv(gel->bbox.x0, gel->hscale);
+	bbox.y0 = fz_idiv(gel->bbox.y0, gel->vscale);
+	bbox.x1 = fz_idiv(gel->bbox.x1, gel->hscale) + 1;
+	bbox.y1 = fz_idiv(gel->bbox.y1, gel->vscale) + 1;
 	return bbox;
 }
 
@@ -321,6 +378,7 @@ fz_insert_gel_raw(fz_gel *gel, int x0, int y0, int x1, int y1)
 	edge->xdir = dx > 0 ? 1 : -1;
 	edge->ydir = winding;
 	edge->x = x0;
+	edge->x1 = x1;
 	edge->y = y0;
 	edge->h = dy;
 	edge->adj_down = dy;
@@ -349,21 +407,22 @@ fz_insert_gel(fz_gel *gel, float fx0, float fy0, float fx1, float fy1)
 {
 	int x0, y0, x1, y1;
 	int d, v;
-	fz_aa_context *ctxaa = gel->ctx->aa;
+	int hscale = gel->hscale;
+	int vscale = gel->vscale;
 
-	fx0 = floorf(fx0 * fz_aa_hscale);
-	fx1 = floorf(fx1 * fz_aa_hscale);
-	fy0 = floorf(fy0 * fz_aa_vscale);
-	fy1 = floorf(fy1 * fz_aa_vscale);
+	fx0 = floorf(fx0 * hscale);
+	fx1 = floorf(fx1 * hscale);
+	fy0 = floorf(fy0 * vscale);
+	fy1 = floorf(fy1 * vscale);
 
 	/* Call fz_clamp so that clamping is done in the float domain, THEN
 	 * cast down to an int. Calling fz_clampi causes problems due to the
 	 * implicit cast down from float to int of the first argument
 	 * over/underflowing and flipping sign at extreme values. */
-	x0 = (int)fz_clamp(fx0, BBOX_MIN * fz_aa_hscale, BBOX_MAX * fz_aa_hscale);
-	y0 = (int)fz_clamp(fy0, BBOX_MIN * fz_aa_vscale, BBOX_MAX * fz_aa_vscale);
-	x1 = (int)fz_clamp(fx1, BBOX_MIN * fz_aa_hscale, BBOX_MAX * fz_aa_hscale);
-	y1 = (int)fz_clamp(fy1, BBOX_MIN * fz_aa_vscale, BBOX_MAX * fz_aa_vscale);
+	x0 = (int)fz_clamp(fx0, BBOX_MIN * hscale, BBOX_MAX * hscale);
+	y0 = (int)fz_clamp(fy0, BBOX_MIN * vscale, BBOX_MAX * vscale);
+	x1 = (int)fz_clamp(fx1, BBOX_MIN * hscale, BBOX_MAX * hscale);
+	y1 = (int)fz_clamp(fy1, BBOX_MIN * vscale, BBOX_MAX * vscale);
 
 	d = clip_lerp_y(gel->clip.y0, 0, x0, y0, x1, y1, &v);
 	if (d == OUTSIDE) return;
@@ -846,6 +905,253 @@ clip_ended:
 	fz_free(ctx, alphas);
 }
 
+/*
+ * Analytic anti-aliased scan conversion.
+ *
+ * Rather than sampling every pixel on a grid of sub scanlines, each edge
+ * is clipped to the pixel rows it crosses and the exact signed cover and
+ * area it contributes are accumulated into the cells it passes through,
+ * in the manner of FreeType's smooth rasterizer. Sweeping a row from left
+ * to right then yields the coverage of each pixel directly.
+ */
+
+static void
+add_line_an(int * restrict cover, int * restrict area, int x1, int y1, int x2, int y2, int dir)
+{
+	int ex1 = x1 >> AN_BITS;
+	int ex2 = x2 >> AN_BITS;
+	int fx1 = x1 & (AN_ONE - 1);
+	int fx2 = x2 & (AN_ONE - 1);
+	int dx, dy, p, first, incr, delta, mod;
+
+	/* y1 < y2, both within the same pixel row */
+	dy = y2 - y1;
+
+	if (ex1 == ex2)
+	{
+		cover[ex1] += dir * dy;
+		area[ex1] += dir * (fx1 + fx2) * dy;
+		return;
+	}
+
+	/* The edge crosses several cells; step through them with a DDA */
+	dx = x2 - x1;
+	if (dx > 0)
+	{
+		p = (AN_ONE - fx1) * dy;
+		first = AN_ONE;
+		incr = 1;
+	}
+	else
+	{
+		p = fx1 * dy;
+		first = 0;
+		incr = -1;
+		dx = -dx;
+	}
+
+	delta = p / dx;
+	mod = p % dx;
+	cover[ex1] += dir * delta;
+	area[ex1] += dir * (fx1 + first) * delta;
+	ex1 += incr;
+	y1 += delta;
+
+	if (ex1 != ex2)
+	{
+		int lift, rem;
+
+		p = AN_ONE * dy;
+		lift = p / dx;
+		rem = p % dx;
+		mod -= dx;
+		do
+		{
+			delta = lift;
+			mod += rem;
+			if (mod >= 0)
+			{
+				mod -= dx;
+				delta++;
+			}
+			cover[ex1] += dir * delta;
+			area[ex1] += dir * AN_ONE * delta;
+			y1 += delta;
+			ex1 += incr;
+		}
+		while (ex1 != ex2);
+	}
+
+	delta = y2 - y1;
+	cover[ex2] += dir * delta;
+	area[ex2] += dir * (fx2 + AN_ONE - first) * delta;
+}
+
+static inline int
+edge_x_an(fz_edge *edge, int y)
+{
+	if (y == edge->y)
+		return edge->x;
+	if (y == edge->y + edge->h)
+		return edge->x1;
+	return edge->x + (int)((int64_t)(y - edge->y) * (edge->x1 - edge->x) / edge->h);
+}
+
+static void
+fz_scan_convert_analytic(fz_gel *gel, int eofill, fz_bbox clip,
+	fz_pixmap *dst, unsigned char *color)
+{
+	unsigned char *alphas;
+	int *cover, *area;
+	int y, e, i;
+	fz_context *ctx = gel->ctx;
+
+	int xmin = fz_idiv(gel->bbox.x0, AN_ONE);
+	int xmax = fz_idiv(gel->bbox.x1, AN_ONE) + 1;
+	int xofs = xmin * AN_ONE;
+	int n = xmax - xmin + 1;
+
+	int skipx = clip.x0 - xmin;
+	int clipx1 = clip.x1 - xmin;
+
+	if (gel->len == 0)
+		return;
+
+	assert(clip.x0 >= xmin);
+	assert(clip.x1 <= xmax);
+
+	alphas = fz_malloc_no_throw(ctx, n);
+	cover = fz_malloc_no_throw(ctx, n * sizeof(int));
+	area = fz_malloc_no_throw(ctx, n * sizeof(int));
+	if (alphas == NULL || cover == NULL || area == NULL)
+	{
+		fz_free(ctx, alphas);
+		fz_free(ctx, cover);
+		fz_free(ctx, area);
+		fz_throw(ctx, "scan conversion failed (malloc failure)");
+	}
+	memset(cover, 0, n * sizeof(int));
+	memset(area, 0, n * sizeof(int));
+	gel->alen = 0;
+
+	/* Edges are sorted by their top y. Each pixel row takes in the edges
+	 * that start above its bottom and retires those that end above its
+	 * top; anything lying wholly above the clip region is retired as soon
+	 * as it is taken in. */
+	e = 0;
+	y = fz_idiv(gel->edges[0].y, AN_ONE);
+	if (y < clip.y0)
+		y = clip.y0;
+
+	for (; y < clip.y1 && (gel->alen > 0 || e < gel->len); y++)
+	{
+		int top = y * AN_ONE;
+		int bot = top + AN_ONE;
+		int minx = INT_MAX;
+		int maxx = INT_MIN;
+		int acc, x, x0;
+
+		while (e < gel->len && gel->edges[e].y < bot)
+		{
+			if (gel->alen + 1 == gel->acap)
+			{
+				int newcap = gel->acap + 64;
+				fz_edge **newactive = fz_resize_array_no_throw(ctx, gel->active, newcap, sizeof(fz_edge*));
+				if (newactive == NULL)
+				{
+					fz_free(ctx, alphas);
+					fz_free(ctx, cover);
+					fz_free(ctx, area);
+					fz_throw(ctx, "scan conversion failed (malloc failure)");
+				}
+				gel->active = newactive;
+				gel->acap = newcap;
+			}
+			gel->active[gel->alen++] = &gel->edges[e++];
+		}
+
+		i = 0;
+		while (i < gel->alen)
+		{
+			fz_edge *edge = gel->active[i];
+			int ey1 = edge->y + edge->h;
+			int sy0, sy1, sx0, sx1;
+
+			if (ey1 <= top)
+			{
+				gel->active[i] = gel->active[--gel->alen];
+				continue;
+			}
+			i++;
+
+			sy0 = fz_maxi(edge->y, top);
+			sy1 = fz_mini(ey1, bot);
+			sx0 = edge_x_an(edge, sy0) - xofs;
+			sx1 = edge_x_an(edge, sy1) - xofs;
+			add_line_an(cover, area, sx0, sy0 - top, sx1, sy1 - top, edge->ydir);
+
+			sx0 >>= AN_BITS;
+			sx1 >>= AN_BITS;
+			if (sx0 > sx1)
+			{
+				int t = sx0; sx0 = sx1; sx1 = t;
+			}
+			if (sx0 < minx)
+				minx = sx0;
+			if (sx1 > maxx)
+				maxx = sx1;
+		}
+
+		if (minx > maxx)
+			continue;
+
+		/* Sweep the touched cells, turning cover and area into alphas
+		 * and clearing them for the next row. */
+		acc = 0;
+		for (x = minx; x <= maxx; x++)
+		{
+			int c;
+			acc += cover[x];
+			c = acc * (AN_ONE * 2) - area[x];
+			cover[x] = 0;
+			area[x] = 0;
+			/* Fold the winding before scaling down, as shifting a
+			 * negative coverage would round it away from zero. */
+			if (c < 0)
+				c = -c;
+			c >>= AN_BITS + 1;
+			if (eofill)
+			{
+				c &= 511;
+				if (c > 256)
+					c = 512 - c;
+			}
+			alphas[x] = c > 255 ? 255 : c;
+		}
+
+		/* Paint the runs of non zero coverage within the clip */
+		if (minx < skipx)
+			minx = skipx;
+		if (maxx >= clipx1)
+			maxx = clipx1 - 1;
+		x = minx;
+		while (x <= maxx)
+		{
+			while (x <= maxx && alphas[x] == 0)
+				x++;
+			x0 = x;
+			while (x <= maxx && alphas[x] != 0)
+				x++;
+			if (x > x0)
+				blit_aa(dst, xmin + x0, y, alphas + x0, x - x0, color);
+		}
+	}
+
+	fz_free(ctx, area);
+	fz_free(ctx, cover);
+	fz_free(ctx, alphas);
+}
+
 /*
  * Sharp (not anti-aliased) scan conversion
  */
@@ -960,7 +1266,9 @@ fz_scan_convert(fz_gel *gel, int eofill, fz_bbox clip,
 {
 	fz_aa_context *ctxaa = gel->ctx->aa;
 
-	if (fz_aa_bits > 0)
+	if (fz_aa_bits > 0 && gel->analytic)
+		fz_scan_convert_analytic(gel, eofill, clip, dst, color);
+	else if (fz_aa_bits > 0)
 		fz_scan_convert_aa(gel, eofill, clip, dst, color);
 	else
 		fz_scan_convert_sharp(gel, eofill, clip, dst, color);
@@ -2,15 +2,10 @@
 
 #define MAX_GLYPH_SIZE 256
 #define MAX_CACHE_SIZE (1024*1024)
+#define GLYPH_HASH_LEN 509
 
 typedef struct fz_glyph_key_s fz_glyph_key;
-
-struct fz_glyph_cache_s
-{
-	int refs;
-	fz_hash_table *hash;
-	int total;
-};
+typedef struct fz_glyph_cache_entry_s fz_glyph_cache_entry;
 
 struct fz_glyph_key_s
 {
@@ -22,49 +17,181 @@ struct fz_glyph_key_s
 	int aa;
 };
 
+/*
+	Each entry is on two lists: the chain of its hash bucket, and the
+	LRU list that runs from the most recently used entry (head) to the
+	next one to be evicted (tail).
+*/
+struct fz_glyph_cache_entry_s
+{
+	fz_glyph_key key;
+	unsigned hash;
+	fz_glyph_cache_entry *lru_prev;
+	fz_glyph_cache_entry *lru_next;
+	fz_glyph_cache_entry *bucket_next;
+	fz_glyph_cache_entry *bucket_prev;
+	fz_pixmap *val;
+	unsigned int size;
+};
+
+struct fz_glyph_cache_s
+{
+	int refs;
+	unsigned int total;
+	unsigned int max;
+	int hits;
+	int misses;
+	int evictions;
+	fz_glyph_cache_entry *entry[GLYPH_HASH_LEN];
+	fz_glyph_cache_entry *lru_head;
+	fz_glyph_cache_entry *lru_tail;
+};
+
 void
 fz_new_glyph_cache_context(fz_context *ctx)
 {
 	fz_glyph_cache *cache;
 
 	cache = fz_malloc_struct(ctx, fz_glyph_cache);
-	fz_try(ctx)
-	{
-		cache->hash = fz_new_hash_table(ctx, 509, sizeof(fz_glyph_key), FZ_LOCK_GLYPHCACHE);
-	}
-	fz_catch(ctx)
-	{
-		fz_free(ctx, cache);
-		fz_rethrow(ctx);
-	}
 	cache->total = 0;
+	cache->max = MAX_CACHE_SIZE;
 	cache->refs = 1;
 
 	ctx->glyph_cache = cache;
 }
 
+static unsigned
+do_hash(unsigned char *s, int len)
+{
+	unsigned val = 0;
+	int i;
+	for (i = 0; i < len; i++)
+	{
+		val += s[i];
+		val += (val << 10);
+		val ^= (val >> 6);
+	}
+	val += (val << 3);
+	val ^= (val >> 11);
+	val += (val << 15);
+	return val;
+}
+
+/* The glyph cache lock is always held when this function is called. */
+static void
+drop_glyph_cache_entry(fz_context *ctx, fz_glyph_cache_entry *entry)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->bucket_next)
+		entry->bucket_next->bucket_prev = entry->bucket_prev;
+	if (entry->bucket_prev)
+		entry->bucket_prev->bucket_next = entry->bucket_next;
+	else
+		cache->entry[entry->hash] = entry->bucket_next;
+	cache->total -= entry->size;
+
+	fz_drop_font(ctx, entry->key.font);
+	fz_drop_pixmap(ctx, entry->val);
+	fz_free(ctx, entry);
+}
+
+/* The glyph cache lock is always held when this function is called. */
+static fz_glyph_cache_entry *
+find_glyph_cache_entry(fz_glyph_cache *cache, fz_glyph_key *key, unsigned hash)
+{
+	fz_glyph_cache_entry *entry;
+
+	for (entry = cache->entry[hash]; entry; entry = entry->bucket_next)
+		if (!memcmp(&entry->key, key, sizeof(*key)))
+			break;
+	if (entry == NULL || entry == cache->lru_head)
+		return entry;
+
+	/* Move to the front of the LRU list */
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next = cache->lru_head;
+	entry->lru_prev = NULL;
+	cache->lru_head->lru_prev = entry;
+	cache->lru_head = entry;
+
+	return entry;
+}
+
 /* The glyph cache lock is always held when this function is called. */
 static void
 fz_evict_glyph_cache(fz_context *ctx)
 {
 	fz_glyph_cache *cache = ctx->glyph_cache;
-	fz_glyph_key *key;
-	fz_pixmap *pixmap;
-	int i;
 
-	for (i = 0; i < fz_hash_len(ctx, cache->hash); i++)
+	while (cache->lru_tail)
+		drop_glyph_cache_entry(ctx, cache->lru_tail);
+}
+
+/* The glyph cache lock is always held when this function is called. */
+static void
+fz_make_glyph_cache_space(fz_context *ctx, unsigned int size)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+
+	while (cache->lru_tail && cache->total + size > cache->max)
 	{
-		key = fz_hash_get_key(ctx, cache->hash, i);
-		if (key->font)
-			fz_drop_font(ctx, key->font);
-		pixmap = fz_hash_get_val(ctx, cache->hash, i);
-		if (pixmap)
-			fz_drop_pixmap(ctx, pixmap);
+		drop_glyph_cache_entry(ctx, cache->lru_tail);
+		cache->evictions++;
 	}
+}
 
-	cache->total = 0;
+void
+fz_purge_glyph_cache(fz_context *ctx)
+{
+	if (!ctx->glyph_cache)
+		return;
 
-	fz_empty_hash(ctx, cache->hash);
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	fz_evict_glyph_cache(ctx);
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+void
+fz_set_glyph_cache_size(fz_context *ctx, unsigned int max)
+{
+	if (!ctx->glyph_cache)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	ctx->glyph_cache->max = max;
+	fz_make_glyph_cache_space(ctx, 0);
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+}
+
+void
+fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats)
+{
+	fz_glyph_cache *cache = ctx->glyph_cache;
+
+	memset(stats, 0, sizeof(*stats));
+	if (!cache)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->size = cache->total;
+	stats->max = cache->max;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 }
 
 void
@@ -78,7 +205,6 @@ fz_drop_glyph_cache_context(fz_context *ctx)
 	if (ctx->glyph_cache->refs == 0)
 	{
 		fz_evict_glyph_cache(ctx);
-		fz_free_hash(ctx, ctx->glyph_cache->hash);
 		fz_free(ctx, ctx->glyph_cache);
 		ctx->glyph_cache = NULL;
 	}
@@ -119,12 +245,15 @@ fz_pixmap *
 fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_colorspace *model, fz_bbox scissor)
 {
 	fz_glyph_cache *cache;
+	fz_glyph_cache_entry *entry;
 	fz_glyph_key key;
 	fz_pixmap *val;
-	float size = fz_matrix_expansion(ctm);
+	unsigned hash;
+	unsigned int size;
+	float expansion = fz_matrix_expansion(ctm);
 	int do_cache;
 
-	if (size <= MAX_GLYPH_SIZE)
+	if (expansion <= MAX_GLYPH_SIZE)
 	{
 		scissor = fz_infinite_bbox;
 		do_cache = 1;
@@ -152,74 +281,88 @@ fz_render_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm, fz_color
 	ctm.e = floorf(ctm.e) + key.e / 256.0f;
 	ctm.f = floorf(ctm.f) + key.f / 256.0f;
 
+	hash = do_hash((unsigned char *)&key, sizeof key) % GLYPH_HASH_LEN;
+
 	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-	val = fz_hash_find(ctx, cache->hash, &key);
-	if (val)
+	entry = find_glyph_cache_entry(cache, &key, hash);
+	if (entry)
 	{
-		fz_keep_pixmap(ctx, val);
+		cache->hits++;
+		val = fz_keep_pixmap(ctx, entry->val);
 		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 		return val;
 	}
+	cache->misses++;
+	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+
+	/* The glyph is rendered without holding the lock, so that other
+	 * threads can keep using the cache meanwhile. The danger is that
+	 * another thread wants the same glyph too, and we both end up
+	 * rendering it. We cope with this when inserting, by abandoning
+	 * ours if the other one got there first. */
+	if (font->ft_face)
+	{
+		val = fz_render_ft_glyph(ctx, font, gid, ctm, key.aa);
+	}
+	else if (font->t3procs)
+	{
+		val = fz_render_t3_glyph(ctx, font, gid, ctm, model, scissor);
+	}
+	else
+	{
+		fz_warn(ctx, "assert: uninitialized font structure");
+		val = NULL;
+	}
+
+	if (!val || !do_cache || val->w >= MAX_GLYPH_SIZE || val->h >= MAX_GLYPH_SIZE)
+		return val;
+
+	size = fz_pixmap_size(ctx, val);
+	if (size > cache->max)
+		return val;
 
 	fz_try(ctx)
 	{
-		if (font->ft_face)
-		{
-			val = fz_render_ft_glyph(ctx, font, gid, ctm, key.aa);
-		}
-		else if (font->t3procs)
-		{
-			/* We drop the glyphcache here, and execute the t3
-			 * glyph code. The danger here is that some other
-			 * thread will come along, and want the same glyph
-			 * too. If it does, we may both end up rendering
-			 * pixmaps. We cope with this later on, by ensuring
-			 * that only one gets inserted into the cache. If
-			 * we insert ours to find one already there, we
-			 * abandon ours, and use the one there already.
-			 */
-			fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-			val = fz_render_t3_glyph(ctx, font, gid, ctm, model, scissor);
-			fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
-		}
-		else
-		{
-			fz_warn(ctx, "assert: uninitialized font structure");
-			val = NULL;
-		}
+		entry = fz_malloc_struct(ctx, fz_glyph_cache_entry);
 	}
 	fz_catch(ctx)
 	{
-		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
-		fz_rethrow(ctx);
+		fz_warn(ctx, "Failed to encache glyph - continuing");
+		return val;
 	}
 
-	if (val && do_cache)
+	fz_lock(ctx, FZ_LOCK_GLYPHCACHE);
+	if (find_glyph_cache_entry(cache, &key, hash))
 	{
-		if (val->w < MAX_GLYPH_SIZE && val->h < MAX_GLYPH_SIZE)
-		{
-			if (cache->total + val->w * val->h > MAX_CACHE_SIZE)
-				fz_evict_glyph_cache(ctx);
-			fz_try(ctx)
-			{
-				fz_pixmap *pix = fz_hash_insert(ctx, cache->hash, &key, val);
-				if (pix)
-				{
-					fz_drop_pixmap(ctx, val);
-					val = pix;
-				}
-				else
-					fz_keep_font(ctx, key.font);
-				val = fz_keep_pixmap(ctx, val);
-			}
-			fz_catch(ctx)
-			{
-				fz_warn(ctx, "Failed to encache glyph - continuing");
-			}
-			cache->total += val->w * val->h;
-		}
+		fz_pixmap *pix = fz_keep_pixmap(ctx, cache->lru_head->val);
+		fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
+		fz_free(ctx, entry);
+		fz_drop_pixmap(ctx, val);
+		return pix;
 	}
 
+	fz_make_glyph_cache_space(ctx, size);
+
+	entry->key = key;
+	entry->hash = hash;
+	entry->val = fz_keep_pixmap(ctx, val);
+	entry->size = size;
+	fz_keep_font(ctx, key.font);
+
+	entry->bucket_next = cache->entry[hash];
+	if (entry->bucket_next)
+		entry->bucket_next->bucket_prev = entry;
+	cache->entry[hash] = entry;
+
+	entry->lru_next = cache->lru_head;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+
+	cache->total += size;
+
 	fz_unlock(ctx, FZ_LOCK_GLYPHCACHE);
 	return val;
 }
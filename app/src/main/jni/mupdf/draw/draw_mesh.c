@@ -348,34 +348,291 @@ do_paint_tri(void *arg, fz_vertex *av, fz_vertex *bv, fz_vertex *cv)
 	fz_paint_triangle(dest, local[0], local[1], local[2], 2 + dest->colorspace->n, ptd->bbox);
 }
 
+/* The sampled shading function, in the colorspace of the destination */
+static void
+fz_shade_clut(fz_context *ctx, fz_shade *shade, fz_colorspace *model, unsigned char clut[256][FZ_MAX_COLORS])
+{
+	fz_color_converter cc;
+	float color[FZ_MAX_COLORS];
+	int i, k;
+
+	fz_find_color_converter(&cc, ctx, model, shade->colorspace);
+	for (i = 0; i < 256; i++)
+	{
+		cc.convert(&cc, color, shade->function[i]);
+		for (k = 0; k < model->n; k++)
+			clut[i][k] = color[k] * 255;
+		clut[i][k] = shade->function[i][shade->colorspace->n] * 255;
+	}
+}
+
+/*
+ * Axial and radial shadings are drawn a pixel at a time: each pixel
+ * centre is mapped back into shading space, where t can be solved for
+ * directly, and the color looked up in the sampled function. The
+ * extensions and the rule that the circle with the largest t wins fall
+ * out of the solution, so no mesh or temporary pixmaps are needed.
+ */
+
+#define SHADE_SPAN 256
+
+/* Filled in by fz_accelerate when the CPU has SIMD; see fitz-internal.h */
+fz_shade_table fz_shade_funcs = { NULL, NULL };
+
+/* t for each pixel as an index into the function table, or -1 if the
+ * shading does not cover it */
+static inline int
+fz_shade_index(float t, int extend0, int extend1)
+{
+	if (t < 0)
+		return extend0 ? 0 : -1;
+	if (t > 1)
+		return extend1 ? 255 : -1;
+	return (int)(t * 255 + 0.5f);
+}
+
+static void
+fz_axial_span(int *idx, int w, float t, float dt, int extend0, int extend1)
+{
+	int i;
+
+	if (fz_shade_funcs.axial)
+	{
+		fz_shade_funcs.axial(idx, w, t, dt, extend0, extend1);
+		return;
+	}
+
+	for (i = 0; i < w; i++)
+		idx[i] = fz_shade_index(t + i * dt, extend0, extend1);
+}
+
+/* As fz_shade_index, for the roots of the radial quadratic */
+static inline int
+fz_radial_index(double t, int extend0, int extend1)
+{
+	if (t < 0)
+		return extend0 ? 0 : -1;
+	if (t > 1)
+		return extend1 ? 255 : -1;
+	return (int)(t * 255 + 0.5);
+}
+
+/*
+	The circle for t has centre c0 + t * (c1 - c0) and radius
+	r0 + t * (r1 - r0). Asking for it to pass through p gives a
+	quadratic in t; the larger root with a non negative radius that is
+	inside the domain (or its extensions) is the one drawn.
+*/
+static void
+fz_radial_span(int *idx, int w, fz_radial_data *rd, double px, double py, double dpx, double dpy, int extend0, int extend1)
+{
+	double pdx, pdy, b, c, disc, t0, t1, t;
+	int i, k, v;
+
+	if (rd->a != 0 && fz_shade_funcs.radial)
+	{
+		fz_shade_funcs.radial(idx, w, rd, px, py, dpx, dpy, extend0, extend1);
+		return;
+	}
+
+	for (i = 0; i < w; i++)
+	{
+		pdx = px + i * dpx - rd->x0;
+		pdy = py + i * dpy - rd->y0;
+		b = pdx * rd->cdx + pdy * rd->cdy + rd->r0 * rd->dr;
+		c = pdx * pdx + pdy * pdy - rd->r0 * rd->r0;
+
+		if (rd->a != 0)
+		{
+			disc = b * b - rd->a * c;
+			if (disc < 0)
+			{
+				idx[i] = -1;
+				continue;
+			}
+			disc = sqrt(disc);
+			t0 = (b + disc) * rd->inva;
+			t1 = (b - disc) * rd->inva;
+			if (t1 > t0)
+			{
+				t = t0;
+				t0 = t1;
+				t1 = t;
+			}
+		}
+		else if (b != 0)
+		{
+			t0 = t1 = c / (2 * b);
+		}
+		else
+		{
+			idx[i] = -1;
+			continue;
+		}
+
+		v = -1;
+		for (k = 0; k < 2 && v < 0; k++)
+		{
+			t = k ? t1 : t0;
+			if (rd->r0 + t * rd->dr >= 0)
+				v = fz_radial_index(t, extend0, extend1);
+		}
+		idx[i] = v;
+	}
+}
+
+/*
+ * Composite the looked up colors, as fz_paint_pixmap would. Opaque
+ * colors are simply copied; otherwise the span is gathered (with
+ * transparent black where the shading does not reach) and handed to
+ * the span painter.
+ */
+static void
+fz_shade_paint_span(unsigned char *dp, int *idx, int w, int n, unsigned char lut[256][FZ_MAX_COLORS], int opaque)
+{
+	unsigned char span[SHADE_SPAN * FZ_MAX_COLORS];
+	unsigned char *sp = span;
+	int i;
+
+	if (opaque)
+	{
+		if (n == 4)
+		{
+			for (i = 0; i < w; i++, dp += 4)
+				if (idx[i] >= 0)
+					memcpy(dp, lut[idx[i]], 4);
+		}
+		else
+		{
+			for (i = 0; i < w; i++, dp += n)
+				if (idx[i] >= 0)
+					memcpy(dp, lut[idx[i]], n);
+		}
+		return;
+	}
+
+	for (i = 0; i < w; i++, sp += n)
+	{
+		if (idx[i] >= 0)
+			memcpy(sp, lut[idx[i]], n);
+		else
+			memset(sp, 0, n);
+	}
+	fz_paint_span(dp, span, n, w, 255);
+}
+
+static int
+fz_paint_shade_direct(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
+{
+	unsigned char lut[256][FZ_MAX_COLORS];
+	int idx[SHADE_SPAN];
+	fz_radial_data rd;
+	fz_matrix inv;
+	float *c0 = shade->u.l_or_r.coords[0];
+	float *c1 = shade->u.l_or_r.coords[1];
+	float det, dx, dy, len;
+	float ta = 0, tb = 0, tc = 0;
+	unsigned char *row;
+	int x, y, w, i, k, a, opaque, n = dest->n;
+	int radial = shade->type == FZ_RADIAL;
+	int extend0 = shade->u.l_or_r.extend[0];
+	int extend1 = shade->u.l_or_r.extend[1];
+
+	/* fz_invert_matrix leaves these alone */
+	det = ctm.a * ctm.d - ctm.b * ctm.c;
+	if (det >= -FLT_EPSILON && det <= FLT_EPSILON)
+		return 0;
+	inv = fz_invert_matrix(ctm);
+
+	bbox = fz_intersect_bbox(bbox, fz_pixmap_bbox(ctx, dest));
+	if (fz_is_empty_bbox(bbox))
+		return 1;
+
+	/* Premultiply */
+	fz_shade_clut(ctx, shade, dest->colorspace, lut);
+	opaque = 1;
+	for (i = 0; i < 256; i++)
+	{
+		a = lut[i][n - 1];
+		for (k = 0; k < n - 1; k++)
+			lut[i][k] = fz_mul255(lut[i][k], a);
+		opaque &= a == 255;
+	}
+
+	if (!radial)
+	{
+		/* t is linear in device space */
+		dx = c1[0] - c0[0];
+		dy = c1[1] - c0[1];
+		len = dx * dx + dy * dy;
+		if (len == 0)
+			return 1;
+		ta = (inv.a * dx + inv.b * dy) / len;
+		tb = (inv.c * dx + inv.d * dy) / len;
+		tc = ((inv.e - c0[0]) * dx + (inv.f - c0[1]) * dy) / len;
+	}
+	else
+	{
+		rd.x0 = c0[0];
+		rd.y0 = c0[1];
+		rd.r0 = c0[2];
+		rd.cdx = c1[0] - c0[0];
+		rd.cdy = c1[1] - c0[1];
+		rd.dr = c1[2] - c0[2];
+		rd.a = rd.cdx * rd.cdx + rd.cdy * rd.cdy - rd.dr * rd.dr;
+		rd.inva = rd.a != 0 ? 1 / rd.a : 0;
+	}
+
+	for (y = bbox.y0; y < bbox.y1; y++)
+	{
+		row = dest->samples + (unsigned int)(((y - dest->y) * dest->w + (bbox.x0 - dest->x)) * n);
+		for (x = bbox.x0; x < bbox.x1; x += w)
+		{
+			float fx = x + 0.5f;
+			float fy = y + 0.5f;
+
+			w = fz_mini(bbox.x1 - x, SHADE_SPAN);
+			if (!radial)
+				fz_axial_span(idx, w, ta * fx + tb * fy + tc, ta, extend0, extend1);
+			else
+				fz_radial_span(idx, w, &rd,
+					(double)fx * inv.a + (double)fy * inv.c + inv.e,
+					(double)fx * inv.b + (double)fy * inv.d + inv.f,
+					inv.a, inv.b, extend0, extend1);
+			fz_shade_paint_span(row, idx, w, n, lut, opaque);
+			row += w * n;
+		}
+	}
+
+	return 1;
+}
+
 void
 fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest, fz_bbox bbox)
 {
 	unsigned char clut[256][FZ_MAX_COLORS];
 	fz_pixmap *temp = NULL;
 	fz_pixmap *conv = NULL;
-	float color[FZ_MAX_COLORS];
 	struct paint_tri_data ptd;
-	int i, k;
+	fz_rect scissor;
+	int k;
+
+	ctm = fz_concat(shade->matrix, ctm);
+
+	if (shade->use_function && (shade->type == FZ_LINEAR || shade->type == FZ_RADIAL))
+	{
+		if (fz_paint_shade_direct(ctx, shade, ctm, dest, bbox))
+			return;
+	}
 
 	fz_var(temp);
 	fz_var(conv);
 
 	fz_try(ctx)
 	{
-		ctm = fz_concat(shade->matrix, ctm);
-
 		if (shade->use_function)
 		{
-			fz_color_converter cc;
-			fz_find_color_converter(&cc, ctx, dest->colorspace, shade->colorspace);
-			for (i = 0; i < 256; i++)
-			{
-				cc.convert(&cc, color, shade->function[i]);
-				for (k = 0; k < dest->colorspace->n; k++)
-					clut[i][k] = color[k] * 255;
-				clut[i][k] = shade->function[i][shade->colorspace->n] * 255;
-			}
+			fz_shade_clut(ctx, shade, dest->colorspace, clut);
 			conv = fz_new_pixmap_with_bbox(ctx, dest->colorspace, bbox);
 			temp = fz_new_pixmap_with_bbox(ctx, fz_device_gray, bbox);
 			fz_clear_pixmap(ctx, temp);
@@ -390,7 +647,11 @@ fz_paint_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_pixmap *dest,
 		ptd.shade = shade;
 		ptd.bbox = bbox;
 
-		fz_process_mesh(ctx, shade, ctm, &do_paint_tri, &ptd);
+		scissor.x0 = bbox.x0;
+		scissor.y0 = bbox.y0;
+		scissor.x1 = bbox.x1;
+		scissor.y1 = bbox.y1;
+		fz_process_mesh(ctx, shade, ctm, scissor, &do_paint_tri, &ptd);
 
 		if (shade->use_function)
 		{
@@ -0,0 +1,206 @@
+#include "fitz-internal.h"
+#include "draw_simd.h"
+
+/*
+Shading parameter spans, as fz_axial_span and fz_radial_span in
+draw_mesh.c: 4 floats or 2 doubles at a time, with the C code's own
+arithmetic for t, and the out of range cases chosen with compares and
+selects instead of branches. The radial roots need doubles, which NEON
+only has on arm64. A short last block is done in full into a scratch
+buffer.
+*/
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+#ifdef HAVE_SSE2
+
+typedef __m128 vf;
+typedef __m128i vi;
+
+#define vf_splat(a) _mm_set1_ps(a)
+#define vf_add(a, b) _mm_add_ps(a, b)
+#define vf_mul(a, b) _mm_mul_ps(a, b)
+#define vf_lt(a, b) _mm_castps_si128(_mm_cmplt_ps(a, b))
+#define vf_gt(a, b) _mm_castps_si128(_mm_cmpgt_ps(a, b))
+#define vf_trunc(a) _mm_cvttps_epi32(a)
+#define vf_lanes() _mm_set_ps(3, 2, 1, 0)
+#define vi_splat(a) _mm_set1_epi32(a)
+#define vi_store(p, a) _mm_storeu_si128((__m128i *)(p), a)
+
+static inline vi vi_select(vi m, vi a, vi b)
+{
+	return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+}
+
+#define HAVE_DOUBLE_LANES
+
+typedef __m128d vd;
+typedef __m128d vdm;
+
+#define vd_splat(a) _mm_set1_pd(a)
+#define vd_add(a, b) _mm_add_pd(a, b)
+#define vd_sub(a, b) _mm_sub_pd(a, b)
+#define vd_mul(a, b) _mm_mul_pd(a, b)
+#define vd_min(a, b) _mm_min_pd(a, b)
+#define vd_max(a, b) _mm_max_pd(a, b)
+#define vd_sqrt(a) _mm_sqrt_pd(a)
+#define vd_ge(a, b) _mm_cmpge_pd(a, b)
+#define vd_le(a, b) _mm_cmple_pd(a, b)
+#define vd_and(a, b) _mm_and_pd(a, b)
+#define vd_or(a, b) _mm_or_pd(a, b)
+#define vd_lanes() _mm_set_pd(1, 0)
+
+static inline vd vd_select(vdm m, vd a, vd b)
+{
+	return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b));
+}
+
+static inline void vd_store_int(int *p, vd a)
+{
+	_mm_storel_epi64((__m128i *)p, _mm_cvttpd_epi32(a));
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+typedef float32x4_t vf;
+typedef int32x4_t vi;
+
+static const float vf_lane_init[4] = { 0, 1, 2, 3 };
+
+#define vf_splat(a) vdupq_n_f32(a)
+#define vf_add(a, b) vaddq_f32(a, b)
+#define vf_mul(a, b) vmulq_f32(a, b)
+#define vf_lt(a, b) vreinterpretq_s32_u32(vcltq_f32(a, b))
+#define vf_gt(a, b) vreinterpretq_s32_u32(vcgtq_f32(a, b))
+#define vf_trunc(a) vcvtq_s32_f32(a)
+#define vf_lanes() vld1q_f32(vf_lane_init)
+#define vi_splat(a) vdupq_n_s32(a)
+#define vi_store(p, a) vst1q_s32(p, a)
+#define vi_select(m, a, b) vbslq_s32(vreinterpretq_u32_s32(m), a, b)
+
+#ifdef __aarch64__
+
+#define HAVE_DOUBLE_LANES
+
+typedef float64x2_t vd;
+typedef uint64x2_t vdm;
+
+static const double vd_lane_init[2] = { 0, 1 };
+
+#define vd_splat(a) vdupq_n_f64(a)
+#define vd_add(a, b) vaddq_f64(a, b)
+#define vd_sub(a, b) vsubq_f64(a, b)
+#define vd_mul(a, b) vmulq_f64(a, b)
+#define vd_min(a, b) vminq_f64(a, b)
+#define vd_max(a, b) vmaxq_f64(a, b)
+#define vd_sqrt(a) vsqrtq_f64(a)
+#define vd_ge(a, b) vcgeq_f64(a, b)
+#define vd_le(a, b) vcleq_f64(a, b)
+#define vd_and(a, b) vandq_u64(a, b)
+#define vd_or(a, b) vorrq_u64(a, b)
+#define vd_lanes() vld1q_f64(vd_lane_init)
+#define vd_select(m, a, b) vbslq_f64(m, a, b)
+#define vd_store_int(p, a) vst1_s32(p, vmovn_s64(vcvtq_s64_f64(a)))
+
+#endif /* __aarch64__ */
+
+#endif /* HAVE_NEON */
+
+static void
+shade_axial_simd(int *idx, int w, float t, float dt, int extend0, int extend1)
+{
+	vf vt = vf_splat(t);
+	vf vdt = vf_splat(dt);
+	vf lanes = vf_lanes();
+	vi lo = vi_splat(extend0 ? 0 : -1);
+	vi hi = vi_splat(extend1 ? 255 : -1);
+	int tail[4];
+	int i;
+
+	for (i = 0; i < w; i += 4)
+	{
+		vf x = vf_add(vt, vf_mul(vf_add(vf_splat((float)i), lanes), vdt));
+		vi v = vf_trunc(vf_add(vf_mul(x, vf_splat(255)), vf_splat(0.5f)));
+		v = vi_select(vf_gt(x, vf_splat(1)), hi, v);
+		v = vi_select(vf_lt(x, vf_splat(0)), lo, v);
+		if (i + 4 <= w)
+			vi_store(idx + i, v);
+		else
+		{
+			vi_store(tail, v);
+			memcpy(idx + i, tail, (w - i) * sizeof(int));
+		}
+	}
+}
+
+#ifdef HAVE_DOUBLE_LANES
+
+/* Whether the circle for t exists and is drawn */
+static inline vdm vd_drawn(vd t, vd r0, vd dr, vd lim0, vd lim1)
+{
+	vdm m = vd_and(vd_ge(t, lim0), vd_le(t, lim1));
+	return vd_and(m, vd_ge(vd_add(r0, vd_mul(t, dr)), vd_splat(0)));
+}
+
+static void
+shade_radial_simd(int *idx, int w, fz_radial_data *rd, double px, double py, double dpx, double dpy, int extend0, int extend1)
+{
+	vd lanes = vd_lanes();
+	vd lim0 = vd_splat(extend0 ? -HUGE_VAL : 0);
+	vd lim1 = vd_splat(extend1 ? HUGE_VAL : 1);
+	vd zero = vd_splat(0);
+	vd r0 = vd_splat(rd->r0);
+	vd dr = vd_splat(rd->dr);
+	int tail[2];
+	int i;
+
+	for (i = 0; i < w; i += 2)
+	{
+		vd k = vd_add(vd_splat(i), lanes);
+		vd pdx = vd_sub(vd_add(vd_splat(px), vd_mul(k, vd_splat(dpx))), vd_splat(rd->x0));
+		vd pdy = vd_sub(vd_add(vd_splat(py), vd_mul(k, vd_splat(dpy))), vd_splat(rd->y0));
+		vd b = vd_add(vd_add(vd_mul(pdx, vd_splat(rd->cdx)), vd_mul(pdy, vd_splat(rd->cdy))), vd_splat(rd->r0 * rd->dr));
+		vd c = vd_sub(vd_add(vd_mul(pdx, pdx), vd_mul(pdy, pdy)), vd_splat(rd->r0 * rd->r0));
+		vd disc = vd_sub(vd_mul(b, b), vd_mul(vd_splat(rd->a), c));
+		vd s = vd_sqrt(vd_max(disc, zero));
+		vd t0 = vd_mul(vd_add(b, s), vd_splat(rd->inva));
+		vd t1 = vd_mul(vd_sub(b, s), vd_splat(rd->inva));
+		vd th = vd_max(t0, t1);
+		vd tl = vd_min(t0, t1);
+		vdm mh = vd_drawn(th, r0, dr, lim0, lim1);
+		vdm ml = vd_drawn(tl, r0, dr, lim0, lim1);
+		vd t, v;
+
+		/* The larger root if its circle is drawn, else the smaller; the
+		 * extensions are then just a clamp */
+		t = vd_select(mh, th, tl);
+		t = vd_min(vd_max(t, zero), vd_splat(1));
+		v = vd_add(vd_mul(t, vd_splat(255)), vd_splat(0.5));
+		v = vd_select(vd_and(vd_or(mh, ml), vd_ge(disc, zero)), v, vd_splat(-1));
+
+		if (i + 2 <= w)
+			vd_store_int(idx + i, v);
+		else
+		{
+			vd_store_int(tail, v);
+			idx[i] = tail[0];
+		}
+	}
+}
+
+#endif /* HAVE_DOUBLE_LANES */
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+void
+fz_accelerate_mesh(void)
+{
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	fz_shade_funcs.axial = shade_axial_simd;
+#ifdef HAVE_DOUBLE_LANES
+	fz_shade_funcs.radial = shade_radial_simd;
+#endif
+#endif
+}
@@ -85,8 +85,23 @@ fz_paint_solid_alpha(byte * restrict dp, int w, int alpha)
 	}
 }
 
-void
-fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
+static inline void
+fz_paint_solid_color_4(byte * restrict dp, int w, byte *color)
+{
+	int sa = FZ_EXPAND(color[3]);
+	while (w--)
+	{
+		int ma = FZ_COMBINE(FZ_EXPAND(255), sa);
+		dp[0] = FZ_BLEND(color[0], dp[0], ma);
+		dp[1] = FZ_BLEND(color[1], dp[1], ma);
+		dp[2] = FZ_BLEND(color[2], dp[2], ma);
+		dp[3] = FZ_BLEND(255, dp[3], ma);
+		dp += 4;
+	}
+}
+
+static inline void
+fz_paint_solid_color_N(byte * restrict dp, int n, int w, byte *color)
 {
 	int n1 = n - 1;
 	int sa = FZ_EXPAND(color[n1]);
@@ -101,6 +116,15 @@ fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
 	}
 }
 
+void
+fz_paint_solid_color(byte * restrict dp, int n, int w, byte *color)
+{
+	if (n == 4)
+		fz_paint_funcs.solid_color_4(dp, w, color);
+	else
+		fz_paint_solid_color_N(dp, n, w, color);
+}
+
 /* Blend a non-premultiplied color in mask over destination */
 
 static inline void
@@ -154,13 +178,103 @@ fz_paint_span_with_color_N(byte * restrict dp, byte * restrict mp, int n, int w,
 	}
 }
 
+/* Opaque colors (the common case for text and line art) need no alpha
+ * combine, and the mask is mostly fully off or fully on: leave the
+ * former alone and store the color for the latter. */
+
+static inline void
+fz_paint_span_with_opaque_color_2(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	int g = color[0];
+	while (w--)
+	{
+		int ma = *mp++;
+		if (ma == 255)
+		{
+			dp[0] = g;
+			dp[1] = 255;
+		}
+		else if (ma != 0)
+		{
+			ma = FZ_EXPAND(ma);
+			dp[0] = FZ_BLEND(g, dp[0], ma);
+			dp[1] = FZ_BLEND(255, dp[1], ma);
+		}
+		dp += 2;
+	}
+}
+
+static inline void
+fz_paint_span_with_opaque_color_4(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	int r = color[0];
+	int g = color[1];
+	int b = color[2];
+	while (w--)
+	{
+		int ma = *mp++;
+		if (ma == 255)
+		{
+			dp[0] = r;
+			dp[1] = g;
+			dp[2] = b;
+			dp[3] = 255;
+		}
+		else if (ma != 0)
+		{
+			ma = FZ_EXPAND(ma);
+			dp[0] = FZ_BLEND(r, dp[0], ma);
+			dp[1] = FZ_BLEND(g, dp[1], ma);
+			dp[2] = FZ_BLEND(b, dp[2], ma);
+			dp[3] = FZ_BLEND(255, dp[3], ma);
+		}
+		dp += 4;
+	}
+}
+
+static inline void
+fz_paint_span_with_opaque_color_N(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
+{
+	int n1 = n - 1;
+	int k;
+	while (w--)
+	{
+		int ma = *mp++;
+		if (ma == 255)
+		{
+			for (k = 0; k < n1; k++)
+				dp[k] = color[k];
+			dp[k] = 255;
+		}
+		else if (ma != 0)
+		{
+			ma = FZ_EXPAND(ma);
+			for (k = 0; k < n1; k++)
+				dp[k] = FZ_BLEND(color[k], dp[k], ma);
+			dp[k] = FZ_BLEND(255, dp[k], ma);
+		}
+		dp += n;
+	}
+}
+
 void
 fz_paint_span_with_color(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
 {
+	if (color[n - 1] == 255)
+	{
+		switch (n)
+		{
+		case 2: fz_paint_funcs.span_with_opaque_color_2(dp, mp, w, color); break;
+		case 4: fz_paint_funcs.span_with_opaque_color_4(dp, mp, w, color); break;
+		default: fz_paint_span_with_opaque_color_N(dp, mp, n, w, color); break;
+		}
+		return;
+	}
+
 	switch (n)
 	{
-	case 2: fz_paint_span_with_color_2(dp, mp, w, color); break;
-	case 4: fz_paint_span_with_color_4(dp, mp, w, color); break;
+	case 2: fz_paint_funcs.span_with_color_2(dp, mp, w, color); break;
+	case 4: fz_paint_funcs.span_with_color_4(dp, mp, w, color); break;
 	default: fz_paint_span_with_color_N(dp, mp, n, w, color); break;
 	}
 }
@@ -232,8 +346,8 @@ fz_paint_span_with_mask(byte * restrict dp, byte * restrict sp, byte * restrict
 {
 	switch (n)
 	{
-	case 2: fz_paint_span_with_mask_2(dp, sp, mp, w); break;
-	case 4: fz_paint_span_with_mask_4(dp, sp, mp, w); break;
+	case 2: fz_paint_funcs.span_with_mask_2(dp, sp, mp, w); break;
+	case 4: fz_paint_funcs.span_with_mask_4(dp, sp, mp, w); break;
 	default: fz_paint_span_with_mask_N(dp, sp, mp, n, w); break;
 	}
 }
@@ -354,8 +468,8 @@ fz_paint_span(byte * restrict dp, byte * restrict sp, int n, int w, int alpha)
 		switch (n)
 		{
 		case 1: fz_paint_span_1(dp, sp, w); break;
-		case 2: fz_paint_span_2(dp, sp, w); break;
-		case 4: fz_paint_span_4(dp, sp, w); break;
+		case 2: fz_paint_funcs.span_2(dp, sp, w); break;
+		case 4: fz_paint_funcs.span_4(dp, sp, w); break;
 		default: fz_paint_span_N(dp, sp, n, w); break;
 		}
 	}
@@ -363,13 +477,50 @@ fz_paint_span(byte * restrict dp, byte * restrict sp, int n, int w, int alpha)
 	{
 		switch (n)
 		{
-		case 2: fz_paint_span_2_with_alpha(dp, sp, w, alpha); break;
-		case 4: fz_paint_span_4_with_alpha(dp, sp, w, alpha); break;
+		case 2: fz_paint_funcs.span_2_with_alpha(dp, sp, w, alpha); break;
+		case 4: fz_paint_funcs.span_4_with_alpha(dp, sp, w, alpha); break;
 		default: fz_paint_span_N_with_alpha(dp, sp, n, w, alpha); break;
 		}
 	}
 }
 
+/* The portable painters for 2 and 4 components; see fz_accelerate */
+
+fz_paint_table fz_paint_funcs =
+{
+	fz_paint_solid_color_4,
+	fz_paint_span_with_color_2,
+	fz_paint_span_with_color_4,
+	fz_paint_span_with_opaque_color_2,
+	fz_paint_span_with_opaque_color_4,
+	fz_paint_span_with_mask_2,
+	fz_paint_span_with_mask_4,
+	fz_paint_span_2,
+	fz_paint_span_4,
+	fz_paint_span_2_with_alpha,
+	fz_paint_span_4_with_alpha,
+};
+
+void
+fz_accelerate(void)
+{
+	static int checked = 0;
+
+	if (checked)
+		return;
+	checked = 1;
+
+	if (!fz_has_simd())
+		return;
+
+	fz_accelerate_paint();
+	fz_accelerate_scale();
+	fz_accelerate_affine();
+	fz_accelerate_unpack();
+	fz_accelerate_blend();
+	fz_accelerate_mesh();
+}
+
 /*
  * Pixmap blending functions
  */
@@ -0,0 +1,404 @@
+#include "fitz-internal.h"
+#include "draw_simd.h"
+
+/*
+
+SIMD versions of the 2 and 4 component span painters in draw_paint.c.
+Each painter works on 16 bytes of destination at a time, with exactly the
+arithmetic of the FZ_ macros. The one rearrangement is FZ_BLEND, which we
+compute as
+
+	(S.A + D.(256-A)) >> 8
+
+rather than ((S-D).A + D.256) >> 8, so that no intermediate leaves the
+unsigned 16-bit range.
+
+*/
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+#ifdef HAVE_SSE2
+
+/* Load one mask value per pixel and spread it over the pixel's lanes */
+static inline void v_mask_2(const byte *mp, v16 *lo, v16 *hi)
+{
+	__m128i m = _mm_loadl_epi64((const __m128i *)mp);
+	m = _mm_unpacklo_epi8(m, m);
+	*lo = _mm_unpacklo_epi8(m, _mm_setzero_si128());
+	*hi = _mm_unpackhi_epi8(m, _mm_setzero_si128());
+}
+
+static inline void v_mask_4(const byte *mp, v16 *lo, v16 *hi)
+{
+	int x;
+	__m128i m;
+	memcpy(&x, mp, 4);
+	m = _mm_cvtsi32_si128(x);
+	m = _mm_unpacklo_epi8(m, m);
+	m = _mm_unpacklo_epi16(m, m);
+	*lo = _mm_unpacklo_epi8(m, _mm_setzero_si128());
+	*hi = _mm_unpackhi_epi8(m, _mm_setzero_si128());
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+static inline void v_mask_2(const byte *mp, v16 *lo, v16 *hi)
+{
+	uint8x8_t m = vld1_u8(mp);
+	uint8x8x2_t z = vzip_u8(m, m);
+	*lo = vmovl_u8(z.val[0]);
+	*hi = vmovl_u8(z.val[1]);
+}
+
+static inline void v_mask_4(const byte *mp, v16 *lo, v16 *hi)
+{
+	uint32_t x;
+	uint8x8_t m;
+	uint8x8x2_t z;
+	memcpy(&x, mp, 4);
+	m = vreinterpret_u8_u32(vdup_n_u32(x));
+	z = vzip_u8(m, m);
+	z = vzip_u8(z.val[0], z.val[0]);
+	*lo = vmovl_u8(z.val[0]);
+	*hi = vmovl_u8(z.val[1]);
+}
+
+#endif /* HAVE_NEON */
+
+static inline v16 v_expand(v16 a)
+{
+	return v_add(a, v_shr(a, 7));
+}
+
+static inline v16 v_blend(v16 s, v16 d, v16 a)
+{
+	return v_shr(v_add(v_mul(s, a), v_mul(d, v_sub(v_splat(256), a))), 8);
+}
+
+static inline void v_mask(const byte *mp, int n, v16 *lo, v16 *hi)
+{
+	if (n == 2)
+		v_mask_2(mp, lo, hi);
+	else
+		v_mask_4(mp, lo, hi);
+}
+
+/* 0 if a block's mask is all clear, 1 if all set, otherwise 2 */
+static inline int mask_state(const byte *mp, int n)
+{
+	unsigned int a, b;
+	memcpy(&a, mp, 4);
+	if (n == 2)
+	{
+		memcpy(&b, mp + 4, 4);
+		if ((a | b) == 0)
+			return 0;
+		return (a & b) == 0xFFFFFFFF ? 1 : 2;
+	}
+	if (a == 0)
+		return 0;
+	return a == 0xFFFFFFFF ? 1 : 2;
+}
+
+/* The color in every lane, with 255 in the alpha lanes */
+static inline v16 v_color(const byte *color, int n)
+{
+	unsigned short c[8];
+	int k;
+	for (k = 0; k < 8; k++)
+		c[k] = (k % n == n - 1) ? 255 : color[k % n];
+	return v_set(c);
+}
+
+static void
+paint_solid_color_4_simd(byte * restrict dp, int w, byte *color)
+{
+	int sa = FZ_EXPAND(color[3]);
+	int ma = FZ_COMBINE(FZ_EXPAND(255), sa);
+	v16 c = v_color(color, 4);
+	v16 a = v_splat(ma);
+
+	for (; w >= 4; w -= 4)
+	{
+		v16 dl, dh;
+		v_load(dp, &dl, &dh);
+		v_store(dp, v_blend(c, dl, a), v_blend(c, dh, a));
+		dp += 16;
+	}
+	while (w--)
+	{
+		dp[0] = FZ_BLEND(color[0], dp[0], ma);
+		dp[1] = FZ_BLEND(color[1], dp[1], ma);
+		dp[2] = FZ_BLEND(color[2], dp[2], ma);
+		dp[3] = FZ_BLEND(255, dp[3], ma);
+		dp += 4;
+	}
+}
+
+/* Blend a non-premultiplied color in mask over destination */
+
+static inline void
+paint_span_with_color_simd(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
+{
+	int n1 = n - 1;
+	int sa = FZ_EXPAND(color[n1]); /* < 256, opaque colors are painted below */
+	v16 c = v_color(color, n);
+	v16 a = v_splat(sa);
+	int k;
+
+	for (; w >= 16 / n; w -= 16 / n)
+	{
+		v16 ml, mh, dl, dh;
+		v_mask(mp, n, &ml, &mh);
+		v_load(dp, &dl, &dh);
+		ml = v_shr(v_mul(v_expand(ml), a), 8);
+		mh = v_shr(v_mul(v_expand(mh), a), 8);
+		v_store(dp, v_blend(c, dl, ml), v_blend(c, dh, mh));
+		dp += 16;
+		mp += 16 / n;
+	}
+	while (w--)
+	{
+		int ma = *mp++;
+		ma = FZ_COMBINE(FZ_EXPAND(ma), sa);
+		for (k = 0; k < n1; k++)
+			dp[k] = FZ_BLEND(color[k], dp[k], ma);
+		dp[k] = FZ_BLEND(255, dp[k], ma);
+		dp += n;
+	}
+}
+
+static void
+paint_span_with_color_2_simd(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	paint_span_with_color_simd(dp, mp, 2, w, color);
+}
+
+static void
+paint_span_with_color_4_simd(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	paint_span_with_color_simd(dp, mp, 4, w, color);
+}
+
+static inline void
+paint_span_with_opaque_color_simd(byte * restrict dp, byte * restrict mp, int n, int w, byte *color)
+{
+	int n1 = n - 1;
+	v16 c = v_color(color, n);
+	byte solid[16];
+	int k;
+
+	for (k = 0; k < 16; k++)
+		solid[k] = (k % n == n1) ? 255 : color[k % n];
+
+	for (; w >= 16 / n; w -= 16 / n)
+	{
+		v16 ml, mh, dl, dh;
+		switch (mask_state(mp, n))
+		{
+		case 0:
+			break;
+		case 1:
+			memcpy(dp, solid, 16);
+			break;
+		default:
+			v_mask(mp, n, &ml, &mh);
+			v_load(dp, &dl, &dh);
+			v_store(dp, v_blend(c, dl, v_expand(ml)), v_blend(c, dh, v_expand(mh)));
+			break;
+		}
+		dp += 16;
+		mp += 16 / n;
+	}
+	while (w--)
+	{
+		int ma = *mp++;
+		if (ma == 255)
+		{
+			for (k = 0; k < n1; k++)
+				dp[k] = color[k];
+			dp[k] = 255;
+		}
+		else if (ma != 0)
+		{
+			ma = FZ_EXPAND(ma);
+			for (k = 0; k < n1; k++)
+				dp[k] = FZ_BLEND(color[k], dp[k], ma);
+			dp[k] = FZ_BLEND(255, dp[k], ma);
+		}
+		dp += n;
+	}
+}
+
+static void
+paint_span_with_opaque_color_2_simd(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	paint_span_with_opaque_color_simd(dp, mp, 2, w, color);
+}
+
+static void
+paint_span_with_opaque_color_4_simd(byte * restrict dp, byte * restrict mp, int w, byte *color)
+{
+	paint_span_with_opaque_color_simd(dp, mp, 4, w, color);
+}
+
+/* Blend source in mask over destination */
+
+static inline void
+paint_span_with_mask_simd(byte * restrict dp, byte * restrict sp, byte * restrict mp, int n, int w)
+{
+	v16 v255 = v_splat(255);
+
+	for (; w >= 16 / n; w -= 16 / n)
+	{
+		v16 ml, mh, sl, sh, dl, dh, al, ah;
+		v_mask(mp, n, &ml, &mh);
+		v_load(sp, &sl, &sh);
+		v_load(dp, &dl, &dh);
+		ml = v_expand(ml);
+		mh = v_expand(mh);
+		al = v_expand(v_sub(v255, v_shr(v_mul(v_alpha(sl, n), ml), 8)));
+		ah = v_expand(v_sub(v255, v_shr(v_mul(v_alpha(sh, n), mh), 8)));
+		dl = v_add(v_shr(v_mul(sl, ml), 8), v_shr(v_mul(dl, al), 8));
+		dh = v_add(v_shr(v_mul(sh, mh), 8), v_shr(v_mul(dh, ah), 8));
+		v_store(dp, dl, dh);
+		sp += 16;
+		dp += 16;
+		mp += 16 / n;
+	}
+	while (w--)
+	{
+		int k = n;
+		int masa;
+		int ma = *mp++;
+		ma = FZ_EXPAND(ma);
+		masa = FZ_COMBINE(sp[n-1], ma);
+		masa = 255 - masa;
+		masa = FZ_EXPAND(masa);
+		while (k--)
+		{
+			*dp = FZ_COMBINE2(*sp, ma, *dp, masa);
+			sp++; dp++;
+		}
+	}
+}
+
+static void
+paint_span_with_mask_2_simd(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	paint_span_with_mask_simd(dp, sp, mp, 2, w);
+}
+
+static void
+paint_span_with_mask_4_simd(byte * restrict dp, byte * restrict sp, byte * restrict mp, int w)
+{
+	paint_span_with_mask_simd(dp, sp, mp, 4, w);
+}
+
+/* Blend source over destination */
+
+static inline void
+paint_span_simd(byte * restrict dp, byte * restrict sp, int n, int w)
+{
+	v16 v255 = v_splat(255);
+
+	for (; w >= 16 / n; w -= 16 / n)
+	{
+		v16 sl, sh, dl, dh, tl, th;
+		v_load(sp, &sl, &sh);
+		v_load(dp, &dl, &dh);
+		tl = v_expand(v_sub(v255, v_alpha(sl, n)));
+		th = v_expand(v_sub(v255, v_alpha(sh, n)));
+		v_store(dp, v_add(sl, v_shr(v_mul(dl, tl), 8)), v_add(sh, v_shr(v_mul(dh, th), 8)));
+		sp += 16;
+		dp += 16;
+	}
+	while (w--)
+	{
+		int k = n;
+		int t = FZ_EXPAND(255 - sp[n-1]);
+		while (k--)
+		{
+			*dp = *sp++ + FZ_COMBINE(*dp, t);
+			dp++;
+		}
+	}
+}
+
+static void
+paint_span_2_simd(byte * restrict dp, byte * restrict sp, int w)
+{
+	paint_span_simd(dp, sp, 2, w);
+}
+
+static void
+paint_span_4_simd(byte * restrict dp, byte * restrict sp, int w)
+{
+	paint_span_simd(dp, sp, 4, w);
+}
+
+/* Blend source in constant alpha over destination */
+
+static inline void
+paint_span_with_alpha_simd(byte * restrict dp, byte * restrict sp, int n, int w, int alpha)
+{
+	v16 a;
+
+	alpha = FZ_EXPAND(alpha);
+	a = v_splat(alpha);
+	for (; w >= 16 / n; w -= 16 / n)
+	{
+		v16 sl, sh, dl, dh;
+		v_load(sp, &sl, &sh);
+		v_load(dp, &dl, &dh);
+		dl = v_blend(sl, dl, v_shr(v_mul(v_alpha(sl, n), a), 8));
+		dh = v_blend(sh, dh, v_shr(v_mul(v_alpha(sh, n), a), 8));
+		v_store(dp, dl, dh);
+		sp += 16;
+		dp += 16;
+	}
+	while (w--)
+	{
+		int masa = FZ_COMBINE(sp[n-1], alpha);
+		int k = n;
+		while (k--)
+		{
+			*dp = FZ_BLEND(*sp++, *dp, masa);
+			dp++;
+		}
+	}
+}
+
+static void
+paint_span_2_with_alpha_simd(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	paint_span_with_alpha_simd(dp, sp, 2, w, alpha);
+}
+
+static void
+paint_span_4_with_alpha_simd(byte * restrict dp, byte * restrict sp, int w, int alpha)
+{
+	paint_span_with_alpha_simd(dp, sp, 4, w, alpha);
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+void
+fz_accelerate_paint(void)
+{
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	fz_paint_funcs.solid_color_4 = paint_solid_color_4_simd;
+	fz_paint_funcs.span_with_color_2 = paint_span_with_color_2_simd;
+	fz_paint_funcs.span_with_color_4 = paint_span_with_color_4_simd;
+	fz_paint_funcs.span_with_opaque_color_2 = paint_span_with_opaque_color_2_simd;
+	fz_paint_funcs.span_with_opaque_color_4 = paint_span_with_opaque_color_4_simd;
+	fz_paint_funcs.span_with_mask_2 = paint_span_with_mask_2_simd;
+	fz_paint_funcs.span_with_mask_4 = paint_span_with_mask_4_simd;
+	fz_paint_funcs.span_2 = paint_span_2_simd;
+	fz_paint_funcs.span_4 = paint_span_4_simd;
+	fz_paint_funcs.span_2_with_alpha = paint_span_2_with_alpha_simd;
+	fz_paint_funcs.span_4_with_alpha = paint_span_4_with_alpha_simd;
+#endif
+}
@@ -285,6 +285,8 @@ struct fz_scale_cache_s
 	int patch_r;
 	int n;
 	int flip;
+	int offset;
+	int part_w;
 	fz_weights *weights;
 };
 
@@ -507,8 +509,43 @@ check_weights(fz_weights *weights, int j, int w, float x, float wf)
 	DBUG(("total weight %d = %d\n", j, sum));
 }
 
+/* Make the weights relative to a part of the source row: offset is
+ * where it starts and w how long it is. Weights falling outside it are
+ * dropped, and the entries packed up again, as the row scalers walk
+ * them in order. */
+static void
+shift_weights(fz_weights *weights, int offset, int w)
+{
+	int *index = weights->index;
+	int j, idx, min, len, cut;
+	int out = index[0];
+
+	for (j = 0; j < weights->count; j++)
+	{
+		idx = index[j];
+		min = index[idx] - offset;
+		len = index[idx+1];
+		cut = 0;
+		if (min < 0)
+		{
+			cut = fz_mini(-min, len);
+			len -= cut;
+			min = 0;
+		}
+		if (min + len > w)
+			len = fz_maxi(w - min, 0);
+		if (len == 0)
+			min = 0;
+		memmove(&index[out+2], &index[idx+2+cut], len * sizeof(int));
+		index[out] = min;
+		index[out+1] = len;
+		index[j] = out;
+		out += 2 + len;
+	}
+}
+
 static fz_weights *
-make_weights(fz_context *ctx, int src_w, float x, float dst_w, fz_scale_filter *filter, int vertical, int dst_w_int, int patch_l, int patch_r, int n, int flip, fz_scale_cache *cache)
+make_weights(fz_context *ctx, int src_w, float x, float dst_w, fz_scale_filter *filter, int vertical, int dst_w_int, int patch_l, int patch_r, int n, int flip, int offset, int part_w, fz_scale_cache *cache)
 {
 	fz_weights *weights;
 	float F, G;
@@ -521,7 +558,8 @@ make_weights(fz_context *ctx, int src_w, float x, float dst_w, fz_scale_filter *
 			cache->filter == filter && cache->vertical == vertical &&
 			cache->dst_w_int == dst_w_int &&
 			cache->patch_l == patch_l && cache->patch_r == patch_r &&
-			cache->n == n && cache->flip == flip)
+			cache->n == n && cache->flip == flip &&
+			cache->offset == offset && cache->part_w == part_w)
 		{
 			return cache->weights;
 		}
@@ -535,6 +573,8 @@ make_weights(fz_context *ctx, int src_w, float x, float dst_w, fz_scale_filter *
 		cache->patch_r = patch_r;
 		cache->n = n;
 		cache->flip = flip;
+		cache->offset = offset;
+		cache->part_w = part_w;
 		fz_free(ctx, cache->weights);
 		cache->weights = NULL;
 	}
@@ -576,6 +616,8 @@ make_weights(fz_context *ctx, int src_w, float x, float dst_w, fz_scale_filter *
 		}
 	}
 	weights->count++; /* weights->count = dst_w_int now */
+	if (offset != 0 || part_w != src_w)
+		shift_weights(weights, offset, part_w);
 	if (cache)
 	{
 		cache->weights = weights;
@@ -1070,6 +1112,59 @@ scale_row_from_temp(unsigned char *dst, int *src, fz_weights *weights, int width
 }
 #endif
 
+/* Filled in by fz_accelerate when the CPU has SIMD; see fitz-internal.h */
+fz_scale_table fz_scale_funcs = { NULL, NULL, NULL, NULL, NULL };
+
+/*
+An exact 2:1 or 4:1 reduction gives every output pixel away from the
+edges the same 2*factor weights, factor source pixels on from its
+neighbour. Find the longest run of such pixels so that the SIMD code can
+hold the weights in registers across it. Returns its length (0 if there
+is none worth having) and sets *first and *factor.
+*/
+static int
+find_fixed_run(fz_weights *weights, int *first, int *factor)
+{
+	int *index = weights->index;
+	int i, start = 0, best = 0;
+
+	for (i = 1; i <= weights->count; i++)
+	{
+		int *a = &index[index[start]];
+		int *b = &index[index[i-1]];
+		int *c = i < weights->count ? &index[index[i]] : NULL;
+		int f = a[1] / 2;
+
+		if (c && (f == 2 || f == 4) && a[1] == 2*f && c[1] == a[1] &&
+			c[0] == b[0] + f && !memcmp(&c[2], &a[2], a[1] * sizeof(int)))
+			continue;
+		if (i - start > best)
+		{
+			best = i - start;
+			*first = start;
+			*factor = f;
+		}
+		start = i;
+	}
+	return best >= 8 ? best : 0;
+}
+
+static void
+scale_row_to_temp_fixed(int *dst, unsigned char *src, fz_weights *weights, int first, int count, int factor)
+{
+	void (*row_scale)(int *dst, unsigned char *src, int *contrib, int count, int flip);
+	int *index = weights->index;
+	int *contrib = &index[index[first]];
+	int n = weights->n;
+	int last = first + count;
+
+	row_scale = n == 1 ? fz_scale_funcs.row_to_temp_1 : n == 2 ? fz_scale_funcs.row_to_temp_2 : fz_scale_funcs.row_to_temp_4;
+	(*row_scale)(dst, src, &index[index[0]], first, 0);
+	fz_scale_funcs.row_to_temp_fixed(&dst[first*n], &src[contrib[0]*n], &contrib[2], n, factor, count);
+	if (last < weights->count)
+		(*row_scale)(&dst[last*n], src, &index[index[last]], weights->count - last, 0);
+}
+
 #ifdef SINGLE_PIXEL_SPECIALS
 static void
 duplicate_single_pixel(unsigned char *dst, unsigned char *src, int n, int w, int h)
@@ -1243,8 +1338,14 @@ fz_scale_pixmap(fz_context *ctx, fz_pixmap *src, float x, float y, float w, floa
 	return fz_scale_pixmap_cached(ctx, src, x, y, w, h, clip, NULL, NULL);
 }
 
-fz_pixmap *
-fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, fz_bbox *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+/*
+	Scale an image of src_w x src_h pixels, of which src holds the part
+	at src_x, src_y. Output pixels are weighted just as they are for
+	the whole image; any source pixels they take outside the part are
+	left out.
+*/
+static fz_pixmap *
+scale_pixmap(fz_context *ctx, fz_pixmap *src, int src_x, int src_y, int src_w, int src_h, float x, float y, float w, float h, fz_bbox *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
 {
 	fz_scale_filter *filter = &fz_scale_filter_simple;
 	fz_weights *contrib_rows = NULL;
@@ -1252,14 +1353,18 @@ fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float
 	fz_pixmap *output = NULL;
 	int *temp = NULL;
 	int max_row, temp_span, temp_rows, row;
+	int fixed_first = 0, fixed_count = 0, fixed_factor = 0;
 	int dst_w_int, dst_h_int, dst_x_int, dst_y_int;
 	int flip_x, flip_y;
 	fz_bbox patch;
 
 	fz_var(contrib_cols);
 	fz_var(contrib_rows);
+	fz_var(fixed_first);
+	fz_var(fixed_count);
+	fz_var(fixed_factor);
 
-	DBUG(("Scale: (%d,%d) to (%g,%g) at (%g,%g)\n",src->w,src->h,w,h,x,y));
+	DBUG(("Scale: (%d,%d) to (%g,%g) at (%g,%g)\n",src_w,src_h,w,h,x,y));
 
 	/* Find the destination bbox, width/height, and sub pixel offset,
 	 * allowing for whether we're flipping or not. */
@@ -1277,7 +1382,7 @@ fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float
 	 *
 	 * x can either be r.xmin-R.xmin or R.xmax-r.xmax depending on whether
 	 * the image is x flipped or not. Whatever happens 0 <= x < 1.
-	 * y is always R.ymax - r.ymax.
+	 * y is always r.ymin - R.ymin, as rows are stored out forwards.
 	 */
 	/* dst_x_int is calculated to be the left of the scaled image, and
 	 * x (the sub_pixel_offset) is the distance in from either the left
@@ -1301,18 +1406,17 @@ fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float
 	}
 	flip_y = (h < 0);
 	/* dst_y_int is calculated to be the top of the scaled image, and
-	 * y (the sub pixel offset) is the distance in from either the top
-	 * or bottom pixel expanded edge.
+	 * y (the sub pixel offset) is the distance in from the top pixel
+	 * expanded edge. A flipped image is fed in bottom row first, so
+	 * the top is where its last row goes.
 	 */
 	if (flip_y)
 	{
-		float tmp;
 		h = -h;
-		dst_y_int = floorf(y-h);
-		tmp = ceilf(y);
-		dst_h_int = (int)tmp;
-		y = tmp - y;
-		dst_h_int -= dst_y_int;
+		y -= h;
+		dst_y_int = floorf(y);
+		y -= (float)dst_y_int;
+		dst_h_int = (int)ceilf(y + h);
 	} else {
 		dst_y_int = floorf(y);
 		y -= (float)dst_y_int;
@@ -1377,17 +1481,17 @@ fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float
 	{
 		/* Step 1: Calculate the weights for columns and rows */
 #ifdef SINGLE_PIXEL_SPECIALS
-		if (src->w == 1)
+		if (src_w == 1 && src->h == src_h)
 			contrib_cols = NULL;
 		else
 #endif /* SINGLE_PIXEL_SPECIALS */
-			contrib_cols = make_weights(ctx, src->w, x, w, filter, 0, dst_w_int, patch.x0, patch.x1, src->n, flip_x, cache_x);
+			contrib_cols = make_weights(ctx, src_w, x, w, filter, 0, dst_w_int, patch.x0, patch.x1, src->n, flip_x, src_x, src->w, cache_x);
 #ifdef SINGLE_PIXEL_SPECIALS
-		if (src->h == 1)
+		if (src_h == 1)
 			contrib_rows = NULL;
 		else
 #endif /* SINGLE_PIXEL_SPECIALS */
-			contrib_rows = make_weights(ctx, src->h, y, h, filter, 1, dst_h_int, patch.y0, patch.y1, src->n, flip_y, cache_y);
+			contrib_rows = make_weights(ctx, src_h, y, h, filter, 1, dst_h_int, patch.y0, patch.y1, src->n, flip_y, 0, src_h, cache_y);
 
 		output = fz_new_pixmap(ctx, src->colorspace, patch.x1 - patch.x0, patch.y1 - patch.y0);
 	}
@@ -1427,6 +1531,9 @@ fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float
 #endif /* SINGLE_PIXEL_SPECIALS */
 	{
 		void (*row_scale)(int *dst, unsigned char *src, fz_weights *weights);
+		void (*row_scale_simd)(int *dst, unsigned char *src, int *contrib, int count, int flip) = NULL;
+
+		fz_var(row_scale_simd);
 
 		temp_span = contrib_cols->count * src->n;
 		temp_rows = contrib_rows->max_len;
@@ -1452,14 +1559,19 @@ fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float
 			break;
 		case 1: /* Image mask case */
 			row_scale = scale_row_to_temp1;
+			row_scale_simd = fz_scale_funcs.row_to_temp_1;
 			break;
 		case 2: /* Greyscale with alpha case */
 			row_scale = scale_row_to_temp2;
+			row_scale_simd = fz_scale_funcs.row_to_temp_2;
 			break;
 		case 4: /* RGBA */
 			row_scale = scale_row_to_temp4;
+			row_scale_simd = fz_scale_funcs.row_to_temp_4;
 			break;
 		}
+		if (row_scale_simd && fz_scale_funcs.row_to_temp_fixed && !contrib_cols->flip)
+			fixed_count = find_fixed_run(contrib_cols, &fixed_first, &fixed_factor);
 		max_row = contrib_rows->index[contrib_rows->index[0]];
 		for (row = 0; row < contrib_rows->count; row++)
 		{
@@ -1474,14 +1586,33 @@ fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float
 			while (max_row < row_min+row_len)
 			{
 				/* Scale another row */
-				assert(max_row < src->h);
+				int *row_temp = &temp[temp_span*(max_row % temp_rows)];
+				int src_row = (flip_y ? (src_h-1-max_row): max_row) - src_y;
+				unsigned char *row_src;
+				assert(max_row < src_h);
 				DBUG(("scaling row %d to temp\n", max_row));
-				(*row_scale)(&temp[temp_span*(max_row % temp_rows)], &src->samples[(flip_y ? (src->h-1-max_row): max_row)*src->w*src->n], contrib_cols);
+				if (src_row < 0 || src_row >= src->h)
+				{
+					/* Rows outside the part count for nothing */
+					memset(row_temp, 0, temp_span * sizeof(int));
+					max_row++;
+					continue;
+				}
+				row_src = &src->samples[src_row*src->w*src->n];
+				if (fixed_count)
+					scale_row_to_temp_fixed(row_temp, row_src, contrib_cols, fixed_first, fixed_count, fixed_factor);
+				else if (row_scale_simd)
+					row_scale_simd(row_temp, row_src, &contrib_cols->index[contrib_cols->index[0]], contrib_cols->count, contrib_cols->flip);
+				else
+					(*row_scale)(row_temp, row_src, contrib_cols);
 				max_row++;
 			}
 
 			DBUG(("scaling row %d from temp\n", row));
-			scale_row_from_temp(&output->samples[row*output->w*output->n], temp, contrib_rows, temp_span, row);
+			if (fz_scale_funcs.row_from_temp)
+				fz_scale_funcs.row_from_temp(&output->samples[row*output->w*output->n], temp, &contrib_rows->index[row_index], row_len, temp_span);
+			else
+				scale_row_from_temp(&output->samples[row*output->w*output->n], temp, contrib_rows, temp_span, row);
 		}
 		fz_free(ctx, temp);
 	}
@@ -1494,6 +1625,18 @@ cleanup:
 	return output;
 }
 
+fz_pixmap *
+fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, fz_bbox *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+{
+	return scale_pixmap(ctx, src, 0, 0, src->w, src->h, x, y, w, h, clip, cache_x, cache_y);
+}
+
+fz_pixmap *
+fz_scale_pixmap_part(fz_context *ctx, fz_pixmap *src, int src_w, int src_h, float x, float y, float w, float h, fz_bbox *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y)
+{
+	return scale_pixmap(ctx, src, src->x, src->y, src_w, src_h, x, y, w, h, clip, cache_x, cache_y);
+}
+
 void
 fz_free_scale_cache(fz_context *ctx, fz_scale_cache *sc)
 {
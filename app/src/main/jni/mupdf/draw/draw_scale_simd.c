@@ -0,0 +1,529 @@
+#include "fitz-internal.h"
+#include "draw_simd.h"
+
+/*
+Scaler passes. The horizontal ones take each output pixel's taps a group
+at a time (8 or 4 greys, 4 grey+alpha pixels, 2 rgba pixels) with the
+weights narrowed to 16 bits, and finish the odd taps in C; a group is
+only loaded when all of its taps are there, so we never read past the
+end of a source row. The vertical pass does 8 output bytes at a time,
+one row of the temporary buffer per weight, which is also kinder to the
+cache than the column order of the C loop. All sums are the same
+integers the C code forms.
+*/
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+#ifdef HAVE_SSE2
+
+/* Four int lanes, for the scaler */
+typedef __m128i v32;
+
+#define v32_splat(a) _mm_set1_epi32(a)
+#define v32_add(a, b) _mm_add_epi32(a, b)
+
+static inline v32 v32_load(const int *p)
+{
+	return _mm_loadu_si128((const __m128i *)p);
+}
+
+static inline void v32_store(int *p, v32 a)
+{
+	_mm_storeu_si128((__m128i *)p, a);
+}
+
+/* acc + a.w, keeping the low 32 bits of each product as C does */
+static inline v32 v32_mla(v32 acc, v32 a, v32 w)
+{
+	__m128i even = _mm_mul_epu32(a, w);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), w);
+	even = _mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0));
+	odd = _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0));
+	return _mm_add_epi32(acc, _mm_unpacklo_epi32(even, odd));
+}
+
+/* a>>16 and b>>16, clamped to 0..255, into 8 bytes */
+static inline void v32_pack(byte *p, v32 a, v32 b)
+{
+	__m128i x = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+	_mm_storel_epi64((__m128i *)p, _mm_packus_epi16(x, x));
+}
+
+/* p[0] = a0+a2, p[1] = a1+a3 */
+static inline void v32_fold(int *p, v32 a)
+{
+	_mm_storel_epi64((__m128i *)p, _mm_add_epi32(a, _mm_srli_si128(a, 8)));
+}
+
+/* [a0+a1, a2+a3, b0+b1, b2+b3] */
+static inline v32 v32_hadd(v32 a, v32 b)
+{
+	__m128 x = _mm_castsi128_ps(a);
+	__m128 y = _mm_castsi128_ps(b);
+	__m128i even = _mm_castps_si128(_mm_shuffle_ps(x, y, _MM_SHUFFLE(2, 0, 2, 0)));
+	__m128i odd = _mm_castps_si128(_mm_shuffle_ps(x, y, _MM_SHUFFLE(3, 1, 3, 1)));
+	return _mm_add_epi32(even, odd);
+}
+
+/* [a0, a2, a1, a3] */
+static inline v32 v32_zip(v32 a)
+{
+	return _mm_shuffle_epi32(a, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/* Eight 16-bit lanes, multiplied and summed in adjacent pairs */
+typedef __m128i v16s;
+
+#define v_madd(x, w) _mm_madd_epi16(x, w)
+
+static inline v16s v16s_set(const short *w)
+{
+	return _mm_loadu_si128((const __m128i *)w);
+}
+
+/* 8 greys */
+static inline v16s v_load_1(const byte *p)
+{
+	return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), _mm_setzero_si128());
+}
+
+/* 4 grey+alpha pixels, as g0 g1 g2 g3 a0 a1 a2 a3 */
+static inline v16s v_load_2(const byte *p)
+{
+	__m128i x = v_load_1(p);
+	x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+	x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+/* 2 rgba pixels, as r0 r1 g0 g1 b0 b1 a0 a1 */
+static inline v16s v_load_4(const byte *p)
+{
+	__m128i x = v_load_1(p);
+	return _mm_unpacklo_epi16(x, _mm_srli_si128(x, 8));
+}
+
+static inline __m128i v_weights(const int *w)
+{
+	__m128i x = v32_load(w);
+	return _mm_packs_epi32(x, x);
+}
+
+/* 4 and 8 greys against their weights; the lanes sum to the result */
+static inline v32 v_dot_4(const byte *p, const int *w)
+{
+	unsigned int a;
+	__m128i x;
+	memcpy(&a, p, 4);
+	x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a), _mm_setzero_si128());
+	return _mm_madd_epi16(x, v_weights(w));
+}
+
+static inline v32 v_dot_8(const byte *p, const int *w)
+{
+	return _mm_madd_epi16(v_load_1(p), _mm_packs_epi32(v32_load(w), v32_load(w + 4)));
+}
+
+/* 4 grey+alpha pixels; lanes 0+2 give grey, 1+3 alpha */
+static inline v32 v_taps_2(const byte *p, const int *w)
+{
+	__m128i x = v_load_1(p);
+	__m128i ww = v_weights(w);
+	x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+	x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(3, 1, 2, 0));
+	return _mm_madd_epi16(x, _mm_unpacklo_epi32(ww, ww));
+}
+
+/* 1 or 2 rgba pixels */
+static inline v32 v_tap_4(const byte *p, int w)
+{
+	unsigned int a;
+	__m128i x;
+	memcpy(&a, p, 4);
+	x = _mm_unpacklo_epi8(_mm_cvtsi32_si128(a), _mm_setzero_si128());
+	x = _mm_unpacklo_epi16(x, _mm_setzero_si128());
+	return _mm_madd_epi16(x, _mm_set1_epi32(w & 0xFFFF));
+}
+
+static inline v32 v_taps_4(const byte *p, const int *w)
+{
+	return _mm_madd_epi16(v_load_4(p), _mm_set1_epi32((w[1] << 16) | (w[0] & 0xFFFF)));
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+/* Four int lanes, for the scaler */
+typedef int32x4_t v32;
+
+#define v32_splat(a) vdupq_n_s32(a)
+#define v32_add(a, b) vaddq_s32(a, b)
+#define v32_load(p) vld1q_s32(p)
+#define v32_store(p, a) vst1q_s32(p, a)
+#define v32_mla(acc, a, w) vmlaq_s32(acc, a, w)
+
+/* a>>16 and b>>16, clamped to 0..255, into 8 bytes */
+static inline void v32_pack(byte *p, v32 a, v32 b)
+{
+	int16x8_t x = vcombine_s16(vqmovn_s32(vshrq_n_s32(a, 16)), vqmovn_s32(vshrq_n_s32(b, 16)));
+	vst1_u8(p, vqmovun_s16(x));
+}
+
+/* p[0] = a0+a2, p[1] = a1+a3 */
+static inline void v32_fold(int *p, v32 a)
+{
+	vst1_s32(p, vadd_s32(vget_low_s32(a), vget_high_s32(a)));
+}
+
+/* [a0+a1, a2+a3, b0+b1, b2+b3] */
+static inline v32 v32_hadd(v32 a, v32 b)
+{
+	return vcombine_s32(vpadd_s32(vget_low_s32(a), vget_high_s32(a)), vpadd_s32(vget_low_s32(b), vget_high_s32(b)));
+}
+
+/* [a0, a2, a1, a3] */
+static inline v32 v32_zip(v32 a)
+{
+	int32x2x2_t z = vzip_s32(vget_low_s32(a), vget_high_s32(a));
+	return vcombine_s32(z.val[0], z.val[1]);
+}
+
+/* Eight 16-bit lanes, multiplied and summed in adjacent pairs */
+typedef int16x8_t v16s;
+
+#define v16s_set(w) vld1q_s16(w)
+
+static inline v32 v_madd(v16s x, v16s w)
+{
+	return v32_hadd(vmull_s16(vget_low_s16(x), vget_low_s16(w)), vmull_s16(vget_high_s16(x), vget_high_s16(w)));
+}
+
+/* 8 greys */
+static inline v16s v_load_1(const byte *p)
+{
+	return vreinterpretq_s16_u16(vmovl_u8(vld1_u8(p)));
+}
+
+/* 4 grey+alpha pixels, as g0 g1 g2 g3 a0 a1 a2 a3 */
+static inline v16s v_load_2(const byte *p)
+{
+	uint8x8_t x = vld1_u8(p);
+	uint8x8x2_t u = vuzp_u8(x, x);
+	uint32x2x2_t z = vzip_u32(vreinterpret_u32_u8(u.val[0]), vreinterpret_u32_u8(u.val[1]));
+	return vreinterpretq_s16_u16(vmovl_u8(vreinterpret_u8_u32(z.val[0])));
+}
+
+/* 2 rgba pixels, as r0 r1 g0 g1 b0 b1 a0 a1 */
+static inline v16s v_load_4(const byte *p)
+{
+	uint8x8_t x = vld1_u8(p);
+	return vreinterpretq_s16_u16(vmovl_u8(vzip_u8(x, vext_u8(x, x, 4)).val[0]));
+}
+
+static inline int16x4_t v_widen_4(const byte *p)
+{
+	unsigned int a;
+	memcpy(&a, p, 4);
+	return vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(a)))));
+}
+
+/* 4 and 8 greys against their weights; the lanes sum to the result */
+static inline v32 v_dot_4(const byte *p, const int *w)
+{
+	return vmull_s16(v_widen_4(p), vmovn_s32(vld1q_s32(w)));
+}
+
+static inline v32 v_dot_8(const byte *p, const int *w)
+{
+	int16x8_t x = v_load_1(p);
+	v32 acc = vmull_s16(vget_low_s16(x), vmovn_s32(vld1q_s32(w)));
+	return vmlal_s16(acc, vget_high_s16(x), vmovn_s32(vld1q_s32(w + 4)));
+}
+
+/* 4 grey+alpha pixels; lanes 0+2 give grey, 1+3 alpha */
+static inline v32 v_taps_2(const byte *p, const int *w)
+{
+	int16x8_t x = v_load_1(p);
+	int16x4_t ww = vmovn_s32(vld1q_s32(w));
+	int16x4x2_t z = vzip_s16(ww, ww);
+	v32 acc = vmull_s16(vget_low_s16(x), z.val[0]);
+	return vmlal_s16(acc, vget_high_s16(x), z.val[1]);
+}
+
+/* 1 or 2 rgba pixels */
+static inline v32 v_tap_4(const byte *p, int w)
+{
+	return vmull_n_s16(v_widen_4(p), w);
+}
+
+static inline v32 v_taps_4(const byte *p, const int *w)
+{
+	int16x8_t x = v_load_1(p);
+	return vmlal_n_s16(vmull_n_s16(vget_low_s16(x), w[0]), vget_high_s16(x), w[1]);
+}
+
+#endif /* HAVE_NEON */
+
+static void
+scale_row_to_temp_1_simd(int *dst, byte *src, int *contrib, int count, int flip)
+{
+	int step = 1;
+
+	if (flip)
+	{
+		dst += count - 1;
+		step = -1;
+	}
+	for (; count > 0; count--)
+	{
+		byte *min = &src[*contrib++];
+		int len = *contrib++;
+		int val = 0;
+		if (len >= 4)
+		{
+			v32 acc = v32_splat(0);
+			int sum[2];
+			for (; len >= 8; len -= 8)
+			{
+				acc = v32_add(acc, v_dot_8(min, contrib));
+				min += 8;
+				contrib += 8;
+			}
+			if (len >= 4)
+			{
+				acc = v32_add(acc, v_dot_4(min, contrib));
+				min += 4;
+				contrib += 4;
+				len -= 4;
+			}
+			v32_fold(sum, acc);
+			val = sum[0] + sum[1];
+		}
+		while (len-- > 0)
+			val += *min++ * *contrib++;
+		*dst = val;
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp_2_simd(int *dst, byte *src, int *contrib, int count, int flip)
+{
+	int step = 2;
+
+	if (flip)
+	{
+		dst += 2 * (count - 1);
+		step = -2;
+	}
+	for (; count > 0; count--)
+	{
+		byte *min = &src[2 * *contrib++];
+		int len = *contrib++;
+		int sum[2] = { 0, 0 };
+		if (len >= 4)
+		{
+			v32 acc = v32_splat(0);
+			for (; len >= 4; len -= 4)
+			{
+				acc = v32_add(acc, v_taps_2(min, contrib));
+				min += 8;
+				contrib += 4;
+			}
+			v32_fold(sum, acc);
+		}
+		while (len-- > 0)
+		{
+			sum[0] += *min++ * *contrib;
+			sum[1] += *min++ * *contrib++;
+		}
+		dst[0] = sum[0];
+		dst[1] = sum[1];
+		dst += step;
+	}
+}
+
+static void
+scale_row_to_temp_4_simd(int *dst, byte *src, int *contrib, int count, int flip)
+{
+	int step = 4;
+
+	if (flip)
+	{
+		dst += 4 * (count - 1);
+		step = -4;
+	}
+	for (; count > 0; count--)
+	{
+		byte *min = &src[4 * *contrib++];
+		int len = *contrib++;
+		v32 acc = v32_splat(0);
+		for (; len >= 2; len -= 2)
+		{
+			acc = v32_add(acc, v_taps_4(min, contrib));
+			min += 8;
+			contrib += 2;
+		}
+		if (len)
+			acc = v32_add(acc, v_tap_4(min, *contrib++));
+		v32_store(dst, acc);
+		dst += step;
+	}
+}
+
+/*
+An exact 2:1 or 4:1 reduction puts the same 2*factor weights on every
+output pixel away from the edges, each pixel's taps starting factor
+source pixels on from the last. Across such a run we keep the weights
+in registers and take several outputs per step. src points at the first
+tap of the first pixel.
+*/
+static void
+scale_row_to_temp_fixed_simd(int *dst, byte *src, int *weights, int n, int factor, int count)
+{
+	short pw[4][8] = { { 0 } };
+	short qw[2][8] = { { 0 } };
+	v16s p0, p1, p2, p3, q0, q1;
+	int i, k, len = 2 * factor;
+
+	/* Taps 2k, 2k+1 in every pair of lanes; taps 4k..4k+3 in each half */
+	for (k = 0; k < factor; k++)
+		for (i = 0; i < 8; i++)
+			pw[k][i] = weights[2 * k + (i & 1)];
+	for (k = 0; k < factor / 2; k++)
+		for (i = 0; i < 8; i++)
+			qw[k][i] = weights[4 * k + (i & 3)];
+	p0 = v16s_set(pw[0]);
+	p1 = v16s_set(pw[1]);
+	p2 = v16s_set(pw[factor == 4 ? 2 : 0]);
+	p3 = v16s_set(pw[factor == 4 ? 3 : 0]);
+	q0 = v16s_set(qw[0]);
+	q1 = v16s_set(qw[factor == 4 ? 1 : 0]);
+
+	if (n == 1 && factor == 2)
+	{
+		for (; count >= 4; count -= 4)
+		{
+			v32_store(dst, v32_add(v_madd(v_load_1(src), p0), v_madd(v_load_1(src + 2), p1)));
+			src += 8;
+			dst += 4;
+		}
+	}
+	else if (n == 1)
+	{
+		for (; count >= 4; count -= 4)
+		{
+			v32 a = v32_add(v_madd(v_load_1(src), q0), v_madd(v_load_1(src + 4), q1));
+			v32 b = v32_add(v_madd(v_load_1(src + 8), q0), v_madd(v_load_1(src + 12), q1));
+			v32_store(dst, v32_hadd(a, b));
+			src += 16;
+			dst += 4;
+		}
+	}
+	else if (n == 2 && factor == 2)
+	{
+		for (; count >= 2; count -= 2)
+		{
+			v32 a = v32_add(v_madd(v_load_2(src), p0), v_madd(v_load_2(src + 4), p1));
+			v32_store(dst, v32_zip(a));
+			src += 8;
+			dst += 4;
+		}
+	}
+	else if (n == 2)
+	{
+		for (; count >= 2; count -= 2)
+		{
+			v16s mid = v_load_2(src + 8);
+			v32 a = v32_add(v_madd(v_load_2(src), q0), v_madd(mid, q1));
+			v32 b = v32_add(v_madd(mid, q0), v_madd(v_load_2(src + 16), q1));
+			v32_store(dst, v32_hadd(a, b));
+			src += 16;
+			dst += 4;
+		}
+	}
+	else if (factor == 2)
+	{
+		for (; count > 0; count--)
+		{
+			v32_store(dst, v32_add(v_madd(v_load_4(src), p0), v_madd(v_load_4(src + 8), p1)));
+			src += 8;
+			dst += 4;
+		}
+	}
+	else
+	{
+		for (; count > 0; count--)
+		{
+			v32 a = v32_add(v_madd(v_load_4(src), p0), v_madd(v_load_4(src + 8), p1));
+			v32 b = v32_add(v_madd(v_load_4(src + 16), p2), v_madd(v_load_4(src + 24), p3));
+			v32_store(dst, v32_add(a, b));
+			src += 16;
+			dst += 4;
+		}
+	}
+
+	for (; count > 0; count--)
+	{
+		for (k = 0; k < n; k++)
+		{
+			int val = 0;
+			for (i = 0; i < len; i++)
+				val += src[i * n + k] * weights[i];
+			*dst++ = val;
+		}
+		src += n * factor;
+	}
+}
+
+static void
+scale_row_from_temp_simd(byte *dst, int *src, int *contrib, int len, int width)
+{
+	int x, k;
+
+	for (x = 0; x + 8 <= width; x += 8)
+	{
+		v32 a = v32_splat(1<<15);
+		v32 b = a;
+		int *min = &src[x];
+		for (k = 0; k < len; k++)
+		{
+			v32 w = v32_splat(contrib[k]);
+			a = v32_mla(a, v32_load(min), w);
+			b = v32_mla(b, v32_load(min + 4), w);
+			min += width;
+		}
+		v32_pack(&dst[x], a, b);
+	}
+	for (; x < width; x++)
+	{
+		int *min = &src[x];
+		int val = 0;
+		for (k = 0; k < len; k++)
+		{
+			val += *min * contrib[k];
+			min += width;
+		}
+		val = (val+(1<<15))>>16;
+		if (val < 0)
+			val = 0;
+		else if (val > 255)
+			val = 255;
+		dst[x] = val;
+	}
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+void
+fz_accelerate_scale(void)
+{
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	fz_scale_funcs.row_to_temp_1 = scale_row_to_temp_1_simd;
+	fz_scale_funcs.row_to_temp_2 = scale_row_to_temp_2_simd;
+	fz_scale_funcs.row_to_temp_4 = scale_row_to_temp_4_simd;
+	fz_scale_funcs.row_to_temp_fixed = scale_row_to_temp_fixed_simd;
+	fz_scale_funcs.row_from_temp = scale_row_from_temp_simd;
+#endif
+}
@@ -0,0 +1,130 @@
+#ifndef DRAW_SIMD_H
+#define DRAW_SIMD_H
+
+/*
+
+The vector layer shared by the draw_*_simd.c files: SSE2 (x86, x86_64)
+and NEON (armeabi-v7a, arm64) versions of the same few operations on 8
+16-bit lanes, so that each kernel is written once for both. Most kernels
+work on 16 bytes at a time (4 rgba or 8 grey pixels), widened into two
+such vectors, with exactly the integer steps of the C code they replace,
+so the output is identical to it.
+
+NEON is optional on ARMv7, so on armeabi-v7a those files are built with
+NEON enabled, and fz_accelerate checks the CPU with fz_has_simd before
+installing any of them. SSE2 is part of both x86 ABIs. AVX2 is not, and
+would need its own run time check and build flags, so there are no
+256-bit versions.
+
+*/
+
+typedef unsigned char byte;
+
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define HAVE_NEON
+#endif
+
+#ifdef HAVE_SSE2
+
+#include <emmintrin.h>
+
+typedef __m128i v16;
+
+static inline void v_load(const byte *p, v16 *lo, v16 *hi)
+{
+	__m128i x = _mm_loadu_si128((const __m128i *)p);
+	*lo = _mm_unpacklo_epi8(x, _mm_setzero_si128());
+	*hi = _mm_unpackhi_epi8(x, _mm_setzero_si128());
+}
+
+static inline void v_store(byte *p, v16 lo, v16 hi)
+{
+	/* truncate to bytes, as the C code does on storing */
+	__m128i m = _mm_set1_epi16(0xFF);
+	_mm_storeu_si128((__m128i *)p, _mm_packus_epi16(_mm_and_si128(lo, m), _mm_and_si128(hi, m)));
+}
+
+static inline v16 v_set(const unsigned short *s)
+{
+	return _mm_loadu_si128((const __m128i *)s);
+}
+
+#define v_splat(a) _mm_set1_epi16(a)
+#define v_add(a, b) _mm_add_epi16(a, b)
+#define v_sub(a, b) _mm_sub_epi16(a, b)
+#define v_mul(a, b) _mm_mullo_epi16(a, b)
+#define v_shr(a, n) _mm_srli_epi16(a, n)
+
+/* Copy the alpha lane of each pixel over its color lanes */
+static inline v16 v_alpha_2(v16 v)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xF5), 0xF5);
+}
+
+static inline v16 v_alpha_4(v16 v)
+{
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xFF), 0xFF);
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+#include <arm_neon.h>
+
+typedef uint16x8_t v16;
+
+static inline void v_load(const byte *p, v16 *lo, v16 *hi)
+{
+	uint8x16_t x = vld1q_u8(p);
+	*lo = vmovl_u8(vget_low_u8(x));
+	*hi = vmovl_u8(vget_high_u8(x));
+}
+
+static inline void v_store(byte *p, v16 lo, v16 hi)
+{
+	vst1q_u8(p, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+}
+
+static inline v16 v_set(const unsigned short *s)
+{
+	return vld1q_u16(s);
+}
+
+#define v_splat(a) vdupq_n_u16(a)
+#define v_add(a, b) vaddq_u16(a, b)
+#define v_sub(a, b) vsubq_u16(a, b)
+#define v_mul(a, b) vmulq_u16(a, b)
+#define v_shr(a, n) vshrq_n_u16(a, n)
+
+static inline v16 v_alpha_2(v16 v)
+{
+	return vtrnq_u16(v, v).val[1];
+}
+
+static inline v16 v_alpha_4(v16 v)
+{
+	return vcombine_u16(vdup_lane_u16(vget_low_u16(v), 3), vdup_lane_u16(vget_high_u16(v), 3));
+}
+
+#endif /* HAVE_NEON */
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+static inline v16 v_alpha(v16 v, int n)
+{
+	return n == 2 ? v_alpha_2(v) : v_alpha_4(v);
+}
+
+/* fz_mul255, lane by lane */
+static inline v16 v_mul255(v16 a, v16 b)
+{
+	v16 x = v_add(v_mul(a, b), v_splat(128));
+	return v_shr(v_add(x, v_shr(x, 8)), 8);
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+#endif
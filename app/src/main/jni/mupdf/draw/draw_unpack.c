@@ -8,10 +8,13 @@
 #define get8(buf,x) (buf[x])
 #define get16(buf,x) (buf[x << 1])
 
+fz_decode_table fz_decode_funcs = { NULL, NULL };
+
 static unsigned char get1_tab_1[256][8];
 static unsigned char get1_tab_1p[256][16];
 static unsigned char get1_tab_255[256][8];
 static unsigned char get1_tab_255p[256][16];
+static unsigned char get1_tab_count[256];
 
 static void
 init_get1_tables(void)
@@ -39,6 +42,8 @@ init_get1_tables(void)
 			get1_tab_255[i][k] = x * 255;
 			get1_tab_255p[i][k * 2] = x * 255;
 			get1_tab_255p[i][k * 2 + 1] = 255;
+
+			get1_tab_count[i] += x;
 		}
 	}
 
@@ -134,6 +139,29 @@ fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, i
 				*dp++ = *sp++;
 		}
 
+		else if (depth == 8 && pad && n == 1)
+		{
+			for (x = 0; x < w; x++)
+			{
+				dp[0] = *sp++;
+				dp[1] = 255;
+				dp += 2;
+			}
+		}
+
+		else if (depth == 8 && pad && n == 3)
+		{
+			for (x = 0; x < w; x++)
+			{
+				dp[0] = sp[0];
+				dp[1] = sp[1];
+				dp[2] = sp[2];
+				dp[3] = 255;
+				dp += 4;
+				sp += 3;
+			}
+		}
+
 		else if (depth == 8 && pad)
 		{
 			for (x = 0; x < w; x++)
@@ -144,6 +172,20 @@ fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, i
 			}
 		}
 
+		else if (depth == 16)
+		{
+			for (x = 0; x < w; x++)
+			{
+				for (k = 0; k < n; k++)
+				{
+					*dp++ = *sp;
+					sp += 2;
+				}
+				if (pad)
+					*dp++ = 255;
+			}
+		}
+
 		else
 		{
 			int b = 0;
@@ -168,74 +210,427 @@ fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, i
 	}
 }
 
-/* Apply decode array */
+/* Make pixels whose components all lie in the color key ranges transparent */
 
 void
-fz_decode_indexed_tile(fz_pixmap *pix, float *decode, int maxval)
+fz_mask_color_key(fz_pixmap *pix, int n, int *colorkey)
 {
-	int add[FZ_MAX_COLORS];
-	int mul[FZ_MAX_COLORS];
 	unsigned char *p = pix->samples;
 	int len = pix->w * pix->h;
-	int n = pix->n - 1;
-	int needed;
-	int k;
+	int k, t;
+	while (len--)
+	{
+		t = 1;
+		for (k = 0; k < n; k++)
+			if (p[k] < colorkey[k * 2] || p[k] > colorkey[k * 2 + 1])
+				t = 0;
+		if (t)
+			for (k = 0; k < pix->n; k++)
+				p[k] = 0;
+		p += pix->n;
+	}
+}
+
+/* Apply decode array */
+
+/*
+ * A decoded sample depends on nothing but its own value and component,
+ * so we tabulate each component's 256 results once and look them up,
+ * rather than multiplying and clamping every sample. The make functions
+ * return 0 when the decode array leaves the samples alone.
+ */
+
+static int
+fz_make_decode_indexed_luts(unsigned char lut[][256], int n, float *decode, int maxval)
+{
+	int needed = 0;
+	int k, v;
 
-	needed = 0;
 	for (k = 0; k < n; k++)
 	{
 		int min = decode[k * 2] * 256;
 		int max = decode[k * 2 + 1] * 256;
-		add[k] = min;
-		mul[k] = (max - min) / maxval;
+		int add = min;
+		int mul = (max - min) / maxval;
 		needed |= min != 0 || max != maxval * 256;
+		for (v = 0; v < 256; v++)
+			lut[k][v] = fz_clampi((add + (((v << 8) * mul) >> 8)) >> 8, 0, 255);
 	}
+	return needed;
+}
 
-	if (!needed)
-		return;
+static int
+fz_make_decode_luts(unsigned char lut[][256], int n, float *decode)
+{
+	int needed = 0;
+	int k, v;
+
+	for (k = 0; k < n; k++)
+	{
+		int min = decode[k * 2] * 255;
+		int max = decode[k * 2 + 1] * 255;
+		int add = min;
+		int mul = max - min;
+		needed |= min != 0 || max != 255;
+		for (v = 0; v < 256; v++)
+			lut[k][v] = fz_clampi(add + fz_mul255(v, mul), 0, 255);
+	}
+	return needed;
+}
+
+static void
+fz_apply_decode_luts(fz_pixmap *pix, unsigned char lut[][256], int n)
+{
+	unsigned char *p = pix->samples;
+	int len = pix->w * pix->h;
+	int k;
 
 	while (len--)
 	{
 		for (k = 0; k < n; k++)
-		{
-			int value = (add[k] + (((p[k] << 8) * mul[k]) >> 8)) >> 8;
-			p[k] = fz_clampi(value, 0, 255);
-		}
-		p += n + 1;
+			p[k] = lut[k][p[k]];
+		p += pix->n;
 	}
 }
 
+void
+fz_decode_indexed_tile(fz_pixmap *pix, float *decode, int maxval)
+{
+	unsigned char lut[FZ_MAX_COLORS][256];
+	int n = pix->n - 1;
+
+	if (fz_make_decode_indexed_luts(lut, n, decode, maxval))
+		fz_apply_decode_luts(pix, lut, n);
+}
+
 void
 fz_decode_tile(fz_pixmap *pix, float *decode)
 {
-	int add[FZ_MAX_COLORS];
-	int mul[FZ_MAX_COLORS];
-	unsigned char *p = pix->samples;
-	int len = pix->w * pix->h;
+	unsigned char lut[FZ_MAX_COLORS][256];
 	int n = fz_maxi(1, pix->n - 1);
-	int needed;
 	int k;
 
-	needed = 0;
+	if (!fz_make_decode_luts(lut, n, decode))
+		return;
+
+	/* Grey and rgb with alpha can go to a SIMD multiply-add instead */
+	if ((pix->n == 2 && fz_decode_funcs.decode_2) || (pix->n == 4 && fz_decode_funcs.decode_4))
+	{
+		int add[4], mul[4];
+		int small = 1;
+		for (k = 0; k < n; k++)
+		{
+			add[k] = (int)(decode[k * 2] * 255);
+			mul[k] = (int)(decode[k * 2 + 1] * 255) - add[k];
+			small &= add[k] >= -32768 && add[k] <= 32767 && mul[k] >= -32768 && mul[k] <= 32767;
+		}
+		if (small)
+		{
+			if (pix->n == 2)
+				fz_decode_funcs.decode_2(pix->samples, pix->w * pix->h, add, mul);
+			else
+				fz_decode_funcs.decode_4(pix->samples, pix->w * pix->h, add, mul);
+			return;
+		}
+	}
+
+	fz_apply_decode_luts(pix, lut, n);
+}
+
+/*
+ * Unpack, color key and decode in one pass, writing each sample once. As
+ * with decoding, every step maps one sample value to another, so the lot
+ * folds into one table per component, indexed by the packed value (by its
+ * high byte for 16 bits). Color keys compare the unpacked samples of a
+ * whole pixel, so they are tested along the way; keyed pixels come out
+ * as a pixel of zeros decoded, with zero alpha.
+ */
+
+void
+fz_decode_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int indexed, float *decode, int *colorkey)
+{
+	unsigned char lut[FZ_MAX_COLORS][256];
+	unsigned char unpacked[256];
+	unsigned char keyed[FZ_MAX_COLORS];
+	int w = dst->w;
+	int pad = dst->n > n;
+	int levels = depth < 8 ? 1 << depth : 256;
+	int scale, nd, needed, x, y, k, v;
+
+	if (dst->n != n + pad || (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16))
+	{
+		/* Not a layout we tabulate; do it the long way */
+		fz_unpack_tile(dst, src, n, depth, stride, indexed);
+		if (colorkey)
+			fz_mask_color_key(dst, n, colorkey);
+		if (indexed)
+			fz_decode_indexed_tile(dst, decode, (1 << depth) - 1);
+		else
+			fz_decode_tile(dst, decode);
+		return;
+	}
+
+	scale = 1;
+	if (!indexed)
+	{
+		switch (depth)
+		{
+		case 1: scale = 255; break;
+		case 2: scale = 85; break;
+		case 4: scale = 17; break;
+		}
+	}
+	for (v = 0; v < levels; v++)
+		unpacked[v] = v * scale;
+
+	/* which components the decode array applies to */
+	if (indexed)
+	{
+		nd = dst->n - 1;
+		needed = fz_make_decode_indexed_luts(lut, nd, decode, (1 << depth) - 1);
+	}
+	else
+	{
+		nd = fz_maxi(1, dst->n - 1);
+		needed = fz_make_decode_luts(lut, nd, decode);
+	}
+
+	if (!needed && !colorkey)
+	{
+		fz_unpack_tile(dst, src, n, depth, stride, indexed);
+		return;
+	}
+
 	for (k = 0; k < n; k++)
 	{
-		int min = decode[k * 2] * 255;
-		int max = decode[k * 2 + 1] * 255;
-		add[k] = min;
-		mul[k] = max - min;
-		needed |= min != 0 || max != 255;
+		unsigned char dec[256];
+		if (needed && k < nd)
+			memcpy(dec, lut[k], 256);
+		else
+			for (v = 0; v < 256; v++)
+				dec[v] = v;
+		for (v = 0; v < levels; v++)
+			lut[k][v] = dec[unpacked[v]];
+		/* the value a keyed pixel takes */
+		keyed[k] = needed && k < nd ? dec[0] : 0;
 	}
 
-	if (!needed)
+	/* Bitonal, grey and alpha only images: expand a byte at a time */
+	if (n == 1 && depth < 8 && !colorkey)
+	{
+		unsigned char tab[256][16];
+		int per = 8 / depth;
+		int size = per << pad;
+
+		for (v = 0; v < 256; v++)
+		{
+			for (x = 0; x < per; x++)
+			{
+				int s = (v >> (8 - depth * (x + 1))) & (levels - 1);
+				if (pad)
+				{
+					tab[v][x * 2] = lut[0][s];
+					tab[v][x * 2 + 1] = 255;
+				}
+				else
+					tab[v][x] = lut[0][s];
+			}
+		}
+
+		for (y = 0; y < dst->h; y++)
+		{
+			unsigned char *sp = src + (unsigned int)(y * stride);
+			unsigned char *dp = dst->samples + (unsigned int)(y * dst->w * dst->n);
+			int wb = w / per;
+			for (x = 0; x < wb; x++)
+			{
+				memcpy(dp, tab[*sp++], size);
+				dp += size;
+			}
+			x = x * per;
+			if (x < w)
+				memcpy(dp, tab[*sp], (w - x) << pad);
+		}
 		return;
+	}
 
-	while (len--)
+	/* Whole bytes: look each one up (the high one of 16 bits) */
+	if (depth >= 8 && !colorkey)
 	{
-		for (k = 0; k < n; k++)
+		int step = depth >> 3;
+
+		for (y = 0; y < dst->h; y++)
 		{
-			int value = add[k] + fz_mul255(p[k], mul[k]);
-			p[k] = fz_clampi(value, 0, 255);
+			unsigned char *sp = src + (unsigned int)(y * stride);
+			unsigned char *dp = dst->samples + (unsigned int)(y * dst->w * dst->n);
+
+			if (n == 1 && !pad)
+			{
+				for (x = 0; x < w; x++)
+				{
+					*dp++ = lut[0][*sp];
+					sp += step;
+				}
+			}
+			else if (n == 1)
+			{
+				for (x = 0; x < w; x++)
+				{
+					dp[0] = lut[0][*sp];
+					dp[1] = 255;
+					dp += 2;
+					sp += step;
+				}
+			}
+			else if (n == 3 && pad)
+			{
+				for (x = 0; x < w; x++)
+				{
+					dp[0] = lut[0][sp[0]];
+					dp[1] = lut[1][sp[step]];
+					dp[2] = lut[2][sp[step * 2]];
+					dp[3] = 255;
+					dp += 4;
+					sp += step * 3;
+				}
+			}
+			else
+			{
+				for (x = 0; x < w; x++)
+				{
+					for (k = 0; k < n; k++)
+					{
+						*dp++ = lut[k][*sp];
+						sp += step;
+					}
+					if (pad)
+						*dp++ = 255;
+				}
+			}
+		}
+		return;
+	}
+
+	for (y = 0; y < dst->h; y++)
+	{
+		unsigned char *sp = src + (unsigned int)(y * stride);
+		unsigned char *dp = dst->samples + (unsigned int)(y * dst->w * dst->n);
+		int b = 0;
+
+		for (x = 0; x < w; x++)
+		{
+			int t = colorkey != NULL;
+			for (k = 0; k < n; k++)
+			{
+				switch (depth)
+				{
+				case 1: v = get1(sp, b); break;
+				case 2: v = get2(sp, b); break;
+				case 4: v = get4(sp, b); break;
+				case 8: v = get8(sp, b); break;
+				default: v = get16(sp, b); break;
+				}
+				b++;
+				if (t && (unpacked[v] < colorkey[k * 2] || unpacked[v] > colorkey[k * 2 + 1]))
+					t = 0;
+				dp[k] = lut[k][v];
+			}
+			if (t)
+			{
+				for (k = 0; k < n; k++)
+					dp[k] = keyed[k];
+				if (pad)
+					dp[n] = 0;
+			}
+			else if (pad)
+				dp[n] = 255;
+			dp += n + pad;
+		}
+	}
+}
+
+/*
+ * Unpack a bilevel bitmap to 0 and 255 (padding with opaque alpha), or
+ * subsample it by 2^factor on the way as fz_subsample_pixmap would the
+ * unpacked pixmap: each pixel is the mean of its block, counted a byte of
+ * bits at a time. The pixmap is filled from block (x0, y0) on.
+ */
+
+static inline int
+count_bits(unsigned char *row, int a, int b)
+{
+	int i = a >> 3;
+	int j = (b - 1) >> 3;
+	int m0 = 0xff >> (a & 7);
+	int m1 = (0xff << (7 - ((b - 1) & 7))) & 0xff;
+	int c;
+
+	if (i == j)
+		return get1_tab_count[row[i] & m0 & m1];
+	c = get1_tab_count[row[i] & m0];
+	while (++i < j)
+		c += get1_tab_count[row[i]];
+	return c + get1_tab_count[row[j] & m1];
+}
+
+void
+fz_unpack_bitmap(fz_pixmap *dst, fz_bitmap *bit, int x0, int y0, int factor)
+{
+	int f = 1 << factor;
+	int pad = dst->n > 1;
+	int w = dst->w;
+	unsigned char *dp = dst->samples;
+	unsigned char *sp;
+	int x, y, xx, yy, sx0, sx1, sy0, sy1, v;
+
+	init_get1_tables();
+
+	if (factor == 0)
+	{
+		for (y = 0; y < dst->h; y++)
+		{
+			sp = bit->samples + (y0 + y) * bit->stride;
+			x = 0;
+			if ((x0 & 7) == 0)
+			{
+				unsigned char *s = sp + (x0 >> 3);
+				int size = 8 << pad;
+				for (; x + 8 <= w; x += 8)
+				{
+					memcpy(dp, pad ? get1_tab_255p[*s] : get1_tab_255[*s], size);
+					dp += size;
+					s++;
+				}
+			}
+			for (; x < w; x++)
+			{
+				xx = x0 + x;
+				*dp++ = get1(sp, xx) * 255;
+				if (pad)
+					*dp++ = 255;
+			}
+		}
+		return;
+	}
+
+	for (y = 0; y < dst->h; y++)
+	{
+		sy0 = (y0 + y) << factor;
+		sy1 = fz_mini(sy0 + f, bit->h);
+		for (x = 0; x < w; x++)
+		{
+			sx0 = (x0 + x) << factor;
+			sx1 = fz_mini(sx0 + f, bit->w);
+			v = 0;
+			sp = bit->samples + sy0 * bit->stride;
+			for (yy = sy0; yy < sy1; yy++)
+			{
+				v += count_bits(sp, sx0, sx1);
+				sp += bit->stride;
+			}
+			*dp++ = v * 255 / ((sx1 - sx0) * (sy1 - sy0));
+			if (pad)
+				*dp++ = 255;
 		}
-		p += pix->n;
 	}
 }
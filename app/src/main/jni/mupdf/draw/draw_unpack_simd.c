@@ -0,0 +1,121 @@
+#include "fitz-internal.h"
+#include "draw_simd.h"
+
+/*
+
+Decode arrays, as the decode pass in draw_unpack.c: 16 bytes (4 rgba or
+8 grey+alpha pixels) at a time.
+
+*/
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+#ifdef HAVE_SSE2
+
+/* add + fz_mul255(p, mul), clamped, for 16 bytes with a mul and add per
+ * byte; the products are formed in 32 bits, pairing each byte with 1
+ * against its mul and 128 */
+static inline void v_decode(byte *p, const int *mul, const int *add)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i ones = _mm_set1_epi16(1);
+	__m128i x = _mm_loadu_si128((const __m128i *)p);
+	__m128i lo = _mm_unpacklo_epi8(x, zero);
+	__m128i hi = _mm_unpackhi_epi8(x, zero);
+	__m128i q[4];
+	int i;
+
+	q[0] = _mm_unpacklo_epi16(lo, ones);
+	q[1] = _mm_unpackhi_epi16(lo, ones);
+	q[2] = _mm_unpacklo_epi16(hi, ones);
+	q[3] = _mm_unpackhi_epi16(hi, ones);
+	for (i = 0; i < 4; i++)
+	{
+		__m128i m = _mm_loadu_si128((const __m128i *)(mul + i * 4));
+		m = _mm_or_si128(_mm_and_si128(m, _mm_set1_epi32(0xFFFF)), _mm_set1_epi32(128 << 16));
+		q[i] = _mm_madd_epi16(q[i], m);
+		q[i] = _mm_add_epi32(q[i], _mm_srai_epi32(q[i], 8));
+		q[i] = _mm_srai_epi32(q[i], 8);
+		q[i] = _mm_add_epi32(q[i], _mm_loadu_si128((const __m128i *)(add + i * 4)));
+	}
+	_mm_storeu_si128((__m128i *)p, _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+/* add + fz_mul255(p, mul), clamped, for 16 bytes with a mul and add per
+ * byte */
+static inline void v_decode(byte *p, const int *mul, const int *add)
+{
+	uint8x16_t x = vld1q_u8(p);
+	int16x8_t lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(x)));
+	int16x8_t hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(x)));
+	int16x4_t s[4];
+	int32x4_t q[4];
+	int i;
+
+	s[0] = vget_low_s16(lo);
+	s[1] = vget_high_s16(lo);
+	s[2] = vget_low_s16(hi);
+	s[3] = vget_high_s16(hi);
+	for (i = 0; i < 4; i++)
+	{
+		q[i] = vmlal_s16(vdupq_n_s32(128), s[i], vmovn_s32(vld1q_s32(mul + i * 4)));
+		q[i] = vaddq_s32(q[i], vshrq_n_s32(q[i], 8));
+		q[i] = vshrq_n_s32(q[i], 8);
+		q[i] = vaddq_s32(q[i], vld1q_s32(add + i * 4));
+	}
+	vst1q_u8(p, vcombine_u8(
+		vqmovun_s16(vcombine_s16(vqmovn_s32(q[0]), vqmovn_s32(q[1]))),
+		vqmovun_s16(vcombine_s16(vqmovn_s32(q[2]), vqmovn_s32(q[3])))));
+}
+
+#endif /* HAVE_NEON */
+
+static inline void
+decode_simd(byte *p, int len, int n, int *add, int *mul)
+{
+	int vmul[16], vadd[16];
+	int k;
+
+	/* alpha goes through as fz_mul255(a, 255) + 0, which is a */
+	for (k = 0; k < 16; k++)
+	{
+		int c = k % n;
+		vmul[k] = c < n - 1 ? mul[c] : 255;
+		vadd[k] = c < n - 1 ? add[c] : 0;
+	}
+	len *= n;
+	for (; len >= 16; len -= 16)
+	{
+		v_decode(p, vmul, vadd);
+		p += 16;
+	}
+	for (k = 0; k < len; k++)
+		p[k] = fz_clampi(vadd[k] + fz_mul255(p[k], vmul[k]), 0, 255);
+}
+
+static void
+decode_2_simd(byte *p, int len, int *add, int *mul)
+{
+	decode_simd(p, len, 2, add, mul);
+}
+
+static void
+decode_4_simd(byte *p, int len, int *add, int *mul)
+{
+	decode_simd(p, len, 4, add, mul);
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+void
+fz_accelerate_unpack(void)
+{
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	fz_decode_funcs.decode_2 = decode_2_simd;
+	fz_decode_funcs.decode_4 = decode_4_simd;
+#endif
+}
@@ -64,6 +64,14 @@ LOCAL_SRC_FILES := \
 	../../mupdf-apv/fitz/apv_doc_document.c \
 	doc_link.c
 
+# As for the draw_*_simd.c files, only the SIMD predictors are built with NEON on
+# ARMv7, and fz_accelerate_predict checks for it at run time.
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_SRC_FILES += filt_predict_simd.c.neon
+else
+LOCAL_SRC_FILES += filt_predict_simd.c
+endif
+
 
 include $(BUILD_STATIC_LIBRARY)
 
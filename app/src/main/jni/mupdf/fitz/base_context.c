@@ -61,6 +61,8 @@ new_context_phase1(fz_alloc_context *alloc, fz_locks_context *locks)
 	fz_try(ctx)
 	{
 		fz_new_aa_context(ctx);
+		fz_accelerate();
+		fz_accelerate_predict();
 	}
 	fz_catch(ctx)
 	{
@@ -587,6 +587,37 @@ fz_free_display_list(fz_context *ctx, fz_display_list *list)
 	fz_free(ctx, list);
 }
 
+unsigned int
+fz_display_list_size(fz_display_list *list)
+{
+	fz_display_node *node;
+	unsigned int size = sizeof(*list);
+
+	for (node = list->first; node; node = node->next)
+	{
+		size += sizeof(*node);
+		switch (node->cmd)
+		{
+		case FZ_CMD_FILL_PATH:
+		case FZ_CMD_STROKE_PATH:
+		case FZ_CMD_CLIP_PATH:
+		case FZ_CMD_CLIP_STROKE_PATH:
+			size += sizeof(fz_path) + node->item.path->len * sizeof(fz_path_item);
+			break;
+		case FZ_CMD_FILL_TEXT:
+		case FZ_CMD_STROKE_TEXT:
+		case FZ_CMD_CLIP_TEXT:
+		case FZ_CMD_CLIP_STROKE_TEXT:
+		case FZ_CMD_IGNORE_TEXT:
+			size += sizeof(fz_text) + node->item.text->len * sizeof(fz_text_item);
+			break;
+		default:
+			break;
+		}
+	}
+	return size;
+}
+
 void
 fz_run_display_list(fz_display_list *list, fz_device *dev, fz_matrix top_ctm, fz_bbox scissor, fz_cookie *cookie)
 {
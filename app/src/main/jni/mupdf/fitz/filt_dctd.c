@@ -1,5 +1,7 @@
 #include "fitz-internal.h"
 
+/* We need the decoder's inverse DCT methods to skip rows (see below) */
+#define JPEG_INTERNALS
 #include <jpeglib.h>
 #include <setjmp.h>
 
@@ -13,6 +15,7 @@ struct fz_dctd_s
 	int init;
 	int stride;
 	int l2factor;
+	int y0, y1;
 	unsigned char *scanline;
 	unsigned char *rp, *wp;
 	struct jpeg_decompress_struct cinfo;
@@ -84,6 +87,48 @@ static void skip_input_data(j_decompress_ptr cinfo, long num_bytes)
 	}
 }
 
+/*
+	Reading a band of rows. Baseline JPEG data can only be entropy
+	decoded in order, so the rows above the band still have to go
+	through the Huffman decoder; but nothing looks at their samples, so
+	we swap the inverse DCT out for a no-op while passing over whole
+	iMCU rows of them. Two iMCU rows are left to the real transform in
+	case the upsampler wants context rows from above the band. Rows
+	below the band are never decoded at all.
+*/
+
+static void
+idct_skip(j_decompress_ptr cinfo, jpeg_component_info *compptr,
+	JCOEFPTR coef_block, JSAMPARRAY output_buf, JDIMENSION output_col)
+{
+	/* nothing to do */
+}
+
+static void
+skip_dctd(fz_dctd *state)
+{
+	j_decompress_ptr cinfo = &state->cinfo;
+	inverse_DCT_method_ptr idct[MAX_COMPONENTS];
+	int ci, safe;
+
+	safe = state->y0 - 2 * cinfo->max_v_samp_factor * cinfo->min_DCT_v_scaled_size;
+	if ((int)cinfo->output_scanline < safe)
+	{
+		for (ci = 0; ci < cinfo->num_components; ci++)
+		{
+			idct[ci] = cinfo->idct->inverse_DCT[ci];
+			cinfo->idct->inverse_DCT[ci] = idct_skip;
+		}
+		while ((int)cinfo->output_scanline < safe)
+			jpeg_read_scanlines(cinfo, &state->scanline, 1);
+		for (ci = 0; ci < cinfo->num_components; ci++)
+			cinfo->idct->inverse_DCT[ci] = idct[ci];
+	}
+
+	while ((int)cinfo->output_scanline < state->y0)
+		jpeg_read_scanlines(cinfo, &state->scanline, 1);
+}
+
 static int
 read_dctd(fz_stream *stm, unsigned char *buf, int len)
 {
@@ -166,6 +211,11 @@ read_dctd(fz_stream *stm, unsigned char *buf, int len)
 		state->scanline = fz_malloc(state->ctx, state->stride);
 		state->rp = state->scanline;
 		state->wp = state->scanline;
+
+		if (state->y1 <= 0 || state->y1 > (int)cinfo->output_height)
+			state->y1 = cinfo->output_height;
+		if (state->y0 > 0)
+			skip_dctd(state);
 	}
 
 	while (state->rp < state->wp && p < ep)
@@ -173,7 +223,7 @@ read_dctd(fz_stream *stm, unsigned char *buf, int len)
 
 	while (p < ep)
 	{
-		if (cinfo->output_scanline == cinfo->output_height)
+		if ((int)cinfo->output_scanline >= state->y1)
 			break;
 
 		if (p + state->stride <= ep)
@@ -206,7 +256,8 @@ close_dctd(fz_context *ctx, void *state_)
 		goto skip;
 	}
 
-	if (state->init)
+	/* A band that stops short is simply abandoned */
+	if (state->init && state->cinfo.output_scanline == state->cinfo.output_height)
 		jpeg_finish_decompress(&state->cinfo);
 
 skip:
@@ -229,6 +280,14 @@ fz_open_dctd(fz_stream *chain, int color_transform)
 
 fz_stream *
 fz_open_resized_dctd(fz_stream *chain, int color_transform, int l2factor)
+{
+	return fz_open_dctd_band(chain, color_transform, l2factor, 0, 0);
+}
+
+/* Rows y0 to y1 (exclusive) of the image decoded at 1/2^l2factor;
+ * y1 = 0 reads to the end. */
+fz_stream *
+fz_open_dctd_band(fz_stream *chain, int color_transform, int l2factor, int y0, int y1)
 {
 	fz_context *ctx = chain->ctx;
 	fz_dctd *state = NULL;
@@ -243,6 +302,8 @@ fz_open_resized_dctd(fz_stream *chain, int color_transform, int l2factor)
 		state->color_transform = color_transform;
 		state->init = 0;
 		state->l2factor = l2factor;
+		state->y0 = y0;
+		state->y1 = y1;
 	}
 	fz_catch(ctx)
 	{
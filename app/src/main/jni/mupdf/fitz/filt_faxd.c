@@ -170,11 +170,6 @@ static const cfd_node cf_uncompressed_decode[] = {
 
 /* bit magic */
 
-static inline int getbit(const unsigned char *buf, int x)
-{
-	return ( buf[x >> 3] >> ( 7 - (x & 7) ) ) & 1;
-}
-
 static const unsigned char mask[8] = {
 	0x7F, 0x3F, 0x1F, 0x0F, 0x07, 0x03, 0x01, 0
 };
@@ -257,20 +252,6 @@ nearend:
 	return x;
 }
 
-static inline int
-find_changing_color(const unsigned char *line, int x, int w, int color)
-{
-	if (!line || x >= w)
-		return w;
-
-	x = find_changing(line, (x > 0 || !color) ? x : -1, w);
-
-	if (x < w && getbit(line, x) != color)
-		x = find_changing(line, x, w);
-
-	return x;
-}
-
 static const unsigned char lm[8] = {
 	0xFF, 0x7F, 0x3F, 0x1F, 0x0F, 0x07, 0x03, 0x01
 };
@@ -281,7 +262,7 @@ static const unsigned char rm[8] = {
 
 static inline void setbits(unsigned char *line, int x0, int x1)
 {
-	int a0, a1, b0, b1, a;
+	int a0, a1, b0, b1;
 
 	if (x1 <= x0)
 		return;
@@ -300,8 +281,8 @@ static inline void setbits(unsigned char *line, int x0, int x1)
 	else
 	{
 		line[a0] |= lm[b0];
-		for (a = a0 + 1; a < a1; a++)
-			line[a] = 0xFF;
+		if (a1 > a0 + 1)
+			memset(line + a0 + 1, 0xFF, a1 - a0 - 1);
 		if (b1)
 			line[a1] |= rm[b1];
 	}
@@ -340,7 +321,9 @@ struct fz_faxd_s
 	int stage;
 
 	int a, c, dim, eolc;
-	unsigned char *ref;
+	int *ref;	/* changing elements of the reference line */
+	int *cur;	/* changing elements of the coding line */
+	int ri, cn, bad;
 	unsigned char *dst;
 	unsigned char *rp, *wp;
 };
@@ -386,6 +369,91 @@ get_code(fz_faxd *fax, const cfd_node *table, int initialbits)
 	return val;
 }
 
+/*
+ * The 2d codes only ever look at the changing elements of the reference
+ * line, so rather than scanning its bits we keep it as a sorted list of
+ * positions. Even entries are white to black changes, odd entries black
+ * to white, and three entries equal to columns end the list.
+ *
+ * The coding line builds its list as the runs are painted. Only corrupt
+ * data moves a0 backwards; such a line is marked bad and its list is
+ * rebuilt from the bitmap when the line ends.
+ */
+
+static inline void
+put_run(fz_faxd *fax, int x)
+{
+	int a = fax->a;
+
+	if (x < a)
+		fax->bad = 1;
+	else if (fax->c && x > a)
+	{
+		setbits(fax->dst, a, x);
+		if (!fax->bad)
+		{
+			if (fax->cn > 0 && fax->cur[fax->cn - 1] == a)
+				fax->cn--;
+			else
+				fax->cur[fax->cn++] = a;
+			fax->cur[fax->cn++] = x;
+		}
+	}
+
+	fax->a = x;
+}
+
+/* first changing element of the reference line right of a0 and of the
+ * opposite colour; its index is left in ri for the pass mode */
+static inline int
+find_b1(fz_faxd *fax)
+{
+	const int *ref = fax->ref;
+	int x, i;
+
+	if (fax->a >= fax->columns)
+		return fax->columns;
+
+	x = fax->a > 0 ? fax->a : -1;
+	i = fax->ri;
+	while (i > 0 && ref[i - 1] > x)
+		i--;
+	while (ref[i] <= x)
+		i++;
+	if ((i & 1) != fax->c)
+		i++;
+
+	fax->ri = i;
+	return ref[i];
+}
+
+/* the coding line becomes the reference line */
+static void
+next_ref_line(fz_faxd *fax)
+{
+	int *tmp;
+	int x;
+
+	if (fax->bad)
+	{
+		fax->cn = 0;
+		x = -1;
+		while ((x = find_changing(fax->dst, x, fax->columns)) < fax->columns)
+			fax->cur[fax->cn++] = x;
+	}
+
+	fax->cur[fax->cn] = fax->columns;
+	fax->cur[fax->cn + 1] = fax->columns;
+	fax->cur[fax->cn + 2] = fax->columns;
+
+	tmp = fax->ref;
+	fax->ref = fax->cur;
+	fax->cur = tmp;
+	fax->cn = 0;
+	fax->ri = 0;
+	fax->bad = 0;
+}
+
 /* decode one 1d code */
 static void
 dec1d(fz_context *ctx, fz_faxd *fax)
@@ -409,10 +477,7 @@ dec1d(fz_context *ctx, fz_faxd *fax)
 	if (fax->a + code > fax->columns)
 		fz_throw(ctx, "overflow in 1d faxd");
 
-	if (fax->c)
-		setbits(fax->dst, fax->a, fax->a + code);
-
-	fax->a += code;
+	put_run(fax, fax->a + code);
 
 	if (code < 64)
 	{
@@ -448,10 +513,7 @@ dec2d(fz_context *ctx, fz_faxd *fax)
 		if (fax->a + code > fax->columns)
 			fz_throw(ctx, "overflow in 2d faxd");
 
-		if (fax->c)
-			setbits(fax->dst, fax->a, fax->a + code);
-
-		fax->a += code;
+		put_run(fax, fax->a + code);
 
 		if (code < 64)
 		{
@@ -474,67 +536,27 @@ dec2d(fz_context *ctx, fz_faxd *fax)
 		break;
 
 	case P:
-		b1 = find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
+		b1 = find_b1(fax);
 		if (b1 >= fax->columns)
 			b2 = fax->columns;
 		else
-			b2 = find_changing(fax->ref, b1, fax->columns);
-		if (fax->c) setbits(fax->dst, fax->a, b2);
-		fax->a = b2;
-		break;
-
-	case V0:
-		b1 = find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VR1:
-		b1 = 1 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 >= fax->columns) b1 = fax->columns;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
-	case VR2:
-		b1 = 2 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 >= fax->columns) b1 = fax->columns;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
+			b2 = fax->ref[fax->ri + 1];
+		put_run(fax, b2);
 		break;
 
 	case VR3:
-		b1 = 3 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 >= fax->columns) b1 = fax->columns;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
+	case VR2:
+	case VR1:
+	case V0:
 	case VL1:
-		b1 = -1 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 < 0) b1 = 0;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
 	case VL2:
-		b1 = -2 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 < 0) b1 = 0;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
-		fax->c = !fax->c;
-		break;
-
 	case VL3:
-		b1 = -3 + find_changing_color(fax->ref, fax->a, fax->columns, !fax->c);
-		if (b1 < 0) b1 = 0;
-		if (fax->c) setbits(fax->dst, fax->a, b1);
-		fax->a = b1;
+		b1 = find_b1(fax) + V0 - code;
+		if (b1 > fax->columns)
+			b1 = fax->columns;
+		else if (b1 < 0)
+			b1 = 0;
+		put_run(fax, b1);
 		fax->c = !fax->c;
 		break;
 
@@ -555,7 +577,6 @@ read_faxd(fz_stream *stm, unsigned char *buf, int len)
 	fz_faxd *fax = stm->state;
 	unsigned char *p = buf;
 	unsigned char *ep = buf + len;
-	unsigned char *tmp;
 
 	if (fax->stage == STATE_DONE)
 		return 0;
@@ -649,9 +670,7 @@ eol:
 	if (fax->rp < fax->wp)
 		return p - buf;
 
-	tmp = fax->ref;
-	fax->ref = fax->dst;
-	fax->dst = tmp;
+	next_ref_line(fax);
 	memset(fax->dst, 0, fax->stride);
 
 	fax->rp = fax->dst;
@@ -710,6 +729,7 @@ close_faxd(fz_context *ctx, void *state_)
 
 	fz_close(fax->chain);
 	fz_free(ctx, fax->ref);
+	fz_free(ctx, fax->cur);
 	fz_free(ctx, fax->dst);
 	fz_free(ctx, fax);
 }
@@ -727,10 +747,14 @@ fz_open_faxd(fz_stream *chain,
 
 	fz_try(ctx)
 	{
+		if (columns <= 0 || columns >= INT_MAX - 7)
+			fz_throw(ctx, "invalid number of columns in faxd (%d)", columns);
+
 		fax = fz_malloc_struct(ctx, fz_faxd);
 		fax->chain = chain;
 
 		fax->ref = NULL;
+		fax->cur = NULL;
 		fax->dst = NULL;
 
 		fax->k = k;
@@ -752,12 +776,18 @@ fz_open_faxd(fz_stream *chain,
 		fax->dim = fax->k < 0 ? 2 : 1;
 		fax->eolc = 0;
 
-		fax->ref = fz_malloc(ctx, fax->stride);
+		/* at most columns + 1 changing elements and the sentinels */
+		fax->ref = fz_malloc_array(ctx, fax->columns + 4, sizeof(int));
+		fax->cur = fz_malloc_array(ctx, fax->columns + 4, sizeof(int));
 		fax->dst = fz_malloc(ctx, fax->stride);
 		fax->rp = fax->dst;
 		fax->wp = fax->dst + fax->stride;
 
-		memset(fax->ref, 0, fax->stride);
+		/* the line above the first one is all white */
+		fax->ref[0] = fax->ref[1] = fax->ref[2] = fax->columns;
+		fax->cn = 0;
+		fax->ri = 0;
+		fax->bad = 0;
 		memset(fax->dst, 0, fax->stride);
 	}
 	fz_catch(ctx)
@@ -765,6 +795,7 @@ fz_open_faxd(fz_stream *chain,
 		if (fax)
 		{
 			fz_free(ctx, fax->dst);
+			fz_free(ctx, fax->cur);
 			fz_free(ctx, fax->ref);
 		}
 		fz_free(ctx, fax);
@@ -3,25 +3,177 @@
 #include <jbig2.h>
 
 typedef struct fz_jbig2d_s fz_jbig2d;
+typedef struct fz_jbig2_alloc_s fz_jbig2_alloc;
+
+/*
+	jbig2dec allocations are routed through the fitz allocator so that
+	they can scavenge the store. Each block carries its size in a small
+	header so that the allocator can keep a running total of live
+	bytes; this is what we charge to the store for cached globals.
+*/
+struct fz_jbig2_alloc_s
+{
+	Jbig2Allocator super;
+	fz_context *ctx;
+	unsigned int size;
+};
+
+typedef union
+{
+	unsigned int size;
+	double align_d;
+	void *align_p;
+} fz_jbig2_block;
+
+struct fz_jbig2_globals_s
+{
+	fz_storable storable;
+	fz_jbig2_alloc alloc;
+	Jbig2GlobalCtx *gctx;
+	fz_context *owner; /* jbig2dec refcounts symbol images unlocked */
+	unsigned int size;
+};
 
 struct fz_jbig2d_s
 {
 	fz_stream *chain;
+	fz_jbig2_alloc alloc;
 	Jbig2Ctx *ctx;
-	Jbig2GlobalCtx *gctx;
+	fz_jbig2_globals *gctx;
 	Jbig2Image *page;
 	int idx;
 };
 
+static void *
+fz_jbig2_alloc_block(Jbig2Allocator *allocator, size_t size)
+{
+	fz_jbig2_alloc *a = (fz_jbig2_alloc *)allocator;
+	fz_jbig2_block *b;
+
+	if (size > UINT_MAX - sizeof *b)
+		return NULL;
+	b = fz_malloc_no_throw(a->ctx, size + sizeof *b);
+	if (!b)
+		return NULL;
+	b->size = size;
+	a->size += size;
+	return b + 1;
+}
+
+static void
+fz_jbig2_free_block(Jbig2Allocator *allocator, void *p)
+{
+	fz_jbig2_alloc *a = (fz_jbig2_alloc *)allocator;
+	fz_jbig2_block *b;
+
+	if (!p)
+		return;
+	b = (fz_jbig2_block *)p - 1;
+	a->size -= b->size;
+	fz_free(a->ctx, b);
+}
+
+static void *
+fz_jbig2_realloc_block(Jbig2Allocator *allocator, void *p, size_t size)
+{
+	fz_jbig2_alloc *a = (fz_jbig2_alloc *)allocator;
+	fz_jbig2_block *b;
+	unsigned int old;
+
+	if (!p)
+		return fz_jbig2_alloc_block(allocator, size);
+	if (size > UINT_MAX - sizeof *b)
+		return NULL;
+	b = (fz_jbig2_block *)p - 1;
+	old = b->size;
+	b = fz_resize_array_no_throw(a->ctx, b, 1, size + sizeof *b);
+	if (!b)
+		return NULL;
+	b->size = size;
+	a->size += size - old;
+	return b + 1;
+}
+
+static void
+fz_jbig2_init_alloc(fz_context *ctx, fz_jbig2_alloc *a)
+{
+	a->super.alloc = fz_jbig2_alloc_block;
+	a->super.free = fz_jbig2_free_block;
+	a->super.realloc = fz_jbig2_realloc_block;
+	a->ctx = ctx;
+	a->size = 0;
+}
+
+fz_jbig2_globals *
+fz_load_jbig2_globals(fz_context *ctx, fz_buffer *buf)
+{
+	fz_jbig2_globals *globals;
+	Jbig2Ctx *jctx;
+
+	globals = fz_malloc_struct(ctx, fz_jbig2_globals);
+	FZ_INIT_STORABLE(globals, 1, fz_free_jbig2_globals_imp);
+	fz_jbig2_init_alloc(ctx, &globals->alloc);
+
+	jctx = jbig2_ctx_new(&globals->alloc.super, JBIG2_OPTIONS_EMBEDDED, NULL, NULL, NULL);
+	if (!jctx)
+	{
+		fz_free(ctx, globals);
+		fz_throw(ctx, "cannot allocate jbig2 globals context");
+	}
+	if (buf)
+		jbig2_data_in(jctx, buf->data, buf->len);
+	globals->gctx = jbig2_make_global_ctx(jctx);
+	globals->owner = ctx;
+	globals->size = sizeof *globals + globals->alloc.size;
+
+	return globals;
+}
+
+fz_jbig2_globals *
+fz_keep_jbig2_globals(fz_context *ctx, fz_jbig2_globals *globals)
+{
+	return (fz_jbig2_globals *)fz_keep_storable(ctx, &globals->storable);
+}
+
+void
+fz_drop_jbig2_globals(fz_context *ctx, fz_jbig2_globals *globals)
+{
+	if (globals)
+		fz_drop_storable(ctx, &globals->storable);
+}
+
+unsigned int
+fz_jbig2_globals_size(fz_jbig2_globals *globals)
+{
+	return globals->size;
+}
+
+int
+fz_jbig2_globals_usable(fz_context *ctx, fz_jbig2_globals *globals)
+{
+	return globals->owner == ctx;
+}
+
+void
+fz_free_jbig2_globals_imp(fz_context *ctx, fz_storable *globals_)
+{
+	fz_jbig2_globals *globals = (fz_jbig2_globals *)globals_;
+
+	/* The store may drop the last reference from a different context,
+	 * but by then no page decoder holds the symbol images. */
+	globals->alloc.ctx = ctx;
+	jbig2_global_ctx_free(globals->gctx);
+	fz_free(ctx, globals);
+}
+
 static void
 close_jbig2d(fz_context *ctx, void *state_)
 {
 	fz_jbig2d *state = (fz_jbig2d *)state_;
 	if (state->page)
 		jbig2_release_page(state->ctx, state->page);
-	if (state->gctx)
-		jbig2_global_ctx_free(state->gctx);
 	jbig2_ctx_free(state->ctx);
+	fz_drop_jbig2_globals(ctx, state->gctx);
 	fz_close(state->chain);
 	fz_free(ctx, state);
 }
@@ -64,7 +216,7 @@ read_jbig2d(fz_stream *stm, unsigned char *buf, int len)
 }
 
 fz_stream *
-fz_open_jbig2d(fz_stream *chain, fz_buffer *globals)
+fz_open_jbig2d(fz_stream *chain, fz_jbig2_globals *globals)
 {
 	fz_jbig2d *state = NULL;
 	fz_context *ctx = chain->ctx;
@@ -73,36 +225,26 @@ fz_open_jbig2d(fz_stream *chain, fz_buffer *globals)
 
 	fz_try(ctx)
 	{
+		if (globals && !fz_jbig2_globals_usable(ctx, globals))
+			fz_throw(ctx, "jbig2 globals belong to another context");
 		state = fz_malloc_struct(chain->ctx, fz_jbig2d);
 		state->ctx = NULL;
-		state->gctx = NULL;
+		state->gctx = globals;
 		state->chain = chain;
-		state->ctx = jbig2_ctx_new(NULL, JBIG2_OPTIONS_EMBEDDED, NULL, NULL, NULL);
+		fz_jbig2_init_alloc(ctx, &state->alloc);
+		state->ctx = jbig2_ctx_new(&state->alloc.super, JBIG2_OPTIONS_EMBEDDED, globals ? globals->gctx : NULL, NULL, NULL);
+		if (!state->ctx)
+			fz_throw(ctx, "cannot allocate jbig2 context");
 		state->page = NULL;
 		state->idx = 0;
-
-		if (globals)
-		{
-			jbig2_data_in(state->ctx, globals->data, globals->len);
-			state->gctx = jbig2_make_global_ctx(state->ctx);
-			state->ctx = jbig2_ctx_new(NULL, JBIG2_OPTIONS_EMBEDDED, state->gctx, NULL, NULL);
-		}
 	}
 	fz_catch(ctx)
 	{
-		if (state)
-		{
-			if (state->gctx)
-				jbig2_global_ctx_free(state->gctx);
-			if (state->ctx)
-				jbig2_ctx_free(state->ctx);
-		}
-		fz_drop_buffer(ctx, globals);
+		fz_drop_jbig2_globals(ctx, globals);
 		fz_free(ctx, state);
 		fz_close(chain);
 		fz_rethrow(ctx);
 	}
-	fz_drop_buffer(ctx, globals);
 
 	return fz_new_stream(ctx, state, read_jbig2d, close_jbig2d);
 }
@@ -17,6 +17,7 @@ struct fz_predict_s
 
 	int stride;
 	int bpp;
+	int inplace;
 	unsigned char *in;
 	unsigned char *out;
 	unsigned char *ref;
@@ -58,6 +59,21 @@ static inline int paeth(int a, int b, int c)
 	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
 }
 
+/* Filled in by fz_accelerate_predict when the CPU has SIMD; see fitz-internal.h */
+fz_predict_table fz_predict_funcs = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
+
+/* Sub, with bpp bytes to the left; out may be in */
+static inline void
+sub_row(unsigned char *out, unsigned char *in, int len, int bpp)
+{
+	int i;
+
+	for (i = 0; i < bpp && i < len; i++)
+		out[i] = in[i];
+	for (; i < len; i++)
+		out[i] = in[i] + out[i - bpp];
+}
+
 static void
 fz_predict_tiff(fz_predict *state, unsigned char *out, unsigned char *in, int len)
 {
@@ -65,6 +81,36 @@ fz_predict_tiff(fz_predict *state, unsigned char *out, unsigned char *in, int le
 	int i, k;
 	const int mask = (1 << state->bpc)-1;
 
+	/* whole bytes predict like PNG Sub, and can be done in place */
+	if (state->bpc == 8)
+	{
+		if (state->colors == 1 && fz_predict_funcs.sub_1)
+			fz_predict_funcs.sub_1(out, in, len);
+		else if (state->colors == 3 && fz_predict_funcs.sub_3)
+			fz_predict_funcs.sub_3(out, in, len);
+		else if (state->colors == 4 && fz_predict_funcs.sub_4)
+			fz_predict_funcs.sub_4(out, in, len);
+		else
+			sub_row(out, in, len, state->colors);
+		return;
+	}
+
+	if (state->bpc == 16)
+	{
+		int bpp = state->colors * 2;
+		for (i = 0; i < bpp && i < len; i++)
+			out[i] = in[i];
+		for (; i + 1 < len; i += 2)
+		{
+			int c = (in[i] << 8) + in[i + 1] + (out[i - bpp] << 8) + out[i - bpp + 1];
+			out[i] = c >> 8;
+			out[i + 1] = c;
+		}
+		if (i < len)
+			out[i] = in[i] + out[i - bpp];
+		return;
+	}
+
 	for (k = 0; k < state->colors; k++)
 		left[k] = 0;
 	memset(out, 0, state->stride);
@@ -82,92 +128,143 @@ fz_predict_tiff(fz_predict *state, unsigned char *out, unsigned char *in, int le
 	}
 }
 
-static void
-fz_predict_png(fz_predict *state, unsigned char *out, unsigned char *in, int len, int predictor)
+/*
+ * One row of any PNG filter. Written for every bpp, but inlined with a
+ * constant one for the common 1, 3 and 4 so that the compiler can keep
+ * the left hand pixel in registers.
+ */
+static inline void
+png_row(unsigned char *out, unsigned char *in, unsigned char *ref, int len, int bpp, int predictor)
 {
-	int bpp = state->bpp;
-	int i;
-	unsigned char *ref = state->ref;
+	int i, k = fz_mini(bpp, len);
 
 	switch (predictor)
 	{
 	case 0:
-		memcpy(out, in, len);
+		if (out != in)
+			memcpy(out, in, len);
 		break;
 	case 1:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++;
-		}
-		for (i = len - bpp; i > 0; i--)
-		{
-			*out = *in++ + out[-bpp];
-			out++;
-		}
+		sub_row(out, in, len, bpp);
 		break;
 	case 2:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++ + *ref++;
-		}
-		for (i = len - bpp; i > 0; i--)
-		{
-			*out++ = *in++ + *ref++;
-		}
+		for (i = 0; i < len; i++)
+			out[i] = in[i] + ref[i];
 		break;
 	case 3:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++ + (*ref++) / 2;
-		}
-		for (i = len - bpp; i > 0; i--)
-		{
-			*out = *in++ + (out[-bpp] + *ref++) / 2;
-			out++;
-		}
+		for (i = 0; i < k; i++)
+			out[i] = in[i] + ref[i] / 2;
+		for (; i < len; i++)
+			out[i] = in[i] + (out[i - bpp] + ref[i]) / 2;
 		break;
 	case 4:
-		for (i = bpp; i > 0; i--)
-		{
-			*out++ = *in++ + paeth(0, *ref++, 0);
-		}
-		for (i = len - bpp; i > 0; i --)
-		{
-			*out = *in++ + paeth(out[-bpp], *ref, ref[-bpp]);
-			ref++;
-			out++;
-		}
+		for (i = 0; i < k; i++)
+			out[i] = in[i] + ref[i];
+		for (; i < len; i++)
+			out[i] = in[i] + paeth(out[i - bpp], ref[i], ref[i - bpp]);
+		break;
+	default:
+		/* an unknown filter repeats the row above */
+		memcpy(out, ref, len);
 		break;
 	}
 }
 
+static void
+fz_predict_png(fz_predict *state, unsigned char *out, unsigned char *in, unsigned char *ref, int len, int predictor)
+{
+	int bpp = state->bpp;
+
+	if (predictor == 1 && bpp == 1 && fz_predict_funcs.sub_1)
+		fz_predict_funcs.sub_1(out, in, len);
+	else if (predictor == 1 && bpp == 3 && fz_predict_funcs.sub_3)
+		fz_predict_funcs.sub_3(out, in, len);
+	else if (predictor == 1 && bpp == 4 && fz_predict_funcs.sub_4)
+		fz_predict_funcs.sub_4(out, in, len);
+	else if (predictor == 2 && fz_predict_funcs.up)
+		fz_predict_funcs.up(out, in, ref, len);
+	else if (predictor == 3 && bpp == 3 && fz_predict_funcs.avg_3)
+		fz_predict_funcs.avg_3(out, in, ref, len);
+	else if (predictor == 3 && bpp == 4 && fz_predict_funcs.avg_4)
+		fz_predict_funcs.avg_4(out, in, ref, len);
+	else if (predictor == 4 && bpp == 3 && fz_predict_funcs.paeth_3)
+		fz_predict_funcs.paeth_3(out, in, ref, len);
+	else if (predictor == 4 && bpp == 4 && fz_predict_funcs.paeth_4)
+		fz_predict_funcs.paeth_4(out, in, ref, len);
+	else switch (bpp)
+	{
+	case 1: png_row(out, in, ref, len, 1, predictor); break;
+	case 3: png_row(out, in, ref, len, 3, predictor); break;
+	case 4: png_row(out, in, ref, len, 4, predictor); break;
+	default: png_row(out, in, ref, len, bpp, predictor); break;
+	}
+}
+
+static void
+fz_predict_row(fz_predict *state, unsigned char *out, unsigned char *in, unsigned char *ref, int len, int predictor)
+{
+	if (state->predictor == 1)
+	{
+		if (out != in)
+			memcpy(out, in, len);
+	}
+	else if (state->predictor == 2)
+		fz_predict_tiff(state, out, in, len);
+	else
+		fz_predict_png(state, out, in, ref, len, predictor);
+}
+
 static int
 read_predict(fz_stream *stm, unsigned char *buf, int len)
 {
 	fz_predict *state = stm->state;
 	unsigned char *p = buf;
 	unsigned char *ep = buf + len;
+	unsigned char *ref = state->ref;
 	int ispng = state->predictor >= 10;
+	int predictor = 0;
 	int n;
 
 	while (state->rp < state->wp && p < ep)
 		*p++ = *state->rp++;
 
+	/* Whole rows are read straight into the caller's buffer and
+	 * unfiltered there, the row above serving as the reference. */
+	if (state->inplace)
+	{
+		while (ep - p >= state->stride)
+		{
+			if (ispng)
+			{
+				predictor = fz_read_byte(state->chain);
+				if (predictor == EOF)
+					break;
+			}
+			n = fz_read(state->chain, p, state->stride);
+			fz_predict_row(state, p, p, ref, n, predictor);
+			p += n;
+			if (n < state->stride)
+				break;
+			ref = p - state->stride;
+		}
+
+		if (ispng && ref != state->ref)
+			memcpy(state->ref, ref, state->stride);
+	}
+
 	while (p < ep)
 	{
 		n = fz_read(state->chain, state->in, state->stride + ispng);
 		if (n == 0)
 			return p - buf;
 
-		if (state->predictor == 1)
-			memcpy(state->out, state->in, n);
-		else if (state->predictor == 2)
-			fz_predict_tiff(state, state->out, state->in, n);
-		else
+		if (ispng)
 		{
-			fz_predict_png(state, state->out, state->in + 1, n - 1, state->in[0]);
+			fz_predict_row(state, state->out, state->in + 1, state->ref, n - 1, state->in[0]);
 			memcpy(state->ref, state->out, state->stride);
 		}
+		else
+			fz_predict_row(state, state->out, state->in, NULL, n, 0);
 
 		state->rp = state->out;
 		state->wp = state->out + n - ispng;
@@ -232,6 +329,9 @@ fz_open_predict(fz_stream *chain, int predictor, int columns, int colors, int bp
 		state->stride = (state->bpc * state->colors * state->columns + 7) / 8;
 		state->bpp = (state->bpc * state->colors + 7) / 8;
 
+		/* TIFF prediction of packed components needs a separate output row */
+		state->inplace = state->predictor != 2 || state->bpc == 8 || state->bpc == 16;
+
 		state->in = fz_malloc(ctx, state->stride + 1);
 		state->out = fz_malloc(ctx, state->stride);
 		state->ref = fz_malloc(ctx, state->stride);
@@ -0,0 +1,341 @@
+#include "fitz-internal.h"
+
+/*
+
+SSE2 (x86, x86_64) and NEON (armeabi-v7a, arm64) versions of the PNG
+predictor rows in filt_predict.c, as png_row does them. Up is a plain
+byte add. Sub is a running sum along the row, done as a prefix sum over
+the pixels of a vector that starts from the last pixel of the vector
+before. Average and Paeth need the pixel just decoded, so they go a pixel
+at a time with its bytes side by side. For 3 byte pixels the fourth lane
+is kept out of the sum, so that storing it writes back the next input
+byte unchanged, which keeps unfiltering in place safe.
+
+Like the draw/draw_*_simd.c files, on armeabi-v7a this file is built with NEON
+enabled, and nothing in it is used unless fz_has_simd finds NEON on the
+CPU.
+
+*/
+
+typedef unsigned char byte;
+
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define HAVE_NEON
+#endif
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+#ifdef HAVE_SSE2
+
+#include <emmintrin.h>
+
+typedef __m128i vb;
+
+#define vb_zero() _mm_setzero_si128()
+#define vb_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vb_store(p, a) _mm_storeu_si128((__m128i *)(p), a)
+#define vb_store_8(p, a) _mm_storel_epi64((__m128i *)(p), a)
+#define vb_add(a, b) _mm_add_epi8(a, b)
+#define vb_and(a, b) _mm_and_si128(a, b)
+
+/* Move the bytes n lanes on along the row, or back towards its start */
+#define vb_up(a, n) _mm_slli_si128(a, n)
+#define vb_down(a, n) _mm_srli_si128(a, n)
+
+static inline vb vb_load_4(const byte *p)
+{
+	int x;
+	memcpy(&x, p, 4);
+	return _mm_cvtsi32_si128(x);
+}
+
+static inline void vb_store_4(byte *p, vb a)
+{
+	int x = _mm_cvtsi128_si32(a);
+	memcpy(p, &x, 4);
+}
+
+/* (a + b) / 2, which pavgb rounds up where we want it rounded down */
+static inline vb vb_avg(vb a, vb b)
+{
+	return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+}
+
+static inline __m128i vb_abs_16(__m128i a)
+{
+	return _mm_max_epi16(a, _mm_sub_epi16(_mm_setzero_si128(), a));
+}
+
+/* The Paeth predictor of the low 8 lanes, in 16 bits */
+static inline vb vb_paeth(vb a, vb b, vb c)
+{
+	__m128i z = _mm_setzero_si128();
+	__m128i a16 = _mm_unpacklo_epi8(a, z);
+	__m128i b16 = _mm_unpacklo_epi8(b, z);
+	__m128i c16 = _mm_unpacklo_epi8(c, z);
+	__m128i pa = vb_abs_16(_mm_sub_epi16(b16, c16));
+	__m128i pb = vb_abs_16(_mm_sub_epi16(a16, c16));
+	__m128i pc = vb_abs_16(_mm_sub_epi16(_mm_add_epi16(a16, b16), _mm_add_epi16(c16, c16)));
+	__m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+	__m128i not_b = _mm_cmpgt_epi16(pb, pc);
+	__m128i r = _mm_or_si128(_mm_andnot_si128(not_b, b16), _mm_and_si128(not_b, c16));
+	r = _mm_or_si128(_mm_andnot_si128(not_a, a16), _mm_and_si128(not_a, r));
+	return _mm_packus_epi16(r, z);
+}
+
+#endif /* HAVE_SSE2 */
+
+#ifdef HAVE_NEON
+
+#include <arm_neon.h>
+
+typedef uint8x16_t vb;
+
+#define vb_zero() vdupq_n_u8(0)
+#define vb_load(p) vld1q_u8(p)
+#define vb_store(p, a) vst1q_u8(p, a)
+#define vb_store_8(p, a) vst1_u8(p, vget_low_u8(a))
+#define vb_add(a, b) vaddq_u8(a, b)
+#define vb_and(a, b) vandq_u8(a, b)
+#define vb_up(a, n) vextq_u8(vdupq_n_u8(0), a, 16 - (n))
+#define vb_down(a, n) vextq_u8(a, vdupq_n_u8(0), n)
+#define vb_avg(a, b) vhaddq_u8(a, b)
+
+static inline vb vb_load_4(const byte *p)
+{
+	uint32_t x;
+	memcpy(&x, p, 4);
+	return vreinterpretq_u8_u32(vsetq_lane_u32(x, vdupq_n_u32(0), 0));
+}
+
+static inline void vb_store_4(byte *p, vb a)
+{
+	uint32_t x = vgetq_lane_u32(vreinterpretq_u32_u8(a), 0);
+	memcpy(p, &x, 4);
+}
+
+static inline vb vb_paeth(vb a, vb b, vb c)
+{
+	uint16x8_t a16 = vmovl_u8(vget_low_u8(a));
+	uint16x8_t b16 = vmovl_u8(vget_low_u8(b));
+	uint16x8_t c16 = vmovl_u8(vget_low_u8(c));
+	uint16x8_t pa = vabdq_u16(b16, c16);
+	uint16x8_t pb = vabdq_u16(a16, c16);
+	uint16x8_t pc = vabdq_u16(vaddq_u16(a16, b16), vaddq_u16(c16, c16));
+	uint16x8_t r = vbslq_u16(vcleq_u16(pb, pc), b16, c16);
+	r = vbslq_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)), a16, r);
+	return vcombine_u8(vmovn_u16(r), vdup_n_u8(0));
+}
+
+#endif /* HAVE_NEON */
+
+static const byte vb_pixel_3[16] = { 255, 255, 255 };
+
+static inline int predict_paeth(int a, int b, int c)
+{
+	int ac = b - c, bc = a - c, abcc = ac + bc;
+	int pa = fz_absi(ac);
+	int pb = fz_absi(bc);
+	int pc = fz_absi(abcc);
+	return pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+}
+
+/* The bytes from i on that are too few for a whole vector or pixel */
+static inline void
+predict_tail(byte *out, byte *in, byte *ref, int i, int len, int bpp, int filter)
+{
+	for (; i < len; i++)
+	{
+		int a = i >= bpp ? out[i - bpp] : 0;
+		if (filter == 1)
+			out[i] = in[i] + a;
+		else if (filter == 3)
+			out[i] = in[i] + (a + ref[i]) / 2;
+		else
+			out[i] = in[i] + predict_paeth(a, ref[i], i >= bpp ? ref[i - bpp] : 0);
+	}
+}
+
+static void
+predict_up_simd(byte *out, byte *in, byte *ref, int len)
+{
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+		vb_store(out + i, vb_add(vb_load(in + i), vb_load(ref + i)));
+	for (; i < len; i++)
+		out[i] = in[i] + ref[i];
+}
+
+static void
+predict_sub_1_simd(byte *out, byte *in, int len)
+{
+	vb x, last = vb_zero();
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		x = vb_add(vb_load(in + i), vb_down(last, 15));
+		x = vb_add(x, vb_up(x, 1));
+		x = vb_add(x, vb_up(x, 2));
+		x = vb_add(x, vb_up(x, 4));
+		x = vb_add(x, vb_up(x, 8));
+		vb_store(out + i, x);
+		last = x;
+	}
+	predict_tail(out, in, NULL, i, len, 1, 1);
+}
+
+static void
+predict_sub_3_simd(byte *out, byte *in, int len)
+{
+	vb x, last = vb_zero();
+	vb m = vb_load(vb_pixel_3);
+	int i;
+
+	/* 4 pixels at a time, from a whole vector of input */
+	for (i = 0; i + 16 <= len; i += 12)
+	{
+		x = vb_add(vb_load(in + i), vb_and(vb_down(last, 9), m));
+		x = vb_add(x, vb_up(x, 3));
+		x = vb_add(x, vb_up(x, 6));
+		vb_store_8(out + i, x);
+		vb_store_4(out + i + 8, vb_down(x, 8));
+		last = x;
+	}
+	predict_tail(out, in, NULL, i, len, 3, 1);
+}
+
+static void
+predict_sub_4_simd(byte *out, byte *in, int len)
+{
+	vb x, last = vb_zero();
+	int i;
+
+	for (i = 0; i + 16 <= len; i += 16)
+	{
+		x = vb_add(vb_load(in + i), vb_down(last, 12));
+		x = vb_add(x, vb_up(x, 4));
+		x = vb_add(x, vb_up(x, 8));
+		vb_store(out + i, x);
+		last = x;
+	}
+	predict_tail(out, in, NULL, i, len, 4, 1);
+}
+
+static void
+predict_avg_3_simd(byte *out, byte *in, byte *ref, int len)
+{
+	vb a = vb_zero();
+	vb m = vb_load(vb_pixel_3);
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 3)
+	{
+		a = vb_add(vb_load_4(in + i), vb_and(vb_avg(a, vb_load_4(ref + i)), m));
+		vb_store_4(out + i, a);
+	}
+	predict_tail(out, in, ref, i, len, 3, 3);
+}
+
+static void
+predict_avg_4_simd(byte *out, byte *in, byte *ref, int len)
+{
+	vb a = vb_zero();
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 4)
+	{
+		a = vb_add(vb_load_4(in + i), vb_avg(a, vb_load_4(ref + i)));
+		vb_store_4(out + i, a);
+	}
+	predict_tail(out, in, ref, i, len, 4, 3);
+}
+
+static void
+predict_paeth_3_simd(byte *out, byte *in, byte *ref, int len)
+{
+	vb a = vb_zero(), b, c = vb_zero();
+	vb m = vb_load(vb_pixel_3);
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 3)
+	{
+		b = vb_load_4(ref + i);
+		a = vb_add(vb_load_4(in + i), vb_and(vb_paeth(a, b, c), m));
+		vb_store_4(out + i, a);
+		c = b;
+	}
+	predict_tail(out, in, ref, i, len, 3, 4);
+}
+
+static void
+predict_paeth_4_simd(byte *out, byte *in, byte *ref, int len)
+{
+	vb a = vb_zero(), b, c = vb_zero();
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 4)
+	{
+		b = vb_load_4(ref + i);
+		a = vb_add(vb_load_4(in + i), vb_paeth(a, b, c));
+		vb_store_4(out + i, a);
+		c = b;
+	}
+	predict_tail(out, in, ref, i, len, 4, 4);
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+int
+fz_has_simd(void)
+{
+#if defined(HAVE_NEON) && !defined(__aarch64__)
+	/* Look for HWCAP_NEON in the AT_HWCAP entry of our auxiliary vector */
+	unsigned long aux[2];
+	int neon = 0;
+	FILE *file = fopen("/proc/self/auxv", "rb");
+	if (file == NULL)
+		return 0;
+	while (fread(aux, sizeof aux, 1, file) == 1 && aux[0] != 0)
+	{
+		if (aux[0] == 16)
+		{
+			neon = (aux[1] & (1 << 12)) != 0;
+			break;
+		}
+	}
+	fclose(file);
+	return neon;
+#elif defined(HAVE_SSE2) || defined(HAVE_NEON)
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void
+fz_accelerate_predict(void)
+{
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	static int checked = 0;
+
+	if (checked)
+		return;
+	checked = 1;
+
+	if (!fz_has_simd())
+		return;
+
+	fz_predict_funcs.up = predict_up_simd;
+	fz_predict_funcs.sub_1 = predict_sub_1_simd;
+	fz_predict_funcs.sub_3 = predict_sub_3_simd;
+	fz_predict_funcs.sub_4 = predict_sub_4_simd;
+	fz_predict_funcs.avg_3 = predict_avg_3_simd;
+	fz_predict_funcs.avg_4 = predict_avg_4_simd;
+	fz_predict_funcs.paeth_3 = predict_paeth_3_simd;
+	fz_predict_funcs.paeth_4 = predict_paeth_4_simd;
+#endif
+}
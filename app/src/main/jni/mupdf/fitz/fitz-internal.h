@@ -557,11 +557,31 @@ void *fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_
 */
 void fz_remove_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *type);
 
+/*
+	fz_filter_store: Remove every item whose key passes a test.
+
+	free: The function used to free the values to consider.
+
+	fn: The test, called with arg and the key of each such item;
+	returns non-zero for the items to remove.
+
+	type: Functions used to manipulate the key.
+*/
+typedef int (fz_store_filter_fn)(void *arg, void *key);
+
+void fz_filter_store(fz_context *ctx, fz_store_free_fn *free, fz_store_filter_fn *fn, void *arg, fz_store_type *type);
+
 /*
 	fz_empty_store: Evict everything from the store.
 */
 void fz_empty_store(fz_context *ctx);
 
+/*
+	fz_store_limit: The most the store will hold, in bytes; 0
+	(FZ_STORE_UNLIMITED) if it has no limit.
+*/
+unsigned int fz_store_limit(fz_context *ctx);
+
 /*
 	fz_store_scavenge: Internal function used as part of the scavenging
 	allocator; when we fail to allocate memory, before returning a
@@ -796,13 +816,33 @@ fz_stream *fz_open_ahxd(fz_stream *chain);
 fz_stream *fz_open_rld(fz_stream *chain);
 fz_stream *fz_open_dctd(fz_stream *chain, int color_transform);
 fz_stream *fz_open_resized_dctd(fz_stream *chain, int color_transform, int l2factor);
+fz_stream *fz_open_dctd_band(fz_stream *chain, int color_transform, int l2factor, int y0, int y1);
 fz_stream *fz_open_faxd(fz_stream *chain,
 	int k, int end_of_line, int encoded_byte_align,
 	int columns, int rows, int end_of_block, int black_is_1);
 fz_stream *fz_open_flated(fz_stream *chain);
 fz_stream *fz_open_lzwd(fz_stream *chain, int early_change);
 fz_stream *fz_open_predict(fz_stream *chain, int predictor, int columns, int colors, int bpc);
-fz_stream *fz_open_jbig2d(fz_stream *chain, fz_buffer *global);
+
+/*
+	Decoded JBIG2Globals segments, shared between all the page streams
+	that refer to them. fz_open_jbig2d takes possession of the reference
+	passed in (which may be NULL).
+
+	Globals may only be used from the context that loaded them, as
+	jbig2dec does not lock its shared symbol images; check with
+	fz_jbig2_globals_usable before reusing globals found in the store.
+*/
+typedef struct fz_jbig2_globals_s fz_jbig2_globals;
+
+fz_jbig2_globals *fz_load_jbig2_globals(fz_context *ctx, fz_buffer *buf);
+fz_jbig2_globals *fz_keep_jbig2_globals(fz_context *ctx, fz_jbig2_globals *globals);
+void fz_drop_jbig2_globals(fz_context *ctx, fz_jbig2_globals *globals);
+void fz_free_jbig2_globals_imp(fz_context *ctx, fz_storable *globals);
+unsigned int fz_jbig2_globals_size(fz_jbig2_globals *globals);
+int fz_jbig2_globals_usable(fz_context *ctx, fz_jbig2_globals *globals);
+
+fz_stream *fz_open_jbig2d(fz_stream *chain, fz_jbig2_globals *globals);
 
 /*
  * Resources and other graphics related objects.
@@ -813,14 +853,23 @@ enum { FZ_MAX_COLORS = 32 };
 int fz_lookup_blendmode(char *name);
 char *fz_blendmode_name(int blendmode);
 
+/*
+	Bitmaps are 1 bit per component, rows packed msb first. Those made
+	from bilevel images (see fz_image_to_bitmap) go in the store; a set
+	bit is a sample of 1 (white, or opaque for a mask), and the bits
+	past the end of each row are clear.
+*/
 struct fz_bitmap_s
 {
-	int refs;
+	fz_storable storable;
 	int w, h, stride, n;
+	int interpolate;
 	unsigned char *samples;
 };
 
 fz_bitmap *fz_new_bitmap(fz_context *ctx, int w, int h, int n);
+void fz_free_bitmap_imp(fz_context *ctx, fz_storable *bit);
+unsigned int fz_bitmap_size(fz_context *ctx, fz_bitmap *bit);
 
 void fz_bitmap_details(fz_bitmap *bitmap, int *w, int *h, int *n, int *stride);
 
@@ -884,6 +933,14 @@ typedef struct fz_scale_cache_s fz_scale_cache;
 fz_scale_cache *fz_new_scale_cache(fz_context *ctx);
 void fz_free_scale_cache(fz_context *ctx, fz_scale_cache *cache);
 fz_pixmap *fz_scale_pixmap_cached(fz_context *ctx, fz_pixmap *src, float x, float y, float w, float h, fz_bbox *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y);
+/*
+	fz_scale_pixmap_part: As fz_scale_pixmap_cached, for a src that
+	holds just the part at src->x, src->y of a src_w x src_h image.
+	The pixels of the result come out as they would from the whole
+	image, as long as clip keeps to those the part has the source
+	pixels for.
+*/
+fz_pixmap *fz_scale_pixmap_part(fz_context *ctx, fz_pixmap *src, int src_w, int src_h, float x, float y, float w, float h, fz_bbox *clip, fz_scale_cache *cache_x, fz_scale_cache *cache_y);
 
 void fz_subsample_pixmap(fz_context *ctx, fz_pixmap *tile, int factor);
 
@@ -901,7 +958,7 @@ enum
 {
 	FZ_IMAGE_UNKNOWN = 0,
 	FZ_IMAGE_JPEG = 1,
-	FZ_IMAGE_JPX = 2, /* Placeholder until supported */
+	FZ_IMAGE_JPX = 2,
 	FZ_IMAGE_FAX = 3,
 	FZ_IMAGE_JBIG2 = 4, /* Placeholder until supported */
 	FZ_IMAGE_RAW = 5,
@@ -964,9 +1021,48 @@ struct fz_image_s
 	fz_image *mask;
 	fz_colorspace *colorspace;
 	fz_pixmap *(*get_pixmap)(fz_context *, fz_image *, int w, int h);
+	fz_pixmap *(*get_pixmap_area)(fz_context *, fz_image *, int w, int h, fz_rect area, int *fw, int *fh);
+	fz_bitmap *(*get_bitmap)(fz_context *, fz_image *);
 };
 
+/*
+	fz_image_to_bitmap: Get a bilevel image (1 bit per sample, one
+	component, such as a CCITT or JBIG2 scan or an image mask) whole, as
+	a 1 bpp bitmap. This is 8 times smaller than the pixmap, so it is
+	what is kept in the store; callers that can work from it directly
+	should. Returns NULL for any other kind of image.
+*/
+fz_bitmap *fz_image_to_bitmap(fz_context *ctx, fz_image *image);
+
+/*
+	fz_image_to_pixmap_area: As fz_image_to_pixmap, but only the part
+	of the image within area (in the unit square of image space) need
+	be decoded. The pixmap returned holds the part at pixmap->x,
+	pixmap->y of the image decoded at fw x fh pixels; this may be
+	anything from a little more than was asked for up to the whole
+	image.
+*/
+fz_pixmap *fz_image_to_pixmap_area(fz_context *ctx, fz_image *image, int w, int h, fz_rect area, int *fw, int *fh);
+
 fz_pixmap *fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int indexed);
+
+/*
+	fz_load_jpx_area: Decode a JPEG 2000 image at a reduced size, and
+	only those of its tiles that are needed.
+
+	l2factor: On entry, the number of times to halve the size; on
+	exit, the number of times it was halved, which is less if the
+	image has too few resolution levels.
+
+	bbox: On entry, the part of the image wanted, in pixels of the
+	full size image (empty for all of it). On exit, the bbox of the
+	whole image at full size.
+
+	The returned pixmap covers the part wanted, rounded out to whole
+	tiles of the JPEG 2000 image; its x and y give its place in the
+	reduced image, (w + (1<<l2factor) - 1) >> l2factor pixels wide.
+*/
+fz_pixmap *fz_load_jpx_area(fz_context *ctx, unsigned char *data, int size, fz_colorspace *cs, int indexed, int *l2factor, fz_bbox *bbox);
 fz_pixmap *fz_load_jpeg(fz_context *doc, unsigned char *data, int size);
 fz_pixmap *fz_load_png(fz_context *doc, unsigned char *data, int size);
 fz_pixmap *fz_load_tiff(fz_context *doc, unsigned char *data, int size);
@@ -1184,6 +1280,25 @@ fz_glyph_cache *fz_keep_glyph_cache(fz_context *ctx);
 void fz_drop_glyph_cache_context(fz_context *ctx);
 void fz_purge_glyph_cache(fz_context *ctx);
 
+/*
+	fz_set_glyph_cache_size: Set the number of bytes the glyph cache
+	may use. The least recently used glyphs are evicted to make room.
+*/
+void fz_set_glyph_cache_size(fz_context *ctx, unsigned int max);
+
+typedef struct fz_glyph_cache_stats_s fz_glyph_cache_stats;
+
+struct fz_glyph_cache_stats_s
+{
+	int hits;
+	int misses;
+	int evictions;
+	unsigned int size;
+	unsigned int max;
+};
+
+void fz_get_glyph_cache_stats(fz_context *ctx, fz_glyph_cache_stats *stats);
+
 fz_path *fz_outline_ft_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix trm);
 fz_path *fz_outline_glyph(fz_context *ctx, fz_font *font, int gid, fz_matrix ctm);
 fz_pixmap *fz_render_ft_glyph(fz_context *ctx, fz_font *font, int cid, fz_matrix trm, int aa);
@@ -1324,7 +1439,11 @@ struct fz_mesh_processor_s {
 	void *process_arg;
 };
 
-void fz_process_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm,
+/*
+ * Triangles wholly outside scissor (in device space) may be skipped;
+ * pass fz_infinite_rect to have them all.
+ */
+void fz_process_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_rect scissor,
 			fz_mesh_process_fn *process, void *process_arg);
 
 #ifndef NDEBUG
@@ -1340,6 +1459,7 @@ typedef struct fz_gel_s fz_gel;
 fz_gel *fz_new_gel(fz_context *ctx);
 void fz_insert_gel(fz_gel *gel, float x0, float y0, float x1, float y1);
 void fz_reset_gel(fz_gel *gel, fz_bbox clip);
+void fz_set_gel_analytic(fz_gel *gel, int analytic);
 void fz_sort_gel(fz_gel *gel);
 fz_bbox fz_bound_gel(fz_gel *gel);
 void fz_free_gel(fz_gel *gel);
@@ -1357,6 +1477,13 @@ void fz_flatten_dash_path(fz_gel *gel, fz_path *path, fz_stroke_state *stroke, f
 
 fz_device *fz_new_draw_device_type3(fz_context *ctx, fz_pixmap *dest);
 
+/*
+	fz_display_list_size: Approximate number of bytes held by a
+	display list, for accounting when a list is kept in the store.
+	Images and shades are shared and not counted.
+*/
+unsigned int fz_display_list_size(fz_display_list *list);
+
 enum
 {
 	/* Hints */
@@ -1451,6 +1578,32 @@ fz_device *fz_new_device(fz_context *ctx, void *user);
 void fz_decode_tile(fz_pixmap *pix, float *decode);
 void fz_decode_indexed_tile(fz_pixmap *pix, float *decode, int maxval);
 void fz_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int scale);
+void fz_mask_color_key(fz_pixmap *pix, int n, int *colorkey);
+void fz_unpack_bitmap(fz_pixmap *dst, fz_bitmap *bit, int x0, int y0, int factor);
+
+/*
+ * fz_decode_unpack_tile: Unpack image samples as fz_unpack_tile does
+ * (unscaled if indexed), mask them with colorkey (if not NULL) as
+ * fz_mask_color_key does, then apply decode as fz_decode_indexed_tile or
+ * fz_decode_tile does, all in one pass over the pixmap.
+ */
+void fz_decode_unpack_tile(fz_pixmap *dst, unsigned char * restrict src, int n, int depth, int stride, int indexed, float *decode, int *colorkey);
+
+/*
+ * Decode array multiply-add for 2 and 4 component pixmaps of len pixels,
+ * for fz_decode_tile. add and mul hold a 16-bit offset and scale for each
+ * color component; alpha is left alone. NULL unless fz_accelerate finds
+ * SIMD support.
+ */
+typedef struct fz_decode_table_s fz_decode_table;
+
+struct fz_decode_table_s
+{
+	void (*decode_2)(unsigned char *p, int len, int *add, int *mul);
+	void (*decode_4)(unsigned char *p, int len, int *add, int *mul);
+};
+
+extern fz_decode_table fz_decode_funcs;
 
 void fz_paint_solid_alpha(unsigned char * restrict dp, int w, int alpha);
 void fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned char *color);
@@ -1458,8 +1611,170 @@ void fz_paint_solid_color(unsigned char * restrict dp, int n, int w, unsigned ch
 void fz_paint_span(unsigned char * restrict dp, unsigned char * restrict sp, int n, int w, int alpha);
 void fz_paint_span_with_color(unsigned char * restrict dp, unsigned char * restrict mp, int n, int w, unsigned char *color);
 
+/*
+ * Span painters for 2 and 4 components (grey and rgb, with alpha). These
+ * start out as the portable C versions; fz_accelerate swaps in SIMD
+ * versions where the CPU has them. Both give identical results.
+ */
+typedef struct fz_paint_table_s fz_paint_table;
+
+struct fz_paint_table_s
+{
+	void (*solid_color_4)(unsigned char * restrict dp, int w, unsigned char *color);
+	void (*span_with_color_2)(unsigned char * restrict dp, unsigned char * restrict mp, int w, unsigned char *color);
+	void (*span_with_color_4)(unsigned char * restrict dp, unsigned char * restrict mp, int w, unsigned char *color);
+	void (*span_with_opaque_color_2)(unsigned char * restrict dp, unsigned char * restrict mp, int w, unsigned char *color);
+	void (*span_with_opaque_color_4)(unsigned char * restrict dp, unsigned char * restrict mp, int w, unsigned char *color);
+	void (*span_with_mask_2)(unsigned char * restrict dp, unsigned char * restrict sp, unsigned char * restrict mp, int w);
+	void (*span_with_mask_4)(unsigned char * restrict dp, unsigned char * restrict sp, unsigned char * restrict mp, int w);
+	void (*span_2)(unsigned char * restrict dp, unsigned char * restrict sp, int w);
+	void (*span_4)(unsigned char * restrict dp, unsigned char * restrict sp, int w);
+	void (*span_2_with_alpha)(unsigned char * restrict dp, unsigned char * restrict sp, int w, int alpha);
+	void (*span_4_with_alpha)(unsigned char * restrict dp, unsigned char * restrict sp, int w, int alpha);
+};
+
+extern fz_paint_table fz_paint_funcs;
+
+/*
+ * Inner loops of the smooth scaler (draw_scale.c). contrib points at a
+ * packed run of [min, len, weights...] records. The row_to_temp passes
+ * apply count of them to one source row of 1, 2 or 4 components,
+ * writing ints backwards if flip is set; row_from_temp applies len
+ * weights to rows of the temporary buffer that lie width ints apart.
+ * row_to_temp_fixed covers a run of count output pixels that share the
+ * same 2*factor weights, with taps factor pixels apart (factor 2 or 4,
+ * as from an exact 2:1 or 4:1 reduction); src points at the first tap.
+ * They stay NULL, and the scaler uses its own loops, unless
+ * fz_accelerate finds SIMD support.
+ */
+typedef struct fz_scale_table_s fz_scale_table;
+
+struct fz_scale_table_s
+{
+	void (*row_to_temp_1)(int *dst, unsigned char *src, int *contrib, int count, int flip);
+	void (*row_to_temp_2)(int *dst, unsigned char *src, int *contrib, int count, int flip);
+	void (*row_to_temp_4)(int *dst, unsigned char *src, int *contrib, int count, int flip);
+	void (*row_to_temp_fixed)(int *dst, unsigned char *src, int *weights, int n, int factor, int count);
+	void (*row_from_temp)(unsigned char *dst, int *src, int *contrib, int len, int width);
+};
+
+extern fz_scale_table fz_scale_funcs;
+
+/*
+ * Bilinear affine samplers (draw_affine.c) for 2 and 4 component images
+ * painted over a destination of the same kind. u and v are the 16.16
+ * image position of the first pixel, stepping by fa and fb; the caller
+ * guarantees that every sample and its right and lower neighbours lie
+ * inside the sw pixel wide image, so there is no clamping to do. alpha
+ * is 1 to 255. NULL unless fz_accelerate finds SIMD support.
+ */
+typedef struct fz_affine_table_s fz_affine_table;
+
+struct fz_affine_table_s
+{
+	void (*lerp_2)(unsigned char * restrict dp, unsigned char *sp, int sw, int u, int v, int fa, int fb, int w, int alpha);
+	void (*lerp_4)(unsigned char * restrict dp, unsigned char *sp, int sw, int u, int v, int fa, int fb, int w, int alpha);
+};
+
+extern fz_affine_table fz_affine_funcs;
+
+/*
+ * Separable blending of an isolated group (draw_blend.c) onto a 2 or 4
+ * component backdrop, for every separable mode but ColorDodge, ColorBurn
+ * and SoftLight. These do whole blocks of 16 bytes from the start of the
+ * span and return how many pixels they did, stopping early at a block
+ * with colors that exceed their alpha; the caller does the rest. NULL
+ * unless fz_accelerate finds SIMD support.
+ */
+typedef struct fz_blend_table_s fz_blend_table;
+
+struct fz_blend_table_s
+{
+	int (*separable_2)(unsigned char * restrict bp, unsigned char * restrict sp, int w, int blendmode);
+	int (*separable_4)(unsigned char * restrict bp, unsigned char * restrict sp, int w, int blendmode);
+};
+
+extern fz_blend_table fz_blend_funcs;
+
+/*
+ * Parameter spans for the direct axial and radial shading painters
+ * (draw_mesh.c). Each writes the function sample index (0 to 255) for w
+ * pixels, or -1 where the shading does not reach; extend0 and extend1
+ * are the shading's Extend flags. axial steps t by dt per pixel. radial
+ * starts at shading space point (px, py), stepping by (dpx, dpy), and
+ * needs rd->a to be non zero. NULL unless fz_accelerate finds SIMD
+ * support; radial needs double lanes, so is also NULL on 32-bit ARM.
+ */
+typedef struct fz_radial_data_s fz_radial_data;
+
+struct fz_radial_data_s
+{
+	double x0, y0, r0;
+	double cdx, cdy, dr;
+	double a, inva;
+};
+
+typedef struct fz_shade_table_s fz_shade_table;
+
+struct fz_shade_table_s
+{
+	void (*axial)(int *idx, int w, float t, float dt, int extend0, int extend1);
+	void (*radial)(int *idx, int w, fz_radial_data *rd, double px, double py, double dpx, double dpy, int extend0, int extend1);
+};
+
+extern fz_shade_table fz_shade_funcs;
+
+/*
+ * PNG predictor rows (filt_predict.c): len bytes of in are unfiltered
+ * into out, which may be in itself; ref is the row above. The Sub,
+ * Average and Paeth filters are for 1, 3 or 4 bytes per pixel as named,
+ * Up is for any. NULL unless fz_accelerate_predict finds SIMD support.
+ */
+typedef struct fz_predict_table_s fz_predict_table;
+
+struct fz_predict_table_s
+{
+	void (*up)(unsigned char *out, unsigned char *in, unsigned char *ref, int len);
+	void (*sub_1)(unsigned char *out, unsigned char *in, int len);
+	void (*sub_3)(unsigned char *out, unsigned char *in, int len);
+	void (*sub_4)(unsigned char *out, unsigned char *in, int len);
+	void (*avg_3)(unsigned char *out, unsigned char *in, unsigned char *ref, int len);
+	void (*avg_4)(unsigned char *out, unsigned char *in, unsigned char *ref, int len);
+	void (*paeth_3)(unsigned char *out, unsigned char *in, unsigned char *ref, int len);
+	void (*paeth_4)(unsigned char *out, unsigned char *in, unsigned char *ref, int len);
+};
+
+extern fz_predict_table fz_predict_funcs;
+
+/*
+ * fz_accelerate installs the SIMD paths of the draw library and
+ * fz_accelerate_predict those of the predictor filter, if fz_has_simd
+ * says the CPU can run them. fz_accelerate does so through the
+ * installers of the draw_*_simd.c files, which leave the checking to it.
+ */
+int fz_has_simd(void);
+void fz_accelerate(void);
+void fz_accelerate_predict(void);
+void fz_accelerate_paint(void);
+void fz_accelerate_scale(void);
+void fz_accelerate_affine(void);
+void fz_accelerate_unpack(void);
+void fz_accelerate_blend(void);
+void fz_accelerate_mesh(void);
+
+/* The image is painted exactly where ctm puts it; callers wanting it
+ * snapped to whole device pixels use fz_gridfit_matrix first. */
 void fz_paint_image(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, int alpha);
 void fz_paint_image_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, fz_matrix ctm, unsigned char *colorbv);
+/* The same, from a bilevel bitmap, as painting the pixmap it unpacks to
+ * would. fz_paint_bitmap paints it as alpha onto a one component dst. */
+void fz_paint_bitmap(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, fz_matrix ctm);
+void fz_paint_bitmap_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_bitmap *bit, fz_matrix ctm, unsigned char *colorbv);
+/* As fz_paint_image and fz_paint_image_with_color, where img holds just
+ * the part at img->x, img->y of a w x h image that ctm places. Its
+ * pixels come out exactly as they would from the whole image. */
+void fz_paint_image_part(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, int w, int h, fz_matrix ctm, int alpha);
+void fz_paint_image_part_with_color(fz_pixmap *dst, fz_bbox scissor, fz_pixmap *shape, fz_pixmap *img, int w, int h, fz_matrix ctm, unsigned char *colorbv);
 
 void fz_paint_pixmap(fz_pixmap *dst, fz_pixmap *src, int alpha);
 void fz_paint_pixmap_with_mask(fz_pixmap *dst, fz_pixmap *src, fz_pixmap *msk);
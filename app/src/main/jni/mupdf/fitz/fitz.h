@@ -384,6 +384,23 @@ int fz_aa_level(fz_context *ctx);
 */
 void fz_set_aa_level(fz_context *ctx, int bits);
 
+/*
+	fz_aa_analytic: Get whether anti-aliased paths are rendered with
+	exact area coverage (non-zero) or by supersampling (zero).
+*/
+int fz_aa_analytic(fz_context *ctx);
+
+/*
+	fz_set_aa_analytic: Choose how anti-aliased paths are rendered.
+
+	analytic: If non-zero, draw devices created after this call
+	fill paths by computing the exact area of each pixel that they
+	cover, rather than by counting samples on a grid within the
+	pixel. Strokes are always sampled. It has no effect when the
+	anti-aliasing level is 0.
+*/
+void fz_set_aa_analytic(fz_context *ctx, int analytic);
+
 /*
 	Locking functions
 
@@ -1714,6 +1731,18 @@ fz_device *fz_new_draw_device(fz_context *ctx, fz_pixmap *dest);
 */
 fz_device *fz_new_draw_device_with_bbox(fz_context *ctx, fz_pixmap *dest, fz_bbox clip);
 
+/*
+	fz_set_draw_device_analytic: Choose how a draw device fills
+	anti-aliased paths, overriding the default it took from
+	fz_aa_analytic when it was created.
+
+	dev: A device created by fz_new_draw_device*.
+
+	analytic: If non-zero, fill paths from their exact area
+	coverage; otherwise by supersampling.
+*/
+void fz_set_draw_device_analytic(fz_device *dev, int analytic);
+
 /*
 	Text extraction device: Used for searching, format conversion etc.
 
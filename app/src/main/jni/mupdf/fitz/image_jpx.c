@@ -21,7 +21,7 @@ static void fz_opj_info_callback(const char *msg, void *client_data)
 }
 
 fz_pixmap *
-fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs, int indexed)
+fz_load_jpx_area(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs, int indexed, int *l2factor, fz_bbox *bbox)
 {
 	fz_pixmap *img;
 	opj_event_mgr_t evtmgr;
@@ -34,6 +34,7 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	int format;
 	int a, n, w, h, depth, sgnd;
 	int x, y, k, v;
+	int f, dx, dy, x0, y0;
 
 	if (size < 2)
 		fz_throw(ctx, "not enough data to determine image format");
@@ -52,6 +53,15 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	opj_set_default_decoder_parameters(&params);
 	if (indexed)
 		params.flags |= OPJ_DPARAMETERS_IGNORE_PCLR_CMAP_CDEF_FLAG;
+	params.cp_reduce = *l2factor;
+	params.cp_threads = opj_get_num_cpus();
+	if (!fz_is_empty_bbox(*bbox))
+	{
+		params.cp_da_x0 = bbox->x0;
+		params.cp_da_y0 = bbox->y0;
+		params.cp_da_x1 = bbox->x1;
+		params.cp_da_y1 = bbox->y1;
+	}
 
 	info = opj_create_decompress(format);
 	opj_set_event_mgr((opj_common_ptr)info, &evtmgr, ctx);
@@ -92,6 +102,22 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	depth = jpx->comps[0].prec;
 	sgnd = jpx->comps[0].sgnd;
 
+	/* The decoder may halve the size fewer times than asked, if the
+	 * image runs out of resolution levels; and may have decoded just
+	 * some of its tiles, which lie where the first component says */
+	f = jpx->comps[0].factor;
+	dx = jpx->comps[0].dx;
+	dy = jpx->comps[0].dy;
+	x0 = (jpx->x0 + dx - 1) / dx;
+	y0 = (jpx->y0 + dy - 1) / dy;
+	*l2factor = f;
+	bbox->x0 = 0;
+	bbox->y0 = 0;
+	bbox->x1 = (jpx->x1 + dx - 1) / dx - x0;
+	bbox->y1 = (jpx->y1 + dy - 1) / dy - y0;
+	x0 = ((jpx->comps[0].x0 + (1 << f) - 1) >> f) - ((x0 + (1 << f) - 1) >> f);
+	y0 = ((jpx->comps[0].y0 + (1 << f) - 1) >> f) - ((y0 + (1 << f) - 1) >> f);
+
 	if (jpx->color_space == CLRSPC_SRGB && n == 4) { n = 3; a = 1; }
 	else if (jpx->color_space == CLRSPC_SYCC && n == 4) { n = 3; a = 1; }
 	else if (n == 2) { n = 1; a = 1; }
@@ -124,6 +150,8 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	fz_try(ctx)
 	{
 		img = fz_new_pixmap(ctx, colorspace, w, h);
+		img->x = x0;
+		img->y = y0;
 	}
 	fz_catch(ctx)
 	{
@@ -154,7 +182,7 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 	{
 		if (n == 4)
 		{
-			fz_pixmap *tmp = fz_new_pixmap(ctx, fz_device_rgb, w, h);
+			fz_pixmap *tmp = fz_new_pixmap_with_bbox(ctx, fz_device_rgb, fz_pixmap_bbox(ctx, img));
 			fz_convert_pixmap(ctx, tmp, img);
 			fz_drop_pixmap(ctx, img);
 			img = tmp;
@@ -166,3 +194,12 @@ fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs
 
 	return img;
 }
+
+fz_pixmap *
+fz_load_jpx(fz_context *ctx, unsigned char *data, int size, fz_colorspace *defcs, int indexed)
+{
+	int l2factor = 0;
+	fz_bbox bbox = fz_empty_bbox;
+
+	return fz_load_jpx_area(ctx, data, size, defcs, indexed, &l2factor, &bbox);
+}
@@ -660,34 +660,6 @@ static void fast_cmyk_to_rgb(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 #endif
 }
 
-static void fast_cmyk_to_bgr(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
-{
-	unsigned char *s = src->samples;
-	unsigned char *d = dst->samples;
-	int n = src->w * src->h;
-	while (n--)
-	{
-#ifdef SLOWCMYK
-		float cmyk[4], rgb[3];
-		cmyk[0] = s[0] / 255.0f;
-		cmyk[1] = s[1] / 255.0f;
-		cmyk[2] = s[2] / 255.0f;
-		cmyk[3] = s[3] / 255.0f;
-		cmyk_to_rgb(ctx, NULL, cmyk, rgb);
-		d[0] = rgb[2] * 255;
-		d[1] = rgb[1] * 255;
-		d[2] = rgb[0] * 255;
-#else
-		d[0] = 255 - (unsigned char)fz_mini(s[2] + s[3], 255);
-		d[1] = 255 - (unsigned char)fz_mini(s[1] + s[3], 255);
-		d[2] = 255 - (unsigned char)fz_mini(s[0] + s[3], 255);
-#endif
-		d[3] = s[4];
-		s += 5;
-		d += 4;
-	}
-}
-
 static void fast_rgb_to_bgr(fz_pixmap *dst, fz_pixmap *src)
 {
 	unsigned char *s = src->samples;
@@ -704,6 +676,416 @@ static void fast_rgb_to_bgr(fz_pixmap *dst, fz_pixmap *src)
 	}
 }
 
+/*
+	Interpolated lookup tables, for converting big images from
+	colorspaces with up to COLOR_LUT_MAX_N components. The converter is
+	sampled on a regular grid over the cube of byte values, and each
+	pixel interpolated from the corners of the simplex of grid points
+	around it: sorting the fractional offsets picks the corners, and the
+	differences between them are the weights. A table is built once per
+	pair of colorspaces and kept in the store.
+
+	Single component (Separation) tables have a node for every byte
+	value, so need no interpolation. For DeviceN with many components
+	the grid gets coarser, to bound the size of the table and the number
+	of tint transform evaluations needed to fill it.
+*/
+
+#define COLOR_LUT_MAX_N 8
+#define COLOR_LUT_MAX_NODES 131072
+
+/* Images with fewer pixels than this use the hash table below, unless
+ * a table for the pair is already in the store. */
+#define COLOR_LUT_MIN_PIXELS 4096
+
+typedef struct fz_color_lut_key_s fz_color_lut_key;
+
+struct fz_color_lut_key_s
+{
+	int refs;
+	fz_colorspace *ss;
+	fz_colorspace *ds;
+};
+
+typedef struct fz_color_lut_s fz_color_lut;
+
+struct fz_color_lut_s
+{
+	fz_storable storable;
+	unsigned int size;
+	int srcn, dstn, grid;
+	int stride[COLOR_LUT_MAX_N];
+	/* for each byte value, the grid point below it (times stride) and
+	 * the distance on to the next, out of 256 */
+	unsigned char index[256];
+	short frac[256];
+	/* the converted colors at the grid points, times 256 */
+	unsigned short *nodes;
+};
+
+static int
+fz_make_hash_color_lut_key(fz_store_hash *hash, void *key_)
+{
+	fz_color_lut_key *key = (fz_color_lut_key *)key_;
+
+	hash->u.pi.ptr = key->ss;
+	hash->u.pi.i = key->ds->n;
+	return 1;
+}
+
+static void *
+fz_keep_color_lut_key(fz_context *ctx, void *key_)
+{
+	fz_color_lut_key *key = (fz_color_lut_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+fz_drop_color_lut_key(fz_context *ctx, void *key_)
+{
+	fz_color_lut_key *key = (fz_color_lut_key *)key_;
+	int drop;
+
+	if (key == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+	{
+		fz_drop_colorspace(ctx, key->ss);
+		fz_drop_colorspace(ctx, key->ds);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_color_lut_key(void *k0_, void *k1_)
+{
+	fz_color_lut_key *k0 = (fz_color_lut_key *)k0_;
+	fz_color_lut_key *k1 = (fz_color_lut_key *)k1_;
+
+	return k0->ss != k1->ss || k0->ds != k1->ds;
+}
+
+#ifndef NDEBUG
+static void
+fz_debug_color_lut_key(void *key_)
+{
+	fz_color_lut_key *key = (fz_color_lut_key *)key_;
+
+	printf("(color lut %s to %s) ", key->ss->name, key->ds->name);
+}
+#endif
+
+static fz_store_type fz_color_lut_store_type =
+{
+	fz_make_hash_color_lut_key,
+	fz_keep_color_lut_key,
+	fz_drop_color_lut_key,
+	fz_cmp_color_lut_key,
+#ifndef NDEBUG
+	fz_debug_color_lut_key
+#endif
+};
+
+static void
+fz_free_color_lut_imp(fz_context *ctx, fz_storable *lut_)
+{
+	fz_color_lut *lut = (fz_color_lut *)lut_;
+
+	fz_free(ctx, lut->nodes);
+	fz_free(ctx, lut);
+}
+
+/* Scale a byte per component to the converter's input range */
+static void
+fz_unpack_color(fz_colorspace *ss, float *srcv, float *s)
+{
+	int k;
+
+	if (!strcmp(ss->name, "Lab") && ss->n == 3)
+	{
+		srcv[0] = s[0] / 255.0f * 100;
+		srcv[1] = s[1] - 128;
+		srcv[2] = s[2] - 128;
+	}
+	else
+	{
+		for (k = 0; k < ss->n; k++)
+			srcv[k] = s[k] / 255.0f;
+	}
+}
+
+/*
+	Pick the grid size for a table, or 0 if the colorspaces are not
+	suitable. The count of grid points is returned in nodes. Strides are
+	packed into 16 bits while converting, so must stay below 65536.
+*/
+static int
+fz_color_lut_grid(int srcn, int dstn, int *nodes)
+{
+	static const int grids[COLOR_LUT_MAX_N + 1] = { 0, 256, 65, 33, 17, 9, 7, 5, 4 };
+	int grid, count, k;
+
+	if (srcn < 1 || srcn > COLOR_LUT_MAX_N || dstn < 1 || dstn > 4)
+		return 0;
+
+	for (grid = grids[srcn]; grid >= 2; grid--)
+	{
+		for (count = 1, k = 1; k < srcn; k++)
+			count *= grid;
+		if (count * dstn < 65536 && count * grid <= COLOR_LUT_MAX_NODES)
+			break;
+	}
+	if (grid < 2)
+		return 0;
+
+	*nodes = count * grid;
+	return grid;
+}
+
+static fz_color_lut *
+fz_new_color_lut(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss)
+{
+	fz_color_lut *lut;
+	fz_color_converter cc;
+	float sv[COLOR_LUT_MAX_N], srcv[FZ_MAX_COLORS], dstv[FZ_MAX_COLORS];
+	int srcn = ss->n;
+	int dstn = ds->n;
+	int grid, count, i, j, k, v;
+	unsigned short *node;
+
+	grid = fz_color_lut_grid(srcn, dstn, &count);
+	if (grid == 0)
+		return NULL;
+
+	lut = fz_malloc_struct(ctx, fz_color_lut);
+	FZ_INIT_STORABLE(lut, 1, fz_free_color_lut_imp);
+	lut->srcn = srcn;
+	lut->dstn = dstn;
+	lut->grid = grid;
+
+	count = dstn;
+	for (k = srcn - 1; k >= 0; k--)
+	{
+		lut->stride[k] = count;
+		count *= grid;
+	}
+
+	for (i = 0; i < 256; i++)
+	{
+		int p = i * (grid - 1);
+		int g = p / 255;
+		int f = (p % 255) * 256 / 255;
+		if (g == grid - 1)
+		{
+			g--;
+			f = 256;
+		}
+		lut->index[i] = g;
+		lut->frac[i] = f;
+	}
+
+	fz_try(ctx)
+	{
+		lut->nodes = fz_malloc_array(ctx, count, sizeof(unsigned short));
+		lut->size = sizeof(*lut) + count * sizeof(unsigned short);
+	}
+	fz_catch(ctx)
+	{
+		fz_free(ctx, lut);
+		fz_rethrow(ctx);
+	}
+
+	fz_find_color_converter(&cc, ctx, ds, ss);
+	node = lut->nodes;
+	for (i = 0; i < count / dstn; i++)
+	{
+		for (k = srcn - 1, j = i; k >= 0; k--, j /= grid)
+			sv[k] = (j % grid) * 255.0f / (grid - 1);
+		fz_unpack_color(ss, srcv, sv);
+		cc.convert(&cc, dstv, srcv);
+		for (k = 0; k < dstn; k++)
+		{
+			v = dstv[k] * (255 * 256);
+			*node++ = fz_clampi(v, 0, 255 * 256);
+		}
+	}
+
+	return lut;
+}
+
+static fz_color_lut *
+fz_find_color_lut(fz_context *ctx, fz_colorspace *ds, fz_colorspace *ss, int build)
+{
+	fz_color_lut_key *key;
+	fz_color_lut *lut, *existing;
+
+	key = fz_malloc_no_throw(ctx, sizeof *key);
+	if (!key)
+		return NULL;
+	key->refs = 1;
+	key->ss = fz_keep_colorspace(ctx, ss);
+	key->ds = fz_keep_colorspace(ctx, ds);
+
+	lut = fz_find_item(ctx, fz_free_color_lut_imp, key, &fz_color_lut_store_type);
+	if (lut || !build)
+	{
+		fz_drop_color_lut_key(ctx, key);
+		return lut;
+	}
+
+	fz_try(ctx)
+	{
+		lut = fz_new_color_lut(ctx, ds, ss);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_color_lut_key(ctx, key);
+		fz_rethrow(ctx);
+	}
+	if (!lut)
+	{
+		fz_drop_color_lut_key(ctx, key);
+		return NULL;
+	}
+
+	existing = fz_store_item(ctx, key, lut, lut->size, &fz_color_lut_store_type);
+	if (existing)
+		fz_drop_storable(ctx, &existing->storable);
+
+	fz_drop_color_lut_key(ctx, key);
+	return lut;
+}
+
+/* a, b = larger, smaller */
+#define fz_order(a, b) do { int t_ = fz_mini(a, b); a = fz_maxi(a, b); b = t_; } while (0)
+
+static inline void
+fz_color_lut_convert_n(fz_color_lut *lut, unsigned char *d, unsigned char *s, unsigned int xy, int srcn, int dstn)
+{
+	int acc[FZ_MAX_COLORS];
+	int e[COLOR_LUT_MAX_N], f[COLOR_LUT_MAX_N], step[COLOR_LUT_MAX_N];
+	unsigned char *sold = NULL;
+	int i, j, k;
+
+	for (; xy > 0; xy--)
+	{
+		for (k = 0; sold && k < srcn; k++)
+			if (sold[k] != s[k])
+				break;
+		if (sold && k == srcn)
+		{
+			for (j = 0; j < dstn; j++)
+				d[j] = d[j - dstn - 1];
+		}
+		else
+		{
+			unsigned short *node = lut->nodes;
+			unsigned short *corner;
+			int w;
+
+			/* Grid point below, and the steps to the other corners,
+			 * largest fraction first. Each fraction goes in the top
+			 * bits with its step, so that a branch free sorting
+			 * network can order them. */
+			for (k = 0; k < srcn; k++)
+			{
+				node += lut->index[s[k]] * lut->stride[k];
+				e[k] = (lut->frac[s[k]] << 16) | lut->stride[k];
+			}
+			if (srcn == 2)
+			{
+				fz_order(e[0], e[1]);
+			}
+			else if (srcn == 3)
+			{
+				fz_order(e[0], e[1]);
+				fz_order(e[1], e[2]);
+				fz_order(e[0], e[1]);
+			}
+			else if (srcn == 4)
+			{
+				fz_order(e[0], e[1]);
+				fz_order(e[2], e[3]);
+				fz_order(e[0], e[2]);
+				fz_order(e[1], e[3]);
+				fz_order(e[1], e[2]);
+			}
+			else
+			{
+				for (i = 1; i < srcn; i++)
+					for (k = i; k > 0 && e[k - 1] < e[k]; k--)
+						fz_order(e[k - 1], e[k]);
+			}
+			for (k = 0; k < srcn; k++)
+			{
+				f[k] = e[k] >> 16;
+				step[k] = e[k] & 0xFFFF;
+			}
+
+			w = 256 - f[0];
+			for (j = 0; j < dstn; j++)
+				acc[j] = node[j] * w;
+			corner = node;
+			for (k = 0; k < srcn; k++)
+			{
+				corner += step[k];
+				w = f[k] - (k + 1 < srcn ? f[k + 1] : 0);
+				for (j = 0; j < dstn; j++)
+					acc[j] += corner[j] * w;
+			}
+			for (j = 0; j < dstn; j++)
+				d[j] = acc[j] >> 16;
+		}
+		sold = s;
+		s += srcn;
+		d += dstn;
+		*d++ = *s++;
+	}
+}
+
+/* A grid point for every byte value: just look the colors up */
+static void
+fz_color_lut_convert_1(fz_color_lut *lut, unsigned char *d, unsigned char *s, unsigned int xy)
+{
+	unsigned short *node;
+	int dstn = lut->dstn;
+	int k;
+
+	for (; xy > 0; xy--)
+	{
+		node = lut->nodes + *s++ * dstn;
+		for (k = 0; k < dstn; k++)
+			*d++ = node[k] >> 8;
+		*d++ = *s++;
+	}
+}
+
+static void
+fz_color_lut_convert(fz_color_lut *lut, unsigned char *d, unsigned char *s, unsigned int xy)
+{
+	/* Let the compiler unroll the common cases */
+	if (lut->srcn == 1 && lut->grid == 256)
+		fz_color_lut_convert_1(lut, d, s, xy);
+	else if (lut->srcn == 4 && lut->dstn == 3)
+		fz_color_lut_convert_n(lut, d, s, xy, 4, 3);
+	else if (lut->srcn == 3 && lut->dstn == 3)
+		fz_color_lut_convert_n(lut, d, s, xy, 3, 3);
+	else if (lut->srcn == 4 && lut->dstn == 1)
+		fz_color_lut_convert_n(lut, d, s, xy, 4, 1);
+	else if (lut->srcn == 3 && lut->dstn == 1)
+		fz_color_lut_convert_n(lut, d, s, xy, 3, 1);
+	else
+		fz_color_lut_convert_n(lut, d, s, xy, lut->srcn, lut->dstn);
+}
+
 static void
 fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 {
@@ -712,6 +1094,8 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 	int srcn, dstn;
 	int k, i;
 	unsigned int xy;
+	fz_color_lut *lut;
+	int nodes, build;
 
 	fz_colorspace *ss = src->colorspace;
 	fz_colorspace *ds = dst->colorspace;
@@ -728,6 +1112,26 @@ fz_std_conv_pixmap(fz_context *ctx, fz_pixmap *dst, fz_pixmap *src)
 
 	xy = (unsigned int)(src->w * src->h);
 
+	/* Interpolate in a lookup table for big images. Filling a table for
+	 * a single component takes no longer than converting a few hundred
+	 * pixels, so always make one; they are shared by every image using
+	 * the same Separation. Past 4 components the grid has as many points
+	 * as a fair sized image, so only fill one for images bigger still. */
+	if (fz_color_lut_grid(srcn, dstn, &nodes))
+	{
+		if (srcn == 1)
+			build = 1;
+		else
+			build = xy >= COLOR_LUT_MIN_PIXELS && (srcn <= 4 || xy >= (unsigned int)nodes);
+		lut = fz_find_color_lut(ctx, ds, ss, build);
+		if (lut)
+		{
+			fz_color_lut_convert(lut, d, s, xy);
+			fz_drop_storable(ctx, &lut->storable);
+			return;
+		}
+	}
+
 	/* Special case for Lab colorspace (scaling of components to float) */
 	if (!strcmp(ss->name, "Lab") && srcn == 3)
 	{
@@ -882,7 +1286,6 @@ fz_convert_pixmap(fz_context *ctx, fz_pixmap *dp, fz_pixmap *sp)
 	else if (ss == fz_device_cmyk)
 	{
 		if (ds == fz_device_gray) fast_cmyk_to_gray(dp, sp);
-		else if (ds == fz_device_bgr) fast_cmyk_to_bgr(ctx, dp, sp);
 		else if (ds == fz_device_rgb) fast_cmyk_to_rgb(ctx, dp, sp);
 		else fz_std_conv_pixmap(ctx, dp, sp);
 	}
@@ -679,6 +679,29 @@ fz_image_to_pixmap(fz_context *ctx, fz_image *image, int w, int h)
 	return image->get_pixmap(ctx, image, w, h);
 }
 
+fz_pixmap *
+fz_image_to_pixmap_area(fz_context *ctx, fz_image *image, int w, int h, fz_rect area, int *fw, int *fh)
+{
+	fz_pixmap *pixmap;
+
+	if (image == NULL)
+		return NULL;
+	if (image->get_pixmap_area)
+		return image->get_pixmap_area(ctx, image, w, h, area, fw, fh);
+	pixmap = image->get_pixmap(ctx, image, w, h);
+	*fw = pixmap->w;
+	*fh = pixmap->h;
+	return pixmap;
+}
+
+fz_bitmap *
+fz_image_to_bitmap(fz_context *ctx, fz_image *image)
+{
+	if (image == NULL || image->get_bitmap == NULL)
+		return NULL;
+	return image->get_bitmap(ctx, image);
+}
+
 fz_image *
 fz_keep_image(fz_context *ctx, fz_image *image)
 {
@@ -639,11 +639,11 @@ make_tensor_patch(tensor_patch *p, int type, fz_point *pt)
 	}
 }
 
-/* FIXME: Nasty */
-#define SUBDIV 3 /* how many levels to subdivide patches */
+#define SUBDIV 3 /* how many levels to subdivide patches, at least */
+#define MAX_SUBDIV 6 /* and at most, however large they are drawn */
 
 static void
-fz_mesh_type6_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_processor *painter)
+fz_mesh_type6_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_processor *painter, int level)
 {
 	fz_stream *stream = fz_open_compressed_buffer(ctx, shade->buffer);
 	int haspatch, hasprevpatch;
@@ -748,7 +748,7 @@ fz_mesh_type6_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_p
 				for (i = 0; i < 4; i++)
 					memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-				draw_patch(painter, &patch, SUBDIV, SUBDIV);
+				draw_patch(painter, &patch, level, level);
 
 				for (i = 0; i < 12; i++)
 					prevp[i] = v[i];
@@ -771,7 +771,7 @@ fz_mesh_type6_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_p
 }
 
 static void
-fz_mesh_type7_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_processor *painter)
+fz_mesh_type7_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_processor *painter, int level)
 {
 	fz_stream *stream = fz_open_compressed_buffer(ctx, shade->buffer);
 	int bpflag = shade->u.m.bpflag;
@@ -876,7 +876,7 @@ fz_mesh_type7_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_p
 				for (i = 0; i < 4; i++)
 					memcpy(patch.color[i], c[i], ncomp * sizeof(float));
 
-				draw_patch(painter, &patch, SUBDIV, SUBDIV);
+				draw_patch(painter, &patch, level, level);
 
 				for (i = 0; i < 16; i++)
 					prevp[i] = v[i];
@@ -898,11 +898,360 @@ fz_mesh_type7_process(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_mesh_p
 	}
 }
 
+/*
+	Mesh shadings (types 4 to 7) are decoded, and their patches
+	subdivided, in shading space and kept in the store as a flat array
+	of triangles, one entry per shading and subdivision level. Subdivision
+	commutes with the (affine) ctm, so every tile, and every later draw
+	at a similar scale, just transforms the triangles that lie near it.
+	The triangles are grouped in blocks with a bounding box each, for
+	culling against the scissor.
+*/
+
+#define MESH_BLOCK 64 /* triangles per block */
+#define MESH_MAX_EXTENT 32 /* pixels */
+#define MESH_MAX_SIZE (8 << 20) /* bytes; deeper subdivision is refused beyond this */
+
+typedef struct fz_mesh_key_s fz_mesh_key;
+
+struct fz_mesh_key_s
+{
+	int refs;
+	fz_shade *shade;
+	int level;
+};
+
+typedef struct fz_mesh_block_s fz_mesh_block;
+
+struct fz_mesh_block_s
+{
+	fz_rect rect;
+	int first, count;
+};
+
+typedef struct fz_mesh_cache_s fz_mesh_cache;
+
+struct fz_mesh_cache_s
+{
+	fz_storable storable;
+	unsigned int size;
+	int stride; /* floats per vertex: x, y and the color */
+	float extent; /* the widest or tallest triangle */
+	int count, cap; /* triangles */
+	float *tris;
+	int nblocks, blockcap;
+	fz_mesh_block *blocks;
+};
+
+static int
+fz_make_hash_mesh_key(fz_store_hash *hash, void *key_)
+{
+	fz_mesh_key *key = (fz_mesh_key *)key_;
+
+	hash->u.pi.ptr = key->shade;
+	hash->u.pi.i = key->level;
+	return 1;
+}
+
+static void *
+fz_keep_mesh_key(fz_context *ctx, void *key_)
+{
+	fz_mesh_key *key = (fz_mesh_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+fz_drop_mesh_key(fz_context *ctx, void *key_)
+{
+	fz_mesh_key *key = (fz_mesh_key *)key_;
+	int drop;
+
+	if (key == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+	{
+		fz_drop_shade(ctx, key->shade);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+fz_cmp_mesh_key(void *k0_, void *k1_)
+{
+	fz_mesh_key *k0 = (fz_mesh_key *)k0_;
+	fz_mesh_key *k1 = (fz_mesh_key *)k1_;
+
+	return k0->shade != k1->shade || k0->level != k1->level;
+}
+
+#ifndef NDEBUG
+static void
+fz_debug_mesh_key(void *key_)
+{
+	fz_mesh_key *key = (fz_mesh_key *)key_;
+
+	printf("(mesh shade=%p level=%d) ", key->shade, key->level);
+}
+#endif
+
+static fz_store_type fz_mesh_store_type =
+{
+	fz_make_hash_mesh_key,
+	fz_keep_mesh_key,
+	fz_drop_mesh_key,
+	fz_cmp_mesh_key,
+#ifndef NDEBUG
+	fz_debug_mesh_key
+#endif
+};
+
+static void
+fz_free_mesh_cache_imp(fz_context *ctx, fz_storable *mesh_)
+{
+	fz_mesh_cache *mesh = (fz_mesh_cache *)mesh_;
+
+	fz_free(ctx, mesh->tris);
+	fz_free(ctx, mesh->blocks);
+	fz_free(ctx, mesh);
+}
+
+struct add_mesh_data
+{
+	fz_context *ctx;
+	fz_mesh_cache *mesh;
+};
+
+static void
+add_tri(void *arg, fz_vertex *v0, fz_vertex *v1, fz_vertex *v2)
+{
+	struct add_mesh_data *amd = (struct add_mesh_data *)arg;
+	fz_context *ctx = amd->ctx;
+	fz_mesh_cache *mesh = amd->mesh;
+	fz_vertex *v[3];
+	fz_mesh_block *block;
+	fz_rect r;
+	float *t;
+	int k;
+
+	if (mesh->count == mesh->cap)
+	{
+		int cap = mesh->cap ? mesh->cap * 2 : 256;
+		mesh->tris = fz_resize_array(ctx, mesh->tris, cap, 3 * mesh->stride * sizeof(float));
+		mesh->cap = cap;
+	}
+	if (mesh->nblocks == 0 || mesh->blocks[mesh->nblocks - 1].count == MESH_BLOCK)
+	{
+		if (mesh->nblocks == mesh->blockcap)
+		{
+			int cap = mesh->blockcap ? mesh->blockcap * 2 : 16;
+			mesh->blocks = fz_resize_array(ctx, mesh->blocks, cap, sizeof(fz_mesh_block));
+			mesh->blockcap = cap;
+		}
+		block = &mesh->blocks[mesh->nblocks++];
+		block->rect = fz_empty_rect;
+		block->first = mesh->count;
+		block->count = 0;
+	}
+	block = &mesh->blocks[mesh->nblocks - 1];
+
+	v[0] = v0;
+	v[1] = v1;
+	v[2] = v2;
+	t = mesh->tris + mesh->count * 3 * mesh->stride;
+	r.x0 = r.x1 = v0->p.x;
+	r.y0 = r.y1 = v0->p.y;
+	for (k = 0; k < 3; k++, t += mesh->stride)
+	{
+		t[0] = v[k]->p.x;
+		t[1] = v[k]->p.y;
+		memcpy(t + 2, v[k]->c, (mesh->stride - 2) * sizeof(float));
+		if (t[0] < r.x0) r.x0 = t[0];
+		if (t[1] < r.y0) r.y0 = t[1];
+		if (t[0] > r.x1) r.x1 = t[0];
+		if (t[1] > r.y1) r.y1 = t[1];
+	}
+	mesh->extent = fz_max(mesh->extent, fz_max(r.x1 - r.x0, r.y1 - r.y0));
+	block->rect = fz_union_rect(block->rect, r);
+	block->count++;
+	mesh->count++;
+}
+
+static fz_mesh_cache *
+fz_new_mesh_cache(fz_context *ctx, fz_shade *shade, int level)
+{
+	fz_mesh_cache *mesh;
+	fz_mesh_processor painter;
+	struct add_mesh_data amd;
+
+	mesh = fz_malloc_struct(ctx, fz_mesh_cache);
+	FZ_INIT_STORABLE(mesh, 1, fz_free_mesh_cache_imp);
+	mesh->stride = 2 + (shade->use_function > 0 ? 1 : shade->colorspace->n);
+
+	amd.ctx = ctx;
+	amd.mesh = mesh;
+	painter.ctx = ctx;
+	painter.shade = shade;
+	painter.process = &add_tri;
+	painter.process_arg = &amd;
+
+	fz_try(ctx)
+	{
+		if (shade->type == FZ_MESH_TYPE4)
+			fz_mesh_type4_process(ctx, shade, fz_identity, &painter);
+		else if (shade->type == FZ_MESH_TYPE5)
+			fz_mesh_type5_process(ctx, shade, fz_identity, &painter);
+		else if (shade->type == FZ_MESH_TYPE6)
+			fz_mesh_type6_process(ctx, shade, fz_identity, &painter, level);
+		else
+			fz_mesh_type7_process(ctx, shade, fz_identity, &painter, level);
+	}
+	fz_catch(ctx)
+	{
+		fz_free_mesh_cache_imp(ctx, &mesh->storable);
+		fz_rethrow(ctx);
+	}
+
+	mesh->size = sizeof(fz_mesh_cache) +
+		mesh->cap * 3 * mesh->stride * sizeof(float) +
+		mesh->blockcap * sizeof(fz_mesh_block);
+	return mesh;
+}
+
+static fz_mesh_cache *
+fz_find_mesh_cache(fz_context *ctx, fz_shade *shade, int level)
+{
+	fz_mesh_key *key;
+	fz_mesh_cache *mesh, *existing;
+
+	key = fz_malloc_struct(ctx, fz_mesh_key);
+	key->refs = 1;
+	key->shade = fz_keep_shade(ctx, shade);
+	key->level = level;
+
+	mesh = fz_find_item(ctx, fz_free_mesh_cache_imp, key, &fz_mesh_store_type);
+	if (mesh)
+	{
+		fz_drop_mesh_key(ctx, key);
+		return mesh;
+	}
+
+	fz_try(ctx)
+	{
+		mesh = fz_new_mesh_cache(ctx, shade, level);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_mesh_key(ctx, key);
+		fz_rethrow(ctx);
+	}
+
+	existing = fz_store_item(ctx, key, mesh, mesh->size, &fz_mesh_store_type);
+	if (existing)
+	{
+		fz_drop_storable(ctx, &mesh->storable);
+		mesh = existing;
+	}
+
+	fz_drop_mesh_key(ctx, key);
+	return mesh;
+}
+
+/*
+	The mesh to draw with ctm. Patches get another level of subdivision
+	(from SUBDIV up to MAX_SUBDIV) for as long as the largest triangle
+	would be over MESH_MAX_EXTENT pixels across, and the result stays
+	within MESH_MAX_SIZE; each level halves the triangles' extent and has
+	four times as many of them.
+*/
+static fz_mesh_cache *
+fz_find_mesh_for_ctm(fz_context *ctx, fz_shade *shade, fz_matrix ctm)
+{
+	fz_mesh_cache *mesh;
+	float extent;
+	unsigned int size;
+	int level;
+
+	if (shade->type != FZ_MESH_TYPE6 && shade->type != FZ_MESH_TYPE7)
+		return fz_find_mesh_cache(ctx, shade, 0);
+
+	mesh = fz_find_mesh_cache(ctx, shade, SUBDIV);
+	extent = mesh->extent * fz_matrix_expansion(ctm);
+	size = mesh->count * 3 * mesh->stride * sizeof(float);
+	level = SUBDIV;
+	while (level < MAX_SUBDIV && extent > MESH_MAX_EXTENT && size <= MESH_MAX_SIZE / 4)
+	{
+		extent /= 2;
+		size *= 4;
+		level++;
+	}
+	if (level == SUBDIV)
+		return mesh;
+
+	fz_drop_storable(ctx, &mesh->storable);
+	return fz_find_mesh_cache(ctx, shade, level);
+}
+
+static void
+fz_process_mesh_cache(fz_context *ctx, fz_mesh_cache *mesh, fz_matrix ctm, fz_rect scissor, fz_mesh_processor *painter)
+{
+	fz_vertex v[3];
+	fz_mesh_block *block;
+	fz_rect r;
+	float *t;
+	int b, i, k;
+	int ncomp = mesh->stride - 2;
+	int cull = !fz_is_infinite_rect(scissor);
+
+	for (b = 0; b < mesh->nblocks; b++)
+	{
+		block = &mesh->blocks[b];
+		if (cull)
+		{
+			r = fz_transform_rect(ctm, block->rect);
+			if (r.x1 < scissor.x0 || r.x0 > scissor.x1 || r.y1 < scissor.y0 || r.y0 > scissor.y1)
+				continue;
+		}
+
+		t = mesh->tris + block->first * 3 * mesh->stride;
+		for (i = 0; i < block->count; i++)
+		{
+			for (k = 0; k < 3; k++, t += mesh->stride)
+			{
+				v[k].p.x = t[0];
+				v[k].p.y = t[1];
+				v[k].p = fz_transform_point(ctm, v[k].p);
+				memcpy(v[k].c, t + 2, ncomp * sizeof(float));
+			}
+			if (cull)
+			{
+				if (v[0].p.x < scissor.x0 && v[1].p.x < scissor.x0 && v[2].p.x < scissor.x0)
+					continue;
+				if (v[0].p.x > scissor.x1 && v[1].p.x > scissor.x1 && v[2].p.x > scissor.x1)
+					continue;
+				if (v[0].p.y < scissor.y0 && v[1].p.y < scissor.y0 && v[2].p.y < scissor.y0)
+					continue;
+				if (v[0].p.y > scissor.y1 && v[1].p.y > scissor.y1 && v[2].p.y > scissor.y1)
+					continue;
+			}
+			paint_tri(painter, &v[0], &v[1], &v[2]);
+		}
+	}
+}
+
 void
-fz_process_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm,
+fz_process_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm, fz_rect scissor,
 		fz_mesh_process_fn *process, void *process_arg)
 {
 	fz_mesh_processor painter;
+	fz_mesh_cache *mesh;
 
 	painter.ctx = ctx;
 	painter.shade = shade;
@@ -915,14 +1264,22 @@ fz_process_mesh(fz_context *ctx, fz_shade *shade, fz_matrix ctm,
 		fz_mesh_type2_process(ctx, shade, ctm, &painter);
 	else if (shade->type == FZ_RADIAL)
 		fz_mesh_type3_process(ctx, shade, ctm, &painter);
-	else if (shade->type == FZ_MESH_TYPE4)
-		fz_mesh_type4_process(ctx, shade, ctm, &painter);
-	else if (shade->type == FZ_MESH_TYPE5)
-		fz_mesh_type5_process(ctx, shade, ctm, &painter);
-	else if (shade->type == FZ_MESH_TYPE6)
-		fz_mesh_type6_process(ctx, shade, ctm, &painter);
-	else if (shade->type == FZ_MESH_TYPE7)
-		fz_mesh_type7_process(ctx, shade, ctm, &painter);
+	else if (shade->type >= FZ_MESH_TYPE4 && shade->type <= FZ_MESH_TYPE7)
+	{
+		mesh = fz_find_mesh_for_ctm(ctx, shade, ctm);
+		fz_try(ctx)
+		{
+			fz_process_mesh_cache(ctx, mesh, ctm, scissor, &painter);
+		}
+		fz_always(ctx)
+		{
+			fz_drop_storable(ctx, &mesh->storable);
+		}
+		fz_catch(ctx)
+		{
+			fz_rethrow(ctx);
+		}
+	}
 	else
 		fz_throw(ctx, "Unexpected mesh type %d\n", shade->type);
 }
@@ -993,6 +1350,8 @@ fz_bound_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm)
 {
 	fz_rect s;
 	struct bound_mesh_data bmd;
+	fz_mesh_cache *mesh;
+	int i;
 
 	ctm = fz_concat(shade->matrix, ctm);
 	s = fz_transform_rect(ctm, shade->bbox);
@@ -1001,9 +1360,20 @@ fz_bound_shade(fz_context *ctx, fz_shade *shade, fz_matrix ctm)
 	if (shade->type == FZ_RADIAL)
 		return fz_intersect_rect(s, fz_infinite_rect);
 
+	/* Without rotation or skew the block bounds are exact */
+	if (shade->type >= FZ_MESH_TYPE4 && shade->type <= FZ_MESH_TYPE7 && fz_is_rectilinear(ctm))
+	{
+		mesh = fz_find_mesh_for_ctm(ctx, shade, ctm);
+		bmd.rect = fz_empty_rect;
+		for (i = 0; i < mesh->nblocks; i++)
+			bmd.rect = fz_union_rect(bmd.rect, fz_transform_rect(ctm, mesh->blocks[i].rect));
+		fz_drop_storable(ctx, &mesh->storable);
+		return fz_intersect_rect(s, bmd.rect);
+	}
+
 	bmd.rect = fz_empty_rect;
 	bmd.first = 1;
-	fz_process_mesh(ctx, shade, ctm, &bound_tri, &bmd);
+	fz_process_mesh(ctx, shade, ctm, fz_infinite_rect, &bound_tri, &bmd);
 
 	return fz_intersect_rect(s, bmd.rect);
 }
@@ -314,6 +314,9 @@ fz_find_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type *
 	{
 		/* We can find objects keyed on indirected objects quickly */
 		item = fz_hash_find(ctx, store->hash, &hash);
+		/* The hash may not capture the whole key */
+		if (item && (item->val->free != free || type->cmp_key(item->key, key)))
+			item = NULL;
 	}
 	else
 	{
@@ -406,6 +409,29 @@ fz_remove_item(fz_context *ctx, fz_store_free_fn *free, void *key, fz_store_type
 		fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
+void
+fz_filter_store(fz_context *ctx, fz_store_free_fn *free, fz_store_filter_fn *fn, void *arg, fz_store_type *type)
+{
+	fz_store *store = ctx->store;
+	fz_item *item;
+
+	if (store == NULL)
+		return;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	/* evict drops the lock, so start again after each one */
+	do
+	{
+		for (item = store->head; item; item = item->next)
+			if (item->val->free == free && item->type == type && fn(arg, item->key))
+				break;
+		if (item)
+			evict(ctx, item); /* Drops then retakes lock */
+	}
+	while (item);
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+}
+
 void
 fz_empty_store(fz_context *ctx)
 {
@@ -423,6 +449,14 @@ fz_empty_store(fz_context *ctx)
 	fz_unlock(ctx, FZ_LOCK_ALLOC);
 }
 
+unsigned int
+fz_store_limit(fz_context *ctx)
+{
+	if (ctx->store == NULL)
+		return FZ_STORE_UNLIMITED;
+	return ctx->store->max;
+}
+
 fz_store *
 fz_keep_store_context(fz_context *ctx)
 {
@@ -557,12 +557,17 @@ struct pdf_page_s
 
 void pdf_run_glyph(pdf_document *doc, pdf_obj *resources, fz_buffer *contents, fz_device *dev, fz_matrix ctm, void *gstate, int nestedDepth);
 
+typedef struct pdf_compiled_contents_s pdf_compiled_contents;
+
+void pdf_free_compiled_contents_imp(fz_context *ctx, fz_storable *cc);
+
 /*
  * PDF interface to store
  */
 void pdf_store_item(fz_context *ctx, pdf_obj *key, void *val, unsigned int itemsize);
 void *pdf_find_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key);
 void pdf_remove_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key);
+void pdf_filter_store(fz_context *ctx, fz_store_free_fn *free, fz_store_filter_fn *fn, void *arg);
 
 /*
  * PDF interaction interface
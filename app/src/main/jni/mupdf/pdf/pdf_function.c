@@ -8,6 +8,8 @@ enum
 };
 
 typedef struct psobj_s psobj;
+typedef struct ps_insn_s ps_insn;
+typedef union ps_reg_u ps_reg;
 
 enum
 {
@@ -54,6 +56,12 @@ struct pdf_function_s
 		struct {
 			psobj *code;
 			int cap;
+			/* compiled program, if there is one */
+			ps_insn *prog;
+			int len;
+			ps_reg *regs; /* constants, inputs in the first m */
+			int nregs;
+			unsigned char out[MAXN];
 		} p;
 	} u;
 };
@@ -199,19 +207,25 @@ ps_push_int(ps_stack *st, int n)
 	}
 }
 
+static inline float
+ps_real(float n)
+{
+	if (isnan(n))
+	{
+		/* Push 1.0, as it's a small known value that won't
+		 * cause a divide by 0. Same reason as in fz_atof. */
+		return 1.0;
+	}
+	return fz_clamp(n, -FLT_MAX, FLT_MAX);
+}
+
 static void
 ps_push_real(ps_stack *st, float n)
 {
 	if (!ps_overflow(st, 1))
 	{
 		st->stack[st->sp].type = PS_REAL;
-		if (isnan(n))
-		{
-			/* Push 1.0, as it's a small known value that won't
-			 * cause a divide by 0. Same reason as in fz_atof. */
-			n = 1.0;
-		}
-		st->stack[st->sp].u.f = fz_clamp(n, -FLT_MAX, FLT_MAX);
+		st->stack[st->sp].u.f = ps_real(n);
 		st->sp++;
 	}
 }
@@ -401,7 +415,7 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 			case PS_OP_DIV:
 				r2 = ps_pop_real(st);
 				r1 = ps_pop_real(st);
-				if (fabsf(r2) < FLT_EPSILON)
+				if (fabsf(r2) >= FLT_EPSILON)
 					ps_push_real(st, r1 / r2);
 				else
 					ps_push_real(st, DIV_BY_ZERO(r1, r2, -FLT_MAX, FLT_MAX));
@@ -477,7 +491,10 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 			case PS_OP_IDIV:
 				i2 = ps_pop_int(st);
 				i1 = ps_pop_int(st);
-				if (i2 != 0)
+				/* INT_MIN / -1 traps */
+				if (i2 == -1)
+					ps_push_int(st, (int)(0U - (unsigned int)i1));
+				else if (i2 != 0)
 					ps_push_int(st, i1 / i2);
 				else
 					ps_push_int(st, DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX));
@@ -528,7 +545,9 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 			case PS_OP_MOD:
 				i2 = ps_pop_int(st);
 				i1 = ps_pop_int(st);
-				if (i2 != 0)
+				if (i2 == -1)
+					ps_push_int(st, 0);
+				else if (i2 != 0)
 					ps_push_int(st, i1 % i2);
 				else
 					ps_push_int(st, DIV_BY_ZERO(i1, i2, INT_MIN, INT_MAX));
@@ -689,6 +708,682 @@ ps_run(fz_context *ctx, psobj *code, ps_stack *st, int pc)
 	}
 }
 
+/*
+ * Compiled calculator functions
+ *
+ * Most calculator functions are short runs of arithmetic on a stack
+ * whose layout does not depend on the inputs. At load time we run the
+ * code once over symbolic values: each stack slot names a register of
+ * known type, and operators whose operands are all constant are folded.
+ * What remains is a straight-line program on registers. Conditionals
+ * with a constant test are inlined; otherwise both arms are compiled and
+ * the slots that differ are picked by selects. Anything else (computed
+ * counts for copy, index or roll, arms leaving different stacks, type
+ * errors) is left to ps_run.
+ */
+
+enum
+{
+	PS_MAX_REGS = 256,
+	PS_MAX_INSNS = 1024
+};
+
+enum
+{
+	PSC_ABS_I, PSC_ABS_R, PSC_ADD_I, PSC_ADD_R, PSC_AND, PSC_ATAN,
+	PSC_BITSHIFT, PSC_CEILING, PSC_COS, PSC_CVI, PSC_CVR, PSC_DIV,
+	PSC_EQ_I, PSC_EQ_R, PSC_EXP, PSC_FLOOR, PSC_GE_I, PSC_GE_R,
+	PSC_GT_I, PSC_GT_R, PSC_IDIV, PSC_LN, PSC_LOG, PSC_MOD,
+	PSC_MUL_I, PSC_MUL_R, PSC_NE_I, PSC_NE_R, PSC_NEG_I, PSC_NEG_R,
+	PSC_NOT_B, PSC_NOT_I, PSC_OR, PSC_ROUND, PSC_SELECT, PSC_SIN,
+	PSC_SQRT, PSC_SUB_I, PSC_SUB_R, PSC_TRUNCATE, PSC_XOR
+};
+
+/* d = a op b; selects pick b or c as a is true or false */
+struct ps_insn_s
+{
+	unsigned char op, d, a, b, c;
+};
+
+/* booleans are held as 0 or 1 in i */
+union ps_reg_u
+{
+	int i;
+	float f;
+};
+
+/* Each case does what ps_run does for the same operator and types */
+static void
+ps_exec(ps_insn *insn, int len, ps_reg *r)
+{
+	ps_reg *d, *a, *b;
+	float x;
+
+	for (; len > 0; len--, insn++)
+	{
+		d = &r[insn->d];
+		a = &r[insn->a];
+		b = &r[insn->b];
+
+		switch (insn->op)
+		{
+		case PSC_ABS_I: d->i = abs(a->i); break;
+		case PSC_ABS_R: d->f = ps_real(fabsf(a->f)); break;
+		case PSC_ADD_I: d->i = a->i + b->i; break;
+		case PSC_ADD_R: d->f = ps_real(a->f + b->f); break;
+		case PSC_AND: d->i = a->i & b->i; break;
+
+		case PSC_ATAN:
+			x = atan2f(a->f, b->f) * RADIAN;
+			if (x < 0)
+				x += 360;
+			d->f = ps_real(x);
+			break;
+
+		case PSC_BITSHIFT:
+			if (b->i > 0 && b->i < 8 * sizeof (b->i))
+				d->i = a->i << b->i;
+			else if (b->i < 0 && b->i > -8 * (int)sizeof (b->i))
+				d->i = (int)((unsigned int)a->i >> -b->i);
+			else
+				d->i = a->i;
+			break;
+
+		case PSC_CEILING: d->f = ps_real(ceilf(a->f)); break;
+		case PSC_COS: d->f = ps_real(cosf(a->f/RADIAN)); break;
+		case PSC_CVI: d->i = a->f; break;
+		case PSC_CVR: d->f = ps_real(a->i); break;
+
+		case PSC_DIV:
+			if (fabsf(b->f) >= FLT_EPSILON)
+				d->f = ps_real(a->f / b->f);
+			else
+				d->f = DIV_BY_ZERO(a->f, b->f, -FLT_MAX, FLT_MAX);
+			break;
+
+		case PSC_EQ_I: d->i = a->i == b->i; break;
+		case PSC_EQ_R: d->i = a->f == b->f; break;
+		case PSC_EXP: d->f = ps_real(powf(a->f, b->f)); break;
+		case PSC_FLOOR: d->f = ps_real(floorf(a->f)); break;
+		case PSC_GE_I: d->i = a->i >= b->i; break;
+		case PSC_GE_R: d->i = a->f >= b->f; break;
+		case PSC_GT_I: d->i = a->i > b->i; break;
+		case PSC_GT_R: d->i = a->f > b->f; break;
+
+		case PSC_IDIV:
+			if (b->i == -1)
+				d->i = (int)(0U - (unsigned int)a->i);
+			else if (b->i != 0)
+				d->i = a->i / b->i;
+			else
+				d->i = DIV_BY_ZERO(a->i, b->i, INT_MIN, INT_MAX);
+			break;
+
+		case PSC_LN:
+			/* Bug 692941 - logf as separate statement */
+			x = logf(a->f);
+			d->f = ps_real(x);
+			break;
+
+		case PSC_LOG: d->f = ps_real(log10f(a->f)); break;
+
+		case PSC_MOD:
+			if (b->i == -1)
+				d->i = 0;
+			else if (b->i != 0)
+				d->i = a->i % b->i;
+			else
+				d->i = DIV_BY_ZERO(a->i, b->i, INT_MIN, INT_MAX);
+			break;
+
+		case PSC_MUL_I: d->i = a->i * b->i; break;
+		case PSC_MUL_R: d->f = ps_real(a->f * b->f); break;
+		case PSC_NE_I: d->i = a->i != b->i; break;
+		case PSC_NE_R: d->i = a->f != b->f; break;
+		case PSC_NEG_I: d->i = -a->i; break;
+		case PSC_NEG_R: d->f = ps_real(-a->f); break;
+		case PSC_NOT_B: d->i = !a->i; break;
+		case PSC_NOT_I: d->i = ~a->i; break;
+		case PSC_OR: d->i = a->i | b->i; break;
+		case PSC_ROUND: d->f = ps_real((a->f >= 0) ? floorf(a->f + 0.5f) : ceilf(a->f - 0.5f)); break;
+		case PSC_SELECT: *d = a->i ? *b : r[insn->c]; break;
+		case PSC_SIN: d->f = ps_real(sinf(a->f/RADIAN)); break;
+		case PSC_SQRT: d->f = ps_real(sqrtf(a->f)); break;
+		case PSC_SUB_I: d->i = a->i - b->i; break;
+		case PSC_SUB_R: d->f = ps_real(a->f - b->f); break;
+		case PSC_TRUNCATE: d->f = ps_real((a->f >= 0) ? floorf(a->f) : ceilf(a->f)); break;
+		case PSC_XOR: d->i = a->i ^ b->i; break;
+		}
+	}
+}
+
+typedef struct ps_compiler_s ps_compiler;
+
+struct ps_compiler_s
+{
+	ps_insn insn[PS_MAX_INSNS];
+	int len;
+	ps_reg reg[PS_MAX_REGS];
+	unsigned char type[PS_MAX_REGS];
+	unsigned char known[PS_MAX_REGS];
+	int nregs;
+};
+
+/* The registers in each slot of the stack, while compiling */
+typedef struct ps_vstack_s ps_vstack;
+
+struct ps_vstack_s
+{
+	unsigned char slot[nelem(((ps_stack *)0)->stack)];
+	int sp;
+};
+
+/* Register functions return -1 on failure, and pass it on if given it */
+static int
+ps_new_reg(ps_compiler *c, int type, int known, ps_reg v)
+{
+	if (c->nregs >= PS_MAX_REGS)
+		return -1;
+	c->type[c->nregs] = type;
+	c->known[c->nregs] = known;
+	c->reg[c->nregs] = v;
+	return c->nregs++;
+}
+
+static int
+ps_emit(ps_compiler *c, int op, int type, int a, int b, int cond)
+{
+	ps_insn insn;
+	ps_reg zero;
+	int d;
+
+	if (a < 0 || b < 0 || cond < 0)
+		return -1;
+
+	zero.i = 0;
+	d = ps_new_reg(c, type, 0, zero);
+	if (d < 0)
+		return -1;
+
+	insn.op = op;
+	insn.d = d;
+	insn.a = a;
+	insn.b = b;
+	insn.c = cond;
+
+	if (c->known[a] && c->known[b] && c->known[cond])
+	{
+		ps_exec(&insn, 1, c->reg);
+		c->known[d] = 1;
+		return d;
+	}
+
+	if (c->len >= PS_MAX_INSNS)
+		return -1;
+	c->insn[c->len++] = insn;
+	return d;
+}
+
+static int
+ps_emit_unary(ps_compiler *c, int op, int type, int a)
+{
+	return ps_emit(c, op, type, a, a, a);
+}
+
+static int
+ps_to_real(ps_compiler *c, int r)
+{
+	if (r < 0 || c->type[r] == PS_BOOL)
+		return -1;
+	if (c->type[r] == PS_INT)
+		return ps_emit_unary(c, PSC_CVR, PS_REAL, r);
+	return r;
+}
+
+static int
+ps_to_int(ps_compiler *c, int r)
+{
+	if (r < 0 || c->type[r] == PS_BOOL)
+		return -1;
+	if (c->type[r] == PS_REAL)
+		return ps_emit_unary(c, PSC_CVI, PS_INT, r);
+	return r;
+}
+
+static int
+ps_vpush(ps_vstack *st, int r)
+{
+	if (r < 0 || st->sp + 1 >= nelem(st->slot))
+		return 0;
+	st->slot[st->sp++] = r;
+	return 1;
+}
+
+/* A known count for copy, index or roll */
+static int
+ps_vpop_count(ps_compiler *c, ps_vstack *st, int *n)
+{
+	int r;
+
+	if (st->sp < 1)
+		return 0;
+	r = st->slot[--st->sp];
+	if (!c->known[r] || c->type[r] == PS_BOOL)
+		return 0;
+	*n = c->type[r] == PS_INT ? c->reg[r].i : (int)c->reg[r].f;
+	return 1;
+}
+
+/* Arithmetic and comparisons: ints stay ints, anything else is real */
+static int
+ps_compile_binary(ps_compiler *c, ps_vstack *st, int op_i, int op_r, int cmp)
+{
+	int a, b;
+
+	if (st->sp < 2)
+		return 0;
+	b = st->slot[--st->sp];
+	a = st->slot[--st->sp];
+	if (c->type[a] == PS_INT && c->type[b] == PS_INT)
+		return ps_vpush(st, ps_emit(c, op_i, cmp ? PS_BOOL : PS_INT, a, b, a));
+	return ps_vpush(st, ps_emit(c, op_r, cmp ? PS_BOOL : PS_REAL, ps_to_real(c, a), ps_to_real(c, b), a));
+}
+
+/* Operators that take reals, or ints after conversion */
+static int
+ps_compile_typed(ps_compiler *c, ps_vstack *st, int op, int args, int type)
+{
+	int a, b;
+
+	if (st->sp < args)
+		return 0;
+	b = st->slot[--st->sp];
+	a = args == 2 ? st->slot[--st->sp] : b;
+	b = type == PS_INT ? ps_to_int(c, b) : ps_to_real(c, b);
+	a = args == 2 ? (type == PS_INT ? ps_to_int(c, a) : ps_to_real(c, a)) : b;
+	return ps_vpush(st, ps_emit(c, op, type, a, b, a));
+}
+
+/* and, or, xor, eq and ne on two booleans */
+static int
+ps_compile_bool(ps_compiler *c, ps_vstack *st, int op)
+{
+	int a, b;
+
+	b = st->slot[st->sp - 1];
+	a = st->slot[st->sp - 2];
+	if (c->type[a] != PS_BOOL || c->type[b] != PS_BOOL)
+		return -1;
+	st->sp -= 2;
+	return ps_vpush(st, ps_emit(c, op, PS_BOOL, a, b, a));
+}
+
+static int
+ps_compile_block(ps_compiler *c, psobj *code, int pc, ps_vstack *st)
+{
+	ps_vstack st2;
+	ps_reg v;
+	int a, b, n, j, i, op, t;
+
+	while (1)
+	{
+		switch (code[pc].type)
+		{
+		case PS_INT:
+			v.i = code[pc++].u.i;
+			if (!ps_vpush(st, ps_new_reg(c, PS_INT, 1, v)))
+				return 0;
+			break;
+
+		case PS_REAL:
+			v.f = ps_real(code[pc++].u.f);
+			if (!ps_vpush(st, ps_new_reg(c, PS_REAL, 1, v)))
+				return 0;
+			break;
+
+		case PS_OPERATOR:
+			op = code[pc++].u.op;
+
+			/* Every operator but these needs something on the stack */
+			if (st->sp < 1 && op != PS_OP_TRUE && op != PS_OP_FALSE &&
+				op != PS_OP_POP && op != PS_OP_RETURN)
+				return 0;
+
+			switch (op)
+			{
+			case PS_OP_ABS:
+			case PS_OP_NEG:
+				a = st->slot[--st->sp];
+				if (c->type[a] == PS_INT)
+					a = ps_emit_unary(c, op == PS_OP_ABS ? PSC_ABS_I : PSC_NEG_I, PS_INT, a);
+				else
+					a = ps_emit_unary(c, op == PS_OP_ABS ? PSC_ABS_R : PSC_NEG_R, PS_REAL, ps_to_real(c, a));
+				if (!ps_vpush(st, a))
+					return 0;
+				break;
+
+			case PS_OP_ADD:
+				if (!ps_compile_binary(c, st, PSC_ADD_I, PSC_ADD_R, 0))
+					return 0;
+				break;
+
+			case PS_OP_SUB:
+				if (!ps_compile_binary(c, st, PSC_SUB_I, PSC_SUB_R, 0))
+					return 0;
+				break;
+
+			case PS_OP_MUL:
+				if (!ps_compile_binary(c, st, PSC_MUL_I, PSC_MUL_R, 0))
+					return 0;
+				break;
+
+			case PS_OP_GE:
+				if (!ps_compile_binary(c, st, PSC_GE_I, PSC_GE_R, 1))
+					return 0;
+				break;
+
+			case PS_OP_GT:
+				if (!ps_compile_binary(c, st, PSC_GT_I, PSC_GT_R, 1))
+					return 0;
+				break;
+
+			/* a <= b is b >= a, once the operands are swapped */
+			case PS_OP_LE:
+			case PS_OP_LT:
+				if (st->sp < 2)
+					return 0;
+				a = st->slot[st->sp - 1];
+				st->slot[st->sp - 1] = st->slot[st->sp - 2];
+				st->slot[st->sp - 2] = a;
+				if (op == PS_OP_LE)
+					n = ps_compile_binary(c, st, PSC_GE_I, PSC_GE_R, 1);
+				else
+					n = ps_compile_binary(c, st, PSC_GT_I, PSC_GT_R, 1);
+				if (!n)
+					return 0;
+				break;
+
+			case PS_OP_EQ:
+			case PS_OP_NE:
+				if (st->sp < 2)
+					return 0;
+				n = ps_compile_bool(c, st, op == PS_OP_EQ ? PSC_EQ_I : PSC_NE_I);
+				if (n < 0)
+				{
+					if (op == PS_OP_EQ)
+						n = ps_compile_binary(c, st, PSC_EQ_I, PSC_EQ_R, 1);
+					else
+						n = ps_compile_binary(c, st, PSC_NE_I, PSC_NE_R, 1);
+				}
+				if (!n)
+					return 0;
+				break;
+
+			case PS_OP_AND:
+				if (st->sp < 2)
+					return 0;
+				a = st->slot[st->sp - 2];
+				b = st->slot[st->sp - 1];
+				if (c->type[a] == PS_INT && c->type[b] == PS_INT)
+					n = ps_compile_typed(c, st, PSC_AND, 2, PS_INT);
+				else
+					n = ps_compile_bool(c, st, PSC_AND);
+				if (n <= 0)
+					return 0;
+				break;
+
+			case PS_OP_OR:
+			case PS_OP_XOR:
+				if (st->sp < 2)
+					return 0;
+				t = op == PS_OP_OR ? PSC_OR : PSC_XOR;
+				n = ps_compile_bool(c, st, t);
+				if (n < 0)
+					n = ps_compile_typed(c, st, t, 2, PS_INT);
+				if (!n)
+					return 0;
+				break;
+
+			case PS_OP_NOT:
+				a = st->slot[--st->sp];
+				if (c->type[a] == PS_BOOL)
+					a = ps_emit_unary(c, PSC_NOT_B, PS_BOOL, a);
+				else
+					a = ps_emit_unary(c, PSC_NOT_I, PS_INT, ps_to_int(c, a));
+				if (!ps_vpush(st, a))
+					return 0;
+				break;
+
+			case PS_OP_ATAN: n = ps_compile_typed(c, st, PSC_ATAN, 2, PS_REAL); goto check;
+			case PS_OP_DIV: n = ps_compile_typed(c, st, PSC_DIV, 2, PS_REAL); goto check;
+			case PS_OP_EXP: n = ps_compile_typed(c, st, PSC_EXP, 2, PS_REAL); goto check;
+			case PS_OP_BITSHIFT: n = ps_compile_typed(c, st, PSC_BITSHIFT, 2, PS_INT); goto check;
+			case PS_OP_IDIV: n = ps_compile_typed(c, st, PSC_IDIV, 2, PS_INT); goto check;
+			case PS_OP_MOD: n = ps_compile_typed(c, st, PSC_MOD, 2, PS_INT); goto check;
+			case PS_OP_CEILING: n = ps_compile_typed(c, st, PSC_CEILING, 1, PS_REAL); goto check;
+			case PS_OP_FLOOR: n = ps_compile_typed(c, st, PSC_FLOOR, 1, PS_REAL); goto check;
+			case PS_OP_COS: n = ps_compile_typed(c, st, PSC_COS, 1, PS_REAL); goto check;
+			case PS_OP_SIN: n = ps_compile_typed(c, st, PSC_SIN, 1, PS_REAL); goto check;
+			case PS_OP_SQRT: n = ps_compile_typed(c, st, PSC_SQRT, 1, PS_REAL); goto check;
+			case PS_OP_LN: n = ps_compile_typed(c, st, PSC_LN, 1, PS_REAL); goto check;
+			case PS_OP_LOG: n = ps_compile_typed(c, st, PSC_LOG, 1, PS_REAL); goto check;
+			check:
+				if (!n)
+					return 0;
+				break;
+
+			case PS_OP_ROUND:
+			case PS_OP_TRUNCATE:
+				a = st->slot[st->sp - 1];
+				if (c->type[a] == PS_BOOL)
+					return 0;
+				if (c->type[a] == PS_REAL)
+				{
+					st->sp--;
+					a = ps_emit_unary(c, op == PS_OP_ROUND ? PSC_ROUND : PSC_TRUNCATE, PS_REAL, a);
+					if (!ps_vpush(st, a))
+						return 0;
+				}
+				break;
+
+			case PS_OP_CVI:
+				a = st->slot[--st->sp];
+				if (!ps_vpush(st, ps_to_int(c, a)))
+					return 0;
+				break;
+
+			case PS_OP_CVR:
+				a = st->slot[--st->sp];
+				if (!ps_vpush(st, ps_to_real(c, a)))
+					return 0;
+				break;
+
+			case PS_OP_TRUE:
+			case PS_OP_FALSE:
+				v.i = op == PS_OP_TRUE;
+				if (!ps_vpush(st, ps_new_reg(c, PS_BOOL, 1, v)))
+					return 0;
+				break;
+
+			case PS_OP_POP:
+				if (st->sp > 0)
+					st->sp--;
+				break;
+
+			case PS_OP_DUP:
+				if (!ps_vpush(st, st->slot[st->sp - 1]))
+					return 0;
+				break;
+
+			case PS_OP_EXCH:
+				if (st->sp < 2)
+					return 0;
+				a = st->slot[st->sp - 1];
+				st->slot[st->sp - 1] = st->slot[st->sp - 2];
+				st->slot[st->sp - 2] = a;
+				break;
+
+			/* As ps_copy, ps_index and ps_roll */
+			case PS_OP_COPY:
+				if (!ps_vpop_count(c, st, &n))
+					return 0;
+				if (n >= 0 && st->sp - n >= 0 && st->sp + n < nelem(st->slot))
+				{
+					memcpy(st->slot + st->sp, st->slot + st->sp - n, n);
+					st->sp += n;
+				}
+				break;
+
+			case PS_OP_INDEX:
+				if (!ps_vpop_count(c, st, &n))
+					return 0;
+				if (n >= st->sp)
+					return 0;
+				if (n >= 0 && st->sp + 1 < nelem(st->slot))
+				{
+					st->slot[st->sp] = st->slot[st->sp - n - 1];
+					st->sp++;
+				}
+				break;
+
+			case PS_OP_ROLL:
+				if (!ps_vpop_count(c, st, &j) || !ps_vpop_count(c, st, &n))
+					return 0;
+				if (n < 0 || st->sp - n < 0 || j == 0 || n == 0)
+					break;
+				if (j >= 0)
+					j %= n;
+				else
+				{
+					j = -j % n;
+					if (j != 0)
+						j = n - j;
+				}
+				for (i = 0; i < j; i++)
+				{
+					a = st->slot[st->sp - 1];
+					memmove(st->slot + st->sp - n + 1, st->slot + st->sp - n, n - 1);
+					st->slot[st->sp - n] = a;
+				}
+				break;
+
+			case PS_OP_IF:
+			case PS_OP_IFELSE:
+				a = st->slot[--st->sp];
+				if (c->type[a] != PS_BOOL)
+					return 0;
+				if (c->known[a])
+				{
+					if (c->reg[a].i)
+						n = ps_compile_block(c, code, code[pc + 1].u.block, st);
+					else if (op == PS_OP_IFELSE)
+						n = ps_compile_block(c, code, code[pc + 0].u.block, st);
+					else
+						n = 1;
+					if (!n)
+						return 0;
+				}
+				else
+				{
+					st2 = *st;
+					if (!ps_compile_block(c, code, code[pc + 1].u.block, st))
+						return 0;
+					if (op == PS_OP_IFELSE && !ps_compile_block(c, code, code[pc + 0].u.block, &st2))
+						return 0;
+					if (st->sp != st2.sp)
+						return 0;
+					for (i = 0; i < st->sp; i++)
+					{
+						b = st->slot[i];
+						t = st2.slot[i];
+						if (b == t)
+							continue;
+						if (c->type[b] != c->type[t])
+							return 0;
+						b = ps_emit(c, PSC_SELECT, c->type[b], a, b, t);
+						if (b < 0)
+							return 0;
+						st->slot[i] = b;
+					}
+				}
+				pc = code[pc + 2].u.block;
+				break;
+
+			case PS_OP_RETURN:
+				return 1;
+
+			default:
+				return 0;
+			}
+			break;
+
+		default:
+			return 0;
+		}
+	}
+}
+
+static void
+ps_compile(fz_context *ctx, pdf_function *func)
+{
+	ps_compiler *c;
+	ps_vstack st;
+	ps_reg zero;
+	int i, r, ok;
+
+	c = fz_malloc_no_throw(ctx, sizeof *c);
+	if (!c)
+		return;
+	c->len = 0;
+	c->nregs = 0;
+	zero.i = 0;
+	st.sp = 0;
+
+	/* The inputs come first */
+	ok = 1;
+	for (i = 0; i < func->m && ok; i++)
+		ok = ps_vpush(&st, ps_new_reg(c, PS_REAL, 0, zero));
+
+	ok = ok && ps_compile_block(c, func->u.p.code, 0, &st);
+
+	/* Results are taken from the top of the stack, with 0 for any
+	 * missing, as in eval_postscript_func */
+	for (i = func->n - 1; i >= 0 && ok; i--)
+	{
+		if (st.sp > 0)
+			r = ps_to_real(c, st.slot[--st.sp]);
+		else
+			r = ps_new_reg(c, PS_REAL, 1, zero);
+		func->u.p.out[i] = r;
+		ok = r >= 0;
+	}
+
+	if (ok)
+	{
+		func->u.p.regs = fz_malloc_no_throw(ctx, c->nregs * sizeof(ps_reg));
+		if (c->len > 0)
+			func->u.p.prog = fz_malloc_no_throw(ctx, c->len * sizeof(ps_insn));
+		if (func->u.p.regs && (func->u.p.prog || c->len == 0))
+		{
+			memcpy(func->u.p.regs, c->reg, c->nregs * sizeof(ps_reg));
+			if (c->len > 0)
+				memcpy(func->u.p.prog, c->insn, c->len * sizeof(ps_insn));
+			func->u.p.nregs = c->nregs;
+			func->u.p.len = c->len;
+			func->size += c->nregs * sizeof(ps_reg) + c->len * sizeof(ps_insn);
+		}
+		else
+		{
+			fz_free(ctx, func->u.p.regs);
+			fz_free(ctx, func->u.p.prog);
+			func->u.p.regs = NULL;
+			func->u.p.prog = NULL;
+		}
+	}
+
+	fz_free(ctx, c);
+}
+
 static void
 resize_code(fz_context *ctx, pdf_function *func, int newsize)
 {
@@ -880,6 +1575,8 @@ load_postscript_func(pdf_function *func, pdf_document *xref, pdf_obj *dict, int
 	}
 
 	func->size += func->u.p.cap * sizeof(psobj);
+
+	ps_compile(ctx, func);
 }
 
 static void
@@ -889,6 +1586,19 @@ eval_postscript_func(fz_context *ctx, pdf_function *func, float *in, float *out)
 	float x;
 	int i;
 
+	if (func->u.p.regs)
+	{
+		ps_reg r[PS_MAX_REGS];
+
+		memcpy(r, func->u.p.regs, func->u.p.nregs * sizeof(ps_reg));
+		for (i = 0; i < func->m; i++)
+			r[i].f = ps_real(fz_clamp(in[i], func->domain[i][0], func->domain[i][1]));
+		ps_exec(func->u.p.prog, func->u.p.len, r);
+		for (i = 0; i < func->n; i++)
+			out[i] = fz_clamp(r[func->u.p.out[i]].f, func->range[i][0], func->range[i][1]);
+		return;
+	}
+
 	ps_init_stack(&st);
 
 	for (i = 0; i < func->m; i++)
@@ -1393,6 +2103,8 @@ pdf_free_function_imp(fz_context *ctx, fz_storable *func_)
 		break;
 	case POSTSCRIPT:
 		fz_free(ctx, func->u.p.code);
+		fz_free(ctx, func->u.p.prog);
+		fz_free(ctx, func->u.p.regs);
 		break;
 	}
 	fz_free(ctx, func);
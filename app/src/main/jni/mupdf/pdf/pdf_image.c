@@ -3,40 +3,28 @@
 
 typedef struct pdf_image_key_s pdf_image_key;
 
+/* Huge JPEG images are decoded in bands of this many rows (at the
+ * chosen subsampling), and only the bands that are needed. */
+#define BAND_HEIGHT 64
+
+#define BITMAP_BAND -2
+
 struct pdf_image_key_s {
 	int refs;
 	fz_image *image;
 	int l2factor;
+	int band; /* -1 for the whole image, -2 for its bitmap */
 };
 
 static void pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image);
 
-static void
-pdf_mask_color_key(fz_pixmap *pix, int n, int *colorkey)
-{
-	unsigned char *p = pix->samples;
-	int len = pix->w * pix->h;
-	int k, t;
-	while (len--)
-	{
-		t = 1;
-		for (k = 0; k < n; k++)
-			if (p[k] < colorkey[k * 2] || p[k] > colorkey[k * 2 + 1])
-				t = 0;
-		if (t)
-			for (k = 0; k < pix->n; k++)
-				p[k] = 0;
-		p += pix->n;
-	}
-}
-
 static int
 pdf_make_hash_image_key(fz_store_hash *hash, void *key_)
 {
 	pdf_image_key *key = (pdf_image_key *)key_;
 
 	hash->u.pi.ptr = key->image;
-	hash->u.pi.i = key->l2factor;
+	hash->u.pi.i = key->l2factor + (key->band + 1) * 16;
 	return 1;
 }
 
@@ -74,7 +62,7 @@ pdf_cmp_image_key(void *k0_, void *k1_)
 	pdf_image_key *k0 = (pdf_image_key *)k0_;
 	pdf_image_key *k1 = (pdf_image_key *)k1_;
 
-	return k0->image == k1->image && k0->l2factor == k1->l2factor;
+	return k0->image != k1->image || k0->l2factor != k1->l2factor || k0->band != k1->band;
 }
 
 #ifndef NDEBUG
@@ -83,7 +71,12 @@ pdf_debug_image(void *key_)
 {
 	pdf_image_key *key = (pdf_image_key *)key_;
 
-	printf("(image %d x %d sf=%d) ", key->image->w, key->image->h, key->l2factor);
+	if (key->band == BITMAP_BAND)
+		printf("(image %d x %d bitmap) ", key->image->w, key->image->h);
+	else if (key->band >= 0)
+		printf("(image %d x %d sf=%d band=%d) ", key->image->w, key->image->h, key->l2factor, key->band);
+	else
+		printf("(image %d x %d sf=%d) ", key->image->w, key->image->h, key->l2factor);
 }
 #endif
 
@@ -98,21 +91,62 @@ static fz_store_type pdf_image_store_type =
 #endif
 };
 
+/* Put a decoded tile (or bitmap) into the store. Any failure here will
+ * just result in us not caching. If a racing thread has stored the same
+ * tile already, we use that one and throw ours away. */
+static fz_storable *
+pdf_store_image_item(fz_context *ctx, pdf_image *image, int l2factor, int band, fz_storable *item, unsigned int size)
+{
+	pdf_image_key *key = NULL;
+	fz_storable *existing;
+
+	fz_var(key);
+	fz_var(item);
+
+	fz_try(ctx)
+	{
+		key = fz_malloc_struct(ctx, pdf_image_key);
+		key->refs = 1;
+		key->image = fz_keep_image(ctx, &image->base);
+		key->l2factor = l2factor;
+		key->band = band;
+		existing = fz_store_item(ctx, key, item, size, &pdf_image_store_type);
+		if (existing)
+		{
+			fz_drop_storable(ctx, item);
+			item = existing;
+		}
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_image_key(ctx, key);
+	}
+	fz_catch(ctx)
+	{
+		/* Do nothing */
+	}
+
+	return item;
+}
+
+static fz_pixmap *
+pdf_store_image_tile(fz_context *ctx, pdf_image *image, int l2factor, int band, fz_pixmap *tile)
+{
+	return (fz_pixmap *)pdf_store_image_item(ctx, image, l2factor, band, &tile->storable, fz_pixmap_size(ctx, tile));
+}
+
 static fz_pixmap *
 decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int in_line, int indexed, int l2factor, int native_l2factor, int cache)
 {
 	fz_pixmap *tile = NULL;
-	fz_pixmap *existing_tile;
 	int stride, len, i;
 	unsigned char *samples = NULL;
 	int f = 1<<native_l2factor;
 	int w = (image->base.w + f-1) >> native_l2factor;
 	int h = (image->base.h + f-1) >> native_l2factor;
-	pdf_image_key *key = NULL;
 
 	fz_var(tile);
 	fz_var(samples);
-	fz_var(key);
 
 	fz_try(ctx)
 	{
@@ -162,26 +196,18 @@ decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int
 				p[i] = ~p[i];
 		}
 
-		fz_unpack_tile(tile, samples, image->n, image->bpc, stride, indexed);
+		fz_decode_unpack_tile(tile, samples, image->n, image->bpc, stride, indexed, image->decode, image->usecolorkey ? image->colorkey : NULL);
 
 		fz_free(ctx, samples);
 		samples = NULL;
 
-		if (image->usecolorkey)
-			pdf_mask_color_key(tile, image->n, image->colorkey);
-
 		if (indexed)
 		{
 			fz_pixmap *conv;
-			fz_decode_indexed_tile(tile, image->decode, (1 << image->bpc) - 1);
 			conv = pdf_expand_indexed_pixmap(ctx, tile);
 			fz_drop_pixmap(ctx, tile);
 			tile = conv;
 		}
-		else
-		{
-			fz_decode_tile(tile, image->decode);
-		}
 	}
 	fz_always(ctx)
 	{
@@ -207,35 +233,329 @@ decomp_image_from_stream(fz_context *ctx, fz_stream *stm, pdf_image *image, int
 	if (!cache)
 		return tile;
 
-	/* Now we try to cache the pixmap. Any failure here will just result
-	 * in us not caching. */
+	return pdf_store_image_tile(ctx, image, l2factor, -1, tile);
+}
+
+/*
+	Bilevel images (1 bit, one component: CCITT and JBIG2 scans, image
+	masks) are decoded to a 1 bpp bitmap, an eighth the size of the
+	pixmap, and pixmaps are made from it as they are wanted: the draw
+	device paints image masks at full size or larger from the bitmap
+	itself, and scaling down wants a subsampled pixmap, which is a box
+	filter over the bitmap's bits.
+
+	The bitmap is kept in the store where the full size pixmap used to
+	be, that is when the image is wanted at full size. Like that pixmap
+	it then does for any smaller size too, so that what an image looks
+	like scaled down does not depend on whether it was kept.
+*/
+static fz_bitmap *
+pdf_image_find_bitmap(fz_context *ctx, pdf_image *image)
+{
+	pdf_image_key key;
+
+	key.refs = 1;
+	key.image = &image->base;
+	key.l2factor = 0;
+	key.band = BITMAP_BAND;
+	return fz_find_item(ctx, fz_free_bitmap_imp, &key, &pdf_image_store_type);
+}
+
+static fz_bitmap *
+decomp_image_bitmap(fz_context *ctx, pdf_image *image)
+{
+	fz_bitmap *bit = NULL;
+	fz_stream *stm;
+	int native_l2factor = 0;
+	int stride, len, x, y, eof;
+	unsigned char invert, last;
+	unsigned char *p;
+
+	stm = fz_open_image_decomp_stream(ctx, image->buffer, &native_l2factor);
+
+	fz_var(bit);
+
 	fz_try(ctx)
 	{
-		key = fz_malloc_struct(ctx, pdf_image_key);
-		key->refs = 1;
-		key->image = fz_keep_image(ctx, &image->base);
-		key->l2factor = l2factor;
-		existing_tile = fz_store_item(ctx, key, tile, fz_pixmap_size(ctx, tile), &pdf_image_store_type);
-		if (existing_tile)
+		bit = fz_new_bitmap(ctx, image->base.w, image->base.h, 1);
+		bit->interpolate = image->interpolate;
+
+		/* Image masks have 0=opaque and 1=transparent, and a Decode of
+		 * [1 0] swaps them; the bitmap has 1 for a sample of 255 */
+		invert = (image->imagemask ^ (image->decode[0] > image->decode[1])) ? 0xff : 0;
+		stride = (bit->w + 7) >> 3;
+		last = 0xff << (7 - ((bit->w - 1) & 7));
+		eof = 0;
+		for (y = 0; y < bit->h; y++)
 		{
-			/* We already have a tile. This must have been produced by a
-			 * racing thread. We'll throw away ours and use that one. */
-			fz_drop_pixmap(ctx, tile);
-			tile = existing_tile;
+			p = bit->samples + y * bit->stride;
+			len = 0;
+			if (!eof)
+			{
+				len = fz_read(stm, p, stride);
+				if (len < 0)
+					fz_throw(ctx, "cannot read image data");
+				if (len < stride)
+				{
+					fz_warn(ctx, "padding truncated image");
+					eof = 1;
+				}
+			}
+			memset(p + len, 0, bit->stride - len);
+			if (invert)
+				for (x = 0; x < stride; x++)
+					p[x] ^= invert;
+			p[stride - 1] &= last;
 		}
 	}
 	fz_always(ctx)
 	{
-		pdf_drop_image_key(ctx, key);
+		fz_close(stm);
 	}
 	fz_catch(ctx)
 	{
-		/* Do nothing */
+		fz_drop_bitmap(ctx, bit);
+		fz_rethrow(ctx);
+	}
+
+	return bit;
+}
+
+static fz_bitmap *
+pdf_image_get_bitmap(fz_context *ctx, fz_image *image_)
+{
+	pdf_image *image = (pdf_image *)image_;
+	fz_bitmap *bit;
+
+	bit = pdf_image_find_bitmap(ctx, image);
+	if (bit)
+		return bit;
+	bit = decomp_image_bitmap(ctx, image);
+	return (fz_bitmap *)pdf_store_image_item(ctx, image, 0, BITMAP_BAND, &bit->storable, fz_bitmap_size(ctx, bit));
+}
+
+/* Make the part x0,y0 to x1,y1 of a bilevel image, subsampled by
+ * 2^l2factor, from its bitmap. Only at full size is a newly decoded
+ * bitmap kept. */
+static fz_pixmap *
+decomp_image_from_bitmap(fz_context *ctx, pdf_image *image, int l2factor, int x0, int y0, int x1, int y1)
+{
+	fz_bitmap *bit;
+	fz_pixmap *tile = NULL;
+
+	if (l2factor == 0)
+		bit = pdf_image_get_bitmap(ctx, &image->base);
+	else
+	{
+		bit = pdf_image_find_bitmap(ctx, image);
+		if (!bit)
+			bit = decomp_image_bitmap(ctx, image);
+	}
+
+	fz_var(tile);
+
+	fz_try(ctx)
+	{
+		tile = fz_new_pixmap(ctx, image->base.colorspace, x1 - x0, y1 - y0);
+		tile->interpolate = image->interpolate;
+		fz_unpack_bitmap(tile, bit, x0, y0, l2factor);
+	}
+	fz_always(ctx)
+	{
+		fz_drop_bitmap(ctx, bit);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
+		fz_rethrow(ctx);
+	}
+
+	return tile;
+}
+
+/*
+	Decode bands b0 to b1 of a JPEG image, storing each one; the
+	JPEG decoder skips quickly over the rows above and stops after the
+	last. Bands already found in the store are passed in, and are not
+	decoded again, though we still have to read through them.
+*/
+static void
+decomp_image_bands(fz_context *ctx, pdf_image *image, int l2factor, int b0, int b1, fz_pixmap **bands)
+{
+	fz_stream *stm;
+	fz_pixmap *tile = NULL;
+	unsigned char *samples = NULL;
+	int f = 1<<l2factor;
+	int w = (image->base.w + f-1) >> l2factor;
+	int h = (image->base.h + f-1) >> l2factor;
+	int stride = w * image->n;
+	int y1 = fz_mini((b1 + 1) * BAND_HEIGHT, h);
+	int b, bh, len;
+
+	stm = fz_open_dctd_band(fz_open_buffer(ctx, image->buffer->buffer),
+		image->buffer->params.u.jpeg.color_transform, l2factor, b0 * BAND_HEIGHT, y1);
+
+	fz_var(tile);
+	fz_var(samples);
+
+	fz_try(ctx)
+	{
+		samples = fz_malloc_array(ctx, BAND_HEIGHT, stride);
+
+		for (b = b0; b <= b1; b++)
+		{
+			bh = fz_mini(BAND_HEIGHT, h - b * BAND_HEIGHT);
+			len = fz_read(stm, samples, bh * stride);
+			if (len < 0)
+				fz_throw(ctx, "cannot read image data");
+			if (len < bh * stride)
+			{
+				fz_warn(ctx, "padding truncated image");
+				memset(samples + len, 0, bh * stride - len);
+			}
+			if (bands[b - b0])
+				continue;
+
+			tile = fz_new_pixmap(ctx, image->base.colorspace, w, bh);
+			tile->interpolate = image->interpolate;
+			fz_decode_unpack_tile(tile, samples, image->n, image->bpc, stride, 0, image->decode, image->usecolorkey ? image->colorkey : NULL);
+			bands[b - b0] = pdf_store_image_tile(ctx, image, l2factor, b, tile);
+			tile = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free(ctx, samples);
+		fz_close(stm);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
+		fz_rethrow(ctx);
+	}
+}
+
+/*
+	Decode a JPEG 2000 image, or just the tiles of it that bbox (in
+	full size pixels) touches, halving its size l2factor times. The
+	decoder cannot go beyond the resolution levels the image has, and
+	says how far it got.
+*/
+static fz_pixmap *
+decomp_jpx_image(fz_context *ctx, pdf_image *image, int *l2factor, fz_bbox bbox)
+{
+	fz_buffer *buf = image->buffer->buffer;
+	fz_colorspace *colorspace = image->base.colorspace;
+	fz_pixmap *tile, *mask = NULL;
+	int indexed = colorspace && !strcmp(colorspace->name, "Indexed");
+
+	fz_var(mask);
+
+	tile = fz_load_jpx_area(ctx, buf->data, buf->len, colorspace, indexed, l2factor, &bbox);
+
+	/* FIXME: We can't handle decode arrays for indexed images currently */
+	if (!indexed)
+		fz_decode_tile(tile, image->decode);
+
+	/* A soft mask has no colorspace; it comes as gray */
+	if (!colorspace)
+	{
+		fz_try(ctx)
+		{
+			mask = fz_alpha_from_gray(ctx, tile, 1);
+		}
+		fz_always(ctx)
+		{
+			fz_drop_pixmap(ctx, tile);
+		}
+		fz_catch(ctx)
+		{
+			fz_rethrow(ctx);
+		}
+		return mask;
 	}
 
 	return tile;
 }
 
+/*
+	As decomp_image_bands, for a JPEG 2000 image: the rows of tiles
+	that bands b0 to b1 fall in are decoded, and every band they
+	cover is stored, as the next row of parts will likely want those
+	below. Bands we cannot get (the decoder stopped short of the
+	subsampling asked for, say) are left NULL.
+*/
+static void
+decomp_jpx_bands(fz_context *ctx, pdf_image *image, int l2factor, int b0, int b1, fz_pixmap **bands)
+{
+	fz_pixmap *tile, *band = NULL;
+	pdf_image_key key;
+	fz_bbox bbox;
+	int f = 1<<l2factor;
+	int w = (image->base.w + f-1) >> l2factor;
+	int h = (image->base.h + f-1) >> l2factor;
+	int native_l2factor = l2factor;
+	int b, bh, y, stride;
+
+	bbox.x0 = 0;
+	bbox.y0 = (b0 * BAND_HEIGHT) << l2factor;
+	bbox.x1 = image->base.w;
+	bbox.y1 = fz_mini((b1 + 1) * BAND_HEIGHT, h) << l2factor;
+	tile = decomp_jpx_image(ctx, image, &native_l2factor, bbox);
+
+	fz_var(band);
+
+	fz_try(ctx)
+	{
+		if (native_l2factor != l2factor || tile->x != 0 || tile->w != w)
+			break;
+
+		stride = tile->w * tile->n;
+		for (b = (tile->y + BAND_HEIGHT - 1) / BAND_HEIGHT; b * BAND_HEIGHT < tile->y + tile->h; b++)
+		{
+			y = b * BAND_HEIGHT;
+			bh = fz_mini(BAND_HEIGHT, h - y);
+			if (bh <= 0 || y + bh > tile->y + tile->h)
+				break;
+			if (b >= b0 && b <= b1 && bands[b - b0])
+				continue;
+			if (b < b0 || b > b1)
+			{
+				key.refs = 1;
+				key.image = &image->base;
+				key.l2factor = l2factor;
+				key.band = b;
+				band = fz_find_item(ctx, fz_free_pixmap_imp, &key, &pdf_image_store_type);
+				if (band)
+				{
+					fz_drop_pixmap(ctx, band);
+					band = NULL;
+					continue;
+				}
+			}
+
+			band = fz_new_pixmap(ctx, tile->colorspace, w, bh);
+			band->interpolate = tile->interpolate;
+			memcpy(band->samples, tile->samples + (y - tile->y) * stride, bh * stride);
+			band = pdf_store_image_tile(ctx, image, l2factor, b, band);
+			if (b >= b0 && b <= b1)
+				bands[b - b0] = band;
+			else
+				fz_drop_pixmap(ctx, band);
+			band = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, band);
+		fz_rethrow(ctx);
+	}
+}
+
 static void
 pdf_free_image(fz_context *ctx, fz_storable *image_)
 {
@@ -250,6 +570,26 @@ pdf_free_image(fz_context *ctx, fz_storable *image_)
 	fz_free(ctx, image);
 }
 
+static int
+pdf_image_l2factor(pdf_image *image, int w, int h)
+{
+	int l2factor;
+
+	/* Ensure our expectations for tile size are reasonable */
+	if (w > image->base.w)
+		w = image->base.w;
+	if (h > image->base.h)
+		h = image->base.h;
+
+	/* What is our ideal factor? */
+	if (w == 0 || h == 0)
+		l2factor = 0;
+	else
+		for (l2factor=0; image->base.w>>(l2factor+1) >= w && image->base.h>>(l2factor+1) >= h && l2factor < 8; l2factor++);
+
+	return l2factor;
+}
+
 static fz_pixmap *
 pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h)
 {
@@ -269,22 +609,13 @@ pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h)
 		return fz_keep_pixmap(ctx, tile); /* That's all we can give you! */
 	}
 
-	/* Ensure our expectations for tile size are reasonable */
-	if (w > image->base.w)
-		w = image->base.w;
-	if (h > image->base.h)
-		h = image->base.h;
-
-	/* What is our ideal factor? */
-	if (w == 0 || h == 0)
-		l2factor = 0;
-	else
-		for (l2factor=0; image->base.w>>(l2factor+1) >= w && image->base.h>>(l2factor+1) >= h && l2factor < 8; l2factor++);
+	l2factor = pdf_image_l2factor(image, w, h);
 
 	/* Can we find any suitable tiles in the cache? */
 	key.refs = 1;
 	key.image = &image->base;
 	key.l2factor = l2factor;
+	key.band = -1;
 	do
 	{
 		tile = fz_find_item(ctx, fz_free_pixmap_imp, &key, &pdf_image_store_type);
@@ -294,13 +625,190 @@ pdf_image_get_pixmap(fz_context *ctx, fz_image *image_, int w, int h)
 	}
 	while (key.l2factor >= 0);
 
-	/* We need to make a new one. */
+	/* We need to make a new one. A bilevel image's bitmap in the store
+	 * stands for its full size tile. */
+	if (image->base.get_bitmap)
+	{
+		int f = 1<<l2factor;
+		fz_bitmap *bit = pdf_image_find_bitmap(ctx, image);
+		if (bit)
+		{
+			fz_drop_bitmap(ctx, bit);
+			return decomp_image_from_bitmap(ctx, image, 0, 0, 0, image->base.w, image->base.h);
+		}
+		tile = decomp_image_from_bitmap(ctx, image, l2factor, 0, 0, (image->base.w + f-1) >> l2factor, (image->base.h + f-1) >> l2factor);
+		return pdf_store_image_tile(ctx, image, l2factor, -1, tile);
+	}
+
 	native_l2factor = l2factor;
+	if (image->buffer->params.type == FZ_IMAGE_JPX)
+	{
+		tile = decomp_jpx_image(ctx, image, &native_l2factor, fz_empty_bbox);
+		return pdf_store_image_tile(ctx, image, l2factor, -1, tile);
+	}
 	stm = fz_open_image_decomp_stream(ctx, image->buffer, &native_l2factor);
 
 	return decomp_image_from_stream(ctx, stm, image, 0, 0, l2factor, native_l2factor, 1);
 }
 
+static fz_pixmap *
+pdf_image_get_whole(fz_context *ctx, pdf_image *image, int w, int h, int *fw, int *fh)
+{
+	fz_pixmap *tile = pdf_image_get_pixmap(ctx, &image->base, w, h);
+	*fw = tile->w;
+	*fh = tile->h;
+	return tile;
+}
+
+/*
+	Get just the part of the image within area. Only huge JPEG images
+	and JPEG 2000 images are worth doing this for: the bands of rows a
+	part needs are decoded and stored (so that neighbouring tiles find
+	them), and the part is then cut out of them. Huge bilevel images at
+	full size are cut straight out of their bitmap. Everything else is
+	done whole.
+*/
+static fz_pixmap *
+pdf_image_get_pixmap_area(fz_context *ctx, fz_image *image_, int w, int h, fz_rect area, int *fw, int *fh)
+{
+	pdf_image *image = (pdf_image *)image_;
+	fz_pixmap *tile = NULL;
+	fz_pixmap **bands = NULL;
+	pdf_image_key key;
+	int l2factor, f, sw, sh, n;
+	int x0, y0, x1, y1, b0, b1, b, m0, m1, y;
+	unsigned int limit;
+	fz_pixmap *band;
+	unsigned char *s, *d;
+	int type, bilevel;
+
+	l2factor = pdf_image_l2factor(image, w, h);
+	f = 1<<l2factor;
+	sw = (image->base.w + f-1) >> l2factor;
+	sh = (image->base.h + f-1) >> l2factor;
+	n = image->base.colorspace ? image->base.colorspace->n + 1 : 1;
+
+	/* An image that can stay in the store whole is best decoded whole,
+	 * once; banding only pays off when it cannot, since every part
+	 * means reading the JPEG data again from the top (JPEG 2000 images
+	 * at least decode only the tiles a part touches). The JPEG decoder
+	 * scales by up to 8 itself; beyond that the image is small enough
+	 * to be done whole in any case. Bilevel images at full size are
+	 * cut from their bitmap, which is cheap to take parts of. */
+	limit = fz_store_limit(ctx);
+	type = image->buffer ? image->buffer->params.type : FZ_IMAGE_UNKNOWN;
+	bilevel = image->base.get_bitmap && l2factor == 0;
+	if (!(bilevel || type == FZ_IMAGE_JPX || (type == FZ_IMAGE_JPEG && image->bpc == 8 && l2factor <= 3)) ||
+		limit == FZ_STORE_UNLIMITED || (double)sw * sh * n <= limit / 4)
+		return pdf_image_get_whole(ctx, image, w, h, fw, fh);
+
+	/* Leave a pixel or two over for interpolation */
+	x0 = fz_maxi((int)floorf(area.x0 * sw) - 2, 0);
+	y0 = fz_maxi((int)floorf(area.y0 * sh) - 2, 0);
+	x1 = fz_mini((int)ceilf(area.x1 * sw) + 2, sw);
+	y1 = fz_mini((int)ceilf(area.y1 * sh) + 2, sh);
+	if (x1 <= x0 || y1 <= y0 || (x0 == 0 && y0 == 0 && x1 == sw && y1 == sh))
+		return pdf_image_get_whole(ctx, image, w, h, fw, fh);
+
+	/* If the whole image is to hand, it will do */
+	key.refs = 1;
+	key.image = &image->base;
+	key.l2factor = l2factor;
+	key.band = -1;
+	do
+	{
+		tile = fz_find_item(ctx, fz_free_pixmap_imp, &key, &pdf_image_store_type);
+		if (tile)
+		{
+			*fw = tile->w;
+			*fh = tile->h;
+			return tile;
+		}
+		key.l2factor--;
+	}
+	while (key.l2factor >= 0);
+
+	/* A huge bilevel image needs no bands: the part is unpacked
+	 * straight from its bitmap */
+	if (bilevel)
+	{
+		tile = decomp_image_from_bitmap(ctx, image, 0, x0, y0, x1, y1);
+		tile->x = x0;
+		tile->y = y0;
+		*fw = sw;
+		*fh = sh;
+		return tile;
+	}
+
+	b0 = y0 / BAND_HEIGHT;
+	b1 = (y1 - 1) / BAND_HEIGHT;
+	bands = fz_malloc_array(ctx, b1 - b0 + 1, sizeof(*bands));
+	memset(bands, 0, (b1 - b0 + 1) * sizeof(*bands));
+
+	fz_var(tile);
+
+	fz_try(ctx)
+	{
+		key.l2factor = l2factor;
+		m0 = m1 = -1;
+		for (b = b0; b <= b1; b++)
+		{
+			key.band = b;
+			bands[b - b0] = fz_find_item(ctx, fz_free_pixmap_imp, &key, &pdf_image_store_type);
+			if (!bands[b - b0])
+			{
+				if (m0 < 0)
+					m0 = b;
+				m1 = b;
+			}
+		}
+		if (m0 >= 0 && type == FZ_IMAGE_JPX)
+			decomp_jpx_bands(ctx, image, l2factor, m0, m1, bands + (m0 - b0));
+		else if (m0 >= 0)
+			decomp_image_bands(ctx, image, l2factor, m0, m1, bands + (m0 - b0));
+
+		for (b = b0; b <= b1; b++)
+			if (!bands[b - b0])
+				break;
+		if (b <= b1)
+			break;
+
+		n = bands[0]->n;
+		tile = fz_new_pixmap(ctx, bands[0]->colorspace, x1 - x0, y1 - y0);
+		tile->interpolate = bands[0]->interpolate;
+		d = tile->samples;
+		for (y = y0; y < y1; y++)
+		{
+			band = bands[y / BAND_HEIGHT - b0];
+			s = band->samples + ((y % BAND_HEIGHT) * band->w + x0) * n;
+			memcpy(d, s, (x1 - x0) * n);
+			d += (x1 - x0) * n;
+		}
+	}
+	fz_always(ctx)
+	{
+		for (b = b0; b <= b1; b++)
+			fz_drop_pixmap(ctx, bands[b - b0]);
+		fz_free(ctx, bands);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_pixmap(ctx, tile);
+		fz_rethrow(ctx);
+	}
+
+	/* A JPEG 2000 image with fewer resolution levels than we wanted to
+	 * drop is done whole; the decoder will get as near as it can */
+	if (!tile)
+		return pdf_image_get_whole(ctx, image, w, h, fw, fh);
+
+	tile->x = x0;
+	tile->y = y0;
+	*fw = sw;
+	*fh = sh;
+	return tile;
+}
+
 static pdf_image *
 pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *cstm, int forcemask)
 {
@@ -332,12 +840,11 @@ pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *c
 
 			if (forcemask)
 			{
-				fz_pixmap *mask_pixmap;
+				/* Decoded as gray, and turned into alpha */
 				if (image->n != 2)
 					fz_throw(ctx, "soft mask must be grayscale");
-				mask_pixmap = fz_alpha_from_gray(ctx, image->tile, 1);
-				fz_drop_pixmap(ctx, image->tile);
-				image->tile = mask_pixmap;
+				fz_drop_colorspace(ctx, image->base.colorspace);
+				image->base.colorspace = NULL;
 			}
 			break; /* Out of fz_try */
 		}
@@ -432,6 +939,7 @@ pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *c
 		/* Now, do we load a ref, or do we load the actual thing? */
 		FZ_INIT_STORABLE(&image->base, 1, pdf_free_image);
 		image->base.get_pixmap = pdf_image_get_pixmap;
+		image->base.get_pixmap_area = pdf_image_get_pixmap_area;
 		image->base.w = w;
 		image->base.h = h;
 		image->n = n;
@@ -447,6 +955,10 @@ pdf_load_image_imp(pdf_document *xref, pdf_obj *rdb, pdf_obj *dict, fz_stream *c
 			int num = pdf_to_num(dict);
 			int gen = pdf_to_gen(dict);
 			image->buffer = pdf_load_compressed_stream(xref, num, gen);
+			if (bpc == 1 && n == 1 && !usecolorkey &&
+				((image->decode[0] == 0 && image->decode[1] == 1) ||
+				(image->decode[0] == 1 && image->decode[1] == 0)))
+				image->base.get_bitmap = pdf_image_get_bitmap;
 			break; /* Out of fz_try */
 		}
 
@@ -493,23 +1005,30 @@ pdf_is_jpx_image(fz_context *ctx, pdf_obj *dict)
 	return 0;
 }
 
+/*
+	JPEG 2000 images are decoded as they are drawn, at the size wanted
+	(or the parts wanted, of huge ones). Here we only decode the first
+	tile at its smallest, to learn the image's size and colorspace.
+*/
 static void
 pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 {
-	fz_buffer *buf = NULL;
+	fz_compressed_buffer *buf = NULL;
 	fz_colorspace *colorspace = NULL;
 	fz_pixmap *img = NULL;
 	pdf_obj *obj;
 	fz_context *ctx = xref->ctx;
 	int indexed = 0;
+	int l2factor = 32;
+	fz_bbox bbox = fz_unit_bbox;
+	int i;
 
 	fz_var(img);
 	fz_var(buf);
 	fz_var(colorspace);
 
-	buf = pdf_load_stream(xref, pdf_to_num(dict), pdf_to_gen(dict));
+	buf = pdf_load_compressed_stream(xref, pdf_to_num(dict), pdf_to_gen(dict));
 
-	/* FIXME: We can't handle decode arrays for indexed images currently */
 	fz_try(ctx)
 	{
 		obj = pdf_dict_gets(dict, "ColorSpace");
@@ -519,14 +1038,12 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 			indexed = !strcmp(colorspace->name, "Indexed");
 		}
 
-		img = fz_load_jpx(ctx, buf->data, buf->len, colorspace, indexed);
+		img = fz_load_jpx_area(ctx, buf->buffer->data, buf->buffer->len, colorspace, indexed, &l2factor, &bbox);
 
+		/* The decoder settles the colorspace if the dictionary does not */
 		if (img && colorspace == NULL)
 			colorspace = fz_keep_colorspace(ctx, img->colorspace);
 
-		fz_drop_buffer(ctx, buf);
-		buf = NULL;
-
 		obj = pdf_dict_getsa(dict, "SMask", "Mask");
 		if (pdf_is_dict(obj))
 		{
@@ -534,37 +1051,36 @@ pdf_load_jpx(pdf_document *xref, pdf_obj *dict, pdf_image *image)
 		}
 
 		obj = pdf_dict_getsa(dict, "Decode", "D");
-		if (obj && !indexed)
+		for (i = 0; i < img->n * 2; i++)
 		{
-			float decode[FZ_MAX_COLORS * 2];
-			int i;
-
-			for (i = 0; i < img->n * 2; i++)
-				decode[i] = pdf_to_real(pdf_array_get(obj, i));
-
-			fz_decode_tile(img, decode);
+			if (obj && !indexed)
+				image->decode[i] = pdf_to_real(pdf_array_get(obj, i));
+			else
+				image->decode[i] = i & 1;
 		}
 	}
 	fz_catch(ctx)
 	{
 		if (colorspace)
 			fz_drop_colorspace(ctx, colorspace);
-		fz_drop_buffer(ctx, buf);
+		fz_free_compressed_buffer(ctx, buf);
 		fz_drop_pixmap(ctx, img);
 		fz_rethrow(ctx);
 	}
 	FZ_INIT_STORABLE(&image->base, 1, pdf_free_image);
 	image->base.get_pixmap = pdf_image_get_pixmap;
-	image->base.w = img->w;
-	image->base.h = img->h;
+	image->base.get_pixmap_area = pdf_image_get_pixmap_area;
+	image->base.w = bbox.x1;
+	image->base.h = bbox.y1;
 	image->base.colorspace = colorspace;
-	image->buffer = NULL;
-	image->tile = img;
+	image->buffer = buf;
+	image->tile = NULL;
 	image->n = img->n;
 	image->bpc = 8;
 	image->interpolate = 0;
 	image->imagemask = 0;
 	image->usecolorkey = 0;
+	fz_drop_pixmap(ctx, img);
 }
 
 static int
@@ -21,6 +21,18 @@ enum
 	PDF_MAT_SHADE,
 };
 
+/* What the content compiler has attached to a token */
+enum
+{
+	PDF_RES_NONE,
+	PDF_RES_FONT,
+	PDF_RES_XOBJECT,
+	PDF_RES_EXTGSTATE,
+	PDF_RES_SHADING,
+	PDF_RES_INLINE_IMAGE,
+	PDF_RES_OBJECT,
+};
+
 struct pdf_material_s
 {
 	int kind;
@@ -79,6 +91,10 @@ struct pdf_csi_s
 	float stack[32];
 	int top;
 
+	/* resource pre-resolved by the content compiler for 'name' */
+	pdf_obj *res;
+	int res_kind;
+
 	int xbalance;
 	int in_text;
 	int in_hidden_ocg;
@@ -96,6 +112,11 @@ struct pdf_csi_s
 	int text_mode;
 	int accumulate;
 
+	/* form display list recording */
+	int in_form_list;
+	int text_objects;
+	int loose_text;
+
 	/* graphics state */
 	fz_matrix top_ctm;
 	pdf_gstate *gstate;
@@ -859,6 +880,10 @@ pdf_show_string(pdf_csi *csi, unsigned char *buf, int len)
 		return;
 	}
 
+	/* Text outside BT/ET depends on the text matrix we came in with */
+	if (!csi->in_text)
+		csi->loose_text = 1;
+
 	while (buf < end)
 	{
 		int w = pdf_decode_cmap(fontdesc->encoding, buf, &cpt);
@@ -1001,6 +1026,8 @@ pdf_new_csi(pdf_document *xref, fz_device *dev, fz_matrix ctm, char *event, fz_c
 		csi->name[0] = 0;
 		csi->string_len = 0;
 		memset(csi->stack, 0, sizeof csi->stack);
+		csi->res = NULL;
+		csi->res_kind = PDF_RES_NONE;
 
 		csi->xbalance = 0;
 		csi->in_text = 0;
@@ -1016,6 +1043,10 @@ pdf_new_csi(pdf_document *xref, fz_device *dev, fz_matrix ctm, char *event, fz_c
 		csi->text_mode = 0;
 		csi->accumulate = 1;
 
+		csi->in_form_list = 0;
+		csi->text_objects = 0;
+		csi->loose_text = 0;
+
 		csi->gcap = 64;
 		csi->gstate = fz_malloc_array(ctx, csi->gcap, sizeof(pdf_gstate));
 
@@ -1048,6 +1079,8 @@ pdf_clear_stack(pdf_csi *csi)
 	csi->obj = NULL;
 
 	csi->name[0] = 0;
+	csi->res = NULL;
+	csi->res_kind = PDF_RES_NONE;
 	csi->string_len = 0;
 	for (i = 0; i < csi->top; i++)
 		csi->stack[i] = 0;
@@ -1377,6 +1410,385 @@ pdf_show_pattern(pdf_csi *csi, pdf_pattern *pat, fz_rect area, int what)
 	pdf_grestore(csi);
 }
 
+/*
+ * Form XObjects that are painted over and over again (page headers,
+ * logos, stamps, symbols in maps and drawings) are recorded into a
+ * display list the first time they are run, and replayed from the
+ * store afterwards. The list is recorded under the ctm the form is run
+ * with, and replayed under the identity. Recording it in form space and
+ * concatenating the ctm on replay would round differently from running
+ * the form; as it is, the list comes out exactly as the form would. The
+ * ctm, and everything else that the interpretation of the form depends
+ * on, is part of the key: a header or logo in the same place on every
+ * page, and each tile of a page, share a list.
+ */
+
+typedef struct pdf_form_key_s pdf_form_key;
+typedef struct pdf_form_list_s pdf_form_list;
+
+struct pdf_form_key_s
+{
+	int refs;
+	pdf_xobject *xobj;
+	pdf_obj *rdb;
+	int iteration;
+	char *event;
+	int hash;
+	pdf_gstate gstate;
+};
+
+struct pdf_form_list_s
+{
+	fz_storable storable;
+	pdf_form_key *key;
+	fz_display_list *list;
+	int text_objects;
+	fz_matrix tm;
+	fz_matrix tlm;
+};
+
+static int
+pdf_cmp_material(pdf_material *a, pdf_material *b)
+{
+	int n = a->colorspace ? a->colorspace->n : 0;
+
+	if (a->kind != b->kind || a->colorspace != b->colorspace ||
+		a->pattern != b->pattern || a->shade != b->shade ||
+		a->alpha != b->alpha)
+		return 1;
+	return memcmp(a->v, b->v, n * sizeof(float)) != 0;
+}
+
+static int
+pdf_cmp_stroke_state(fz_stroke_state *a, fz_stroke_state *b)
+{
+	if (a == b)
+		return 0;
+	if (a->start_cap != b->start_cap || a->dash_cap != b->dash_cap ||
+		a->end_cap != b->end_cap || a->linejoin != b->linejoin ||
+		a->linewidth != b->linewidth || a->miterlimit != b->miterlimit ||
+		a->dash_phase != b->dash_phase || a->dash_len != b->dash_len)
+		return 1;
+	return memcmp(a->dash_list, b->dash_list, a->dash_len * sizeof(float)) != 0;
+}
+
+static unsigned int
+pdf_hash_material(unsigned int h, pdf_material *mat)
+{
+	int i, n = mat->colorspace ? mat->colorspace->n : 0;
+
+	h = h * 31 + mat->kind;
+	for (i = 0; i < n; i++)
+		h = h * 31 + (int)(mat->v[i] * 255);
+	return h * 31 + (int)(mat->alpha * 255);
+}
+
+static unsigned int
+pdf_hash_matrix(unsigned int h, fz_matrix *m)
+{
+	unsigned int v[6];
+	int i;
+
+	memcpy(v, m, sizeof v);
+	for (i = 0; i < 6; i++)
+		h = h * 31 + v[i];
+	return h;
+}
+
+static pdf_form_key *
+pdf_new_form_key(fz_context *ctx, pdf_csi *csi, pdf_obj *rdb, pdf_xobject *xobj)
+{
+	pdf_gstate *gs = csi->gstate + csi->gtop;
+	pdf_form_key *key;
+	unsigned int h;
+
+	key = fz_malloc_struct(ctx, pdf_form_key);
+	key->refs = 1;
+	key->xobj = pdf_keep_xobject(ctx, xobj);
+	key->rdb = pdf_keep_obj(rdb);
+	key->iteration = xobj->iteration;
+	key->event = csi->event;
+
+	memcpy(&key->gstate, gs, sizeof(pdf_gstate));
+	key->gstate.clip_depth = 0;
+	pdf_keep_material(ctx, &key->gstate.stroke);
+	pdf_keep_material(ctx, &key->gstate.fill);
+	if (key->gstate.font)
+		pdf_keep_font(ctx, key->gstate.font);
+	fz_keep_stroke_state(ctx, key->gstate.stroke_state);
+
+	h = xobj->iteration;
+	h = pdf_hash_matrix(h, &gs->ctm);
+	h = pdf_hash_material(h, &gs->fill);
+	h = pdf_hash_material(h, &gs->stroke);
+	h = h * 31 + (int)(gs->size * 64);
+	h = h * 31 + gs->render;
+	key->hash = (int)h;
+
+	return key;
+}
+
+static int
+pdf_make_hash_form_key(fz_store_hash *hash, void *key_)
+{
+	pdf_form_key *key = (pdf_form_key *)key_;
+
+	hash->u.pi.ptr = key->xobj;
+	hash->u.pi.i = key->hash;
+	return 1;
+}
+
+static void *
+pdf_keep_form_key(fz_context *ctx, void *key_)
+{
+	pdf_form_key *key = (pdf_form_key *)key_;
+
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	key->refs++;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+
+	return (void *)key;
+}
+
+static void
+pdf_drop_form_key(fz_context *ctx, void *key_)
+{
+	pdf_form_key *key = (pdf_form_key *)key_;
+	int drop;
+
+	if (key == NULL)
+		return;
+	fz_lock(ctx, FZ_LOCK_ALLOC);
+	drop = --key->refs;
+	fz_unlock(ctx, FZ_LOCK_ALLOC);
+	if (drop == 0)
+	{
+		pdf_drop_material(ctx, &key->gstate.stroke);
+		pdf_drop_material(ctx, &key->gstate.fill);
+		if (key->gstate.font)
+			pdf_drop_font(ctx, key->gstate.font);
+		fz_drop_stroke_state(ctx, key->gstate.stroke_state);
+		pdf_drop_obj(key->rdb);
+		pdf_drop_xobject(ctx, key->xobj);
+		fz_free(ctx, key);
+	}
+}
+
+static int
+pdf_cmp_form_key(void *k0_, void *k1_)
+{
+	pdf_form_key *k0 = (pdf_form_key *)k0_;
+	pdf_form_key *k1 = (pdf_form_key *)k1_;
+	pdf_gstate *a = &k0->gstate;
+	pdf_gstate *b = &k1->gstate;
+
+	if (k0->xobj != k1->xobj || k0->rdb != k1->rdb ||
+		k0->iteration != k1->iteration || k0->hash != k1->hash ||
+		strcmp(k0->event, k1->event) ||
+		memcmp(&a->ctm, &b->ctm, sizeof a->ctm))
+		return 1;
+	if (pdf_cmp_material(&a->fill, &b->fill) ||
+		pdf_cmp_material(&a->stroke, &b->stroke) ||
+		pdf_cmp_stroke_state(a->stroke_state, b->stroke_state))
+		return 1;
+	return a->char_space != b->char_space || a->word_space != b->word_space ||
+		a->scale != b->scale || a->leading != b->leading ||
+		a->font != b->font || a->size != b->size ||
+		a->render != b->render || a->rise != b->rise ||
+		a->blendmode != b->blendmode;
+}
+
+#ifndef NDEBUG
+static void
+pdf_debug_form_key(void *key_)
+{
+	pdf_form_key *key = (pdf_form_key *)key_;
+
+	printf("(form list %d %d R iteration=%d) ", pdf_to_num(key->xobj->me), pdf_to_gen(key->xobj->me), key->iteration);
+}
+#endif
+
+static fz_store_type pdf_form_store_type =
+{
+	pdf_make_hash_form_key,
+	pdf_keep_form_key,
+	pdf_drop_form_key,
+	pdf_cmp_form_key,
+#ifndef NDEBUG
+	pdf_debug_form_key
+#endif
+};
+
+static void
+pdf_free_form_list_imp(fz_context *ctx, fz_storable *fl_)
+{
+	pdf_form_list *fl = (pdf_form_list *)fl_;
+
+	pdf_drop_form_key(ctx, fl->key);
+	fz_free_display_list(ctx, fl->list);
+	fz_free(ctx, fl);
+}
+
+static int
+pdf_form_list_cacheable(pdf_csi *csi)
+{
+	pdf_gstate *gstate = csi->gstate + csi->gtop;
+
+	/* Only for plain rendering of page level content. Type 3 glyphs
+	 * and text extraction run forms directly. */
+	if (csi->in_form_list || csi->nested_depth > 0 || csi->in_hidden_ocg > 0)
+		return 0;
+	if (csi->dev->hints != 0 || csi->dev->flags != 0)
+		return 0;
+	/* The form must not continue a text object or mask from outside */
+	if (csi->in_text || csi->text || csi->accumulate != 1 || gstate->softmask)
+		return 0;
+	return 1;
+}
+
+static void
+pdf_store_form_list(fz_context *ctx, pdf_form_key *key, fz_display_list *list, pdf_csi *csi, int text_objects)
+{
+	pdf_form_list *fl, *existing;
+
+	fl = fz_malloc_struct(ctx, pdf_form_list);
+	FZ_INIT_STORABLE(fl, 1, pdf_free_form_list_imp);
+	fl->key = pdf_keep_form_key(ctx, key);
+	fl->list = list;
+	fl->text_objects = text_objects;
+	fl->tm = csi->tm;
+	fl->tlm = csi->tlm;
+
+	existing = fz_store_item(ctx, key, fl, sizeof(*fl) + fz_display_list_size(list), &pdf_form_store_type);
+	if (existing)
+		fz_drop_storable(ctx, &existing->storable);
+	fz_drop_storable(ctx, &fl->storable);
+}
+
+/* Run the contents of a form through the display list cache. Returns
+ * 0 if the form has to be run directly instead. */
+static int
+pdf_run_form_list(pdf_csi *csi, pdf_obj *rdb, pdf_xobject *xobj)
+{
+	fz_context *ctx = csi->dev->ctx;
+	fz_device *dev = csi->dev;
+	fz_device *list_dev = NULL;
+	fz_display_list *list = NULL;
+	pdf_form_key *key = NULL;
+	pdf_form_list *fl;
+	fz_matrix tm, tlm;
+	int xbalance, text_objects, reuse;
+
+	if (!pdf_form_list_cacheable(csi))
+		return 0;
+
+	fz_var(key);
+	fz_var(reuse);
+
+	fz_try(ctx)
+	{
+		key = pdf_new_form_key(ctx, csi, rdb, xobj);
+	}
+	fz_catch(ctx)
+	{
+		return 0;
+	}
+
+	/* The store only matches the hash, so check the rest of the key */
+	fl = fz_find_item(ctx, pdf_free_form_list_imp, key, &pdf_form_store_type);
+	if (fl && !pdf_cmp_form_key(fl->key, key))
+	{
+		pdf_drop_form_key(ctx, key);
+		fz_try(ctx)
+		{
+			fz_run_display_list(fl->list, dev, fz_identity, fz_infinite_bbox, NULL);
+			if (fl->text_objects)
+			{
+				csi->tm = fl->tm;
+				csi->tlm = fl->tlm;
+			}
+		}
+		fz_always(ctx)
+		{
+			fz_drop_storable(ctx, &fl->storable);
+		}
+		fz_catch(ctx)
+		{
+			fz_rethrow(ctx);
+		}
+		return 1;
+	}
+	if (fl)
+		fz_drop_storable(ctx, &fl->storable);
+
+	tm = csi->tm;
+	tlm = csi->tlm;
+	xbalance = csi->xbalance;
+	text_objects = csi->text_objects;
+	csi->loose_text = 0;
+
+	fz_var(list);
+	fz_var(list_dev);
+
+	fz_try(ctx)
+	{
+		list = fz_new_display_list(ctx);
+		list_dev = fz_new_list_device(ctx, list);
+
+		csi->dev = list_dev;
+		csi->in_form_list = 1;
+
+		pdf_run_contents_object(csi, rdb, xobj->contents);
+	}
+	fz_always(ctx)
+	{
+		csi->in_form_list = 0;
+		csi->dev = dev;
+		fz_free_device(list_dev);
+	}
+	fz_catch(ctx)
+	{
+		/* Show what we got before passing the error on */
+		if (list)
+			fz_run_display_list(list, dev, fz_identity, fz_infinite_bbox, NULL);
+		fz_free_display_list(ctx, list);
+		pdf_drop_form_key(ctx, key);
+		fz_rethrow(ctx);
+	}
+
+	text_objects = csi->text_objects - text_objects;
+
+	/* Only keep the list if replaying it is equivalent to running the
+	 * form: no state may leak in from, or out to, the caller. */
+	reuse = !csi->loose_text && !csi->text && csi->accumulate == 1 &&
+		!csi->clip && csi->path->len == 0 &&
+		csi->xbalance == xbalance && csi->in_hidden_ocg == 0 &&
+		!(csi->cookie && csi->cookie->abort);
+	if (!text_objects && (memcmp(&tm, &csi->tm, sizeof tm) || memcmp(&tlm, &csi->tlm, sizeof tlm)))
+		reuse = 0;
+
+	fz_try(ctx)
+	{
+		fz_run_display_list(list, dev, fz_identity, fz_infinite_bbox, NULL);
+		if (reuse)
+		{
+			pdf_store_form_list(ctx, key, list, csi, text_objects);
+			list = NULL;
+		}
+	}
+	fz_always(ctx)
+	{
+		fz_free_display_list(ctx, list);
+		pdf_drop_form_key(ctx, key);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return 1;
+}
+
 static void
 pdf_run_xobject(pdf_csi *csi, pdf_obj *resources, pdf_xobject *xobj, fz_matrix transform)
 {
@@ -1463,7 +1875,8 @@ pdf_run_xobject(pdf_csi *csi, pdf_obj *resources, pdf_xobject *xobj, fz_matrix t
 		if (xobj->resources)
 			resources = xobj->resources;
 
-		pdf_run_contents_object(csi, resources, xobj->contents);
+		if (!pdf_run_form_list(csi, resources, xobj))
+			pdf_run_contents_object(csi, resources, xobj->contents);
 	}
 	fz_always(ctx)
 	{
@@ -1749,6 +2162,7 @@ static void pdf_run_BMC(pdf_csi *csi)
 
 static void pdf_run_BT(pdf_csi *csi)
 {
+	csi->text_objects++;
 	csi->in_text = 1;
 	csi->tm = fz_identity;
 	csi->tlm = fz_identity;
@@ -1824,13 +2238,18 @@ static void pdf_run_Do(pdf_csi *csi, pdf_obj *rdb)
 	pdf_obj *obj;
 	pdf_obj *subtype;
 
-	dict = pdf_dict_gets(rdb, "XObject");
-	if (!dict)
-		fz_throw(ctx, "cannot find XObject dictionary when looking for: '%s'", csi->name);
+	if (csi->res_kind == PDF_RES_XOBJECT)
+		obj = csi->res;
+	else
+	{
+		dict = pdf_dict_gets(rdb, "XObject");
+		if (!dict)
+			fz_throw(ctx, "cannot find XObject dictionary when looking for: '%s'", csi->name);
 
-	obj = pdf_dict_gets(dict, csi->name);
-	if (!obj)
-		fz_throw(ctx, "cannot find xobject resource: '%s'", csi->name);
+		obj = pdf_dict_gets(dict, csi->name);
+		if (!obj)
+			fz_throw(ctx, "cannot find xobject resource: '%s'", csi->name);
+	}
 
 	subtype = pdf_dict_gets(obj, "Subtype");
 	if (!pdf_is_name(subtype))
@@ -2083,13 +2502,18 @@ static void pdf_run_Tf(pdf_csi *csi, pdf_obj *rdb)
 		pdf_drop_font(ctx, gstate->font);
 	gstate->font = NULL;
 
-	dict = pdf_dict_gets(rdb, "Font");
-	if (!dict)
-		fz_throw(ctx, "cannot find Font dictionary");
+	if (csi->res_kind == PDF_RES_FONT)
+		obj = csi->res;
+	else
+	{
+		dict = pdf_dict_gets(rdb, "Font");
+		if (!dict)
+			fz_throw(ctx, "cannot find Font dictionary");
 
-	obj = pdf_dict_gets(dict, csi->name);
-	if (!obj)
-		fz_throw(ctx, "cannot find font resource: '%s'", csi->name);
+		obj = pdf_dict_gets(dict, csi->name);
+		if (!obj)
+			fz_throw(ctx, "cannot find font resource: '%s'", csi->name);
+	}
 
 	gstate->font = pdf_load_font(csi->xref, rdb, obj, csi->nested_depth);
 }
@@ -2269,13 +2693,18 @@ static void pdf_run_gs(pdf_csi *csi, pdf_obj *rdb)
 	pdf_obj *obj;
 	fz_context *ctx = csi->dev->ctx;
 
-	dict = pdf_dict_gets(rdb, "ExtGState");
-	if (!dict)
-		fz_throw(ctx, "cannot find ExtGState dictionary");
+	if (csi->res_kind == PDF_RES_EXTGSTATE)
+		obj = csi->res;
+	else
+	{
+		dict = pdf_dict_gets(rdb, "ExtGState");
+		if (!dict)
+			fz_throw(ctx, "cannot find ExtGState dictionary");
 
-	obj = pdf_dict_gets(dict, csi->name);
-	if (!obj)
-		fz_throw(ctx, "cannot find extgstate resource '%s'", csi->name);
+		obj = pdf_dict_gets(dict, csi->name);
+		if (!obj)
+			fz_throw(ctx, "cannot find extgstate resource '%s'", csi->name);
+	}
 
 	pdf_run_extgstate(csi, rdb, obj);
 }
@@ -2370,13 +2799,18 @@ static void pdf_run_sh(pdf_csi *csi, pdf_obj *rdb)
 	pdf_obj *obj;
 	fz_shade *shd;
 
-	dict = pdf_dict_gets(rdb, "Shading");
-	if (!dict)
-		fz_throw(ctx, "cannot find shading dictionary");
+	if (csi->res_kind == PDF_RES_SHADING)
+		obj = csi->res;
+	else
+	{
+		dict = pdf_dict_gets(rdb, "Shading");
+		if (!dict)
+			fz_throw(ctx, "cannot find shading dictionary");
 
-	obj = pdf_dict_gets(dict, csi->name);
-	if (!obj)
-		fz_throw(ctx, "cannot find shading resource: '%s'", csi->name);
+		obj = pdf_dict_gets(dict, csi->name);
+		if (!obj)
+			fz_throw(ctx, "cannot find shading resource: '%s'", csi->name);
+	}
 
 	if ((csi->dev->hints & FZ_IGNORE_SHADE) == 0)
 	{
@@ -2464,9 +2898,8 @@ static void pdf_run_dquote(pdf_csi *csi)
 #define C(a,b,c) (a | b << 8 | c << 16)
 
 static int
-pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
+pdf_keyword_key(char *buf)
 {
-	fz_context *ctx = csi->dev->ctx;
 	int key;
 
 	key = buf[0];
@@ -2480,6 +2913,16 @@ pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
 				key = 0;
 		}
 	}
+	return key;
+}
+
+static int
+pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
+{
+	fz_context *ctx = csi->dev->ctx;
+	int key;
+
+	key = pdf_keyword_key(buf);
 
 	switch (key)
 	{
@@ -2603,20 +3046,594 @@ pdf_run_keyword(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, char *buf)
 	return 0;
 }
 
+/*
+ * Compiled content streams
+ *
+ * The first time a content stream object is run we decode it once and
+ * record the tokens the lexer produces, with the offset at which each one
+ * ends. Later runs replay the tokens instead of decoding and lexing the
+ * stream again. Names used as operands of Tf, Do, gs and sh are looked up
+ * in the resource dictionary at compile time, and inline images are loaded
+ * once and kept with the tokens.
+ *
+ * Arrays and dictionaries are parsed at compile time as well, from each
+ * opening token, and replay resumes at the token where the parser stopped.
+ * The decoded data is not kept. On the rare paths that leave the data at
+ * an offset that does not end a recorded token (an inline image that
+ * could not be shown, say) we decode the stream again and lex the rest of
+ * it from there, so the interpreter always sees the same operators it
+ * would have seen without the cache.
+ *
+ * A stream that cannot be compiled is remembered as an entry with no
+ * tokens, and is interpreted directly from then on.
+ */
+
+#define MAX_COMPILED_CONTENTS (100 << 20)
+
+typedef struct pdf_content_token_s pdf_content_token;
+typedef struct pdf_content_image_s pdf_content_image;
+
+struct pdf_content_token_s
+{
+	unsigned char type;
+	unsigned char kind;
+	int end;
+	int len;
+	union
+	{
+		int i;
+		float f;
+		int text;
+	} u;
+	void *ptr;
+};
+
+struct pdf_content_image_s
+{
+	fz_image *image;
+	int data_end;
+};
+
+struct pdf_compiled_contents_s
+{
+	fz_storable storable;
+	unsigned int size;
+	pdf_obj *rdb;
+	pdf_obj *contents;
+	int len, cap;
+	pdf_content_token *tok;
+	int text_len, text_cap;
+	char *text;
+};
+
+static char *pdf_resource_type[] =
+{
+	NULL, "Font", "XObject", "ExtGState", "Shading"
+};
+
+void
+pdf_free_compiled_contents_imp(fz_context *ctx, fz_storable *cc_)
+{
+	pdf_compiled_contents *cc = (pdf_compiled_contents *)cc_;
+	int i;
+
+	for (i = 0; i < cc->len; i++)
+	{
+		pdf_content_token *ct = &cc->tok[i];
+
+		if (ct->kind == PDF_RES_INLINE_IMAGE)
+		{
+			pdf_content_image *ci = ct->ptr;
+			fz_drop_image(ctx, ci->image);
+			fz_free(ctx, ci);
+		}
+		else if (ct->ptr)
+			pdf_drop_obj(ct->ptr);
+	}
+	fz_free(ctx, cc->tok);
+	fz_free(ctx, cc->text);
+	pdf_drop_obj(cc->contents);
+	pdf_drop_obj(cc->rdb);
+	fz_free(ctx, cc);
+}
+
+static void
+pdf_drop_compiled_contents(fz_context *ctx, pdf_compiled_contents *cc)
+{
+	if (cc)
+		fz_drop_storable(ctx, &cc->storable);
+}
+
+static pdf_compiled_contents *
+pdf_new_compiled_contents(fz_context *ctx, pdf_obj *rdb, pdf_obj *contents)
+{
+	pdf_compiled_contents *cc;
+
+	cc = fz_malloc_struct(ctx, pdf_compiled_contents);
+	FZ_INIT_STORABLE(cc, 1, pdf_free_compiled_contents_imp);
+	cc->rdb = pdf_keep_obj(rdb);
+	cc->contents = pdf_keep_obj(contents);
+	cc->size = sizeof(*cc);
+	return cc;
+}
+
+static pdf_content_token *
+pdf_add_content_token(fz_context *ctx, pdf_compiled_contents *cc, int type)
+{
+	pdf_content_token *ct;
+
+	if (cc->len == cc->cap)
+	{
+		int cap = cc->cap ? cc->cap * 2 : 256;
+		cc->tok = fz_resize_array(ctx, cc->tok, cap, sizeof(*cc->tok));
+		cc->cap = cap;
+	}
+
+	ct = &cc->tok[cc->len++];
+	ct->type = type;
+	ct->kind = PDF_RES_NONE;
+	ct->end = 0;
+	ct->len = 0;
+	ct->u.i = 0;
+	ct->ptr = NULL;
+	return ct;
+}
+
+static int
+pdf_add_content_text(fz_context *ctx, pdf_compiled_contents *cc, char *s, int len)
+{
+	int ofs;
+
+	if (cc->text_len + len + 1 > cc->text_cap)
+	{
+		int cap = cc->text_cap ? cc->text_cap : 1024;
+		while (cc->text_len + len + 1 > cap)
+			cap *= 2;
+		cc->text = fz_resize_array(ctx, cc->text, cap, 1);
+		cc->text_cap = cap;
+	}
+
+	ofs = cc->text_len;
+	memcpy(cc->text + ofs, s, len);
+	cc->text[ofs + len] = 0;
+	cc->text_len += len + 1;
+	return ofs;
+}
+
+static int
+pdf_keyword_resource(int key)
+{
+	switch (key)
+	{
+	case B('T','f'): return PDF_RES_FONT;
+	case B('D','o'): return PDF_RES_XOBJECT;
+	case B('g','s'): return PDF_RES_EXTGSTATE;
+	case B('s','h'): return PDF_RES_SHADING;
+	}
+	return PDF_RES_NONE;
+}
+
+static void
+pdf_compile_resource(pdf_compiled_contents *cc, pdf_obj *rdb, pdf_content_token *ct, int kind)
+{
+	char name[256];
+	pdf_obj *obj;
+
+	if (ct->ptr)
+		return;
+
+	/* Look the name up exactly as the operator would after copying
+	 * it into csi->name. */
+	fz_strlcpy(name, cc->text + ct->u.text, sizeof name);
+	obj = pdf_dict_gets(pdf_dict_gets(rdb, pdf_resource_type[kind]), name);
+	if (obj)
+	{
+		ct->ptr = pdf_keep_obj(obj);
+		ct->kind = kind;
+	}
+}
+
+static void
+pdf_compile_inline_image(pdf_csi *csi, pdf_obj *rdb, pdf_compiled_contents *cc, pdf_content_token *ct, fz_stream *file)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_content_image *ci;
+	fz_image *img;
+	pdf_obj *obj;
+	int ch;
+
+	fz_var(img);
+	fz_var(ci);
+
+	/* Consume the image as pdf_run_BI does */
+	obj = pdf_parse_dict(csi->xref, file, &csi->xref->lexbuf.base);
+
+	/* read whitespace after ID keyword */
+	ch = fz_read_byte(file);
+	if (ch == '\r')
+		if (fz_peek_byte(file) == '\n')
+			fz_read_byte(file);
+
+	fz_try(ctx)
+	{
+		img = pdf_load_inline_image(csi->xref, rdb, obj, file);
+	}
+	fz_always(ctx)
+	{
+		pdf_drop_obj(obj);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	fz_try(ctx)
+	{
+		ci = fz_malloc_struct(ctx, pdf_content_image);
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_image(ctx, img);
+		fz_rethrow(ctx);
+	}
+	ci->image = img;
+	ci->data_end = fz_tell(file);
+	ct->kind = PDF_RES_INLINE_IMAGE;
+	ct->ptr = ci;
+	cc->size += img->w * img->h * (img->colorspace ? img->colorspace->n + 1 : 1);
+
+	/* find EI */
+	ch = fz_read_byte(file);
+	while (ch != 'E' && ch != EOF)
+		ch = fz_read_byte(file);
+	ch = fz_read_byte(file);
+	if (ch != 'I')
+		fz_throw(ctx, "syntax error after inline image");
+}
+
 static void
-pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
+pdf_compile_object(pdf_csi *csi, pdf_compiled_contents *cc, pdf_content_token *ct, fz_stream *file, pdf_lexbuf *buf)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_obj *obj = NULL;
+
+	fz_var(obj);
+
+	/* Parse from here as pdf_run_stream would have done, then go back
+	 * and lex the tokens inside for when it meets them in text. */
+	fz_try(ctx)
+	{
+		if (ct->type == PDF_TOK_OPEN_ARRAY)
+			obj = pdf_parse_array(csi->xref, file, buf);
+		else
+			obj = pdf_parse_dict(csi->xref, file, buf);
+	}
+	fz_catch(ctx)
+	{
+		/* A NULL object replays the failure */
+		obj = NULL;
+	}
+	ct->kind = PDF_RES_OBJECT;
+	ct->ptr = obj;
+	ct->u.i = fz_tell(file);
+	ct->len = buf->size;
+	cc->size += ct->u.i - ct->end;
+	fz_seek(file, ct->end, 0);
+}
+
+static pdf_compiled_contents *
+pdf_compile_contents(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents, fz_buffer *data)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_compiled_contents *cc;
+	pdf_content_token *ct;
+	pdf_lexbuf *buf = NULL;
+	fz_stream *file = NULL;
+	pdf_token tok;
+	int last_name = -1;
+	int depth = 0;
+	int key;
+
+	fz_var(buf);
+	fz_var(file);
+	fz_var(last_name);
+	fz_var(depth);
+
+	cc = pdf_new_compiled_contents(ctx, rdb, contents);
+
+	fz_try(ctx)
+	{
+		/* Lex with the same buffer size as pdf_run_contents_stream
+		 * so that over-long names are truncated identically. */
+		buf = fz_malloc(ctx, sizeof(*buf));
+		pdf_lexbuf_init(ctx, buf, PDF_LEXBUF_SMALL);
+		file = fz_open_buffer(ctx, data);
+
+		do
+		{
+			tok = pdf_lex(file, buf);
+			ct = pdf_add_content_token(ctx, cc, tok);
+
+			switch (tok)
+			{
+			case PDF_TOK_INT:
+				ct->u.i = buf->i;
+				break;
+			case PDF_TOK_REAL:
+				ct->u.f = buf->f;
+				break;
+			case PDF_TOK_STRING:
+				ct->len = buf->len;
+				ct->u.text = pdf_add_content_text(ctx, cc, buf->scratch, buf->len);
+				break;
+			case PDF_TOK_NAME:
+				if (depth == 0)
+					last_name = cc->len - 1;
+				/* fallthrough */
+			case PDF_TOK_KEYWORD:
+				ct->len = strlen(buf->scratch);
+				ct->u.text = pdf_add_content_text(ctx, cc, buf->scratch, ct->len);
+				break;
+			case PDF_TOK_OPEN_ARRAY:
+			case PDF_TOK_OPEN_DICT:
+				depth++;
+				ct->end = fz_tell(file);
+				pdf_compile_object(csi, cc, ct, file, buf);
+				break;
+			case PDF_TOK_CLOSE_ARRAY:
+			case PDF_TOK_CLOSE_DICT:
+				if (depth > 0)
+					depth--;
+				break;
+			default:
+				break;
+			}
+			ct->end = fz_tell(file);
+
+			if (tok == PDF_TOK_KEYWORD)
+			{
+				key = pdf_keyword_key(buf->scratch);
+				if (last_name >= 0 && pdf_keyword_resource(key))
+					pdf_compile_resource(cc, rdb, &cc->tok[last_name], pdf_keyword_resource(key));
+				if (key == B('B','I'))
+					pdf_compile_inline_image(csi, rdb, cc, ct, file);
+				last_name = -1;
+				depth = 0;
+			}
+		}
+		while (tok != PDF_TOK_EOF && tok != PDF_TOK_ENDSTREAM);
+	}
+	fz_always(ctx)
+	{
+		fz_close(file);
+		pdf_lexbuf_fin(buf);
+		fz_free(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		pdf_free_compiled_contents_imp(ctx, &cc->storable);
+		fz_rethrow(ctx);
+	}
+
+	cc->size += cc->cap * sizeof(*cc->tok) + cc->text_cap;
+	return cc;
+}
+
+/* Read the stream as the lexer would, so that one that fails to decode
+ * ends exactly where interpreting it directly would stop. */
+static fz_buffer *
+pdf_read_contents(fz_context *ctx, fz_stream *file)
+{
+	fz_buffer *buf;
+	int n;
+
+	buf = fz_new_buffer(ctx, 1024);
+	fz_try(ctx)
+	{
+		while (fz_peek_byte(file) != EOF)
+		{
+			n = file->wp - file->rp;
+			if (buf->len + n > MAX_COMPILED_CONTENTS)
+				fz_throw(ctx, "content stream too large to compile");
+			while (buf->len + n > buf->cap)
+				fz_grow_buffer(ctx, buf);
+			memcpy(buf->data + buf->len, file->rp, n);
+			buf->len += n;
+			file->rp = file->wp;
+		}
+	}
+	fz_catch(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+		fz_rethrow(ctx);
+	}
+	return buf;
+}
+
+/* Returns the compiled contents, or NULL to interpret them directly. When
+ * compiling fails *datap is what we decoded, to interpret instead of
+ * decoding the stream a second time. */
+static pdf_compiled_contents *
+pdf_load_compiled_contents(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents, fz_buffer **datap)
+{
+	fz_context *ctx = csi->dev->ctx;
+	pdf_compiled_contents *cc = NULL;
+	fz_stream *file;
+	fz_buffer *data = NULL;
+
+	*datap = NULL;
+
+	if ((cc = pdf_find_item(ctx, pdf_free_compiled_contents_imp, contents)))
+	{
+		int same = (cc->rdb == rdb);
+		if (same && cc->len > 0)
+			return cc;
+		pdf_drop_compiled_contents(ctx, cc);
+		cc = NULL;
+		if (same)
+			return NULL;
+		/* Compiled against other resources; replace it */
+		pdf_remove_item(ctx, pdf_free_compiled_contents_imp, contents);
+	}
+
+	/* Leave missing streams to pdf_open_contents_stream to report */
+	if (!pdf_is_array(contents) && !pdf_is_stream(csi->xref, pdf_to_num(contents), pdf_to_gen(contents)))
+		return NULL;
+
+	file = pdf_open_contents_stream(csi->xref, contents);
+	if (file == NULL)
+		return NULL;
+
+	fz_var(data);
+	fz_var(cc);
+
+	fz_try(ctx)
+	{
+		data = pdf_read_contents(ctx, file);
+		cc = pdf_compile_contents(csi, rdb, contents, data);
+	}
+	fz_always(ctx)
+	{
+		fz_close(file);
+	}
+	fz_catch(ctx)
+	{
+		cc = NULL;
+	}
+
+	if (cc)
+	{
+		fz_drop_buffer(ctx, data);
+		data = NULL;
+	}
+	else
+	{
+		fz_try(ctx)
+		{
+			cc = pdf_new_compiled_contents(ctx, rdb, contents);
+		}
+		fz_catch(ctx)
+		{
+			*datap = data;
+			return NULL;
+		}
+	}
+
+	pdf_store_item(ctx, contents, cc, cc->size);
+
+	if (cc->len == 0)
+	{
+		pdf_drop_compiled_contents(ctx, cc);
+		*datap = data;
+		return NULL;
+	}
+	return cc;
+}
+
+/* Get file ready to lex the decoded data from ofs, decoding the stream
+ * again if we have nothing open at or before it. */
+static void
+pdf_seek_compiled_contents(pdf_csi *csi, pdf_compiled_contents *cc, fz_stream **filep, int ofs)
+{
+	if (*filep == NULL || fz_tell(*filep) > ofs)
+	{
+		fz_close(*filep);
+		*filep = NULL;
+		*filep = pdf_open_contents_stream(csi->xref, cc->contents);
+		if (*filep == NULL)
+			return;
+	}
+	fz_seek(*filep, ofs, 0);
+}
+
+static pdf_token
+pdf_replay_token(pdf_compiled_contents *cc, pdf_content_token *ct, pdf_lexbuf *buf)
+{
+	switch (ct->type)
+	{
+	case PDF_TOK_INT:
+		buf->i = ct->u.i;
+		break;
+	case PDF_TOK_REAL:
+		buf->f = ct->u.f;
+		break;
+	case PDF_TOK_NAME:
+	case PDF_TOK_STRING:
+	case PDF_TOK_KEYWORD:
+		/* grow as the lexer would have done */
+		while (ct->len >= buf->size)
+			pdf_lexbuf_grow(buf);
+		memcpy(buf->scratch, cc->text + ct->u.text, ct->len + 1);
+		buf->len = ct->len;
+		break;
+	}
+	return ct->type;
+}
+
+/* Find where replay resumes after something has read the data up to ofs,
+ * or -1 if we have to carry on lexing from there. */
+static int
+pdf_find_content_token(pdf_compiled_contents *cc, int ofs)
+{
+	int l = 0;
+	int r = cc->len - 1;
+
+	while (l < r)
+	{
+		int m = (l + r) >> 1;
+		if (cc->tok[m].end < ofs)
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	/* The tokens after BI follow the image data, not the keyword */
+	if (l >= cc->len - 1 || cc->tok[l].end != ofs || cc->tok[l].kind == PDF_RES_INLINE_IMAGE)
+		return -1;
+	return l + 1;
+}
+
+/* Take the array or dictionary that starts at ct, as pdf_parse_array or
+ * pdf_parse_dict would have returned it, and resume after it. */
+static pdf_obj *
+pdf_replay_object(pdf_compiled_contents *cc, pdf_content_token *ct, pdf_lexbuf *buf, int *pc, int *ofs)
+{
+	/* grow as the parser would have done */
+	while (buf->size < ct->len)
+		pdf_lexbuf_grow(buf);
+	*pc = pdf_find_content_token(cc, ct->u.i);
+	*ofs = ct->u.i;
+	if (ct->ptr == NULL)
+		fz_throw(buf->ctx, "cannot parse %s", ct->type == PDF_TOK_OPEN_ARRAY ? "array" : "dict");
+	return pdf_keep_obj(ct->ptr);
+}
+
+static void
+pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf, pdf_compiled_contents *cc)
 {
 	fz_context *ctx = csi->dev->ctx;
 	pdf_token tok = PDF_TOK_ERROR;
+	pdf_content_token *ct = NULL;
 	int in_array;
 	int ignoring_errors = 0;
+	int pc, next = 0, ofs = -1;
 
 	/* make sure we have a clean slate if we come here from flush_text */
 	pdf_clear_stack(csi);
 	in_array = 0;
 
+	/* With compiled contents, pc is the next token to replay, or -1
+	 * while we are lexing from file. We open file ourselves, and only
+	 * when we need it; until then ofs is where lexing has to start. */
+	pc = cc ? 0 : -1;
+
+	fz_var(file);
 	fz_var(in_array);
 	fz_var(tok);
+	fz_var(ct);
+	fz_var(pc);
+	fz_var(next);
+	fz_var(ofs);
 
 	if (csi->cookie)
 	{
@@ -2641,7 +3658,30 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 					csi->cookie->progress++;
 				}
 
-				tok = pdf_lex(file, buf);
+				if (pc >= 0)
+				{
+					ct = &cc->tok[pc++];
+					tok = pdf_replay_token(cc, ct, buf);
+					if (ct->kind == PDF_RES_INLINE_IMAGE)
+					{
+						/* Unless the image is shown below, carry
+						 * on lexing after the BI keyword. */
+						next = pc;
+						pc = -1;
+						ofs = ct->end;
+					}
+				}
+				else
+				{
+					ct = NULL;
+					if (ofs >= 0)
+					{
+						int at = ofs;
+						ofs = -1;
+						pdf_seek_compiled_contents(csi, cc, &file, at);
+					}
+					tok = file ? pdf_lex(file, buf) : PDF_TOK_EOF;
+				}
 
 				if (in_array)
 				{
@@ -2691,7 +3731,14 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 							pdf_drop_obj(csi->obj);
 							csi->obj = NULL;
 						}
-						csi->obj = pdf_parse_array(csi->xref, file, buf);
+						if (ct)
+							csi->obj = pdf_replay_object(cc, ct, buf, &pc, &ofs);
+						else
+						{
+							csi->obj = pdf_parse_array(csi->xref, file, buf);
+							if (cc)
+								pc = pdf_find_content_token(cc, fz_tell(file));
+						}
 					}
 					else
 					{
@@ -2705,11 +3752,28 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 						pdf_drop_obj(csi->obj);
 						csi->obj = NULL;
 					}
-					csi->obj = pdf_parse_dict(csi->xref, file, buf);
+					if (ct)
+						csi->obj = pdf_replay_object(cc, ct, buf, &pc, &ofs);
+					else
+					{
+						csi->obj = pdf_parse_dict(csi->xref, file, buf);
+						if (cc)
+							pc = pdf_find_content_token(cc, fz_tell(file));
+					}
 					break;
 
 				case PDF_TOK_NAME:
 					fz_strlcpy(csi->name, buf->scratch, sizeof(csi->name));
+					if (ct && ct->ptr)
+					{
+						csi->res = ct->ptr;
+						csi->res_kind = ct->kind;
+					}
+					else
+					{
+						csi->res = NULL;
+						csi->res_kind = PDF_RES_NONE;
+					}
 					break;
 
 				case PDF_TOK_INT:
@@ -2748,7 +3812,16 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 					break;
 
 				case PDF_TOK_KEYWORD:
-					if (pdf_run_keyword(csi, rdb, file, buf->scratch))
+					if (ct && ct->kind == PDF_RES_INLINE_IMAGE)
+					{
+						pdf_content_image *ci = ct->ptr;
+						/* If showing it fails we lex on from the
+						 * end of the image data, like pdf_run_BI. */
+						ofs = ci->data_end;
+						pdf_show_image(csi, ci->image);
+						pc = next;
+					}
+					else if (pdf_run_keyword(csi, rdb, file, buf->scratch))
 					{
 						tok = PDF_TOK_EOF;
 					}
@@ -2774,9 +3847,18 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
 			/* If we do catch an error, then reset ourselves to a
 			 * base lexing state */
 			in_array = 0;
+			if (cc && pc < 0)
+			{
+				if (ofs < 0)
+					ofs = file ? fz_tell(file) : -1;
+				pc = pdf_find_content_token(cc, ofs);
+			}
 		}
 	}
 	while (tok != PDF_TOK_EOF);
+
+	if (cc)
+		fz_close(file);
 }
 
 /*
@@ -2784,7 +3866,7 @@ pdf_run_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_lexbuf *buf)
  */
 
 static void
-pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
+pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file, pdf_compiled_contents *cc)
 {
 	fz_context *ctx = csi->dev->ctx;
 	pdf_lexbuf *buf;
@@ -2793,7 +3875,7 @@ pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 
 	fz_var(buf);
 
-	if (file == NULL)
+	if (file == NULL && cc == NULL)
 		return;
 
 	buf = fz_malloc(ctx, sizeof(*buf)); /* we must be re-entrant for type3 fonts */
@@ -2804,7 +3886,7 @@ pdf_run_contents_stream(pdf_csi *csi, pdf_obj *rdb, fz_stream *file)
 	csi->gbot = csi->gtop;
 	fz_try(ctx)
 	{
-		pdf_run_stream(csi, rdb, file, buf);
+		pdf_run_stream(csi, rdb, file, buf, cc);
 	}
 	fz_catch(ctx)
 	{
@@ -2822,19 +3904,30 @@ static void
 pdf_run_contents_object(pdf_csi *csi, pdf_obj *rdb, pdf_obj *contents)
 {
 	fz_context *ctx = csi->dev->ctx;
+	pdf_compiled_contents *cc;
+	fz_buffer *data;
 	fz_stream *file = NULL;
 
 	if (contents == NULL)
 		return;
 
-	file = pdf_open_contents_stream(csi->xref, contents);
+	cc = pdf_load_compiled_contents(csi, rdb, contents, &data);
+
+	fz_var(file);
+
 	fz_try(ctx)
 	{
-		pdf_run_contents_stream(csi, rdb, file);
+		if (data)
+			file = fz_open_buffer(ctx, data);
+		else if (!cc)
+			file = pdf_open_contents_stream(csi->xref, contents);
+		pdf_run_contents_stream(csi, rdb, file, cc);
 	}
 	fz_always(ctx)
 	{
 		fz_close(file);
+		fz_drop_buffer(ctx, data);
+		pdf_drop_compiled_contents(ctx, cc);
 	}
 	fz_catch(ctx)
 	{
@@ -2854,7 +3947,7 @@ pdf_run_contents_buffer(pdf_csi *csi, pdf_obj *rdb, fz_buffer *contents)
 	file = fz_open_buffer(ctx, contents);
 	fz_try(ctx)
 	{
-		pdf_run_contents_stream(csi, rdb, file);
+		pdf_run_contents_stream(csi, rdb, file, NULL);
 	}
 	fz_always(ctx)
 	{
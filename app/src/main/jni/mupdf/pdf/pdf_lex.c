@@ -23,16 +23,39 @@
 #define RANGE_A_F \
 	'A':case'B':case'C':case'D':case'E':case'F'
 
-static inline int iswhite(int ch)
+/*
+ * Character classes, indexed by byte value. A byte can be in several
+ * classes at once; the table lets the hot loops below test a class with
+ * a single load instead of a chain of comparisons.
+ */
+enum
 {
-	return
-		ch == '\000' ||
-		ch == '\011' ||
-		ch == '\012' ||
-		ch == '\014' ||
-		ch == '\015' ||
-		ch == '\040';
-}
+	CC_WHITE = 1,	/* PDF whitespace */
+	CC_DELIM = 2,	/* PDF delimiter */
+	CC_DIGIT = 4,	/* 0-9 */
+	CC_NAME = 8,	/* may be copied verbatim into a name or keyword */
+	CC_STRING = 16	/* may be copied verbatim into a literal string */
+};
+
+static const unsigned char pdf_cc[256] =
+{
+	0x11, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x11, 0x11, 0x18, 0x11, 0x11, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x11, 0x18, 0x18, 0x10, 0x18, 0x12, 0x18, 0x18, 0x02, 0x02, 0x18, 0x18, 0x18, 0x18, 0x18, 0x12,
+	0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x1c, 0x18, 0x18, 0x12, 0x18, 0x12, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x12, 0x08, 0x12, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x12, 0x18, 0x12, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+	0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18,
+};
 
 static inline int unhex(int ch)
 {
@@ -42,24 +65,110 @@ static inline int unhex(int ch)
 	return 0;
 }
 
+/*
+ * The lexer works directly on the buffer window of the stream
+ * (f->rp .. f->wp) where it can, and only falls back to reading a byte
+ * at a time through fz_read_byte when it runs into the end of the window.
+ */
+
 static void
 lex_white(fz_stream *f)
 {
 	int c;
-	do {
-		c = fz_read_byte(f);
-	} while ((c <= 32) && (iswhite(c)));
-	if (c != EOF)
-		fz_unread_byte(f);
+	while (1)
+	{
+		unsigned char *p = f->rp;
+		unsigned char *e = f->wp;
+		while (p < e && (pdf_cc[*p] & CC_WHITE))
+			p++;
+		f->rp = p;
+		if (p < e)
+			return;
+		c = fz_peek_byte(f);
+		if (c == EOF || !(pdf_cc[c] & CC_WHITE))
+			return;
+	}
 }
 
 static void
 lex_comment(fz_stream *f)
 {
 	int c;
-	do {
+	while (1)
+	{
+		unsigned char *p = f->rp;
+		unsigned char *e = f->wp;
+		while (p < e && *p != '\012' && *p != '\015')
+			p++;
+		if (p < e)
+		{
+			f->rp = p + 1;
+			return;
+		}
+		f->rp = p;
 		c = fz_read_byte(f);
-	} while ((c != '\012') && (c != '\015') && (c != EOF));
+		if (c == '\012' || c == '\015' || c == EOF)
+			return;
+	}
+}
+
+/*
+ * Parse a number lying entirely inside the buffer window. The first
+ * character has already been consumed and is passed in c. Returns
+ * PDF_TOK_ERROR without consuming anything if the number runs up to the
+ * end of the window, in which case the caller uses the byte-at-a-time
+ * parser instead. The arithmetic mirrors that of lex_number exactly.
+ */
+static int
+lex_number_fast(fz_stream *f, pdf_lexbuf *buf, int c)
+{
+	unsigned char *p = f->rp;
+	unsigned char *e = f->wp;
+	int neg = 0;
+	int i = 0;
+	int n = 0;
+	int d = 1;
+	float v;
+
+	if (c == '-')
+		neg = 1;
+	else if (c != '+' && c != '.')
+		i = c - '0';
+
+	if (c != '.')
+	{
+		while (p < e && (pdf_cc[*p] & CC_DIGIT))
+			i = 10*i + (*p++ - '0');
+		if (p == e)
+			return PDF_TOK_ERROR;
+		if (*p != '.')
+		{
+			f->rp = p;
+			buf->i = neg ? -i : i;
+			return PDF_TOK_INT;
+		}
+		p++;
+	}
+
+	while (p < e && (pdf_cc[*p] & CC_DIGIT))
+	{
+		if (d >= INT_MAX/10)
+			break;
+		n = n*10 + (*p++ - '0');
+		d *= 10;
+	}
+	/* Ignore any digits after here, because they are too small */
+	while (p < e && (pdf_cc[*p] & CC_DIGIT))
+		p++;
+	if (p == e)
+		return PDF_TOK_ERROR;
+
+	f->rp = p;
+	v = (float)i + ((float)n / (float)d);
+	if (neg)
+		v = -v;
+	buf->f = v;
+	return PDF_TOK_REAL;
 }
 
 static int
@@ -70,6 +179,11 @@ lex_number(fz_stream *f, pdf_lexbuf *buf, int c)
 	int n;
 	int d;
 	float v;
+	int tok;
+
+	tok = lex_number_fast(f, buf, c);
+	if (tok != PDF_TOK_ERROR)
+		return tok;
 
 	/* Initially we might have +, -, . or a digit */
 	switch (c)
@@ -165,7 +279,21 @@ lex_name(fz_stream *f, pdf_lexbuf *buf)
 
 	while (n > 1)
 	{
-		int c = fz_read_byte(f);
+		unsigned char *p = f->rp;
+		unsigned char *e = f->wp;
+		int c;
+
+		/* Copy plain name characters straight out of the buffer */
+		if (e - p > n - 1)
+			e = p + n - 1;
+		while (p < e && (pdf_cc[*p] & CC_NAME))
+			*s++ = *p++;
+		n -= p - f->rp;
+		f->rp = p;
+		if (n <= 1)
+			break;
+
+		c = fz_read_byte(f);
 		switch (c)
 		{
 		case IS_WHITE:
@@ -241,11 +369,25 @@ lex_string(fz_stream *f, pdf_lexbuf *lb)
 
 	while (1)
 	{
+		unsigned char *p, *pe;
+
 		if (s == e)
 		{
 			s += pdf_lexbuf_grow(lb);
 			e = lb->scratch + lb->size;
 		}
+
+		/* Copy runs of ordinary characters straight out of the buffer */
+		p = f->rp;
+		pe = f->wp;
+		if (pe - p > e - s)
+			pe = p + (e - s);
+		while (p < pe && (pdf_cc[*p] & CC_STRING))
+			*s++ = *p++;
+		f->rp = p;
+		if (s == e)
+			continue;
+
 		c = fz_read_byte(f);
 		switch (c)
 		{
@@ -447,7 +589,15 @@ pdf_lex(fz_stream *f, pdf_lexbuf *buf)
 {
 	while (1)
 	{
-		int c = fz_read_byte(f);
+		unsigned char *p = f->rp;
+		int c;
+
+		/* Skip separating whitespace without leaving the buffer */
+		while (p < f->wp && (pdf_cc[*p] & CC_WHITE))
+			p++;
+		f->rp = p;
+
+		c = fz_read_byte(f);
 		switch (c)
 		{
 		case EOF:
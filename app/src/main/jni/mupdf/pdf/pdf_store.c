@@ -76,3 +76,9 @@ pdf_remove_item(fz_context *ctx, fz_store_free_fn *free, pdf_obj *key)
 	fz_remove_item(ctx, free, key, &pdf_obj_store_type);
 }
 
+void
+pdf_filter_store(fz_context *ctx, fz_store_free_fn *free, fz_store_filter_fn *fn, void *arg)
+{
+	fz_filter_store(ctx, free, fn, arg, &pdf_obj_store_type);
+}
+
@@ -44,6 +44,49 @@ pdf_stream_has_crypt(fz_context *ctx, pdf_obj *stm)
 	return 0;
 }
 
+/*
+ * Load the JBIG2Globals of a JBIG2Decode filter. The decoded segments are
+ * kept in the store so that all the pages sharing them decode them once.
+ * Globals stored by another context are not usable here, so we decode a
+ * private copy and leave the stored one alone.
+ */
+static fz_jbig2_globals *
+pdf_load_jbig2_globals(pdf_document *xref, pdf_obj *dict)
+{
+	fz_context *ctx = xref->ctx;
+	fz_jbig2_globals *globals;
+	fz_buffer *buf = NULL;
+	int stored = 0;
+
+	if ((globals = pdf_find_item(ctx, fz_free_jbig2_globals_imp, dict)))
+	{
+		if (fz_jbig2_globals_usable(ctx, globals))
+			return globals;
+		fz_drop_jbig2_globals(ctx, globals);
+		stored = 1;
+	}
+
+	fz_var(buf);
+
+	fz_try(ctx)
+	{
+		buf = pdf_load_stream(xref, pdf_to_num(dict), pdf_to_gen(dict));
+		globals = fz_load_jbig2_globals(ctx, buf);
+		if (!stored)
+			pdf_store_item(ctx, dict, globals, fz_jbig2_globals_size(globals));
+	}
+	fz_always(ctx)
+	{
+		fz_drop_buffer(ctx, buf);
+	}
+	fz_catch(ctx)
+	{
+		fz_rethrow(ctx);
+	}
+
+	return globals;
+}
+
 /*
  * Create a filter given a name and param dictionary.
  */
@@ -159,16 +202,31 @@ build_filter(fz_stream *chain, pdf_document * xref, pdf_obj * f, pdf_obj * p, in
 
 	else if (!strcmp(s, "JBIG2Decode"))
 	{
-		fz_buffer *globals = NULL;
+		fz_jbig2_globals *globals = NULL;
 		pdf_obj *obj = pdf_dict_gets(p, "JBIG2Globals");
 		if (obj)
-			globals = pdf_load_stream(xref, pdf_to_num(obj), pdf_to_gen(obj));
+		{
+			fz_try(ctx)
+			{
+				globals = pdf_load_jbig2_globals(xref, obj);
+			}
+			fz_catch(ctx)
+			{
+				fz_close(chain);
+				fz_rethrow(ctx);
+			}
+		}
 		/* fz_open_jbig2d takes possession of globals */
 		return fz_open_jbig2d(chain, globals);
 	}
 
 	else if (!strcmp(s, "JPXDecode"))
-		return chain; /* JPX decoding is special cased in the image loading code */
+	{
+		/* JPX decoding is special cased in the image loading code */
+		if (params)
+			params->type = FZ_IMAGE_JPX;
+		return chain;
+	}
 
 	else if (!strcmp(s, "Crypt"))
 	{
@@ -1220,10 +1220,26 @@ pdf_update_object(pdf_document *xref, int num, pdf_obj *newobj)
 	x->obj = pdf_keep_obj(newobj);
 }
 
+static int
+pdf_contents_array_uses(void *ref, void *key)
+{
+	pdf_obj *contents = (pdf_obj *)key;
+	int i, n;
+
+	if (!pdf_is_array(contents))
+		return 0;
+	n = pdf_array_len(contents);
+	for (i = 0; i < n; i++)
+		if (!pdf_objcmp(pdf_array_get(contents, i), ref))
+			return 1;
+	return 0;
+}
+
 void
 pdf_update_stream(pdf_document *xref, int num, fz_buffer *newbuf)
 {
 	pdf_xref_entry *x;
+	pdf_obj *ref;
 
 	if (num < 0 || num >= xref->len)
 	{
@@ -1235,6 +1251,13 @@ pdf_update_stream(pdf_document *xref, int num, fz_buffer *newbuf)
 
 	fz_drop_buffer(xref->ctx, x->stm_buf);
 	x->stm_buf = fz_keep_buffer(xref->ctx, newbuf);
+
+	/* Forget any compiled version of the old contents, on its own or
+	 * as part of a /Contents array */
+	ref = pdf_new_indirect(xref->ctx, num, x->gen, xref);
+	pdf_remove_item(xref->ctx, pdf_free_compiled_contents_imp, ref);
+	pdf_filter_store(xref->ctx, pdf_free_compiled_contents_imp, pdf_contents_array_uses, ref);
+	pdf_drop_obj(ref);
 }
 
 int
@@ -2,7 +2,7 @@ LOCAL_PATH:= $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_CFLAGS := -O3
+LOCAL_CFLAGS := -O3 -DHAVE_PTHREADS
 LOCAL_ARM_MODE := arm
 
 LOCAL_MODULE    := openjpeg
@@ -26,12 +26,20 @@ LOCAL_SRC_FILES := \
 	t2.c \
 	tcd.c \
 	tgt.c \
+	thread.c \
 	cidx_manager.c \
 	tpix_manager.c \
 	ppix_manager.c \
 	thix_manager.c \
 	phix_manager.c
 
+# NEON is optional on ARMv7: build only the SIMD kernels with it, and let
+# simd_init check for it at run time.
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_SRC_FILES += simd.c.neon
+else
+LOCAL_SRC_FILES += simd.c
+endif
 
 include $(BUILD_STATIC_LIBRARY)
 
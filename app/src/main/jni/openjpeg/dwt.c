@@ -268,6 +268,40 @@ static void dwt_decode_1(dwt_t *v) {
 	dwt_decode_1_(v->mem, v->dn, v->sn, v->cas);
 }
 
+#define S4(i) w[(i)*8+l]
+#define D4(i) w[(i)*8+4+l]
+#define S4_(i) ((i)<0?S4(0):((i)>=sn?S4(sn-1):S4(i)))
+#define D4_(i) ((i)<0?D4(0):((i)>=dn?D4(dn-1):D4(i)))
+#define SS4_(i) ((i)<0?S4(0):((i)>=dn?S4(dn-1):S4(i)))
+#define DD4_(i) ((i)<0?D4(0):((i)>=sn?D4(sn-1):D4(i)))
+
+/* <summary>                                                     */
+/* Inverse 5-3 wavelet transform in 1-D of four signals at once. */
+/* Sample k of signal l is w[k*4+l].                             */
+/* </summary>                                                    */
+static void dwt_decode_1_v4(int *w, int dn, int sn, int cas) {
+	int i, l;
+
+	if (simd_funcs.dwt_decode_1_v4) {
+		simd_funcs.dwt_decode_1_v4(w, dn, sn, cas);
+		return;
+	}
+
+	if (!cas) {
+		if ((dn > 0) || (sn > 1)) { /* NEW :  CASE ONE ELEMENT */
+			for (i = 0; i < sn; i++) for (l = 0; l < 4; l++) S4(i) -= (D4_(i - 1) + D4_(i) + 2) >> 2;
+			for (i = 0; i < dn; i++) for (l = 0; l < 4; l++) D4(i) += (S4_(i) + S4_(i + 1)) >> 1;
+		}
+	} else {
+		if (!sn  && dn == 1) {        /* NEW :  CASE ONE ELEMENT */
+			for (l = 0; l < 4; l++) S4(0) /= 2;
+		} else {
+			for (i = 0; i < sn; i++) for (l = 0; l < 4; l++) D4(i) -= (SS4_(i) + SS4_(i + 1) + 2) >> 2;
+			for (i = 0; i < dn; i++) for (l = 0; l < 4; l++) S4(i) += (DD4_(i) + DD4_(i - 1)) >> 1;
+		}
+	}
+}
+
 /* <summary>                             */
 /* Forward 9-7 wavelet transform in 1-D. */
 /* </summary>                            */
@@ -519,20 +553,24 @@ static int dwt_decode_max_resolution(opj_tcd_resolution_t* restrict r, int i) {
 static void dwt_decode_tile(opj_tcd_tilecomp_t* tilec, int numres, DWT1DFN dwt_1D) {
 	dwt_t h;
 	dwt_t v;
+	int *mem4;
 
 	opj_tcd_resolution_t* tr = tilec->resolutions;
 
 	int rw = tr->x1 - tr->x0;	/* width of the resolution level computed */
 	int rh = tr->y1 - tr->y0;	/* height of the resolution level computed */
 
-	int w = tilec->x1 - tilec->x0;
+	int w = tilec->data_w;
 
-	h.mem = (int*)opj_aligned_malloc(dwt_decode_max_resolution(tr, numres) * sizeof(int));
+	/* Rows and columns are transformed four at a time where they can be, */
+	/* which keeps the column pass walking along rows of the data.        */
+	mem4 = (int*)opj_aligned_malloc(dwt_decode_max_resolution(tr, numres) * 4 * sizeof(int));
+	h.mem = mem4;
 	v.mem = h.mem;
 
 	while( --numres) {
 		int * restrict tiledp = tilec->data;
-		int j;
+		int j, k;
 
 		++tr;
 		h.sn = rw;
@@ -544,7 +582,31 @@ static void dwt_decode_tile(opj_tcd_tilecomp_t* tilec, int numres, DWT1DFN dwt_1
 		h.dn = rw - h.sn;
 		h.cas = tr->x0 % 2;
 
-		for(j = 0; j < rh; ++j) {
+		for(j = 0; j + 4 <= rh; j += 4) {
+			int *a = &tiledp[j*w];
+			for(k = 0; k < h.sn; ++k) {
+				int *m = &mem4[(h.cas + 2*k) * 4];
+				m[0] = a[k];
+				m[1] = a[k + w];
+				m[2] = a[k + w*2];
+				m[3] = a[k + w*3];
+			}
+			for(k = 0; k < h.dn; ++k) {
+				int *m = &mem4[(1 - h.cas + 2*k) * 4];
+				m[0] = a[h.sn + k];
+				m[1] = a[h.sn + k + w];
+				m[2] = a[h.sn + k + w*2];
+				m[3] = a[h.sn + k + w*3];
+			}
+			dwt_decode_1_v4(mem4, h.dn, h.sn, h.cas);
+			for(k = 0; k < rw; ++k) {
+				a[k] = mem4[k*4];
+				a[k + w] = mem4[k*4 + 1];
+				a[k + w*2] = mem4[k*4 + 2];
+				a[k + w*3] = mem4[k*4 + 3];
+			}
+		}
+		for(; j < rh; ++j) {
 			dwt_interleave_h(&h, &tiledp[j*w]);
 			(dwt_1D)(&h);
 			memcpy(&tiledp[j*w], h.mem, rw * sizeof(int));
@@ -553,8 +615,17 @@ static void dwt_decode_tile(opj_tcd_tilecomp_t* tilec, int numres, DWT1DFN dwt_1
 		v.dn = rh - v.sn;
 		v.cas = tr->y0 % 2;
 
-		for(j = 0; j < rw; ++j){
-			int k;
+		for(j = 0; j + 4 <= rw; j += 4) {
+			int *a = &tiledp[j];
+			for(k = 0; k < v.sn; ++k)
+				memcpy(&mem4[(v.cas + 2*k) * 4], &a[k*w], 4 * sizeof(int));
+			for(k = 0; k < v.dn; ++k)
+				memcpy(&mem4[(1 - v.cas + 2*k) * 4], &a[(v.sn + k)*w], 4 * sizeof(int));
+			dwt_decode_1_v4(mem4, v.dn, v.sn, v.cas);
+			for(k = 0; k < rh; ++k)
+				memcpy(&a[k*w], &mem4[k*4], 4 * sizeof(int));
+		}
+		for(; j < rw; ++j){
 			dwt_interleave_v(&v, &tiledp[j], w);
 			(dwt_1D)(&v);
 			for(k = 0; k < rh; ++k) {
@@ -562,7 +633,7 @@ static void dwt_decode_tile(opj_tcd_tilecomp_t* tilec, int numres, DWT1DFN dwt_1
 			}
 		}
 	}
-	opj_aligned_free(h.mem);
+	opj_aligned_free(mem4);
 }
 
 static void v4dwt_interleave_h(v4dwt_t* restrict w, float* restrict a, int x, int size){
@@ -760,6 +831,15 @@ static void v4dwt_decode(v4dwt_t* restrict dwt){
 	v4dwt_decode_step2_sse(dwt->wavelet+b, dwt->wavelet+a+1, dwt->sn, int_min(dwt->sn, dwt->dn-a), _mm_set1_ps(dwt_beta));
 	v4dwt_decode_step2_sse(dwt->wavelet+a, dwt->wavelet+b+1, dwt->dn, int_min(dwt->dn, dwt->sn-b), _mm_set1_ps(dwt_alpha));
 #else
+	if (simd_funcs.v4dwt_decode_step2) {
+		simd_funcs.v4dwt_decode_step1((float*) (dwt->wavelet+a), dwt->sn, K);
+		simd_funcs.v4dwt_decode_step1((float*) (dwt->wavelet+b), dwt->dn, c13318);
+		simd_funcs.v4dwt_decode_step2((float*) (dwt->wavelet+b), (float*) (dwt->wavelet+a+1), dwt->sn, int_min(dwt->sn, dwt->dn-a), dwt_delta);
+		simd_funcs.v4dwt_decode_step2((float*) (dwt->wavelet+a), (float*) (dwt->wavelet+b+1), dwt->dn, int_min(dwt->dn, dwt->sn-b), dwt_gamma);
+		simd_funcs.v4dwt_decode_step2((float*) (dwt->wavelet+b), (float*) (dwt->wavelet+a+1), dwt->sn, int_min(dwt->sn, dwt->dn-a), dwt_beta);
+		simd_funcs.v4dwt_decode_step2((float*) (dwt->wavelet+a), (float*) (dwt->wavelet+b+1), dwt->dn, int_min(dwt->dn, dwt->sn-b), dwt_alpha);
+		return;
+	}
 	v4dwt_decode_step1(dwt->wavelet+a, dwt->sn, K);
 	v4dwt_decode_step1(dwt->wavelet+b, dwt->dn, c13318);
 	v4dwt_decode_step2(dwt->wavelet+b, dwt->wavelet+a+1, dwt->sn, int_min(dwt->sn, dwt->dn-a), dwt_delta);
@@ -781,14 +861,14 @@ void dwt_decode_real(opj_tcd_tilecomp_t* restrict tilec, int numres){
 	int rw = res->x1 - res->x0;	/* width of the resolution level computed */
 	int rh = res->y1 - res->y0;	/* height of the resolution level computed */
 
-	int w = tilec->x1 - tilec->x0;
+	int w = tilec->data_w;
 
 	h.wavelet = (v4*) opj_aligned_malloc((dwt_decode_max_resolution(res, numres)+5) * sizeof(v4));
 	v.wavelet = h.wavelet;
 
 	while( --numres) {
 		float * restrict aj = (float*) tilec->data;
-		int bufsize = (tilec->x1 - tilec->x0) * (tilec->y1 - tilec->y0);
+		int bufsize = tilec->data_w * tilec->data_h;
 		int j;
 
 		h.sn = rw;
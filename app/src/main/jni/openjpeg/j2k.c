@@ -688,11 +688,15 @@ static void j2k_read_cox(opj_j2k_t *j2k, int compno) {
 
 	tccp->numresolutions = cio_read(cio, 1) + 1;	/* SPcox (D) */
 
-	/* If user wants to remove more resolutions than the codestream contains, return error*/
-	if (cp->reduce >= tccp->numresolutions) {
-		opj_event_msg(j2k->cinfo, EVT_ERROR, "Error decoding component %d.\nThe number of resolutions to remove is higher than the number "
-					"of resolutions of this component\nModify the cp_reduce parameter.\n\n", compno);
-		j2k->state |= J2K_STATE_ERR;
+	/* If user wants to remove more resolutions than the codestream contains, keep the lowest one */
+	if (cp->reduce >= tccp->numresolutions && tccp->numresolutions > 0) {
+		opj_image_t *image = j2k->image;
+		opj_event_msg(j2k->cinfo, EVT_INFO, "Component %d has only %d resolutions; reducing by %d instead of %d.\n",
+					compno, tccp->numresolutions, tccp->numresolutions - 1, cp->reduce);
+		cp->reduce = tccp->numresolutions - 1;
+		for (i = 0; i < image->numcomps; i++) {
+			image->comps[i].factor = cp->reduce;
+		}
 	}
   if( tccp->numresolutions > J2K_MAXRLVLS ) {
     opj_event_msg(j2k->cinfo, EVT_ERROR, "Error decoding component %d.\nThe number of resolutions is too big: %d vs max= %d. Truncating.\n\n",
@@ -1615,6 +1619,12 @@ static void j2k_read_eoc(opj_j2k_t *j2k) {
 		opj_tcd_t *tcd = tcd_create(j2k->cinfo);
 		tcd_malloc_decode(tcd, j2k->image, j2k->cp);
 		for (i = 0; i < j2k->cp->tileno_size; i++) {
+			if (!tcd_tile_in_area(j2k->cp, j2k->image, j2k->cp->tileno[i])) {
+				tileno = j2k->cp->tileno[i];
+				opj_free(j2k->tile_data[tileno]);
+				j2k->tile_data[tileno] = NULL;
+				continue;
+			}
 			tcd_malloc_decode_tile(tcd, j2k->image, j2k->cp, i, j2k->cstr_info);
 			if (j2k->cp->tileno[i] != -1)
 			{
@@ -1851,6 +1861,11 @@ void j2k_setup_decoder(opj_j2k_t *j2k, opj_dparameters_t *parameters) {
 		cp->reduce = parameters->cp_reduce;	
 		cp->layer = parameters->cp_layer;
 		cp->limit_decoding = parameters->cp_limit_decoding;
+		cp->da_x0 = parameters->cp_da_x0;
+		cp->da_y0 = parameters->cp_da_y0;
+		cp->da_x1 = parameters->cp_da_x1;
+		cp->da_y1 = parameters->cp_da_y1;
+		cp->threads = parameters->cp_threads;
 
 #ifdef USE_JPWL
 		cp->correct = parameters->jpwl_correct;
@@ -228,6 +228,13 @@ typedef struct opj_cp {
 	int layer;
 	/** if == NO_LIMITATION, decode entire codestream; if == LIMIT_TO_MAIN_HEADER then only decode the main header */
 	OPJ_LIMIT_DECODING limit_decoding;
+	/** decoding area, relative to the image origin; if empty, all tiles are decoded */
+	int da_x0;
+	int da_y0;
+	int da_x1;
+	int da_y1;
+	/** number of threads to decode code-blocks on; if <= 1, they are decoded in the calling thread */
+	int threads;
 	/** XTOsiz */
 	int tx0;
 	/** YTOsiz */
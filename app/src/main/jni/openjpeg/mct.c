@@ -78,6 +78,10 @@ void mct_decode(
 		int n)
 {
 	int i;
+	if (simd_funcs.mct_decode) {
+		simd_funcs.mct_decode(c0, c1, c2, n);
+		return;
+	}
 	for (i = 0; i < n; ++i) {
 		int y = c0[i];
 		int u = c1[i];
@@ -168,6 +172,11 @@ void mct_decode_real(
 		c2 += 4;
 	}
 	n &= 7;
+#else
+	if (simd_funcs.mct_decode_real) {
+		simd_funcs.mct_decode_real(c0, c1, c2, n);
+		return;
+	}
 #endif
 	for(i = 0; i < n; ++i) {
 		float y = c0[i];
@@ -66,6 +66,7 @@ opj_dinfo_t* OPJ_CALLCONV opj_create_decompress(OPJ_CODEC_FORMAT format) {
 	opj_dinfo_t *dinfo = (opj_dinfo_t*)opj_calloc(1, sizeof(opj_dinfo_t));
 	if(!dinfo) return NULL;
 	dinfo->is_decompressor = OPJ_TRUE;
+	simd_init();
 	switch(format) {
 		case CODEC_J2K:
 		case CODEC_JPT:
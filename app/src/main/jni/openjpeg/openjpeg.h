@@ -409,6 +409,22 @@ typedef struct opj_dparameters {
 	*/
 	OPJ_LIMIT_DECODING cp_limit_decoding;
 
+	/**
+	Decoding area, in pixels of the full resolution image counted from its top left corner.
+	Only the tiles that overlap the area are decoded, and the image returned covers just those
+	(the x0 and y0 of its components say where it lies). If the area is empty, all tiles are decoded.
+	*/
+	int cp_da_x0;
+	int cp_da_y0;
+	int cp_da_x1;
+	int cp_da_y1;
+
+	/**
+	Number of threads to decode code-blocks on, counting the calling thread.
+	if <= 1 or not used, the code-blocks are decoded in the calling thread
+	*/
+	int cp_threads;
+
 	unsigned int flags;
 } opj_dparameters_t;
 
@@ -731,6 +747,12 @@ extern "C" {
 
 OPJ_API const char * OPJ_CALLCONV opj_version(void);
 
+/**
+Get the number of processors online, for use as opj_dparameters_t.cp_threads
+@return Returns the number of processors, at least 1
+*/
+OPJ_API int OPJ_CALLCONV opj_get_num_cpus(void);
+
 /* 
 ==========================================================
    image functions definitions
@@ -120,11 +120,13 @@ static INLINE long lrintf(float f){
 #include "bio.h"
 #include "tgt.h"
 #include "pi.h"
+#include "thread.h"
 #include "tcd.h"
 #include "t1.h"
 #include "dwt.h"
 #include "t2.h"
 #include "mct.h"
+#include "simd.h"
 #include "int.h"
 #include "fix.h"
 
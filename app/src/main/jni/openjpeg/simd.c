@@ -0,0 +1,261 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS `AS IS'
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#if defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+#include "opj_includes.h"
+
+opj_simd_funcs_t simd_funcs;
+
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+
+/*
+Vectors of four 32-bit integers. The arithmetic is that of the C code in DWT.C
+and MCT.C (including the arithmetic right shifts), so the output is identical.
+*/
+
+#ifdef HAVE_SSE2
+
+typedef __m128i v4i;
+
+#define vi_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define vi_store(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define vi_splat(a) _mm_set1_epi32(a)
+#define vi_add(a, b) _mm_add_epi32(a, b)
+#define vi_sub(a, b) _mm_sub_epi32(a, b)
+#define vi_sra(a, n) _mm_srai_epi32(a, n)
+
+#else
+
+typedef int32x4_t v4i;
+
+#define vi_load(p) vld1q_s32((const int32_t *)(p))
+#define vi_store(p, v) vst1q_s32((int32_t *)(p), v)
+#define vi_splat(a) vdupq_n_s32(a)
+#define vi_add(a, b) vaddq_s32(a, b)
+#define vi_sub(a, b) vsubq_s32(a, b)
+#define vi_sra(a, n) vshrq_n_s32(a, n)
+
+#endif
+
+/*
+One lifting step of the inverse 5-3 transform on four interleaved signals:
+x(i) -= (y(i+off) + y(i+off+1) + 2) >> 2 for the update step, and
+x(i) += (y(i+off) + y(i+off+1)) >> 1 for the predict step, for i in [0, n),
+with the indices into y clamped to [0, m-1] as in DWT.C. Element i of x is
+the four integers at x + i*8 (the other signal is interleaved between).
+*/
+
+#define DWT_Y(j) ((j) < 0 ? 0 : (j) >= m ? m - 1 : (j))
+
+static void dwt_update_v4(int *x, const int *y, int n, int m, int off) {
+	v4i two = vi_splat(2);
+	int i, e;
+	for (i = 0; i < n && i < -off; i++) {
+		v4i s = vi_add(vi_load(y + DWT_Y(i + off) * 8), vi_load(y + DWT_Y(i + off + 1) * 8));
+		vi_store(x + i * 8, vi_sub(vi_load(x + i * 8), vi_sra(vi_add(s, two), 2)));
+	}
+	e = n < m - 1 - off ? n : m - 1 - off;
+	for (; i < e; i++) {
+		v4i s = vi_add(vi_load(y + (i + off) * 8), vi_load(y + (i + off + 1) * 8));
+		vi_store(x + i * 8, vi_sub(vi_load(x + i * 8), vi_sra(vi_add(s, two), 2)));
+	}
+	for (; i < n; i++) {
+		v4i s = vi_add(vi_load(y + DWT_Y(i + off) * 8), vi_load(y + DWT_Y(i + off + 1) * 8));
+		vi_store(x + i * 8, vi_sub(vi_load(x + i * 8), vi_sra(vi_add(s, two), 2)));
+	}
+}
+
+static void dwt_predict_v4(int *x, const int *y, int n, int m, int off) {
+	int i, e;
+	for (i = 0; i < n && i < -off; i++) {
+		v4i s = vi_add(vi_load(y + DWT_Y(i + off) * 8), vi_load(y + DWT_Y(i + off + 1) * 8));
+		vi_store(x + i * 8, vi_add(vi_load(x + i * 8), vi_sra(s, 1)));
+	}
+	e = n < m - 1 - off ? n : m - 1 - off;
+	for (; i < e; i++) {
+		v4i s = vi_add(vi_load(y + (i + off) * 8), vi_load(y + (i + off + 1) * 8));
+		vi_store(x + i * 8, vi_add(vi_load(x + i * 8), vi_sra(s, 1)));
+	}
+	for (; i < n; i++) {
+		v4i s = vi_add(vi_load(y + DWT_Y(i + off) * 8), vi_load(y + DWT_Y(i + off + 1) * 8));
+		vi_store(x + i * 8, vi_add(vi_load(x + i * 8), vi_sra(s, 1)));
+	}
+}
+
+#undef DWT_Y
+
+static void dwt_decode_1_v4_simd(int *w, int dn, int sn, int cas) {
+	if (!cas) {
+		if ((dn > 0) || (sn > 1)) {
+			dwt_update_v4(w, w + 4, sn, dn, -1);
+			dwt_predict_v4(w + 4, w, dn, sn, 0);
+		}
+	} else {
+		if (!sn && dn == 1) {
+			w[0] /= 2;
+			w[1] /= 2;
+			w[2] /= 2;
+			w[3] /= 2;
+		} else {
+			dwt_update_v4(w + 4, w, sn, dn, 0);
+			dwt_predict_v4(w, w + 4, dn, sn, -1);
+		}
+	}
+}
+
+static void mct_decode_simd(int *c0, int *c1, int *c2, int n) {
+	int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		v4i y = vi_load(c0 + i);
+		v4i u = vi_load(c1 + i);
+		v4i v = vi_load(c2 + i);
+		v4i g = vi_sub(y, vi_sra(vi_add(u, v), 2));
+		vi_store(c0 + i, vi_add(v, g));
+		vi_store(c1 + i, g);
+		vi_store(c2 + i, vi_add(u, g));
+	}
+	for (; i < n; i++) {
+		int y = c0[i];
+		int u = c1[i];
+		int v = c2[i];
+		int g = y - ((u + v) >> 2);
+		c0[i] = v + g;
+		c1[i] = g;
+		c2[i] = u + g;
+	}
+}
+
+#ifdef HAVE_NEON
+
+/*
+The 9-7 transform and the irreversible MCT have inline SSE versions in DWT.C and
+MCT.C; these are their NEON counterparts. Products and sums are taken in the same
+order as in the C code, and never fused.
+*/
+
+static void v4dwt_decode_step1_neon(float *w, int count, float c) {
+	float32x4_t vc = vdupq_n_f32(c);
+	int i;
+	for (i = 0; i < count; i++) {
+		vst1q_f32(w, vmulq_f32(vld1q_f32(w), vc));
+		w += 8;
+	}
+}
+
+static void v4dwt_decode_step2_neon(float *l, float *w, int k, int m, float c) {
+	float32x4_t vc = vdupq_n_f32(c);
+	float32x4_t tmp1 = vld1q_f32(l);
+	int i;
+	for (i = 0; i < m; i++) {
+		float32x4_t tmp2 = vld1q_f32(w - 4);
+		float32x4_t tmp3 = vld1q_f32(w);
+		vst1q_f32(w - 4, vaddq_f32(tmp2, vmulq_f32(vaddq_f32(tmp1, tmp3), vc)));
+		tmp1 = tmp3;
+		l = w;
+		w += 8;
+	}
+	if (m < k) {
+		float32x4_t c2 = vmulq_f32(vld1q_f32(l), vaddq_f32(vc, vc));
+		for (; m < k; m++) {
+			vst1q_f32(w - 4, vaddq_f32(vld1q_f32(w - 4), c2));
+			w += 8;
+		}
+	}
+}
+
+static void mct_decode_real_neon(float *c0, float *c1, float *c2, int n) {
+	float32x4_t vrv = vdupq_n_f32(1.402f);
+	float32x4_t vgu = vdupq_n_f32(0.34413f);
+	float32x4_t vgv = vdupq_n_f32(0.71414f);
+	float32x4_t vbu = vdupq_n_f32(1.772f);
+	int i;
+	for (i = 0; i + 4 <= n; i += 4) {
+		float32x4_t vy = vld1q_f32(c0 + i);
+		float32x4_t vu = vld1q_f32(c1 + i);
+		float32x4_t vv = vld1q_f32(c2 + i);
+		vst1q_f32(c0 + i, vaddq_f32(vy, vmulq_f32(vv, vrv)));
+		vst1q_f32(c1 + i, vsubq_f32(vsubq_f32(vy, vmulq_f32(vu, vgu)), vmulq_f32(vv, vgv)));
+		vst1q_f32(c2 + i, vaddq_f32(vy, vmulq_f32(vu, vbu)));
+	}
+	for (; i < n; i++) {
+		float y = c0[i];
+		float u = c1[i];
+		float v = c2[i];
+		c0[i] = y + (v * 1.402f);
+		c1[i] = y - (u * 0.34413f) - (v * (0.71414f));
+		c2[i] = y + (u * 1.772f);
+	}
+}
+
+#endif /* HAVE_NEON */
+
+static opj_bool simd_available(void) {
+#if defined(HAVE_NEON) && !defined(__aarch64__) && defined(__linux__)
+	/* Look for HWCAP_NEON in the AT_HWCAP entry of the auxiliary vector */
+	unsigned long aux[2];
+	opj_bool neon = OPJ_FALSE;
+	FILE *file = fopen("/proc/self/auxv", "rb");
+	if (file == NULL)
+		return OPJ_FALSE;
+	while (fread(aux, sizeof aux, 1, file) == 1 && aux[0] != 0) {
+		if (aux[0] == 16) {
+			neon = (aux[1] & (1 << 12)) != 0;
+			break;
+		}
+	}
+	fclose(file);
+	return neon;
+#else
+	return OPJ_TRUE;
+#endif
+}
+
+#endif /* HAVE_SSE2 || HAVE_NEON */
+
+void simd_init(void) {
+#if defined(HAVE_SSE2) || defined(HAVE_NEON)
+	static int checked = 0;
+
+	if (checked)
+		return;
+	checked = 1;
+
+	if (!simd_available())
+		return;
+
+	simd_funcs.dwt_decode_1_v4 = dwt_decode_1_v4_simd;
+	simd_funcs.mct_decode = mct_decode_simd;
+#ifdef HAVE_NEON
+	simd_funcs.v4dwt_decode_step1 = v4dwt_decode_step1_neon;
+	simd_funcs.v4dwt_decode_step2 = v4dwt_decode_step2_neon;
+	simd_funcs.mct_decode_real = mct_decode_real_neon;
+#endif
+#endif
+}
@@ -0,0 +1,68 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS `AS IS'
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __SIMD_H
+#define __SIMD_H
+/**
+@file simd.h
+@brief SIMD versions of the inverse DWT and MCT kernels
+
+The functions in SIMD.C are SSE2 and NEON versions of the inner loops of DWT.C and
+MCT.C. NEON is optional on ARMv7, so on that architecture SIMD.C alone is built with
+NEON enabled, and simd_init checks the CPU before installing any of it.
+*/
+
+/** @defgroup SIMD SIMD - SIMD versions of the inverse DWT and MCT kernels */
+/*@{*/
+
+/**
+Kernels installed by simd_init; each is NULL when the CPU or the build lacks it,
+and the portable C code is used instead
+*/
+typedef struct opj_simd_funcs {
+	/** Inverse 5-3 wavelet transform in 1-D of four signals, interleaved sample by sample */
+	void (*dwt_decode_1_v4)(int *w, int dn, int sn, int cas);
+	/** Scaling step of the inverse 9-7 transform of four interleaved signals (where there is no inline SSE) */
+	void (*v4dwt_decode_step1)(float *w, int count, float c);
+	/** Lifting step of the inverse 9-7 transform of four interleaved signals (where there is no inline SSE) */
+	void (*v4dwt_decode_step2)(float *l, float *w, int k, int m, float c);
+	/** Inverse reversible multi-component transform */
+	void (*mct_decode)(int *c0, int *c1, int *c2, int n);
+	/** Inverse irreversible multi-component transform (where there is no inline SSE) */
+	void (*mct_decode_real)(float *c0, float *c1, float *c2, int n);
+} opj_simd_funcs_t;
+
+extern opj_simd_funcs_t simd_funcs;
+
+/** @name Exported functions */
+/*@{*/
+/* ----------------------------------------------------------------------- */
+/**
+Install the SIMD kernels the CPU supports in simd_funcs. Only the first call does any work.
+*/
+void simd_init(void);
+/* ----------------------------------------------------------------------- */
+/*@}*/
+
+/*@}*/
+
+#endif /* __SIMD_H */
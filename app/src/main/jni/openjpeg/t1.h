@@ -106,6 +106,9 @@ typedef struct opj_t1 {
 	int datasize;
 	int flagssize;
 	int flags_stride;
+	/** Number of code-blocks decoded with a bad segmentation symbol; they
+	are counted, not reported, since T1 may be running on a worker thread */
+	int bad_segsym;
 } opj_t1_t;
 
 #define MACRO_t1_flags(x,y) t1->flags[((x)*(t1->flags_stride))+(y)]
@@ -133,12 +136,16 @@ Encode the code-blocks of a tile
 */
 void t1_encode_cblks(opj_t1_t *t1, opj_tcd_tile_t *tile, opj_tcp_t *tcp);
 /**
-Decode the code-blocks of a tile
+Decode a code-block of a tile, store its coefficients in the tile component data
+and free its coded data
 @param t1 T1 handle
-@param tilec The tile to decode
-@param tccp Tile coding parameters
+@param tilec The tile component the code-block belongs to
+@param tccp Tile coding parameters of the component
+@param resno Resolution level of the code-block
+@param band Subband of the code-block
+@param cblk The code-block to decode
 */
-void t1_decode_cblks(opj_t1_t* t1, opj_tcd_tilecomp_t* tilec, opj_tccp_t* tccp);
+void t1_decode_tile_cblk(opj_t1_t* t1, opj_tcd_tilecomp_t* tilec, opj_tccp_t* tccp, int resno, opj_tcd_band_t* band, opj_tcd_cblk_dec_t* cblk);
 /* ----------------------------------------------------------------------- */
 /*@}*/
 
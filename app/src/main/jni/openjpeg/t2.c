@@ -593,8 +593,11 @@ static int t2_decode_packet(opj_t2_t* t2, unsigned char *src, int len, opj_tcd_t
 
 #endif /* USE_JPWL */
 				
-				cblk->data = (unsigned char*) opj_realloc(cblk->data, (cblk->len + seg->newlen) * sizeof(unsigned char));
-				memcpy(cblk->data + cblk->len, c, seg->newlen);
+				/* the code-blocks of discarded resolutions are never decoded */
+				if (resno < tile->comps[compno].numresolutions - cp->reduce) {
+					cblk->data = (unsigned char*) opj_realloc(cblk->data, (cblk->len + seg->newlen) * sizeof(unsigned char));
+					memcpy(cblk->data + cblk->len, c, seg->newlen);
+				}
 				if (seg->numpasses == 0) {
 					seg->data = &cblk->data;
 					seg->dataindex = cblk->len;
@@ -612,14 +612,30 @@ void tcd_init_encode(opj_tcd_t *tcd, opj_image_t * image, opj_cp_t * cp, int cur
 	/* tcd_dump(stdout, tcd, &tcd->tcd_image); */
 }
 
+opj_bool tcd_tile_in_area(opj_cp_t * cp, opj_image_t * image, int tileno) {
+	int p = tileno % cp->tw;
+	int q = tileno / cp->tw;
+
+	if (cp->da_x1 <= cp->da_x0 || cp->da_y1 <= cp->da_y0)
+		return OPJ_TRUE;
+
+	return cp->tx0 + p * cp->tdx < image->x0 + cp->da_x1 &&
+		cp->tx0 + (p + 1) * cp->tdx > image->x0 + cp->da_x0 &&
+		cp->ty0 + q * cp->tdy < image->y0 + cp->da_y1 &&
+		cp->ty0 + (q + 1) * cp->tdy > image->y0 + cp->da_y0;
+}
+
 void tcd_malloc_decode(opj_tcd_t *tcd, opj_image_t * image, opj_cp_t * cp) {
-	int i, j, tileno, p, q;
+	int i, j, tileno, p, q, first;
 	unsigned int x0 = 0, y0 = 0, x1 = 0, y1 = 0, w, h;
 
 	tcd->image = image;
 	tcd->tcd_image->tw = cp->tw;
 	tcd->tcd_image->th = cp->th;
     tcd->tcd_image->tiles = (opj_tcd_tile_t *) opj_calloc(cp->tw * cp->th, sizeof(opj_tcd_tile_t));
+	tcd->pool = NULL;
+	tcd->t1 = NULL;
+	tcd->cblk_jobs = NULL;
 
 	/* 
 	Allocate place to store the decoded data = final image
@@ -636,6 +652,7 @@ void tcd_malloc_decode(opj_tcd_t *tcd, opj_image_t * image, opj_cp_t * cp) {
 	}
 
 	for (i = 0; i < image->numcomps; i++) {
+		first = 1;
 		for (j = 0; j < cp->tileno_size; j++) {
 			opj_tcd_tile_t *tile;
 			opj_tcd_tilecomp_t *tilec;
@@ -643,6 +660,10 @@ void tcd_malloc_decode(opj_tcd_t *tcd, opj_image_t * image, opj_cp_t * cp) {
 			/* cfr p59 ISO/IEC FDIS15444-1 : 2000 (18 august 2000) */
 			
 			tileno = cp->tileno[j];
+
+			/* the decoded image only covers the tiles in the decoding area */
+			if (!tcd_tile_in_area(cp, image, tileno))
+				continue;
 			
 			tile = &(tcd->tcd_image->tiles[cp->tileno[tileno]]);
 			tilec = &tile->comps[i];
@@ -661,10 +682,11 @@ void tcd_malloc_decode(opj_tcd_t *tcd, opj_image_t * image, opj_cp_t * cp) {
 			tilec->x1 = int_ceildiv(tile->x1, image->comps[i].dx);
 			tilec->y1 = int_ceildiv(tile->y1, image->comps[i].dy);
 
-			x0 = j == 0 ? tilec->x0 : int_min(x0, (unsigned int) tilec->x0);
-			y0 = j == 0 ? tilec->y0 : int_min(y0,	(unsigned int) tilec->y0);
-			x1 = j == 0 ? tilec->x1 : int_max(x1,	(unsigned int) tilec->x1);
-			y1 = j == 0 ? tilec->y1 : int_max(y1,	(unsigned int) tilec->y1);
+			x0 = first ? tilec->x0 : int_min(x0, (unsigned int) tilec->x0);
+			y0 = first ? tilec->y0 : int_min(y0,	(unsigned int) tilec->y0);
+			x1 = first ? tilec->x1 : int_max(x1,	(unsigned int) tilec->x1);
+			y1 = first ? tilec->y1 : int_max(y1,	(unsigned int) tilec->y1);
+			first = 0;
 		}
 
 		w = int_ceildivpow2(x1 - x0, image->comps[i].factor);
@@ -1327,6 +1349,14 @@ int tcd_encode_tile(opj_tcd_t *tcd, int tileno, unsigned char *dest, int len, op
 	return l;
 }
 
+/* Runs on the pool: nothing here may go through tcd->cinfo, whose event
+   handlers are only safe to call from the thread decoding the image */
+static void tcd_decode_cblk_job(void *arg, int worker, int jobno) {
+	opj_tcd_t *tcd = (opj_tcd_t*) arg;
+	opj_tcd_cblk_job_t *job = &tcd->cblk_jobs[jobno];
+	t1_decode_tile_cblk(tcd->t1[worker], job->tilec, job->tccp, job->resno, job->band, job->cblk);
+}
+
 opj_bool tcd_decode_tile(opj_tcd_t *tcd, unsigned char *src, int len, int tileno, opj_codestream_info_t *cstr_info) {
 	int l;
 	int compno;
@@ -1334,7 +1364,7 @@ opj_bool tcd_decode_tile(opj_tcd_t *tcd, unsigned char *src, int len, int tileno
 	double tile_time, t1_time, dwt_time;
 	opj_tcd_tile_t *tile = NULL;
 
-	opj_t1_t *t1 = NULL;		/* T1 component */
+	int numjobs, resno, bandno, precno, cblkno;
 	opj_t2_t *t2 = NULL;		/* T2 component */
 	
 	tcd->tcd_tileno = tileno;
@@ -1386,27 +1416,94 @@ opj_bool tcd_decode_tile(opj_tcd_t *tcd, unsigned char *src, int len, int tileno
 	/*------------------TIER1-----------------*/
 	
 	t1_time = opj_clock();	/* time needed to decode a tile */
-	t1 = t1_create(tcd->cinfo);
-    if (t1 == NULL)
-    {
-        opj_event_msg(tcd->cinfo, EVT_ERROR, "Out of memory\n");
-        t1_destroy(t1);
-        return OPJ_FALSE;
-    }
 
+	numjobs = 0;
 	for (compno = 0; compno < tile->numcomps; ++compno) {
 		opj_tcd_tilecomp_t* tilec = &tile->comps[compno];
+		int numres = int_max(tilec->numresolutions - tcd->cp->reduce, 1);
+		opj_tcd_resolution_t* res = &tilec->resolutions[numres - 1];
+
+		/* Only the resolutions decoded are kept, at the top left of the data */
+		tilec->data_w = res->x1 - res->x0;
+		tilec->data_h = res->y1 - res->y0;
 		/* The +3 is headroom required by the vectorized DWT */
-		tilec->data = (int*) opj_aligned_malloc((((tilec->x1 - tilec->x0) * (tilec->y1 - tilec->y0))+3) * sizeof(int));
+		tilec->data = (int*) opj_aligned_malloc(((tilec->data_w * tilec->data_h)+3) * sizeof(int));
         if (tilec->data == NULL)
         {
             opj_event_msg(tcd->cinfo, EVT_ERROR, "Out of memory\n");
             return OPJ_FALSE;
         }
 
-		t1_decode_cblks(t1, tilec, &tcd->tcp->tccps[compno]);
+		for (resno = 0; resno < tilec->numresolutions; ++resno) {
+			res = &tilec->resolutions[resno];
+			for (bandno = 0; bandno < res->numbands; ++bandno) {
+				opj_tcd_band_t* band = &res->bands[bandno];
+				for (precno = 0; precno < res->pw * res->ph; ++precno) {
+					opj_tcd_precinct_t* precinct = &band->precincts[precno];
+					for (cblkno = 0; cblkno < precinct->cw * precinct->ch; ++cblkno) {
+						opj_tcd_cblk_dec_t* cblk = &precinct->cblks.dec[cblkno];
+						/* resolutions above numres are discarded undecoded */
+						if (resno >= numres) {
+							opj_free(cblk->data);
+							opj_free(cblk->segs);
+							cblk->data = NULL;
+							cblk->segs = NULL;
+							continue;
+						}
+						if (numjobs % 256 == 0) {
+							opj_tcd_cblk_job_t *jobs = (opj_tcd_cblk_job_t*) opj_realloc(tcd->cblk_jobs, (numjobs + 256) * sizeof(opj_tcd_cblk_job_t));
+							if (jobs == NULL) {
+								opj_event_msg(tcd->cinfo, EVT_ERROR, "Out of memory\n");
+								return OPJ_FALSE;
+							}
+							tcd->cblk_jobs = jobs;
+						}
+						tcd->cblk_jobs[numjobs].tilec = tilec;
+						tcd->cblk_jobs[numjobs].tccp = &tcd->tcp->tccps[compno];
+						tcd->cblk_jobs[numjobs].resno = resno;
+						tcd->cblk_jobs[numjobs].band = band;
+						tcd->cblk_jobs[numjobs].cblk = cblk;
+						numjobs++;
+					}
+				}
+			}
+		}
+	}
+
+	/* Start the threads, and give each its T1 handle, on the first tile */
+	if (tcd->t1 == NULL) {
+		int i, n;
+		if (numjobs > 1)
+			tcd->pool = thread_pool_create(tcd->cp->threads);
+		n = thread_pool_size(tcd->pool);
+		tcd->t1 = (opj_t1_t**) opj_calloc(n, sizeof(opj_t1_t*));
+		for (i = 0; tcd->t1 && i < n; i++) {
+			tcd->t1[i] = t1_create(tcd->cinfo);
+			if (tcd->t1[i] == NULL) {
+				opj_event_msg(tcd->cinfo, EVT_ERROR, "Out of memory\n");
+				return OPJ_FALSE;
+			}
+		}
+		if (tcd->t1 == NULL) {
+			opj_event_msg(tcd->cinfo, EVT_ERROR, "Out of memory\n");
+			return OPJ_FALSE;
+		}
+	}
+
+	/* Code-blocks are independent, and each fills its own part of the data */
+	thread_pool_run(tcd->pool, tcd_decode_cblk_job, tcd, numjobs);
+
+	/* The workers are idle again, so report what they found from here */
+	{
+		int i, bad = 0;
+		for (i = 0; i < thread_pool_size(tcd->pool); i++) {
+			bad += tcd->t1[i]->bad_segsym;
+			tcd->t1[i]->bad_segsym = 0;
+		}
+		if (bad)
+			opj_event_msg(tcd->cinfo, EVT_WARNING, "Bad segmentation symbol in %d code-blocks\n", bad);
 	}
-	t1_destroy(t1);
+
 	t1_time = opj_clock() - t1_time;
 	opj_event_msg(tcd->cinfo, EVT_INFO, "- tiers-1 took %f s\n", t1_time);
 	
@@ -1444,7 +1541,7 @@ opj_bool tcd_decode_tile(opj_tcd_t *tcd, unsigned char *src, int len, int tileno
 	/*----------------MCT-------------------*/
 
 	if (tcd->tcp->mct) {
-		int n = (tile->comps[0].x1 - tile->comps[0].x0) * (tile->comps[0].y1 - tile->comps[0].y0);
+		int n = tile->comps[0].data_w * tile->comps[0].data_h;
 
 		if (tile->numcomps >= 3 ){
 			if (tcd->tcp->tccps[0].qmfbid == 1) {
@@ -1475,7 +1572,7 @@ opj_bool tcd_decode_tile(opj_tcd_t *tcd, unsigned char *src, int len, int tileno
 		int min = imagec->sgnd ? -(1 << (imagec->prec - 1)) : 0;
 		int max = imagec->sgnd ?  (1 << (imagec->prec - 1)) - 1 : (1 << imagec->prec) - 1;
 
-		int tw = tilec->x1 - tilec->x0;
+		int tw = tilec->data_w;
 		int w = imagec->w;
 
 		int offset_x = int_ceildivpow2(imagec->x0, imagec->factor);
@@ -1530,6 +1627,14 @@ void tcd_free_decode(opj_tcd_t *tcd) {
     }
 
 	opj_free(tcd_image->tiles);
+
+	if (tcd->t1) {
+		for (i = 0; i < thread_pool_size(tcd->pool); i++)
+			t1_destroy(tcd->t1[i]);
+		opj_free(tcd->t1);
+	}
+	thread_pool_destroy(tcd->pool);
+	opj_free(tcd->cblk_jobs);
 }
 
 void tcd_free_decode_tile(opj_tcd_t *tcd, int tileno) {
@@ -142,6 +142,7 @@ typedef struct opj_tcd_tilecomp {
   int numresolutions;		/* number of resolutions level */
   opj_tcd_resolution_t *resolutions;	/* resolutions information */
   int *data;			/* data of the component */
+  int data_w, data_h;		/* dimension of data when decoding: that of the highest resolution decoded */
   int numpix;			/* add fixed_quality */
 } opj_tcd_tilecomp_t;
 
@@ -167,6 +168,17 @@ typedef struct opj_tcd_image {
   opj_tcd_tile_t *tiles;		/* Tiles information */
 } opj_tcd_image_t;
 
+/**
+A code-block to decode, and where it belongs
+*/
+typedef struct opj_tcd_cblk_job {
+  opj_tcd_tilecomp_t *tilec;	/* tile component */
+  opj_tccp_t *tccp;		/* coding parameters of the component */
+  int resno;			/* resolution level */
+  opj_tcd_band_t *band;		/* subband */
+  opj_tcd_cblk_dec_t *cblk;	/* code-block */
+} opj_tcd_cblk_job_t;
+
 /**
 Tile coder/decoder
 */
@@ -198,6 +210,12 @@ typedef struct opj_tcd {
 	int tcd_tileno;
 	/** Time taken to encode a tile*/
 	double encoding_time;
+	/** threads that decode code-blocks, or NULL to decode them in the calling thread */
+	opj_thread_pool_t *pool;
+	/** a T1 handle for each thread */
+	struct opj_t1 **t1;
+	/** code-blocks of the tile being decoded */
+	opj_tcd_cblk_job_t *cblk_jobs;
 } opj_tcd_t;
 
 /** @name Exported functions */
@@ -247,6 +265,14 @@ Initialize the tile decoder
 @param cp Coding parameters
 */
 void tcd_malloc_decode(opj_tcd_t *tcd, opj_image_t * image, opj_cp_t * cp);
+/**
+Tell whether a tile overlaps the decoding area
+@param cp Coding parameters
+@param image Raw image
+@param tileno Number that identifies the tile
+@return Returns true if the tile is to be decoded
+*/
+opj_bool tcd_tile_in_area(opj_cp_t * cp, opj_image_t * image, int tileno);
 void tcd_malloc_decode_tile(opj_tcd_t *tcd, opj_image_t * image, opj_cp_t * cp, int tileno, opj_codestream_info_t *cstr_info);
 void tcd_makelayer_fixed(opj_tcd_t *tcd, int layno, int final);
 void tcd_rateallocate_fixed(opj_tcd_t *tcd);
@@ -0,0 +1,205 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS `AS IS'
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "opj_includes.h"
+
+#ifdef HAVE_PTHREADS
+
+#include <pthread.h>
+#include <unistd.h>
+
+struct opj_thread_pool {
+	/** worker threads (the calling thread is worker 0, and has no entry) */
+	pthread_t *threads;
+	int numthreads;
+	/** guards everything below */
+	pthread_mutex_t mutex;
+	/** signalled when a batch starts, or the pool is destroyed */
+	pthread_cond_t start;
+	/** signalled when the last busy worker runs out of jobs */
+	pthread_cond_t done;
+	/** current batch */
+	opj_job_fn fn;
+	void *arg;
+	int numjobs;
+	int nextjob;
+	/** incremented for each batch, so that workers start each one once */
+	int batch;
+	/** number of threads that have not yet finished with the current batch */
+	int busy;
+	opj_bool quit;
+};
+
+typedef struct opj_worker {
+	opj_thread_pool_t *pool;
+	int worker;
+} opj_worker_t;
+
+/** Run jobs of the current batch until there are none left; called with the mutex held */
+static void thread_pool_work(opj_thread_pool_t *pool, int worker) {
+	while (pool->nextjob < pool->numjobs) {
+		int jobno = pool->nextjob++;
+		pthread_mutex_unlock(&pool->mutex);
+		pool->fn(pool->arg, worker, jobno);
+		pthread_mutex_lock(&pool->mutex);
+	}
+	if (--pool->busy == 0)
+		pthread_cond_signal(&pool->done);
+}
+
+static void* thread_pool_main(void *arg) {
+	opj_worker_t *w = (opj_worker_t*) arg;
+	opj_thread_pool_t *pool = w->pool;
+	int batch = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->quit && pool->batch == batch)
+			pthread_cond_wait(&pool->start, &pool->mutex);
+		if (pool->quit)
+			break;
+		batch = pool->batch;
+		thread_pool_work(pool, w->worker);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	opj_free(w);
+	return NULL;
+}
+
+opj_thread_pool_t* thread_pool_create(int numthreads) {
+	opj_thread_pool_t *pool;
+	int i;
+
+	if (numthreads < 2)
+		return NULL;
+
+	pool = (opj_thread_pool_t*) opj_calloc(1, sizeof(opj_thread_pool_t));
+	if (!pool)
+		return NULL;
+	pool->threads = (pthread_t*) opj_malloc((numthreads - 1) * sizeof(pthread_t));
+	if (!pool->threads) {
+		opj_free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->start, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pool->numthreads = 1;
+	for (i = 1; i < numthreads; i++) {
+		opj_worker_t *w = (opj_worker_t*) opj_malloc(sizeof(opj_worker_t));
+		if (!w)
+			break;
+		w->pool = pool;
+		w->worker = i;
+		if (pthread_create(&pool->threads[i - 1], NULL, thread_pool_main, w) != 0) {
+			opj_free(w);
+			break;
+		}
+		pool->numthreads++;
+	}
+
+	if (pool->numthreads < 2) {
+		thread_pool_destroy(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void thread_pool_destroy(opj_thread_pool_t *pool) {
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = OPJ_TRUE;
+	pthread_cond_broadcast(&pool->start);
+	pthread_mutex_unlock(&pool->mutex);
+	for (i = 1; i < pool->numthreads; i++)
+		pthread_join(pool->threads[i - 1], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->start);
+	pthread_mutex_destroy(&pool->mutex);
+	opj_free(pool->threads);
+	opj_free(pool);
+}
+
+int thread_pool_size(opj_thread_pool_t *pool) {
+	return pool ? pool->numthreads : 1;
+}
+
+void thread_pool_run(opj_thread_pool_t *pool, opj_job_fn fn, void *arg, int numjobs) {
+	int i;
+
+	/* A single job is not worth waking the workers for */
+	if (!pool || numjobs < 2) {
+		for (i = 0; i < numjobs; i++)
+			fn(arg, 0, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->fn = fn;
+	pool->arg = arg;
+	pool->numjobs = numjobs;
+	pool->nextjob = 0;
+	pool->busy = pool->numthreads;
+	pool->batch++;
+	pthread_cond_broadcast(&pool->start);
+	thread_pool_work(pool, 0);
+	while (pool->busy > 0)
+		pthread_cond_wait(&pool->done, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+int OPJ_CALLCONV opj_get_num_cpus(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : (int) n;
+}
+
+#else
+
+opj_thread_pool_t* thread_pool_create(int numthreads) {
+	return NULL;
+}
+
+void thread_pool_destroy(opj_thread_pool_t *pool) {
+}
+
+int thread_pool_size(opj_thread_pool_t *pool) {
+	return 1;
+}
+
+void thread_pool_run(opj_thread_pool_t *pool, opj_job_fn fn, void *arg, int numjobs) {
+	int i;
+	for (i = 0; i < numjobs; i++)
+		fn(arg, 0, i);
+}
+
+int OPJ_CALLCONV opj_get_num_cpus(void) {
+	return 1;
+}
+
+#endif /* HAVE_PTHREADS */
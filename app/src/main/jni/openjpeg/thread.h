@@ -0,0 +1,82 @@
+/*
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS `AS IS'
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef __THREAD_H
+#define __THREAD_H
+/**
+@file thread.h
+@brief Implementation of a pool of worker threads
+
+The functions in THREAD.C run a batch of independent jobs on a set of worker
+threads, the calling thread taking its share. They are used by TCD.C to decode
+the code-blocks of a tile in parallel. Without HAVE_PTHREADS, every batch is run
+in the calling thread.
+*/
+
+/** @defgroup THREAD THREAD - Implementation of a pool of worker threads */
+/*@{*/
+
+typedef struct opj_thread_pool opj_thread_pool_t;
+
+/**
+A job of a batch
+@param arg Argument given to thread_pool_run
+@param worker Number of the thread running the job, from 0 (the calling thread) to numthreads - 1
+@param jobno Number of the job, from 0 to numjobs - 1
+*/
+typedef void (*opj_job_fn)(void *arg, int worker, int jobno);
+
+/** @name Exported functions */
+/*@{*/
+/* ----------------------------------------------------------------------- */
+/**
+Create a pool of threads
+@param numthreads Number of threads to run jobs on, counting the calling thread
+@return Returns a new pool, or NULL if numthreads is less than 2 or no thread could be started
+*/
+opj_thread_pool_t* thread_pool_create(int numthreads);
+/**
+Stop the threads of a pool and free it
+@param pool Pool to destroy (may be NULL)
+*/
+void thread_pool_destroy(opj_thread_pool_t *pool);
+/**
+Get the number of threads of a pool, counting the calling thread
+@param pool Pool (may be NULL, which has one thread)
+@return Returns the number of threads
+*/
+int thread_pool_size(opj_thread_pool_t *pool);
+/**
+Run a batch of jobs, and wait for all of them to finish.
+Jobs are handed out in order, but may run in any order and concurrently.
+@param pool Pool to run the jobs on (if NULL, the jobs are run in the calling thread)
+@param fn Job function
+@param arg Argument passed to each job
+@param numjobs Number of jobs
+*/
+void thread_pool_run(opj_thread_pool_t *pool, opj_job_fn fn, void *arg, int numjobs);
+/* ----------------------------------------------------------------------- */
+/*@}*/
+
+/*@}*/
+
+#endif /* __THREAD_H */
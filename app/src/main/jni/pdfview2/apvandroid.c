@@ -77,6 +77,9 @@ Java_cx_hell_android_lib_pdf_PDF_init(
         fitz_context = fz_new_context(fitz_alloc_context, NULL, max_store);
         if (fitz_context == NULL) {
             __android_log_print(ANDROID_LOG_ERROR, PDFVIEW_LOG_TAG, "failed to create fitz_context"); // TODO: display error to user
+        } else if (max_store / 32 > 1024 * 1024) {
+            /* text heavy pages at odd zooms need more than the default 1 MiB of glyphs */
+            fz_set_glyph_cache_size(fitz_context, max_store / 32);
         }
     }
 }
@@ -341,6 +344,32 @@ Java_cx_hell_android_lib_pdf_PDF_getHeapSize(
 }
 
 
+/**
+ * Get glyph cache counters: hits, misses, evictions, bytes used and byte budget.
+ */
+JNIEXPORT jintArray JNICALL
+Java_cx_hell_android_lib_pdf_PDF_getGlyphCacheStats(
+        JNIEnv *env,
+        jclass clazz) {
+    fz_glyph_cache_stats stats;
+    jint values[5];
+    jintArray result;
+
+    if (fitz_context == NULL) return NULL;
+    fz_get_glyph_cache_stats(fitz_context, &stats);
+    values[0] = stats.hits;
+    values[1] = stats.misses;
+    values[2] = stats.evictions;
+    values[3] = stats.size;
+    values[4] = stats.max;
+
+    result = (*env)->NewIntArray(env, 5);
+    if (result == NULL) return NULL;
+    (*env)->SetIntArrayRegion(env, result, 0, 5, values);
+    return result;
+}
+
+
 /**
  * Free resources allocated in native code.
  * Frees memory directly associated with this pdf_t instance. Does not destroy fitz_context.